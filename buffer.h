@@ -2,6 +2,7 @@
 #define MODLANG_BUFFER_H
 
 #include <stdlib.h>
+#include <stdbool.h>
 
 #define buffer_setcap(A, N) ((A).data = array_realloc_proc((void*)(A).data, sizeof(*(A).data), (size_t)(A).capacity, (size_t)(N), __FILE__, __LINE__), (A).capacity = (N), (A).data)
 #define buffer_grow(A, N) ((A).capacity = buffer_grow_proc((void**)&(A).data, sizeof(*(A).data), (size_t)(A).capacity, (size_t)(N), __FILE__, __LINE__))
@@ -17,26 +18,107 @@
 #define buffer_setcount(A, N) (buffer_reserve((A), (N)), (A).count = (N))
 
 #define buffer_top(A) ((A).count > 0 ? &(A).data[(A).count - 1] : NULL)
-#define buffer_free(A) ((A).capacity > 0 ? free((A).data) : 0)
+#define buffer_free(A) ((A).capacity > 0 ? free_dbg((A).data) : 0)
 #define buffer_pop(A) ((A).data[--(A).count])
 
-#ifdef _WIN32
-void *malloc_dbg(size_t size, char *filename, int lineno) {
-    return _malloc_dbg(size, _NORMAL_BLOCK, filename, lineno);
+#if defined(_MSC_VER)
+#define MODLANG_THREAD_LOCAL __declspec(thread)
+#else
+#define MODLANG_THREAD_LOCAL _Thread_local
+#endif
+
+/* The compiler copies types around freely, sharing whatever they point to,
+   so nothing can tell when one is done with. Instead, while an arena is set,
+   everything allocated through these functions is also linked into it, and
+   arena_release frees whatever is left once the program that the compiler
+   made is done with, see context_free. Blocks that are freed or grown before
+   then are unlinked or moved, on whichever thread owned the arena. */
+struct allocation_header {
+    struct allocation_header *prev;
+    /* NULL for blocks that no arena owns. */
+    struct allocation_header *next;
+};
+
+/* A circular list, through a header that doesn't belong to any block. */
+struct allocation_arena {
+    struct allocation_header blocks;
+};
+
+MODLANG_THREAD_LOCAL struct allocation_arena *allocation_arena;
+
+void allocation_link(
+    struct allocation_header *it,
+    struct allocation_header *prev
+) {
+    it->prev = prev;
+    it->next = prev->next;
+    it->next->prev = it;
+    prev->next = it;
 }
 
-void *realloc_dbg(void *data, size_t size, char *filename, int lineno) {
-    return _realloc_dbg(data, size, _NORMAL_BLOCK, filename, lineno);
+void allocation_unlink(struct allocation_header *it) {
+    it->prev->next = it->next;
+    it->next->prev = it->prev;
 }
+
+#ifdef _WIN32
+#define ALLOCATION_MALLOC(SIZE, FILENAME, LINENO) \
+    _malloc_dbg((SIZE), _NORMAL_BLOCK, (FILENAME), (LINENO))
+#define ALLOCATION_REALLOC(DATA, SIZE, FILENAME, LINENO) \
+    _realloc_dbg((DATA), (SIZE), _NORMAL_BLOCK, (FILENAME), (LINENO))
 #else
+#define ALLOCATION_MALLOC(SIZE, FILENAME, LINENO) malloc(SIZE)
+#define ALLOCATION_REALLOC(DATA, SIZE, FILENAME, LINENO) \
+    realloc((DATA), (SIZE))
+#endif
+
 void *malloc_dbg(size_t size, char *filename, int lineno) {
-    return malloc(size);
+    struct allocation_header *it = ALLOCATION_MALLOC(
+        sizeof(struct allocation_header) + size, filename, lineno);
+    if (!it) return NULL;
+    if (allocation_arena) {
+        allocation_link(it, &allocation_arena->blocks);
+    } else {
+        it->next = NULL;
+    }
+    return it + 1;
 }
 
 void *realloc_dbg(void *data, size_t size, char *filename, int lineno) {
-    return realloc(data, size);
+    struct allocation_header *it = (struct allocation_header*)data - 1;
+    struct allocation_header *prev = it->prev;
+    bool linked = it->next != NULL;
+    if (linked) allocation_unlink(it);
+    it = ALLOCATION_REALLOC(it, sizeof(struct allocation_header) + size,
+        filename, lineno);
+    if (!it) return NULL;
+    if (linked) allocation_link(it, prev);
+    return it + 1;
+}
+
+/* For single blocks that an arena might own, such as types. */
+#define arena_alloc(SIZE) malloc_dbg((SIZE), __FILE__, __LINE__)
+
+void free_dbg(void *data) {
+    struct allocation_header *it = (struct allocation_header*)data - 1;
+    if (it->next) allocation_unlink(it);
+    free(it);
+}
+
+void arena_init(struct allocation_arena *arena) {
+    arena->blocks.prev = &arena->blocks;
+    arena->blocks.next = &arena->blocks;
+}
+
+void arena_release(struct allocation_arena *arena) {
+    struct allocation_header *it = arena->blocks.next;
+    while (it != &arena->blocks) {
+        struct allocation_header *next = it->next;
+        free(it);
+        it = next;
+    }
+    arena_init(arena);
 }
-#endif
 
 void *array_realloc_proc(
     void *data,
@@ -53,7 +135,7 @@ void *array_realloc_proc(
         }
         /* else */ return malloc_dbg(size * new_capacity, filename, lineno);
     } else {
-        if (capacity > 0) free(data);
+        if (capacity > 0) free_dbg(data);
         return NULL;
     }
 }
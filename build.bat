@@ -1,3 +1,5 @@
 @echo off
 if "%VCToolsVersion%"=="" call "C:\Program Files\Microsoft Visual Studio\2022\Community\VC\Auxiliary\Build\vcvars64.bat"
 cl /Z7 /DEBUG:FULL /MTd main.c
+cl /c /Z7 /MTd libmodlang.c
+lib /nologo /OUT:modlang.lib libmodlang.obj
@@ -9,7 +9,11 @@ union variable_contents add_procedure(
     struct instruction_buffer instructions
 ) {
     struct procedure *p = buffer_addn(*procedures, 1);
-    p->instructions = instructions;
+    *p = (struct procedure){0};
+    int stack_arrays = place_stack_arrays(&instructions);
+    p->code = prepare_bytecode(&instructions);
+    p->code.stack_arrays = stack_arrays;
+    buffer_free(instructions);
 
     union variable_contents result;
     result.val64 = procedures->count - 1;
@@ -39,9 +43,30 @@ void bind_procedure(
     struct instruction_buffer instructions
 ) {
     union variable_contents val = add_procedure(procedures, instructions);
+    /* The procedure can only see the globals that were bound before it. */
+    struct bytecode_limits limits = {procedures->count, bindings->global_count};
+    check_bytecode(&procedures->data[val.val64].code, limits);
     bind_global(bindings, call_stack, proc_binding, val);
 }
 
+/* par_map and par_reduce own the array they are given, like any other
+   procedure, and return whatever is in local 2. */
+void compile_par_builtin_return(struct instruction_buffer *out) {
+    struct instruction *instr = buffer_addn(*out, 1);
+    *instr = (struct instruction){0};
+    instr->op = OP_DECREMENT_REFCOUNT;
+    instr->arg1.type = REF_LOCAL;
+    instr->arg1.x = 0;
+
+    instr = buffer_addn(*out, 1);
+    *instr = (struct instruction){0};
+    instr->op = OP_RET;
+    instr->arg1.type = REF_CONSTANT;
+    instr->arg1.x = 2;
+    instr->arg2.type = REF_CONSTANT;
+    instr->arg2.x = 1;
+}
+
 void add_builtins(
     struct record_table *bindings,
     struct procedure_buffer *procedures,
@@ -65,6 +90,104 @@ void add_builtins(
         struct instruction_buffer i = {0};
         buffer_push(i, instr);
 
+        bind_procedure(bindings, procedures, call_stack, b, i);
+    }
+    {
+        struct type stats_type = type_empty_record;
+#define MEMORY_STATS_TYPE_FIELD(NAME) \
+        { \
+            struct field *field = buffer_addn(stats_type.fields, 1); \
+            field->name = from_cstr(#NAME); \
+            field->type = type_int64; \
+            stats_type.total_size += type_int64.total_size; \
+        }
+        MEMORY_STATS_FIELDS(MEMORY_STATS_TYPE_FIELD)
+#undef MEMORY_STATS_TYPE_FIELD
+
+        struct type_buffer inputs = {0};
+        struct type_buffer outputs = {0};
+        buffer_push(outputs, stats_type);
+
+        struct record_entry b = {0};
+        b.name = from_cstr("memory_stats");
+        b.type = type_proc(inputs, outputs);
+        b.is_var = false;
+
+        /* With no arguments, the pointer to the result comes first. */
+        struct instruction instr = {0};
+        instr.op = OP_MEMORY_STATS;
+        instr.arg1.type = REF_LOCAL;
+        instr.arg1.x = 0;
+
+        struct instruction_buffer i = {0};
+        buffer_push(i, instr);
+
+        bind_procedure(bindings, procedures, call_stack, b, i);
+    }
+    /* There are no type parameters, so these only work on [Int]. */
+    {
+        struct type_buffer f_inputs = {0};
+        buffer_push(f_inputs, type_int64);
+        struct type_buffer f_outputs = {0};
+        buffer_push(f_outputs, type_int64);
+
+        struct type_buffer inputs = {0};
+        buffer_push(inputs, type_array_of(type_int64));
+        buffer_push(inputs, type_proc(f_inputs, f_outputs));
+        struct type_buffer outputs = {0};
+        buffer_push(outputs, type_array_of(type_int64));
+
+        struct record_entry b = {0};
+        b.name = from_cstr("par_map");
+        b.type = type_proc(inputs, outputs);
+        b.is_var = false;
+
+        struct instruction_buffer i = {0};
+        struct instruction *instr = buffer_addn(i, 1);
+        *instr = (struct instruction){0};
+        instr->op = OP_PAR_MAP;
+        instr->output.type = REF_LOCAL;
+        instr->output.x = 2;
+        instr->arg1.type = REF_LOCAL;
+        instr->arg1.x = 0;
+        instr->arg2.type = REF_LOCAL;
+        instr->arg2.x = 1;
+        compile_par_builtin_return(&i);
+
+        bind_procedure(bindings, procedures, call_stack, b, i);
+    }
+    {
+        struct type_buffer f_inputs = {0};
+        buffer_push(f_inputs, type_int64);
+        buffer_push(f_inputs, type_int64);
+        struct type_buffer f_outputs = {0};
+        buffer_push(f_outputs, type_int64);
+
+        struct type_buffer inputs = {0};
+        buffer_push(inputs, type_array_of(type_int64));
+        buffer_push(inputs, type_proc(f_inputs, f_outputs));
+        buffer_push(inputs, type_int64);
+        struct type_buffer outputs = {0};
+        buffer_push(outputs, type_int64);
+
+        struct record_entry b = {0};
+        b.name = from_cstr("par_reduce");
+        b.type = type_proc(inputs, outputs);
+        b.is_var = false;
+
+        /* The initial value is already in the output. */
+        struct instruction_buffer i = {0};
+        struct instruction *instr = buffer_addn(i, 1);
+        *instr = (struct instruction){0};
+        instr->op = OP_PAR_REDUCE;
+        instr->output.type = REF_LOCAL;
+        instr->output.x = 2;
+        instr->arg1.type = REF_LOCAL;
+        instr->arg1.x = 0;
+        instr->arg2.type = REF_LOCAL;
+        instr->arg2.x = 1;
+        compile_par_builtin_return(&i);
+
         bind_procedure(bindings, procedures, call_stack, b, i);
     }
 }
@@ -0,0 +1,1115 @@
+#ifndef MODLANG_BYTECODE_H
+#define MODLANG_BYTECODE_H
+
+#include "types.h"
+
+/* This file takes the instructions that the compiler emits, and lowers them
+   into the packed form that the interpreter actually executes. */
+
+/********************/
+/* Refcount Elision */
+/********************/
+
+/* The compiler takes and drops references one expression at a time, so
+   plenty of them cancel out over a whole procedure, like a parameter that is
+   copied into a temporary and then dropped. Code is straight line, so one
+   scan forward from each increment finds the decrement that cancels it, and
+   shows whether anything in between could tell that the count was lower. */
+
+bool ref_eq(struct ref a, struct ref b) {
+    return a.type == b.type && a.x == b.x;
+}
+
+bool ref_is_variable(struct ref ref) {
+    return ref.type == REF_LOCAL || ref.type == REF_TEMPORARY;
+}
+
+/* Whether an instruction refers to a variable at all, including the ranges
+   of variables that calls and returns pass along. */
+bool instruction_mentions(struct instruction *instr, struct ref var) {
+    if (ref_eq(instr->output, var)) return true;
+    if (ref_eq(instr->arg1, var)) return true;
+    if (ref_eq(instr->arg2, var)) return true;
+    if (var.type == REF_GLOBAL) return false;
+    if (instr->op == OP_CALL || instr->op == OP_TAIL_CALL) {
+        /* Arguments are handed over, and results written back, from one
+           before arg2 onwards. */
+        return var.x >= instr->arg2.x - 1;
+    }
+    if (instr->op == OP_RET) {
+        return var.x >= instr->arg1.x && var.x < instr->arg1.x + instr->arg2.x;
+    }
+    return false;
+}
+
+/* Whether an instruction might stop a variable from holding the reference
+   that it held before: by overwriting it, dropping it, or handing it to
+   something else. Temporaries get handed over by whatever reads them, so any
+   mention of one counts. */
+bool instruction_consumes(struct instruction *instr, struct ref var) {
+    if (var.type == REF_TEMPORARY) return instruction_mentions(instr, var);
+    if (ref_eq(instr->output, var)) return true;
+    switch (instr->op) {
+    case OP_ARRAY_OFFSET_MAKE_UNIQUE:
+    case OP_DECREMENT_REFCOUNT:
+        return ref_eq(instr->arg1, var);
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_RET:
+        return instruction_mentions(instr, var);
+    default:
+        return false;
+    }
+}
+
+/* Whether an instruction could change or free the memory of a struct, other
+   than by sweeping the struct that ignore points at. */
+bool instruction_touches_structs(struct instruction *instr, struct ref ignore) {
+    switch (instr->op) {
+    case OP_POINTER_DECREMENT_REFCOUNT:
+        return !ref_eq(instr->arg1, ignore);
+    case OP_ARRAY_INDEX:
+        /* Overwriting the array drops it. */
+        return ref_eq(instr->output, instr->arg1);
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_RET:
+    case OP_ARRAY_OFFSET_MAKE_UNIQUE:
+    case OP_ARRAY_STORE:
+    case OP_ARRAY_CONCAT:
+    case OP_DECREMENT_REFCOUNT:
+    case OP_STACK_FREE:
+    case OP_POINTER_STORE:
+    case OP_POINTER_COPY:
+    case OP_POINTER_COPY_OVERLAPPING:
+    case OP_POINTER_LOAD_MAKE_UNIQUE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_array_decrement(struct instruction *instr, struct ref var) {
+    return instr->op == OP_DECREMENT_REFCOUNT && ref_eq(instr->arg1, var);
+}
+
+/* `dst = src` copies an array out of a local, taking a reference. If src is
+   dropped before it is used again, this is really a move, so the reference
+   can just be handed over. Returns the index of the decrement that goes, or
+   -1. */
+int find_array_move(struct instruction *instrs, bool *removed, int count, int i) {
+    struct ref src = instrs[i].arg1;
+    for (int k = i + 1; k < count; k++) {
+        if (removed[k]) continue;
+        if (is_array_decrement(&instrs[k], src)) return k;
+        if (instruction_mentions(&instrs[k], src)) return -1;
+    }
+    return -1;
+}
+
+/* Otherwise, if dst is a local that is dropped while src still holds its
+   reference, dst can borrow the reference from src for that long. The only
+   thing that looks at the count is making an array unique, and both of those
+   variables are off limits until dst is dropped, while anything else that
+   holds the array counts itself as well as src. */
+int find_array_borrow(struct instruction *instrs, bool *removed, int count, int i) {
+    struct ref dst = instrs[i].output;
+    struct ref src = instrs[i].arg1;
+    if (dst.type != REF_LOCAL) return -1;
+    for (int k = i + 1; k < count; k++) {
+        if (removed[k]) continue;
+        if (is_array_decrement(&instrs[k], dst)) return k;
+        if (instruction_consumes(&instrs[k], dst)) return -1;
+        if (instruction_consumes(&instrs[k], src)) return -1;
+    }
+    return -1;
+}
+
+/* compile_copy follows a struct copy `*dst = *src` with increments of every
+   array in src. If the copy is then swept with decrements before anything can
+   change or free either struct, src keeps each array alive for the whole
+   time, so the increment and the decrement of each array can both go. */
+int find_struct_borrow(struct instruction *instrs, bool *removed, int count, int i) {
+    struct ref src = instrs[i].arg1;
+    int64 offset = instrs[i].arg2.x;
+
+    /* Walk back over the rest of the sweep to the copy. */
+    int copy = i - 1;
+    while (copy >= 0 && (removed[copy]
+        || (instrs[copy].op == OP_POINTER_INCREMENT_REFCOUNT
+            && ref_eq(instrs[copy].arg1, src))))
+    {
+        copy -= 1;
+    }
+    if (copy < 0) return -1;
+    struct instruction *c = &instrs[copy];
+    if (c->op != OP_POINTER_DUP && c->op != OP_POINTER_COPY) return -1;
+    if (!ref_eq(c->arg1, src) || c->arg2.type != REF_CONSTANT) return -1;
+    if (offset >= c->arg2.x) return -1;
+    struct ref dst = c->output;
+    if (!ref_is_variable(dst) || ref_eq(dst, src)) return -1;
+
+    for (int k = i + 1; k < count; k++) {
+        if (removed[k]) continue;
+        struct instruction *instr = &instrs[k];
+        if (instr->op == OP_POINTER_DECREMENT_REFCOUNT
+            && ref_eq(instr->arg1, dst) && instr->arg2.x == offset)
+        {
+            return k;
+        }
+        if (instruction_touches_structs(instr, dst)) return -1;
+        if (ref_eq(instr->output, src) || ref_eq(instr->output, dst)) return -1;
+    }
+    return -1;
+}
+
+/* `t = x ++ y` followed straight away by dropping x, which is how
+   `x = x ++ y` compiles, can hand x's reference over to the concatenation
+   instead, so that it can extend x in place when nothing else can see it.
+   Returns the index of the decrement that goes, or -1. */
+int find_concat_move(struct instruction *instrs, bool *removed, int count, int i) {
+    struct instruction *instr = &instrs[i];
+    struct ref src = instr->arg1;
+    if (src.type != REF_LOCAL && src.type != REF_GLOBAL) return -1;
+    /* Extending x in place would pull its buffer out from under y. */
+    if (ref_eq(instr->arg2, src) || ref_eq(instr->output, src)) return -1;
+
+    int next = i + 1;
+    while (next < count && removed[next]) next += 1;
+    if (next < count && is_array_decrement(&instrs[next], src)) return next;
+    return -1;
+}
+
+/* Remove pairs of reference count operations that cancel out, and
+   decrements that an operation can do itself. Returns how many operations
+   were removed. */
+int elide_refcounts(struct instruction_buffer *in) {
+    struct instruction *instrs = in->data;
+    int count = in->count;
+    if (count == 0) return 0;
+    bool *removed = calloc(count, sizeof(bool));
+    int removed_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct instruction *instr = &instrs[i];
+        if (instr->op == OP_MOV && instr->flags == OP_SHARED_BUFF
+            && instr->arg1.type == REF_LOCAL && instr->output.type != REF_NULL)
+        {
+            int j = find_array_move(instrs, removed, count, i);
+            if (j < 0) j = find_array_borrow(instrs, removed, count, i);
+            if (j < 0) continue;
+            instr->flags |= OP_NO_REFCOUNT;
+            removed[j] = true;
+            removed_count += 2;
+        } else if (instr->op == OP_ARRAY_CONCAT) {
+            int j = find_concat_move(instrs, removed, count, i);
+            if (j < 0) continue;
+            instr->flags |= OP_MOVE_ARG1;
+            removed[j] = true;
+            removed_count += 1;
+        } else if (instr->op == OP_POINTER_INCREMENT_REFCOUNT) {
+            int j = find_struct_borrow(instrs, removed, count, i);
+            if (j < 0) continue;
+            removed[i] = true;
+            removed[j] = true;
+            removed_count += 2;
+        }
+    }
+
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (!removed[i]) instrs[kept++] = instrs[i];
+    }
+    in->count = kept;
+    free(removed);
+
+    return removed_count;
+}
+
+/*******************/
+/* Escape Analysis */
+/*******************/
+
+/* An array literal that a procedure moves into a local, and then only reads,
+   indexes, or writes elements of through that local until it drops it, is
+   never returned, passed on, stored, or seen under another name, so it can't
+   outlive the frame, and nothing else can ever hold a reference to it. Those
+   arrays go on the data stack, and are freed with OP_STACK_FREE where the
+   local would have been dropped, so they never touch the pool or count
+   references. Arrays with arrays in their elements would still have to drop
+   those, so they stay on the heap. */
+
+/* Whether dropping a value of this type could drop an array. */
+bool type_holds_arrays(struct type *type) {
+    if (type->connective == TYPE_ARRAY) return true;
+    if (type->connective == TYPE_TUPLE) {
+        for (int i = 0; i < type->elements.count; i++) {
+            if (type_holds_arrays(&type->elements.data[i])) return true;
+        }
+    } else if (type->connective == TYPE_RECORD) {
+        for (int i = 0; i < type->fields.count; i++) {
+            if (type_holds_arrays(&type->fields.data[i].type)) return true;
+        }
+    }
+    return false;
+}
+
+/* Follow the array that OP_ARRAY_ALLOC i makes, through filling in the
+   literal, into the local that it is moved to, and on to the decrement that
+   drops that local. Returns the index of that decrement, or -1 if the array
+   might escape on the way. */
+int find_stack_array(struct instruction *instrs, int count, int i) {
+    struct instruction *alloc = &instrs[i];
+    struct type *elem_type = (struct type *)alloc->arg1.x;
+    int64 elem_count = alloc->arg2.x;
+    if (alloc->output.type != REF_TEMPORARY) return -1;
+    if (alloc->arg2.type != REF_CONSTANT || elem_count <= 0) return -1;
+    if (type_holds_arrays(elem_type)) return -1;
+    /* Small integer arrays are kept inline anyway, see
+       shared_buff_fits_inline. */
+    if (elem_type->connective == TYPE_INT
+        && elem_type->total_size * elem_count <= sizeof(void *))
+    {
+        return -1;
+    }
+
+    struct ref temp = alloc->output;
+    int k = i + 1;
+    for (; k < count; k++) {
+        struct instruction *instr = &instrs[k];
+        if (instr->op == OP_ARRAY_STORE && ref_eq(instr->output, temp)
+            && !ref_eq(instr->arg2, temp))
+        {
+            continue;
+        }
+        if (instr->op == OP_ARRAY_OFFSET && ref_eq(instr->arg1, temp)
+            && !ref_eq(instr->output, temp))
+        {
+            continue;
+        }
+        if (instruction_mentions(instr, temp)) break;
+    }
+    if (k == count) return -1;
+
+    struct instruction *move = &instrs[k];
+    if (move->op != OP_MOV || !ref_eq(move->arg1, temp)) return -1;
+    if (move->output.type != REF_LOCAL) return -1;
+    struct ref local = move->output;
+
+    for (k += 1; k < count; k++) {
+        struct instruction *instr = &instrs[k];
+        if (is_array_decrement(instr, local)) return k;
+        if (!instruction_mentions(instr, local)) continue;
+        if (ref_eq(instr->output, local)) return -1;
+        switch (instr->op) {
+        case OP_ARRAY_INDEX:
+        case OP_ARRAY_OFFSET:
+        case OP_ARRAY_OFFSET_MAKE_UNIQUE:
+            /* Nothing else holds it, so it is already unique. */
+            if (ref_eq(instr->arg2, local)) return -1;
+            continue;
+        case OP_ARRAY_CONCAT:
+            /* Copies the elements out, without taking the array over. */
+            continue;
+        default:
+            return -1;
+        }
+    }
+    return -1;
+}
+
+struct stack_array {
+    int alloc;
+    int free;
+    bool rejected;
+};
+
+struct stack_array_buffer {
+    struct stack_array *data;
+    size_t count;
+    size_t capacity;
+};
+
+/* The array that instruction index allocates, or frees if at_free is set. */
+struct stack_array *stack_array_at(
+    struct stack_array_buffer *arrays,
+    int index,
+    bool at_free
+) {
+    for (int i = 0; i < arrays->count; i++) {
+        struct stack_array *it = &arrays->data[i];
+        if (it->rejected) continue;
+        if ((at_free ? it->free : it->alloc) == index) return it;
+    }
+    return NULL;
+}
+
+int64 instruction_frame_extent(struct instruction *instr);
+
+/* Freeing from the data stack frees everything allocated after it as well,
+   so a stack array has to be on top when it is freed, and must not be under
+   anything that gets freed while it is alive. Code is straight line, so
+   running through the allocations in order shows exactly which allocation
+   each variable holds, and what is on the stack at every point. Rejects the
+   arrays that break that, and returns whether it did. If something gets
+   freed that can't be traced, none of the arrays are safe. */
+bool reject_unordered_stack_arrays(
+    struct instruction *instrs,
+    int count,
+    struct stack_array_buffer *arrays
+) {
+    int64 frame_size = 0;
+    for (int i = 0; i < count; i++) {
+        int64 extent = instruction_frame_extent(&instrs[i]);
+        if (extent > frame_size) frame_size = extent;
+    }
+    /* Which allocation each variable points to, by instruction index. */
+    int *holds = malloc(frame_size * sizeof(int));
+    for (int64 i = 0; i < frame_size; i++) holds[i] = -1;
+    int *live = malloc(count * sizeof(int));
+    int live_count = 0;
+    bool rejected = false;
+
+    for (int k = 0; k < count; k++) {
+        struct instruction *instr = &instrs[k];
+        struct stack_array *array_freed = stack_array_at(arrays, k, true);
+        if (instr->op == OP_STACK_ALLOC || instr->op == OP_POINTER_DUP
+            || (instr->op == OP_ARRAY_ALLOC && stack_array_at(arrays, k, false)))
+        {
+            live[live_count++] = k;
+            if (ref_is_variable(instr->output)) holds[instr->output.x] = k;
+        } else if (instr->op == OP_STACK_FREE || array_freed) {
+            int freed = -1;
+            if (ref_is_variable(instr->arg1)) freed = holds[instr->arg1.x];
+            int depth = live_count - 1;
+            while (depth >= 0 && live[depth] != freed) depth -= 1;
+            if (freed < 0 || depth < 0) {
+                for (int i = 0; i < arrays->count; i++) {
+                    if (!arrays->data[i].rejected) rejected = true;
+                    arrays->data[i].rejected = true;
+                }
+                break;
+            }
+            if (depth + 1 < live_count) {
+                for (int i = depth + 1; i < live_count; i++) {
+                    struct stack_array *above =
+                        stack_array_at(arrays, live[i], false);
+                    if (above) {
+                        above->rejected = true;
+                        rejected = true;
+                    }
+                }
+                if (array_freed) {
+                    array_freed->rejected = true;
+                    rejected = true;
+                }
+            }
+            live_count = depth;
+            holds[instr->arg1.x] = -1;
+        } else if (instr->op == OP_MOV) {
+            if (ref_is_variable(instr->output)) {
+                holds[instr->output.x] = ref_is_variable(instr->arg1)
+                    ? holds[instr->arg1.x] : -1;
+            }
+        } else if (instr->op == OP_CALL || instr->op == OP_TAIL_CALL) {
+            /* Results are written back over the arguments. */
+            for (int64 i = instr->arg2.x - 1; i < frame_size; i++) {
+                if (i >= 0) holds[i] = -1;
+            }
+        } else if (ref_is_variable(instr->output)) {
+            switch (instr->op) {
+            case OP_ARRAY_STORE:
+            case OP_POINTER_STORE:
+            case OP_POINTER_COPY:
+            case OP_POINTER_COPY_OVERLAPPING:
+                /* These write through the output, not to it. */
+                break;
+            default:
+                holds[instr->output.x] = -1;
+            }
+        }
+    }
+
+    free(holds);
+    free(live);
+    return rejected;
+}
+
+/* Put the arrays that can't escape their procedure on the data stack. Only
+   for procedure bodies, since top level variables outlive the statement that
+   makes them. Returns how many arrays were placed. */
+int place_stack_arrays(struct instruction_buffer *in) {
+    struct instruction *instrs = in->data;
+    int count = in->count;
+
+    struct stack_array_buffer arrays = {0};
+    for (int i = 0; i < count; i++) {
+        if (instrs[i].op != OP_ARRAY_ALLOC) continue;
+        int j = find_stack_array(instrs, count, i);
+        if (j < 0) continue;
+        struct stack_array *it = buffer_addn(arrays, 1);
+        it->alloc = i;
+        it->free = j;
+        it->rejected = false;
+    }
+
+    while (reject_unordered_stack_arrays(instrs, count, &arrays)) {}
+
+    int placed = 0;
+    for (int i = 0; i < arrays.count; i++) {
+        struct stack_array *it = &arrays.data[i];
+        if (it->rejected) continue;
+        instrs[it->alloc].flags |= OP_STACK_ARRAY;
+        instrs[it->free].op = OP_STACK_FREE;
+        placed += 1;
+    }
+    buffer_free(arrays);
+
+    return placed;
+}
+
+/************/
+/* Lowering */
+/************/
+
+void lower_ref(
+    struct constant_pool *constants,
+    struct ref ref,
+    enum ref_type *type_out,
+    int32 *x_out
+) {
+    switch (ref.type) {
+    case REF_NULL:
+        *type_out = REF_NULL;
+        *x_out = 0;
+        return;
+    case REF_CONSTANT:
+        if (ref.x >= INT32_MIN && ref.x <= INT32_MAX) {
+            *type_out = REF_CONSTANT;
+            *x_out = (int32)ref.x;
+        } else {
+            *type_out = REF_WIDE_CONSTANT;
+            *x_out = (int32)constants->count;
+            buffer_push(*constants, ref.x);
+        }
+        return;
+    case REF_STATIC_POINTER:
+        *type_out = REF_STATIC_POINTER;
+        *x_out = (int32)constants->count;
+        buffer_push(*constants, ref.x);
+        return;
+    case REF_GLOBAL:
+    case REF_LOCAL:
+    case REF_TEMPORARY:
+        if (ref.x < 0 || ref.x > INT32_MAX) {
+            fprintf(errout, "Error: Variable index %lld is too large to "
+                "encode.\n", (long long)ref.x);
+            error_exit();
+        }
+        *type_out = ref.type;
+        *x_out = (int32)ref.x;
+        return;
+    default:
+        fprintf(errout, "Error: Tried to lower unexpected ref.type value "
+            "%d?\n", ref.type);
+        error_exit();
+    }
+}
+
+/* How far into the frame an instruction reaches, including the arguments
+   that it passes to a call, and the results that it returns. */
+int64 instruction_frame_extent(struct instruction *instr) {
+    int64 result = 0;
+    struct ref refs[3] = {instr->output, instr->arg1, instr->arg2};
+    for (int i = 0; i < 3; i++) {
+        if (refs[i].type != REF_LOCAL && refs[i].type != REF_TEMPORARY) {
+            continue;
+        }
+        if (refs[i].x + 1 > result) result = refs[i].x + 1;
+    }
+    if (instr->op == OP_CALL || instr->op == OP_TAIL_CALL) {
+        /* The output of a call is its argument count. */
+        if (instr->arg2.x + instr->output.x > result) {
+            result = instr->arg2.x + instr->output.x;
+        }
+    } else if (instr->op == OP_RET) {
+        if (instr->arg1.x + instr->arg2.x > result) {
+            result = instr->arg1.x + instr->arg2.x;
+        }
+    }
+    return result;
+}
+
+/* Pack a compiled instruction buffer. The interpreter never checks whether it
+   has run off the end of a frame, so every piece of bytecode has to end in a
+   return or a tail call. Top level statements and some builtins just fall off
+   the end, so they get an OP_RET that returns nothing. */
+struct bytecode lower_instructions(struct instruction_buffer *in) {
+    struct bytecode result = {0};
+    buffer_reserve(result.instructions, in->count + 1);
+
+    for (int i = 0; i < in->count; i++) {
+        struct instruction *instr = &in->data[i];
+        struct packed_instruction *packed = buffer_addn(result.instructions, 1);
+
+        enum ref_type output_type, arg1_type, arg2_type;
+        lower_ref(&result.constants, instr->output, &output_type, &packed->output);
+        lower_ref(&result.constants, instr->arg1, &arg1_type, &packed->arg1);
+        lower_ref(&result.constants, instr->arg2, &arg2_type, &packed->arg2);
+
+        packed->op = instr->op;
+        packed->flags = instr->flags;
+        packed->ref_types = PACK_REF_TYPES(output_type, arg1_type, arg2_type);
+
+        /* Work out the whole frame up front, so that calls can reserve it
+           once, and nothing has to check for space as it writes. */
+        int64 extent = instruction_frame_extent(instr);
+        if (extent > INT32_MAX) {
+            fprintf(errout, "Error: Frame of %lld variables is too large to "
+                "encode.\n", (long long)extent);
+            error_exit();
+        }
+        if (extent > result.frame_size) result.frame_size = (int32)extent;
+    }
+
+    struct packed_instruction *last = buffer_top(result.instructions);
+    if (!last || (last->op != OP_RET && last->op != OP_TAIL_CALL)) {
+        struct packed_instruction *ret = buffer_addn(result.instructions, 1);
+        ret->op = OP_RET;
+        ret->flags = 0;
+        ret->ref_types = PACK_REF_TYPES(REF_NULL, REF_CONSTANT, REF_CONSTANT);
+        ret->output = 0;
+        ret->arg1 = 0;
+        ret->arg2 = 0;
+    }
+
+    return result;
+}
+
+/**********/
+/* Fusion */
+/**********/
+
+#define FUSED_MAX_LENGTH 3
+
+struct fused_operation {
+    enum operation op;
+    int length;
+    enum operation parts[FUSED_MAX_LENGTH];
+};
+
+#define FUSED_PAIR_TABLE_ENTRY(A, B) {OP_##A##_##B, 2, {OP_##A, OP_##B}},
+#define FUSED_TRIPLE_TABLE_ENTRY(A, B, C) \
+    {OP_##A##_##B##_##C, 3, {OP_##A, OP_##B, OP_##C}},
+
+/* Triples come first, so that the longest run wins. */
+struct fused_operation fused_operations[] = {
+    FUSED_TRIPLES(FUSED_TRIPLE_TABLE_ENTRY)
+    FUSED_PAIRS(FUSED_PAIR_TABLE_ENTRY)
+};
+
+#undef FUSED_PAIR_TABLE_ENTRY
+#undef FUSED_TRIPLE_TABLE_ENTRY
+
+#define FUSED_OPERATION_COUNT \
+    (sizeof(fused_operations) / sizeof(fused_operations[0]))
+
+/* How many instruction slots an operation covers. */
+int fused_operation_length(enum operation op) {
+    for (int i = 0; i < FUSED_OPERATION_COUNT; i++) {
+        if (fused_operations[i].op == op) return fused_operations[i].length;
+    }
+    return 1;
+}
+
+/* Replace runs of instructions with fused operations. Code is straight line
+   apart from calls, and calls return to the instruction after the call,
+   which is never in the middle of a run, so nothing can jump into the middle
+   of a fused operation. */
+void fuse_bytecode(struct bytecode *code) {
+    struct packed_instruction *instrs = code->instructions.data;
+    size_t count = code->instructions.count;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < FUSED_OPERATION_COUNT; j++) {
+            struct fused_operation *f = &fused_operations[j];
+            if (i + f->length > count) continue;
+
+            bool matches = true;
+            for (int k = 0; k < f->length; k++) {
+                if (instrs[i + k].op != f->parts[k]) matches = false;
+            }
+            if (!matches) continue;
+
+            instrs[i].op = f->op;
+            i += f->length - 1;
+            break;
+        }
+    }
+}
+
+/**************/
+/* Quickening */
+/**************/
+
+enum quickened_kind {
+    QUICK_NONE,
+    QUICK_L,
+    QUICK_G,
+    QUICK_C,
+};
+
+struct quickened_operation {
+    enum operation op;
+    enum operation generic;
+    enum quickened_kind arg1;
+    enum quickened_kind arg2;
+};
+
+#define QUICKENED_TABLE_ENTRY(OP, SYMBOL, A, B) \
+    {OP##_##A##B, OP, QUICK_##A, QUICK_##B},
+#define QUICKENED_TABLE_OP(OP, SYMBOL) \
+    QUICKENED_OPERAND_KINDS(QUICKENED_TABLE_ENTRY, OP, SYMBOL)
+#define QUICKENED_MOV_TABLE_ENTRY(A) {OP_MOV_##A, OP_MOV, QUICK_##A, QUICK_NONE},
+
+struct quickened_operation quickened_operations[] = {
+    QUICKENED_BINARY_OPS(QUICKENED_TABLE_OP)
+    QUICKENED_MOVS(QUICKENED_MOV_TABLE_ENTRY)
+};
+
+#undef QUICKENED_TABLE_ENTRY
+#undef QUICKENED_TABLE_OP
+#undef QUICKENED_MOV_TABLE_ENTRY
+
+#define QUICKENED_OPERATION_COUNT \
+    (sizeof(quickened_operations) / sizeof(quickened_operations[0]))
+
+enum quickened_kind quickened_kind_of(enum ref_type type) {
+    switch (type) {
+    case REF_LOCAL:
+    case REF_TEMPORARY:
+        return QUICK_L;
+    case REF_GLOBAL:
+        return QUICK_G;
+    case REF_CONSTANT:
+        return QUICK_C;
+    default:
+        /* Wide constants and static pointers live in the constant pool, so
+           leave those to the generic operations. Nothing in the table takes
+           QUICK_NONE as arg1, or as arg2 of a binary operation, so this is
+           enough to stop them from matching. */
+        return QUICK_NONE;
+    }
+}
+
+/* Rewrite 64 bit operations into versions that are specialized on the kinds
+   of their operands. None of these operations care about refcounts or moves,
+   so the only thing that matters is where the values come from. */
+void quicken_bytecode(struct bytecode *code) {
+    for (int i = 0; i < code->instructions.count; i++) {
+        struct packed_instruction *instr = &code->instructions.data[i];
+        /* Fused operations have already claimed their whole run. */
+        i += fused_operation_length(instr->op) - 1;
+        if (instr->flags != OP_64BIT) continue;
+
+        enum ref_type output_type = OUTPUT_TYPE(instr);
+        if (output_type != REF_LOCAL && output_type != REF_TEMPORARY) continue;
+
+        enum quickened_kind arg1 = quickened_kind_of(ARG1_TYPE(instr));
+        enum quickened_kind arg2 = quickened_kind_of(ARG2_TYPE(instr));
+        for (int j = 0; j < QUICKENED_OPERATION_COUNT; j++) {
+            struct quickened_operation *q = &quickened_operations[j];
+            if (q->generic != instr->op) continue;
+            if (q->arg1 != arg1) continue;
+            /* OP_MOV doesn't look at arg2, so don't care what it is. */
+            if (q->arg2 != QUICK_NONE && q->arg2 != arg2) continue;
+
+            instr->op = q->op;
+            break;
+        }
+    }
+}
+
+/* Undo quickening and fusion, for anything that wants to look at the
+   operations that the compiler actually emitted. The other instructions in a
+   fused run are left untouched, so only the first needs to be recovered. */
+enum operation generic_operation(enum operation op) {
+    for (int i = 0; i < QUICKENED_OPERATION_COUNT; i++) {
+        if (quickened_operations[i].op == op) {
+            return quickened_operations[i].generic;
+        }
+    }
+    for (int i = 0; i < FUSED_OPERATION_COUNT; i++) {
+        if (fused_operations[i].op == op) return fused_operations[i].parts[0];
+    }
+    return op;
+}
+
+/* Everything that gets executed goes through here, so that the interpreter
+   never sees code that hasn't been through every pass. */
+struct bytecode prepare_bytecode(struct instruction_buffer *in) {
+    int elided = elide_refcounts(in);
+    struct bytecode result = lower_instructions(in);
+    result.elided_refcounts = elided;
+    fuse_bytecode(&result);
+    quicken_bytecode(&result);
+    return result;
+}
+
+/****************/
+/* Verification */
+/****************/
+
+/* Bytecode is checked once, before it is bound or run, so that the
+   interpreter can trust it instead of checking every operand as it goes.
+   The one thing it can't check is what a variable holds, so calls through
+   a variable still check their target as they happen. */
+
+/* What an instruction does with each of its operands. */
+enum operand_use {
+    OPERAND_IGNORED,
+    OPERAND_READ,
+    OPERAND_WRITE, /* A variable, or REF_NULL to discard the value. */
+    OPERAND_READ_WRITE, /* Must be a variable. */
+    OPERAND_COUNT, /* A non-negative REF_CONSTANT. */
+};
+
+struct operation_rule {
+    enum operand_use output;
+    enum operand_use arg1;
+    enum operand_use arg2;
+    /* Passes its flags to copy_scalar, so they must say how to copy. */
+    bool copies;
+};
+
+#define IGNORED OPERAND_IGNORED
+#define READ OPERAND_READ
+#define WRITE OPERAND_WRITE
+#define READ_WRITE OPERAND_READ_WRITE
+#define COUNT OPERAND_COUNT
+
+struct operation_rule operation_rules[OP_COUNT] = {
+    [OP_NULL] = {IGNORED, IGNORED, IGNORED},
+    [OP_MOV] = {WRITE, READ, IGNORED, true},
+    [OP_LOR] = {WRITE, READ, READ},
+    [OP_LAND] = {WRITE, READ, READ},
+    [OP_EQ] = {WRITE, READ, READ},
+    [OP_NEQ] = {WRITE, READ, READ},
+    [OP_LEQ] = {WRITE, READ, READ},
+    [OP_GEQ] = {WRITE, READ, READ},
+    [OP_LESS] = {WRITE, READ, READ},
+    [OP_GREATER] = {WRITE, READ, READ},
+    [OP_BOR] = {WRITE, READ, READ},
+    [OP_BAND] = {WRITE, READ, READ},
+    [OP_BXOR] = {WRITE, READ, READ},
+    [OP_PLUS] = {WRITE, READ, READ},
+    [OP_MINUS] = {WRITE, READ, READ},
+    [OP_LSHIFT] = {WRITE, READ, READ},
+    [OP_RSHIFT] = {WRITE, READ, READ},
+    [OP_MUL] = {WRITE, READ, READ},
+    [OP_DIV] = {WRITE, READ, READ},
+    [OP_MOD] = {WRITE, READ, READ},
+    [OP_EDIV] = {WRITE, READ, READ},
+    [OP_EMOD] = {WRITE, READ, READ},
+    /* Calls keep their argument count in their output, and the locals
+       offset of the new frame in arg2. */
+    [OP_CALL] = {COUNT, READ, COUNT},
+    [OP_RET] = {IGNORED, COUNT, COUNT},
+    [OP_TAIL_CALL] = {COUNT, READ, COUNT},
+    [OP_ARRAY_ALLOC] = {WRITE, READ, READ},
+    [OP_ARRAY_OFFSET] = {WRITE, READ, READ},
+    [OP_ARRAY_OFFSET_MAKE_UNIQUE] = {WRITE, READ_WRITE, READ},
+    /* Inline arrays are written back after the store. */
+    [OP_ARRAY_STORE] = {READ_WRITE, READ, READ, true},
+    [OP_ARRAY_INDEX] = {WRITE, READ, READ, true},
+    [OP_ARRAY_CONCAT] = {WRITE, READ, READ},
+    [OP_ARRAY_SLICE_END] = {WRITE, READ, READ},
+    [OP_ARRAY_SLICE_START] = {WRITE, READ, READ},
+    [OP_DECREMENT_REFCOUNT] = {IGNORED, READ, IGNORED},
+    [OP_STACK_ALLOC] = {WRITE, READ, IGNORED},
+    [OP_STACK_FREE] = {IGNORED, READ, IGNORED},
+    [OP_POINTER_OFFSET] = {WRITE, READ, READ},
+    [OP_POINTER_STORE] = {READ, READ, READ, true},
+    [OP_POINTER_COPY] = {READ, READ, READ},
+    [OP_POINTER_DUP] = {WRITE, READ, READ},
+    [OP_POINTER_COPY_OVERLAPPING] = {READ, READ, READ},
+    [OP_POINTER_LOAD] = {WRITE, READ, READ, true},
+    [OP_POINTER_LOAD_MAKE_UNIQUE] = {WRITE, READ, READ},
+    [OP_POINTER_INCREMENT_REFCOUNT] = {IGNORED, READ, READ},
+    [OP_POINTER_DECREMENT_REFCOUNT] = {IGNORED, READ, READ},
+    [OP_ASSERT] = {IGNORED, READ, IGNORED},
+    [OP_MEMORY_STATS] = {IGNORED, READ, IGNORED},
+    [OP_PAR_MAP] = {WRITE, READ, READ},
+    [OP_PAR_REDUCE] = {READ_WRITE, READ, READ},
+};
+
+#undef IGNORED
+#undef READ
+#undef WRITE
+#undef READ_WRITE
+#undef COUNT
+
+/* Everything outside of the bytecode itself that it can refer to. */
+struct bytecode_limits {
+    size_t procedure_count;
+    size_t global_count;
+};
+
+/* The state of a verification pass, mostly so that errors can say where they
+   happened. */
+struct verifier {
+    struct bytecode *code;
+    struct bytecode_limits limits;
+    size_t index;
+};
+
+bool verify_error(struct verifier *v, char *message) {
+    fprintf(errout, "Error: Bytecode failed verification at instruction "
+        "%zu: %s\n", v->index, message);
+    return false;
+}
+
+bool verify_operand(
+    struct verifier *v,
+    enum operand_use use,
+    enum ref_type type,
+    int32 x
+) {
+    switch (type) {
+    case REF_NULL:
+        if (use == OPERAND_READ || use == OPERAND_READ_WRITE
+            || use == OPERAND_COUNT)
+        {
+            return verify_error(v, "Expected an operand, but got none.");
+        }
+        return true;
+    case REF_CONSTANT:
+        if (use == OPERAND_WRITE || use == OPERAND_READ_WRITE) {
+            return verify_error(v, "Tried to write to a constant.");
+        }
+        if (use == OPERAND_COUNT && x < 0) {
+            return verify_error(v, "Got a negative count or offset.");
+        }
+        return true;
+    case REF_WIDE_CONSTANT:
+    case REF_STATIC_POINTER:
+        if (use == OPERAND_WRITE || use == OPERAND_READ_WRITE) {
+            return verify_error(v, "Tried to write to a constant.");
+        }
+        if (use == OPERAND_COUNT) {
+            return verify_error(v, "Expected a small constant.");
+        }
+        if (x < 0 || x >= v->code->constants.count) {
+            return verify_error(v, "Constant pool index out of range.");
+        }
+        return true;
+    case REF_GLOBAL:
+        if (use == OPERAND_COUNT) {
+            return verify_error(v, "Expected a constant, but got a global.");
+        }
+        if (x < 0 || x >= v->limits.global_count) {
+            return verify_error(v, "Global index out of range.");
+        }
+        return true;
+    case REF_LOCAL:
+    case REF_TEMPORARY:
+        if (use == OPERAND_COUNT) {
+            return verify_error(v, "Expected a constant, but got a local.");
+        }
+        if (x < 0 || x >= v->code->frame_size) {
+            return verify_error(v, "Local index is outside of the frame.");
+        }
+        return true;
+    default:
+        return verify_error(v, "Unknown operand type.");
+    }
+}
+
+/* Check the operands of a single instruction against the rules of the
+   operation that it performs. */
+bool verify_instruction(
+    struct verifier *v,
+    enum operation op,
+    struct packed_instruction *instr
+) {
+    struct operation_rule *rule = &operation_rules[op];
+    if (!verify_operand(v, rule->output, OUTPUT_TYPE(instr), instr->output)) {
+        return false;
+    }
+    if (!verify_operand(v, rule->arg1, ARG1_TYPE(instr), instr->arg1)) {
+        return false;
+    }
+    if (!verify_operand(v, rule->arg2, ARG2_TYPE(instr), instr->arg2)) {
+        return false;
+    }
+    if (rule->copies && instr->flags != OP_64BIT
+        && instr->flags != OP_SHARED_BUFF
+        && instr->flags != (OP_SHARED_BUFF | OP_NO_REFCOUNT))
+    {
+        return verify_error(v, "Flags don't say how to copy the value.");
+    }
+
+    int64 start = 0, length = 0;
+    if (op == OP_RET) {
+        start = instr->arg1;
+        length = instr->arg2;
+    } else if (op == OP_CALL || op == OP_TAIL_CALL) {
+        start = instr->arg2;
+        length = instr->output;
+    }
+    if (start + length > v->code->frame_size) {
+        return verify_error(v, "Variables are outside of the frame.");
+    }
+
+    /* Calls through a variable are checked when they happen, see
+       check_procedure_index. */
+    bool calls = false;
+    enum ref_type callee_type = REF_NULL;
+    int64 callee = 0;
+    if (op == OP_CALL || op == OP_TAIL_CALL) {
+        calls = true;
+        callee_type = ARG1_TYPE(instr);
+        callee = instr->arg1;
+    } else if (op == OP_PAR_MAP || op == OP_PAR_REDUCE) {
+        calls = true;
+        callee_type = ARG2_TYPE(instr);
+        callee = instr->arg2;
+    }
+    if (calls && callee_type == REF_CONSTANT
+        && (callee < 0 || callee >= v->limits.procedure_count))
+    {
+        return verify_error(v, "Call to a procedure that doesn't exist.");
+    }
+    if (calls && (callee_type == REF_WIDE_CONSTANT
+        || callee_type == REF_STATIC_POINTER))
+    {
+        return verify_error(v, "Call to a procedure that doesn't exist.");
+    }
+    return true;
+}
+
+/* Quickened operations skip read_operand entirely, so their operands really
+   have to be the kinds that their names say. */
+bool verify_quickened(
+    struct verifier *v,
+    struct quickened_operation *q,
+    struct packed_instruction *instr
+) {
+    if (instr->flags != OP_64BIT) {
+        return verify_error(v, "Quickened operation without OP_64BIT.");
+    }
+    enum ref_type output_type = OUTPUT_TYPE(instr);
+    if (output_type != REF_LOCAL && output_type != REF_TEMPORARY) {
+        return verify_error(v, "Quickened operation must write a local.");
+    }
+    if (quickened_kind_of(ARG1_TYPE(instr)) != q->arg1) {
+        return verify_error(v, "Quickened operation has the wrong arg1.");
+    }
+    if (q->arg2 != QUICK_NONE && quickened_kind_of(ARG2_TYPE(instr)) != q->arg2) {
+        return verify_error(v, "Quickened operation has the wrong arg2.");
+    }
+    return true;
+}
+
+/* Check that every operand is the right kind for its instruction, that every
+   index is in range, that the results of returns and the arguments of calls
+   sit inside the frame, and that the code ends in a return. Prints what went
+   wrong, and returns false, if any of that fails. */
+bool verify_bytecode(struct bytecode *code, struct bytecode_limits limits) {
+    struct verifier v = {code, limits, 0};
+    if (code->frame_size < 0) {
+        return verify_error(&v, "Negative frame size.");
+    }
+    struct packed_instruction *instrs = code->instructions.data;
+    size_t count = code->instructions.count;
+
+    for (v.index = 0; v.index < count; v.index++) {
+        struct packed_instruction *instr = &instrs[v.index];
+        if (instr->op >= OP_COUNT) {
+            return verify_error(&v, "Unknown opcode.");
+        }
+
+        enum operation op = generic_operation(instr->op);
+        if (!verify_instruction(&v, op, instr)) return false;
+
+        for (int i = 0; i < QUICKENED_OPERATION_COUNT; i++) {
+            if (quickened_operations[i].op != instr->op) continue;
+            if (!verify_quickened(&v, &quickened_operations[i], instr)) {
+                return false;
+            }
+        }
+
+        /* Fused operations read the rest of their run straight out of the
+           instructions that follow, which have to still be there. */
+        for (int i = 0; i < FUSED_OPERATION_COUNT; i++) {
+            struct fused_operation *f = &fused_operations[i];
+            if (f->op != instr->op) continue;
+            if (v.index + f->length > count) {
+                return verify_error(&v, "Fused operation runs off the end.");
+            }
+            for (int k = 1; k < f->length; k++) {
+                v.index += 1;
+                if (instrs[v.index].op != f->parts[k]) {
+                    return verify_error(&v, "Fused operation doesn't match "
+                        "the instructions that follow it.");
+                }
+                if (!verify_instruction(&v, f->parts[k], &instrs[v.index])) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    if (count == 0 || (instrs[count - 1].op != OP_RET
+        && instrs[count - 1].op != OP_TAIL_CALL))
+    {
+        v.index = count;
+        return verify_error(&v, "Code doesn't end in a return.");
+    }
+
+    return true;
+}
+
+/* For code that the compiler just produced, failing verification is a bug in
+   the compiler, so there's nothing to do but stop. */
+void check_bytecode(struct bytecode *code, struct bytecode_limits limits) {
+    if (!verify_bytecode(code, limits)) error_exit();
+}
+
+void bytecode_free(struct bytecode *code) {
+    buffer_free(code->instructions);
+    buffer_free(code->constants);
+}
+
+/* Turn a packed operand back into the ref that the compiler gave us. */
+struct ref unpack_ref(struct bytecode *code, enum ref_type type, int32 x) {
+    struct ref result;
+    switch (type) {
+    case REF_WIDE_CONSTANT:
+        result.type = REF_CONSTANT;
+        result.x = code->constants.data[x];
+        break;
+    case REF_STATIC_POINTER:
+        result.type = REF_STATIC_POINTER;
+        result.x = code->constants.data[x];
+        break;
+    default:
+        result.type = type;
+        result.x = x;
+        break;
+    }
+    return result;
+}
+
+struct instruction unpack_instruction(struct bytecode *code, size_t index) {
+    struct packed_instruction *packed = &code->instructions.data[index];
+
+    struct instruction result;
+    result.op = generic_operation(packed->op);
+    result.flags = packed->flags;
+    result.output = unpack_ref(code, OUTPUT_TYPE(packed), packed->output);
+    result.arg1 = unpack_ref(code, ARG1_TYPE(packed), packed->arg1);
+    result.arg2 = unpack_ref(code, ARG2_TYPE(packed), packed->arg2);
+    return result;
+}
+
+#endif
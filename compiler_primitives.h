@@ -119,10 +119,10 @@ struct ref variable_index_ref(struct record_table *bindings, int ind) {
 }
 
 void scope_error(struct token *tk) {
-    fprintf(stderr, "Error on line %d, %d: \"", tk->row, tk->column);
-    fputstr(tk->it, stderr);
-    fprintf(stderr, "\" is not defined in this scope.\n");
-    exit(EXIT_FAILURE);
+    fprintf(errout, "Error on line %d, %d: \"", tk->row, tk->column);
+    fputstr(tk->it, errout);
+    fprintf(errout, "\" is not defined in this scope.\n");
+    error_exit();
 }
 
 struct record_entry *convert_name(
@@ -165,10 +165,10 @@ void compile_value_token(
         loc->ref.x = value;
         loc->type = type_int64;
     } else {
-        fprintf(stderr, "Error: Asked to compile \"");
-        fputstr(in->it, stderr);
-        fprintf(stderr, "\" as an RPN atom?\n");
-        exit(EXIT_FAILURE);
+        fprintf(errout, "Error: Asked to compile \"");
+        fputstr(in->it, errout);
+        fprintf(errout, "\" as an RPN atom?\n");
+        error_exit();
     }
 }
 
@@ -189,9 +189,9 @@ void compile_mov_ref(
     } else if (ty->connective == TYPE_PROCEDURE) {
         flags = OP_64BIT;
     } else {
-        fprintf(stderr, "Error: Move instructions are only "
+        fprintf(errout, "Error: Move instructions are only "
             "implemented for arrays and 64 bit integers.\n");
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 
     struct instruction *instr = buffer_addn(*out, 1);
@@ -241,7 +241,7 @@ void compile_pointer_refcounts(
             offset += it->total_size;
         }
     } else if (element_type->connective != TYPE_INT) {
-        fprintf(stderr, "Warning: copying type connective %d is not yet "
+        fprintf(errout, "Warning: copying type connective %d is not yet "
             "implemented.\n", element_type->connective);
     }
 }
@@ -361,8 +361,8 @@ void compile_store(
     enum operation_flags flags = 0;
     if (val.is_pointer) {
         if (val.type.connective != TYPE_TUPLE && val.type.connective != TYPE_RECORD) {
-            fprintf(stderr, "Error: Tried to store a pointer that was pointing to a scalar?\n");
-            exit(EXIT_FAILURE);
+            fprintf(errout, "Error: Tried to store a pointer that was pointing to a scalar?\n");
+            error_exit();
         }
 
         struct ref offset_ptr = push_intermediate(intermediates, val.type);
@@ -396,9 +396,9 @@ void compile_store(
         instr->arg1.x = offset;
         instr->arg2 = val.ref;
     } else {
-        fprintf(stderr, "Error: Store instructions are only "
+        fprintf(errout, "Error: Store instructions are only "
             "implemented for arrays and 64 bit integers.\n");
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 }
 
@@ -425,9 +425,9 @@ void compile_push(
     struct intermediate_buffer *intermediates
 ) {
     if (intermediates->count == 0) {
-        fprintf(stderr, "Error: Tried to push an intermediate to the stack, "
+        fprintf(errout, "Error: Tried to push an intermediate to the stack, "
             "when there were no intermediates?\n");
-        exit(EXIT_FAILURE);
+        error_exit();
     }
     struct intermediate *val = buffer_top(*intermediates);
     if (val->ref.type != REF_TEMPORARY) {
@@ -454,13 +454,13 @@ void compile_operation(
     }
     if (!op) {
         if (IS_PRINTABLE(operation.id)) {
-            fprintf(stderr, "Error: Operator '%c' is not yet "
+            fprintf(errout, "Error: Operator '%c' is not yet "
                 "implemented.\n", operation.id);
         } else {
-            fprintf(stderr, "Error: Operator id %d is not implemented.\n",
+            fprintf(errout, "Error: Operator id %d is not implemented.\n",
                 operation.id);
         }
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 
     struct intermediate val2 = pop_intermediate(intermediates);
@@ -478,18 +478,18 @@ void compile_operation(
            make the connective "scalar", or work out some bit mask trick to
            test them all in one go. */
         if (val1.type.connective != TYPE_ARRAY) {
-            fprintf(stderr, "Error: Left side of array index must be an "
+            fprintf(errout, "Error: Left side of array index must be an "
                 "array.\n");
-            exit(EXIT_FAILURE);
+            error_exit();
         }
         if (val2.type.connective != TYPE_INT) {
-            fprintf(stderr, "Error: Array index must be an integer.\n");
-            exit(EXIT_FAILURE);
+            fprintf(errout, "Error: Array index must be an integer.\n");
+            error_exit();
         }
         if (val2.type.word_size != 3) {
-            fprintf(stderr, "Error: Currently only 64 bit integer types are "
+            fprintf(errout, "Error: Currently only 64 bit integer types are "
                     "implemented.\n");
-            exit(EXIT_FAILURE);
+            error_exit();
         }
         struct type *inner = val1.type.inner;
         if (is_assignment_lhs) {
@@ -508,16 +508,18 @@ void compile_operation(
                 fst->arg2.x = val1.ref_offset;
                 fst->flags = 0;
 
-                /* Now offset into the scalar version. */
-                result.op = OP_ARRAY_OFFSET;
+                /* Now offset into the scalar version. Large arrays are
+                   tries, which only made their root unique so far, so
+                   this still has to make the rest of the path unique. */
+                result.op = OP_ARRAY_OFFSET_MAKE_UNIQUE;
                 result.arg1 = tmp;
             } else {
                 /* Scalar array, make it mutable, and then offset it. */
                 result.op = OP_ARRAY_OFFSET_MAKE_UNIQUE;
             }
         } else if (val1.is_pointer) {
-            fprintf(stderr, "Error: Got a pointer to an array, that wasn't on the LHS of an assignment?\n");
-            exit(EXIT_FAILURE);
+            fprintf(errout, "Error: Got a pointer to an array, that wasn't on the LHS of an assignment?\n");
+            error_exit();
         } else if (inner->connective == TYPE_RECORD || inner->connective == TYPE_TUPLE) {
             /* We want to read a struct, so get the pointer to it. */
             result.op = OP_ARRAY_OFFSET;
@@ -530,51 +532,52 @@ void compile_operation(
                appropriately. */
             result.flags = OP_64BIT;
         } else {
-            fprintf(stderr, "Error: Unknown connective %d?\n", inner->connective);
+            fprintf(errout, "Error: Unknown connective %d?\n", inner->connective);
         }
 
         result_type = *val1.type.inner;
     } else if (op->opcode == OP_ARRAY_CONCAT) {
         if (is_assignment_lhs) {
-            fprintf(stderr, "Error at line %d, %d: Got binary operator \"", operation.row, operation.column);
-            fputstr(operation.it, stderr);
-            fprintf(stderr, "\" on left hand side of an assignment.\n");
-            exit(EXIT_FAILURE);
+            fprintf(errout, "Error at line %d, %d: Got binary operator \"", operation.row, operation.column);
+            fputstr(operation.it, errout);
+            fprintf(errout, "\" on left hand side of an assignment.\n");
+            error_exit();
         }
 
         if (val1.type.connective != TYPE_ARRAY || val2.type.connective != TYPE_ARRAY) {
-            fprintf(stderr, "Error: Arguments to ++ operator must be "
+            fprintf(errout, "Error: Arguments to ++ operator must be "
                 "arrays.\n");
-            exit(EXIT_FAILURE);
+            error_exit();
         }
 
         if (!type_eq(val1.type.inner, val2.type.inner)) {
-            fprintf(stderr, "Error: Tried to apply ++ operator to arrays with "
+            fprintf(errout, "Error: Tried to apply ++ operator to arrays with "
                 "different types.\n", operation.row, operation.column);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
 
+        result.flags = 0;
         result_type = val1.type;
     } else {
         if (is_assignment_lhs) {
-            fprintf(stderr, "Error at line %d, %d: Got binary operator \"", operation.row, operation.column);
-            fputstr(operation.it, stderr);
-            fprintf(stderr, "\" on left hand side of an assignment.\n");
-            exit(EXIT_FAILURE);
+            fprintf(errout, "Error at line %d, %d: Got binary operator \"", operation.row, operation.column);
+            fputstr(operation.it, errout);
+            fprintf(errout, "\" on left hand side of an assignment.\n");
+            error_exit();
         }
 
         /* Casing all the scalar connectives sounds annoying. Maybe I should
            make the connective "scalar", or work out some bit mask trick to
            test them all in one go. */
         if (val1.type.connective != TYPE_INT || val2.type.connective != TYPE_INT) {
-            fprintf(stderr, "Error: Argument to operator %c must be an integer.\n",
+            fprintf(errout, "Error: Argument to operator %c must be an integer.\n",
                     operation.id);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
         if (val1.type.word_size != 3 || val2.type.word_size != 3) {
-            fprintf(stderr, "Error: Currently only 64 bit integer types are "
+            fprintf(errout, "Error: Currently only 64 bit integer types are "
                     "implemented.\n");
-            exit(EXIT_FAILURE);
+            error_exit();
         }
         result.flags = OP_64BIT;
     }
@@ -591,6 +594,59 @@ void compile_operation(
     buffer_push(*out, result);
 }
 
+/* xs[start..end] narrows the array down to its first end elements, and then
+   drops the first start elements, so that each bound gets checked against the
+   actual range that it ends up limiting. Both steps share the original
+   buffer, and only make a copy if something writes to the slice later. */
+void compile_array_slice(
+    struct instruction_buffer *out,
+    struct intermediate_buffer *intermediates,
+    struct token slice_tk,
+    bool is_assignment_lhs
+) {
+    if (is_assignment_lhs) {
+        fprintf(errout, "Error at line %d, %d: Cannot assign to an array "
+            "slice.\n", slice_tk.row, slice_tk.column);
+        error_exit();
+    }
+
+    /* The result might land on top of a bound that is still needed, so the
+       first step goes into the slot above everything. */
+    struct ref tmp;
+    tmp.type = REF_TEMPORARY;
+    tmp.x = intermediates->next_local_index;
+
+    struct intermediate end = pop_intermediate(intermediates);
+    struct intermediate start = pop_intermediate(intermediates);
+    struct intermediate array = pop_intermediate(intermediates);
+
+    if (array.type.connective != TYPE_ARRAY) {
+        fprintf(errout, "Error at line %d, %d: Left side of array slice must "
+            "be an array.\n", slice_tk.row, slice_tk.column);
+        error_exit();
+    }
+    if (start.type.connective != TYPE_INT || end.type.connective != TYPE_INT) {
+        fprintf(errout, "Error at line %d, %d: Array slice bounds must be "
+            "integers.\n", slice_tk.row, slice_tk.column);
+        error_exit();
+    }
+
+    struct ref result = push_intermediate(intermediates, array.type);
+
+    struct instruction *instrs = buffer_addn(*out, 2);
+    instrs[0].op = OP_ARRAY_SLICE_END;
+    instrs[0].flags = 0;
+    instrs[0].output = tmp;
+    instrs[0].arg1 = array.ref;
+    instrs[0].arg2 = end.ref;
+
+    instrs[1].op = OP_ARRAY_SLICE_START;
+    instrs[1].flags = 0;
+    instrs[1].output = result;
+    instrs[1].arg1 = tmp;
+    instrs[1].arg2 = start.ref;
+}
+
 void compile_struct_member(
     struct instruction_buffer *out,
     struct record_table *bindings,
@@ -604,20 +660,20 @@ void compile_struct_member(
     int64 member_index;
     if (it->type.connective == TYPE_TUPLE) {
         if (member_tk.id != TOKEN_NUMERIC) {
-            fprintf(stderr, "Error at line %d, %d: Tried to access the "
+            fprintf(errout, "Error at line %d, %d: Tried to access the "
                 "field \"", member_tk.row, member_tk.column);
-            fputstr(member_tk.it, stderr);
-            fprintf(stderr, "\" in a tuple type.\n");
-            exit(EXIT_FAILURE);
+            fputstr(member_tk.it, errout);
+            fprintf(errout, "\" in a tuple type.\n");
+            error_exit();
         }
 
         member_index = integer_from_string(member_tk.it);
         if (member_index >= it->type.elements.count) {
-            fprintf(stderr, "Error at line %d, %d: Tried to access element "
+            fprintf(errout, "Error at line %d, %d: Tried to access element "
                 "%lld of a tuple with only %llu elements.\n",
                 member_tk.row, member_tk.column,
                 member_index, it->type.elements.count);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
         for (int i = 0; i < member_index; i++) {
             offset += it->type.elements.data[i].total_size;
@@ -626,21 +682,21 @@ void compile_struct_member(
     } else if (it->type.connective == TYPE_RECORD) {
         member_index = lookup_name_fields(&it->type.fields, member_tk.it);
         if (member_index == -1) {
-            fprintf(stderr, "Error at line %d, %d: Tried to access field \"", member_tk.row, member_tk.column);
-            fputstr(member_tk.it, stderr);
-            fprintf(stderr, "\" of a record type that does not have that "
+            fprintf(errout, "Error at line %d, %d: Tried to access field \"", member_tk.row, member_tk.column);
+            fputstr(member_tk.it, errout);
+            fprintf(errout, "\" of a record type that does not have that "
                 "field.\n");
-            exit(EXIT_FAILURE);
+            error_exit();
         }
         for (int i = 0; i < member_index; i++) {
             offset += it->type.fields.data[i].type.total_size;
         }
         member_ty = &it->type.fields.data[member_index].type;
     } else {
-        fprintf(stderr, "Error at line %d, %d: Tried to access a member of "
+        fprintf(errout, "Error at line %d, %d: Tried to access a member of "
             "something that wasn't a tuple or record type.\n",
             member_tk.row, member_tk.column);
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 
     if (!is_assignment_lhs && (member_ty->connective == TYPE_INT || member_ty->connective == TYPE_ARRAY)) {
@@ -652,9 +708,9 @@ void compile_struct_member(
             /* Reading a scalar from a struct literal, load the value, and then
                destroy the struct. */
             if (it->ref.type != REF_TEMPORARY) {
-                fprintf(stderr, "Internal error: Got an intermediate that "
+                fprintf(errout, "Internal error: Got an intermediate that "
                     "owns stack memory, but isn't a temporary?\n");
-                exit(EXIT_FAILURE);
+                error_exit();
             }
 
             /* `output` should be the same ref as `it.ref`, but we want to free
@@ -787,18 +843,18 @@ void compile_proc_call(
 
     if (proc_val.type.connective != TYPE_PROCEDURE) {
         /* TODO: Get a row/column here somehow */
-        fprintf(stderr, "Error: Tried to call something that "
+        fprintf(errout, "Error: Tried to call something that "
             "wasn't a function or procedure.\n");
-        exit(EXIT_FAILURE);
+        error_exit();
     }
     struct type_buffer inputs = proc_val.type.proc.inputs;
     struct type_buffer outputs = proc_val.type.proc.outputs;
 
     if (inputs.count != call->arg_count) {
         /* TODO: Get a row/column here somehow */
-        fprintf(stderr, "Error: Procedure expected %d arguments, but %d were "
+        fprintf(errout, "Error: Procedure expected %d arguments, but %d were "
             "given.\n", (int)inputs.count, (int)call->arg_count);
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 
     struct intermediate *actual_types =
@@ -807,9 +863,9 @@ void compile_proc_call(
     for (int i = 0; i < inputs.count; i++) {
         if (!type_eq(&inputs.data[i], &actual_types[i].type)) {
             /* TODO: Get a row/column here somehow */
-            fprintf(stderr, "Error: Argument %d of function call had the "
+            fprintf(errout, "Error: Argument %d of function call had the "
                 "wrong type.\n", i + 1);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
     }
 
@@ -837,7 +893,10 @@ void compile_proc_call(
     struct instruction instr = {0};
     instr.op = OP_CALL;
     instr.flags = 0;
-    instr.output.type = REF_NULL;
+    /* Calls don't write anything through their output, so use it to record
+       how many arguments there are, in case this becomes a tail call. */
+    instr.output.type = REF_CONSTANT;
+    instr.output.x = call->arg_count;
     instr.arg1 = proc_val.ref;
     instr.arg2.type = REF_CONSTANT;
     instr.arg2.x = intermediates->next_local_index - call->arg_count;
@@ -872,11 +931,11 @@ void compile_proc_call(
         /* We have structs to return, so we want to use the temp_memory pointer
            as the output. */
         if (outputs.count > 1) {
-            fprintf(stderr, "Error: Structs in multivalue function results are not yet implemented.\n");
+            fprintf(errout, "Error: Structs in multivalue function results are not yet implemented.\n");
         }
         if (outputs.count == 0) {
-            fprintf(stderr, "Error: Function was called with keep_output_memory had no outputs?\n");
-            exit(EXIT_FAILURE);
+            fprintf(errout, "Error: Function was called with keep_output_memory had no outputs?\n");
+            error_exit();
         }
 
         if (call->has_input_memory) {
@@ -940,20 +999,20 @@ void type_check_return(
     str proc_name
 ) {
     if (expected->count != actual->count) {
-        fprintf(stderr, "Error: Function \"");
-        fputstr(proc_name, stderr);
-        fprintf(stderr, "\" should return %d values, but %d were "
+        fprintf(errout, "Error: Function \"");
+        fputstr(proc_name, errout);
+        fprintf(errout, "\" should return %d values, but %d were "
             "given.\n", (int)expected->count,
             (int)actual->count);
-        exit(EXIT_FAILURE);
+        error_exit();
     }
     for (int i = 0; i < actual->count; i++) {
         if (!type_eq(&actual->data[i].type, &expected->data[i])) {
-            fprintf(stderr, "Error: Return value %d of function \"",
+            fprintf(errout, "Error: Return value %d of function \"",
                 i + 1);
-            fputstr(proc_name, stderr);
-            fprintf(stderr, "\" had the wrong type.\n");
-            exit(EXIT_FAILURE);
+            fputstr(proc_name, errout);
+            fprintf(errout, "\" had the wrong type.\n");
+            error_exit();
         }
     }
 }
@@ -987,7 +1046,7 @@ void compile_variable_decrements(
             instr->arg2.type = REF_NULL;
         }
     } else if (type->connective != TYPE_INT) {
-        fprintf(stderr, "Warning: Unknown type will be put on the stack, it "
+        fprintf(errout, "Warning: Unknown type will be put on the stack, it "
             "may leak memory.\n");
     }
 }
@@ -1006,6 +1065,71 @@ void compile_local_decrements(
     }
 }
 
+/* Whether any part of a type is a tuple or record. */
+bool type_contains_struct(struct type *type) {
+    if (type->connective == TYPE_TUPLE) {
+        for (int i = 0; i < type->elements.count; i++) {
+            if (type_contains_struct(&type->elements.data[i])) return true;
+        }
+        return false;
+    } else if (type->connective == TYPE_RECORD) {
+        for (int i = 0; i < type->fields.count; i++) {
+            if (type_contains_struct(&type->fields.data[i].type)) return true;
+        }
+        return false;
+    } else if (type->connective == TYPE_ARRAY) {
+        return type_contains_struct(type->inner);
+    }
+    return false;
+}
+
+/* If the value being returned is exactly the result of the call that was just
+   compiled, then turn that call into an OP_TAIL_CALL, which moves its
+   arguments down to the start of the current frame, and runs the callee in
+   place of this procedure, returning straight to our caller. That only works
+   if nothing has to happen after the call, so the local decrements have to be
+   moved in front of it. Arrays can be released early, since the arguments
+   hold their own references, but struct locals can't be freed while an
+   argument might point into them, and neither can arrays with structs in
+   them. Returns false, having emitted nothing, if the call can't be made a
+   tail call. */
+bool compile_tail_call(
+    struct instruction_buffer *out,
+    struct record_table *bindings,
+    struct intermediate_buffer *intermediates
+) {
+    if (intermediates->count != 1) return false;
+    if (bindings->out_ptr_count != 0) return false;
+
+    struct intermediate *result = &intermediates->data[0];
+    if (result->ref.type != REF_TEMPORARY) return false;
+    if (result->is_pointer || result->owns_stack_memory) return false;
+
+    struct instruction *call = buffer_top(*out);
+    if (!call || call->op != OP_CALL) return false;
+    int64 results_index = call->arg2.x;
+    if (call->arg1.type == REF_TEMPORARY) results_index -= 1;
+    if (result->ref.x != results_index) return false;
+
+    int64 local_count = bindings->count - bindings->global_count;
+    for (int64 i = 0; i < local_count; i++) {
+        struct record_entry *it = &bindings->data[bindings->global_count + i];
+        bool is_arg = i < bindings->arg_count;
+        if (it->type.connective == TYPE_ARRAY) {
+            if (type_contains_struct(it->type.inner)) return false;
+        } else if (type_contains_struct(&it->type) && !is_arg) {
+            return false;
+        }
+    }
+
+    struct instruction tail_call = buffer_pop(*out);
+    tail_call.op = OP_TAIL_CALL;
+    compile_local_decrements(out, bindings);
+    buffer_push(*out, tail_call);
+
+    return true;
+}
+
 void compile_return(
     struct instruction_buffer *out,
     struct record_table *bindings,
@@ -1017,18 +1141,20 @@ void compile_return(
            boolean into expression compilation, to allocate all things
            immediately to the stack. This is similar to what we do for function
            arguments, but at the top level of the expression now. */
-        fprintf(stderr, "Error: Multivalue return statements are not yet "
+        fprintf(errout, "Error: Multivalue return statements are not yet "
             "implemented.\n");
-        exit(EXIT_FAILURE);
+        error_exit();
     }
+    if (compile_tail_call(out, bindings, intermediates)) return;
+
     if (val_count == 1) {
         struct type *result_type = &intermediates->data[0].type;
         if (result_type->connective == TYPE_TUPLE || result_type->connective == TYPE_RECORD) {
             if (bindings->out_ptr_count != 1) {
                 /* TODO: Better error message for when this is actually
                    reachable? */
-                fprintf(stderr, "Error: Expected %llu struct results, but got 1.\n", bindings->out_ptr_count);
-                exit(EXIT_FAILURE);
+                fprintf(errout, "Error: Expected %llu struct results, but got 1.\n", bindings->out_ptr_count);
+                error_exit();
             }
             struct ref out_ptr = {REF_LOCAL, bindings->arg_count};
             compile_copy(
@@ -1044,14 +1170,14 @@ void compile_return(
             val_count -= 1;
         } else {
             if (intermediates->data[0].is_pointer) {
-                fprintf(stderr, "Error: tried to return a pointer that was pointing to a scalar?\n");
-                exit(EXIT_FAILURE);
+                fprintf(errout, "Error: tried to return a pointer that was pointing to a scalar?\n");
+                error_exit();
             }
             if (bindings->out_ptr_count != 0) {
                 /* TODO: Better error message for when this is actually
                    reachable? */
-                fprintf(stderr, "Error: Expected %llu struct results, but got none.\n", bindings->out_ptr_count);
-                exit(EXIT_FAILURE);
+                fprintf(errout, "Error: Expected %llu struct results, but got none.\n", bindings->out_ptr_count);
+                error_exit();
             }
             compile_push(out, intermediates);
         }
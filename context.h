@@ -0,0 +1,241 @@
+#ifndef MODLANG_CONTEXT_H
+#define MODLANG_CONTEXT_H
+
+#include "types.h"
+#include "statements.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "builtins.h"
+
+/* Everything that one program needs, so that many programs can run at once,
+   each on whichever thread it likes, as long as only one thread runs a
+   context at a time. The thread locals that the interpreter uses, such as
+   shared_buff_pool, are swapped in by context_enter and back out by
+   context_leave.
+
+   Errors jump back to context_enter's recover point, see error_exit. Once a
+   context has failed, whatever it was in the middle of is left half done, so
+   all that can be done with it is context_free.
+
+   Whatever the compiler allocates belongs to the context's arena, since
+   types and names get copied around too freely to be freed one at a time.
+   Programs don't run with the arena set, since the thread pool and the
+   buffers it allocates outlive any one context. */
+
+struct context {
+    struct procedure_buffer procedures;
+    struct record_table bindings;
+    struct call_stack call_stack;
+    /* How many of each add_builtins made, which compiled programs leave
+       out, see modc.h. */
+    size_t builtin_procedure_count;
+    size_t builtin_global_count;
+    /* A compiled program that the procedures' code points into, see
+       modc_map. */
+    void *mapping;
+    size_t mapping_size;
+
+    bool debug;
+    bool jit_enabled;
+
+    struct shared_buff_pool pool;
+    struct release_queue release_queue;
+    struct memory_stats memory_stats;
+
+    struct error_channel errors;
+    struct allocation_arena arena;
+};
+
+/* Whatever the thread had before context_enter. */
+struct context_thread_state {
+    struct shared_buff_pool pool;
+    struct release_queue release_queue;
+    struct memory_stats memory_stats;
+    bool debug;
+    bool jit_enabled;
+    struct error_channel *error_channel;
+    struct allocation_arena *allocation_arena;
+};
+
+void context_enter(
+    struct context *ctx,
+    struct context_thread_state *saved,
+    error_jump_buffer *recover
+) {
+    saved->pool = shared_buff_pool;
+    saved->release_queue = release_queue;
+    saved->memory_stats = memory_stats;
+    saved->debug = debug;
+    saved->jit_enabled = jit_enabled;
+    saved->error_channel = error_channel;
+    saved->allocation_arena = allocation_arena;
+
+    shared_buff_pool = ctx->pool;
+    release_queue = ctx->release_queue;
+    memory_stats = ctx->memory_stats;
+    debug = ctx->debug;
+    jit_enabled = ctx->jit_enabled;
+    ctx->errors.recover = recover;
+    error_channel = &ctx->errors;
+    allocation_arena = NULL;
+}
+
+void context_leave(
+    struct context *ctx,
+    struct context_thread_state *saved
+) {
+    ctx->pool = shared_buff_pool;
+    ctx->release_queue = release_queue;
+    ctx->memory_stats = memory_stats;
+    ctx->errors.recover = NULL;
+
+    shared_buff_pool = saved->pool;
+    release_queue = saved->release_queue;
+    memory_stats = saved->memory_stats;
+    debug = saved->debug;
+    jit_enabled = saved->jit_enabled;
+    error_channel = saved->error_channel;
+    allocation_arena = saved->allocation_arena;
+}
+
+/* Errors go to stderr until ctx->errors.output says otherwise. */
+struct context *context_create(size_t data_stack_size) {
+    struct context *ctx = calloc(1, sizeof(struct context));
+    arena_init(&ctx->arena);
+    ctx->call_stack.data = stack_create(data_stack_size);
+
+    struct context_thread_state saved;
+    context_enter(ctx, &saved, NULL);
+    allocation_arena = &ctx->arena;
+    add_builtins(&ctx->bindings, &ctx->procedures, &ctx->call_stack);
+    ctx->builtin_procedure_count = ctx->procedures.count;
+    ctx->builtin_global_count = ctx->bindings.global_count;
+    context_leave(ctx, &saved);
+
+    return ctx;
+}
+
+/* Arrays are all freed along with the pool, without looking at their
+   counts, since a context that failed can't be trusted to have kept them
+   right. Everything the compiler made goes with the arena. */
+void context_free(struct context *ctx) {
+    for (size_t i = 0; i < ctx->procedures.count; i++) {
+        struct procedure *p = &ctx->procedures.data[i];
+        bytecode_free(&p->code);
+#ifdef MODLANG_JIT
+        jit_free_procedure(p);
+#endif
+    }
+    buffer_free(ctx->procedures);
+    buffer_free(ctx->bindings);
+    if (ctx->mapping) {
+#if defined(__unix__) || defined(__APPLE__)
+        munmap(ctx->mapping, ctx->mapping_size);
+#elif defined(_WIN32)
+        UnmapViewOfFile(ctx->mapping);
+#else
+        free(ctx->mapping);
+#endif
+    }
+
+    buffer_free(ctx->call_stack.exec);
+    buffer_free(ctx->call_stack.vars);
+    stack_destroy(&ctx->call_stack.data);
+
+    buffer_free(ctx->release_queue);
+    buffer_free(ctx->memory_stats.types);
+    pool_release(&ctx->pool);
+    arena_release(&ctx->arena);
+
+    free(ctx);
+}
+
+/* The rest is for a thread that has entered ctx. */
+
+void context_execute(struct context *ctx, struct bytecode *code) {
+    execute_top_level_code(ctx->procedures, &ctx->call_stack, code);
+}
+
+/* Clear up after a top level statement, once its results have been
+   dropped. */
+void context_end_statement(struct context *ctx) {
+    /* Discard any locals or temporaries. */
+    buffer_setcount(ctx->call_stack.vars, ctx->call_stack.vars.global_count);
+
+    /* With -defer-release, whatever this statement dropped is released
+       here, off its critical path. */
+    release_dead_buffers();
+}
+
+/* Drop the results of a top level statement that just ran, and whatever
+   else it left on the call stack. */
+void context_finish_statement(
+    struct context *ctx,
+    struct intermediate_buffer *intermediates
+) {
+    struct instruction_buffer deinitialize_instructions = {0};
+    compile_multivalue_decrements(&deinitialize_instructions, intermediates);
+
+    struct bytecode deinitialize_code =
+        prepare_bytecode(&deinitialize_instructions);
+    struct bytecode_limits limits =
+        {ctx->procedures.count, ctx->bindings.global_count};
+    check_bytecode(&deinitialize_code, limits);
+    context_execute(ctx, &deinitialize_code);
+    bytecode_free(&deinitialize_code);
+    buffer_free(deinitialize_instructions);
+
+    context_end_statement(ctx);
+}
+
+/* Parse and run every item in input, as a script would be. The globals that
+   it makes are left in the call stack, named by ctx->bindings. Returns false
+   if anything went wrong, after writing the error to ctx->errors.output. */
+bool context_run_source(struct context *ctx, FILE *input) {
+    if (ctx->errors.failed) return false;
+
+    struct context_thread_state saved;
+    error_jump_buffer recover;
+    /* Whatever the tokenizer had read is lost if this jumps back. */
+    struct tokenizer tokenizer = start_tokenizer(input);
+
+    context_enter(ctx, &saved, &recover);
+    if (error_catch(recover)) {
+        buffer_free(tokenizer.blob);
+        context_leave(ctx, &saved);
+        return false;
+    }
+
+    while (true) {
+        allocation_arena = &ctx->arena;
+        struct item item = parse_item(&tokenizer, &ctx->bindings, false);
+
+        if (item.type == ITEM_STATEMENT) {
+            struct bytecode code = prepare_bytecode(&item.instructions);
+            struct bytecode_limits limits =
+                {ctx->procedures.count, ctx->bindings.global_count};
+            check_bytecode(&code, limits);
+            buffer_free(item.instructions);
+
+            allocation_arena = NULL;
+            context_execute(ctx, &code);
+            bytecode_free(&code);
+            context_finish_statement(ctx, &item.intermediates);
+            buffer_free(item.intermediates);
+        } else if (item.type == ITEM_PROCEDURE) {
+            bind_procedure(&ctx->bindings, &ctx->procedures, &ctx->call_stack,
+                item.proc_binding, item.instructions);
+        } else if (item.type == ITEM_NULL) {
+            break;
+        } else {
+            fprintf(errout, "Error: Unknown item type %d?\n", item.type);
+            error_exit();
+        }
+    }
+
+    buffer_free(tokenizer.blob);
+    context_leave(ctx, &saved);
+    return true;
+}
+
+#endif
@@ -0,0 +1,35 @@
+var xs := [0];
+xs = xs ++ [1];
+xs = xs ++ [2, 3];
+xs = xs ++ [4];
+xs = xs ++ [5, 6, 7, 8];
+assert(xs[8] == 8);
+
+ys := xs;
+xs = xs ++ [9];
+assert(xs[9] == 9);
+assert(ys[8] == 8);
+xs[0] = 10;
+assert(ys[0] == 0);
+
+var zs := ys ++ [9];
+zs = zs ++ [10] ++ [11];
+assert(zs[11] == 11);
+assert(xs[0] == 10);
+
+var nested := [[1], [2, 3]];
+nested = nested ++ [xs];
+nested = nested ++ [[4]];
+xs[1] = 20;
+assert(nested[2][1] == 1);
+assert(nested[3][0] == 4);
+
+procedure build(n: Int) -> [Int] {
+    var acc := [n];
+    acc = acc ++ [n + 1];
+    acc = acc ++ [n + 2];
+    acc = acc ++ acc;
+    return acc;
+}
+built := build(3);
+assert(built[5] == 5);
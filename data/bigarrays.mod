@@ -0,0 +1,67 @@
+procedure grow(seed: Int) -> [Int] {
+    var xs := [seed, seed + 1, seed + 2, seed + 3];
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ [seed + 100];
+    return xs;
+}
+
+procedure update_shared(seed: Int) -> Int {
+    xs := grow(seed);
+    var ys := xs;
+    ys[2047] = 7;
+    ys[3] = 8;
+    assert(xs[2047] == seed + 3);
+    assert(xs[3] == seed + 3);
+    assert(ys[2047] == 7);
+    assert(ys[2046] == seed + 2);
+    assert(xs[2048] == seed + 100);
+
+    ys = ys ++ [5];
+    assert(ys[2049] == 5);
+    assert(xs[2048] == seed + 100);
+
+    tail := ys[2040..2050];
+    assert(tail[7] == 7);
+    assert(tail[9] == 5);
+    joined := tail ++ xs[0..2];
+    assert(joined[10] == seed);
+
+    var nested := [xs, ys];
+    nested[1][0] = 99;
+    assert(nested[1][0] == 99);
+    assert(ys[0] == seed);
+    return tail[8] + joined[11];
+}
+
+procedure update_records(seed: Int) -> Int {
+    var arr := [{1, [5, 6]}, {2, [3, 4]}];
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    arr = arr ++ arr;
+    before := arr;
+    arr[1501].1[0] = seed;
+    arr[1500].0 = 9;
+    assert(arr[1501].1[0] == seed);
+    assert(arr[1501].1[1] == 4);
+    assert(before[1501].1[0] == 3);
+    assert(before[1500].0 == 1);
+    return arr[1500].0 + arr[2047].1[1];
+}
+
+a := update_shared(10);
+b := update_records(7);
@@ -0,0 +1,37 @@
+procedure add_one(x: Int) -> Int {
+    return x + 1;
+}
+
+procedure double(x: Int) -> Int {
+    return x * 2;
+}
+
+procedure add(x: Int, y: Int) -> Int {
+    return x + y;
+}
+
+f := add_one;
+assert(f(2) == 3);
+
+g := double;
+assert(g(5) == 10);
+
+procedure tail_through_global(x: Int) -> Int {
+    return g(x + 1);
+}
+
+assert(tail_through_global(3) == 8);
+
+gs := [add_one, double];
+
+procedure through_array(i: Int, x: Int) -> Int {
+    return gs[i](x);
+}
+
+assert(through_array(0, 7) == 8);
+assert(through_array(1, 7) == 14);
+
+reducer := add;
+mapped := par_map([1, 2, 3], g);
+total := par_reduce(mapped, reducer, 100);
+assert(total == 112);
@@ -0,0 +1,179 @@
+function f0(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    return big.7;
+}
+function f1(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f0(y.3.7);
+    return r + y.0.0 - x;
+}
+function f2(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f1(y.3.7);
+    return r + y.0.0 - x;
+}
+function f3(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f2(y.3.7);
+    return r + y.0.0 - x;
+}
+function f4(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f3(y.3.7);
+    return r + y.0.0 - x;
+}
+function f5(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f4(y.3.7);
+    return r + y.0.0 - x;
+}
+function f6(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f5(y.3.7);
+    return r + y.0.0 - x;
+}
+function f7(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f6(y.3.7);
+    return r + y.0.0 - x;
+}
+function f8(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f7(y.3.7);
+    return r + y.0.0 - x;
+}
+function f9(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f8(y.3.7);
+    return r + y.0.0 - x;
+}
+function f10(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f9(y.3.7);
+    return r + y.0.0 - x;
+}
+function f11(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f10(y.3.7);
+    return r + y.0.0 - x;
+}
+function f12(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f11(y.3.7);
+    return r + y.0.0 - x;
+}
+function f13(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f12(y.3.7);
+    return r + y.0.0 - x;
+}
+function f14(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f13(y.3.7);
+    return r + y.0.0 - x;
+}
+function f15(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f14(y.3.7);
+    return r + y.0.0 - x;
+}
+function f16(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f15(y.3.7);
+    return r + y.0.0 - x;
+}
+function f17(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f16(y.3.7);
+    return r + y.0.0 - x;
+}
+function f18(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f17(y.3.7);
+    return r + y.0.0 - x;
+}
+function f19(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f18(y.3.7);
+    return r + y.0.0 - x;
+}
+function f20(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f19(y.3.7);
+    return r + y.0.0 - x;
+}
+function f21(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f20(y.3.7);
+    return r + y.0.0 - x;
+}
+function f22(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f21(y.3.7);
+    return r + y.0.0 - x;
+}
+function f23(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f22(y.3.7);
+    return r + y.0.0 - x;
+}
+function f24(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f23(y.3.7);
+    return r + y.0.0 - x;
+}
+function f25(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f24(y.3.7);
+    return r + y.0.0 - x;
+}
+function f26(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f25(y.3.7);
+    return r + y.0.0 - x;
+}
+function f27(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f26(y.3.7);
+    return r + y.0.0 - x;
+}
+function f28(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f27(y.3.7);
+    return r + y.0.0 - x;
+}
+function f29(x: Int) -> Int {
+    big := {x, x, x, x, x, x, x, x};
+    y := {big, big, big, big};
+    r := f28(y.3.7);
+    return r + y.0.0 - x;
+}
+assert(f29(5) == 5);
@@ -0,0 +1,70 @@
+function logic(a: Int, b: Int) := (a < b) + (a > b) * 2 + (a <= b) * 4
+    + (a >= b) * 8 + (a == b) * 16 + (a /= b) * 32
+    + ((a < b) or (a == b)) * 64 + ((a < b) and (a == b)) * 128;
+
+assert(logic(1, 2) == 1 + 4 + 32 + 64);
+assert(logic(2, 2) == 4 + 8 + 16 + 64);
+assert(logic(3, 2) == 2 + 8 + 32);
+
+function bits(a: Int, b: Int) := ((a | b) << 8) + ((a & b) << 4) + (a ^ b);
+
+assert(bits(12, 10) == 14 * 256 + 8 * 16 + 6);
+
+function arith(a: Int, b: Int) := (a + b) * (a - b) / b + a % b + (a >> 1);
+
+assert(arith(17, 5) == 22 * 12 / 5 + 2 + 8);
+
+procedure stop(n: Int, acc: Int) -> Int {
+    return acc;
+}
+
+var steps := [stop, stop];
+
+procedure count(n: Int, acc: Int) -> Int {
+    next := steps[n > 0];
+    return next(n - 1, acc + n * n % 7);
+}
+
+steps = [stop, count];
+
+assert(count(1000, 0) == 2002);
+
+procedure fill(xs: [Int], n: Int) -> [Int] {
+    var ys := xs ++ [n, n + 1];
+    ys[0] = ys[0] + n;
+    return ys[1..3];
+}
+
+filled := fill([5, 6, 7], 10);
+assert(filled[0] == 6);
+assert(filled[1] == 7);
+
+procedure swap(p: {x: Int, y: Int}) -> {x: Int, y: Int} {
+    return {x: p.y, y: p.x};
+}
+
+swapped := swap({x: 1, y: 2});
+assert(swapped.x == 2);
+assert(swapped.y == 1);
+function double(x: Int) := x * 2;
+
+doubled := par_map([1, 2, 3], double);
+assert(doubled[2] == 6);
+
+var moved := swapped;
+moved.y = moved.x + 5;
+assert(moved.y == 7);
+assert(swapped.y == 1);
+
+var holder := {xs: [1, 2], n: 3};
+kept := holder;
+holder.xs[0] = 9;
+assert(holder.xs[0] == 9);
+assert(kept.xs[0] == 1);
+middle := {1, {2, 3, 4}}.1;
+assert(middle.2 == 4);
+function add(a: Int, b: Int) := a + b;
+
+total := par_reduce(doubled, add, 40);
+assert(total == 52);
+assert(memory_stats().allocations > 0);
@@ -0,0 +1,91 @@
+procedure wide(a: Int, b: Int) -> Int {
+    v0 := a + b;
+    v1 := v0 * 3 % 1000 + 1;
+    v2 := v1 * 3 % 1000 + 2;
+    v3 := v2 * 3 % 1000 + 3;
+    v4 := v3 * 3 % 1000 + 4;
+    v5 := v4 * 3 % 1000 + 5;
+    v6 := v5 * 3 % 1000 + 6;
+    v7 := v6 * 3 % 1000 + 7;
+    v8 := v7 * 3 % 1000 + 8;
+    v9 := v8 * 3 % 1000 + 9;
+    v10 := v9 * 3 % 1000 + 10;
+    v11 := v10 * 3 % 1000 + 11;
+    v12 := v11 * 3 % 1000 + 12;
+    v13 := v12 * 3 % 1000 + 13;
+    v14 := v13 * 3 % 1000 + 14;
+    v15 := v14 * 3 % 1000 + 15;
+    v16 := v15 * 3 % 1000 + 16;
+    v17 := v16 * 3 % 1000 + 17;
+    v18 := v17 * 3 % 1000 + 18;
+    v19 := v18 * 3 % 1000 + 19;
+    v20 := v19 * 3 % 1000 + 20;
+    v21 := v20 * 3 % 1000 + 21;
+    v22 := v21 * 3 % 1000 + 22;
+    v23 := v22 * 3 % 1000 + 23;
+    v24 := v23 * 3 % 1000 + 24;
+    v25 := v24 * 3 % 1000 + 25;
+    v26 := v25 * 3 % 1000 + 26;
+    v27 := v26 * 3 % 1000 + 27;
+    v28 := v27 * 3 % 1000 + 28;
+    v29 := v28 * 3 % 1000 + 29;
+    v30 := v29 * 3 % 1000 + 30;
+    v31 := v30 * 3 % 1000 + 31;
+    v32 := v31 * 3 % 1000 + 32;
+    v33 := v32 * 3 % 1000 + 33;
+    v34 := v33 * 3 % 1000 + 34;
+    v35 := v34 * 3 % 1000 + 35;
+    v36 := v35 * 3 % 1000 + 36;
+    v37 := v36 * 3 % 1000 + 37;
+    v38 := v37 * 3 % 1000 + 38;
+    v39 := v38 * 3 % 1000 + 39;
+    return v0 + v8 + v16 + v24 + v32 + (v1 + v2) * (v3 - v4 + 1000);
+}
+
+procedure bottom(n: Int, acc: Int) -> Int {
+    return acc;
+}
+
+var steps := [bottom, bottom];
+
+procedure dive(n: Int, acc: Int) -> Int {
+    k0 := n * 1 + acc % 7;
+    k1 := n * 2 + acc % 8;
+    k2 := n * 3 + acc % 9;
+    k3 := n * 4 + acc % 10;
+    k4 := n * 5 + acc % 11;
+    k5 := n * 6 + acc % 12;
+    k6 := n * 7 + acc % 13;
+    k7 := n * 8 + acc % 14;
+    k8 := n * 9 + acc % 15;
+    k9 := n * 10 + acc % 16;
+    k10 := n * 11 + acc % 17;
+    k11 := n * 12 + acc % 18;
+    k12 := n * 13 + acc % 19;
+    k13 := n * 14 + acc % 20;
+    k14 := n * 15 + acc % 21;
+    k15 := n * 16 + acc % 22;
+    k16 := n * 17 + acc % 23;
+    k17 := n * 18 + acc % 24;
+    k18 := n * 19 + acc % 25;
+    k19 := n * 20 + acc % 26;
+    k20 := n * 21 + acc % 27;
+    k21 := n * 22 + acc % 28;
+    k22 := n * 23 + acc % 29;
+    k23 := n * 24 + acc % 30;
+    next := steps[n > 0];
+    deeper := next(n - 1, acc + k23 % 10);
+    return deeper + k0 + k6 + k12 + k18 - n * 40 - acc % 7 - acc % 13 - acc % 19 - acc % 25;
+}
+
+procedure small(n: Int) -> Int {
+    return wide(n, n + 1);
+}
+
+steps = [bottom, dive];
+
+assert(wide(1, 2) == 35491);
+assert(small(1) == 35491);
+assert(dive(5, 3) == 24);
+deep := dive(300, 0);
+assert(deep == 1200);
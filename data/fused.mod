@@ -0,0 +1,49 @@
+procedure check_positive(x: Int) {
+    assert(x > 0);
+}
+
+procedure make_point(x: Int, y: Int) -> {x: Int, y: Int, z: Int} {
+    return {x: x, y: y, z: x + y};
+}
+
+procedure sum_fields(p: {x: Int, y: Int, z: Int}) -> Int {
+    return p.x + p.y + p.z;
+}
+
+procedure inner_y(q: {a: Int, b: {x: Int, y: Int}}) -> Int {
+    return q.b.y;
+}
+
+procedure inner(q: {a: Int, b: {x: Int, y: Int}}) -> {x: Int, y: Int} {
+    b := q.b;
+    return b;
+}
+
+procedure y_at(ps: [{x: Int, y: Int}], i: Int) -> Int {
+    return ps[i].y;
+}
+
+procedure repeat(p: {x: Int, y: Int}) -> [{x: Int, y: Int}] {
+    return [p, p, p];
+}
+
+check_positive(3);
+p := make_point(1, 2);
+assert(sum_fields(p) == 6);
+assert(make_point(3, 4).z == 7);
+q := {a: 1, b: {x: 2, y: 3}};
+assert(inner_y(q) == 3);
+b := inner(q);
+assert(b.x == 2);
+ps := [{x: 1, y: 2}, {x: 3, y: 4}];
+r := ps[1];
+assert(r.y == 4);
+assert(y_at(ps, 0) == 2);
+rs := repeat(r);
+assert(y_at(rs, 2) == 4);
+wide := {a: 1, b: 2, c: 3, d: 4, e: 5};
+assert(wide.e == 5);
+nested := {a: 5, b: r};
+assert(nested.b.x == 3);
+from_array := {a: 6, b: ps[0]};
+assert(from_array.b.y == 2);
@@ -0,0 +1,7 @@
+xs := [1, 2, 3, 4];
+var ys := xs;
+ys[0] = 5;
+ps := [{x: 1, y: [2]}, {x: 3, y: [4, 5]}];
+s := memory_stats();
+assert(s.unique_copies == 1);
+assert(s.live_bytes > 0);
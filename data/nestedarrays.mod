@@ -0,0 +1,25 @@
+var rs := [{1, [2, 3]}, {4, [5]}];
+copy := rs;
+rs[0].1[0] = 20;
+assert(rs[0].1[0] == 20);
+assert(copy[0].1[0] == 2);
+
+both := rs ++ copy;
+assert(both[2].1[1] == 3);
+assert(both[0].1[0] == 20);
+
+var named := [{n: 1, xs: [6], ys: [7, 8]}];
+named = named ++ [{n: 2, xs: [9], ys: [10]}];
+others := named;
+named[1].ys[0] = 11;
+assert(others[1].ys[0] == 10);
+assert(named[1].ys[0] == 11);
+assert(named[0].ys[1] == 8);
+
+var deep := [[[1, 2], [3]], [[4]]];
+shallow := deep[0];
+deep[0][1][0] = 30;
+assert(shallow[1][0] == 3);
+assert(deep[0][1][0] == 30);
+deep = [[[0]]];
+assert(shallow[0][1] == 2);
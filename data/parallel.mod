@@ -0,0 +1,39 @@
+procedure score(x: Int) -> Int {
+    return x * x % 1000 + 1;
+}
+
+procedure add(x: Int, y: Int) -> Int {
+    return x + y;
+}
+
+procedure count_up(n: Int) -> [Int] {
+    var xs := [0, 1, 2, 3, 4, 5, 6, 7];
+    xs = xs ++ [8, 9, 10, 11, 12, 13, 14, 15];
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    return xs ++ [n];
+}
+
+procedure check(n: Int) -> Int {
+    xs := count_up(n);
+    scores := par_map(xs, score);
+    assert(scores[0] == 1);
+    assert(scores[3] == 10);
+    assert(scores[16383] == 226);
+    assert(scores[16384] == n * n % 1000 + 1);
+    total := par_reduce(xs, add, 5);
+    assert(total == 1024 * 120 + n + 5);
+    return par_reduce(scores, add, 0);
+}
+
+small := par_map([1, 2, 3], score);
+empty := par_reduce(small[0..0], add, 7);
+sum := check(99);
@@ -0,0 +1,33 @@
+procedure spread(x: Int) -> Int {
+    xs := [x, x + 1, x + 2];
+    ys := xs ++ xs;
+    return ys[4];
+}
+
+procedure count_up(n: Int) -> [Int] {
+    var xs := [0, 1, 2, 3, 4, 5, 6, 7];
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    xs = xs ++ xs;
+    return xs ++ [n];
+}
+
+procedure check(n: Int) -> Int {
+    xs := count_up(n);
+    before := memory_stats();
+    spreads := par_map(xs, spread);
+    after := memory_stats();
+    assert(spreads[8192] == n + 1);
+    assert(after.allocations - before.allocations > 8192);
+    assert(after.decrements - before.decrements > 8192);
+    return spreads[8192];
+}
+
+last := check(5);
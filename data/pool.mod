@@ -0,0 +1,49 @@
+procedure done(xs: [Int], n: Int) -> [Int] {
+    return xs;
+}
+
+var grow_steps := [done, done];
+
+procedure grow(xs: [Int], n: Int) -> [Int] {
+    next := grow_steps[n > 0];
+    return next(xs ++ [n], n - 1);
+}
+
+grow_steps = [done, grow];
+
+procedure built(n: Int) -> Int {
+    xs := grow([0], n);
+    copy := xs[1..n + 1] ++ xs[0..1];
+    return xs[1] + xs[n] + copy[0] + copy[n];
+}
+
+procedure mixed(n: Int) -> Int {
+    small := [[n, 2, 3, 4, 5], [1, 2, 3, 4, 5, 6, 7], [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, n]];
+    medium := [small[2] ++ small[0], small[2] ++ small[2] ++ small[1] ++ small[2]];
+    large := medium[1] ++ medium[1] ++ medium[0];
+    var copy := large;
+    copy[0] = n + 1;
+    return large[0] + copy[0] + large[95] + medium[0][11];
+}
+
+assert(mixed(20) == 1 + 21 + 5 + 20);
+single := [{x: 1}];
+pair := [{x: 1}, {x: 2}];
+
+procedure reuse(n: Int) -> Int {
+    before := memory_stats();
+    first := built(n);
+    middle := memory_stats();
+    second := built(n);
+    after := memory_stats();
+    assert(first == second);
+    assert(after.allocations - middle.allocations == middle.allocations - before.allocations);
+    assert(middle.allocations - before.allocations > n);
+    assert(mixed(30) == mixed(30));
+    assert(memory_stats().unique_copies - after.unique_copies == 2);
+    return first;
+}
+
+live := memory_stats().live_bytes;
+assert(reuse(100) == 201);
+assert(memory_stats().live_bytes == live);
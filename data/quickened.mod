@@ -0,0 +1,134 @@
+g := 7;
+h := 3;
+
+procedure compare(a: Int, b: Int, c: Int) -> Int {
+    assert(a == a);
+    assert(b == g);
+    assert(a == 12);
+    assert(g == b);
+    assert(g == g);
+    assert(g == 7);
+    assert(2 == c);
+    assert(7 == g);
+    assert(a /= b);
+    assert(a /= g);
+    assert(a /= 2);
+    assert(g /= a);
+    assert(g /= h);
+    assert(g /= 2);
+    assert(2 /= a);
+    assert(2 /= g);
+    assert(b <= a);
+    assert(b <= g);
+    assert(a <= 12);
+    assert(g <= a);
+    assert(h <= g);
+    assert(g <= 9);
+    assert(2 <= a);
+    assert(2 <= g);
+    assert(a >= b);
+    assert(a >= g);
+    assert(a >= 2);
+    assert(g >= b);
+    assert(g >= h);
+    assert(g >= 2);
+    assert(2 >= c);
+    assert(9 >= g);
+    assert(b < a);
+    assert(c < g);
+    assert(a < 30);
+    assert(g < a);
+    assert(h < g);
+    assert(g < 9);
+    assert(2 < a);
+    assert(2 < g);
+    assert(a > b);
+    assert(a > g);
+    assert(a > 2);
+    assert(g > c);
+    assert(g > h);
+    assert(g > 2);
+    assert(9 > b);
+    assert(9 > g);
+    return a;
+}
+
+procedure arithmetic(a: Int, b: Int, c: Int) -> Int {
+    assert((a | b) == 15);
+    assert((a | g) == 15);
+    assert((a | 2) == 14);
+    assert((g | a) == 15);
+    assert((g | h) == 7);
+    assert((g | 2) == 7);
+    assert((2 | a) == 14);
+    assert((2 | g) == 7);
+    assert((a & b) == 4);
+    assert((a & g) == 4);
+    assert((a & 2) == 0);
+    assert((g & a) == 4);
+    assert((g & h) == 3);
+    assert((g & 2) == 2);
+    assert((2 & a) == 0);
+    assert((2 & g) == 2);
+    assert((a ^ b) == 11);
+    assert((a ^ g) == 11);
+    assert((a ^ 2) == 14);
+    assert((g ^ a) == 11);
+    assert((g ^ h) == 4);
+    assert((g ^ 2) == 5);
+    assert((2 ^ a) == 14);
+    assert((2 ^ g) == 5);
+    assert((a + b) == 19);
+    assert((a + g) == 19);
+    assert((a + 2) == 14);
+    assert((g + a) == 19);
+    assert((g + h) == 10);
+    assert((g + 2) == 9);
+    assert((2 + a) == 14);
+    assert((2 + g) == 9);
+    assert((a - b) == 5);
+    assert((a - g) == 5);
+    assert((a - 2) == 10);
+    assert((g - b) == 0);
+    assert((g - h) == 4);
+    assert((g - 2) == 5);
+    assert((2 - c) == 0);
+    assert((9 - g) == 2);
+    assert((a * b) == 84);
+    assert((a * g) == 84);
+    assert((a * 2) == 24);
+    assert((g * a) == 84);
+    assert((g * h) == 21);
+    assert((g * 2) == 14);
+    assert((2 * a) == 24);
+    assert((2 * g) == 14);
+    return b;
+}
+
+procedure moves(a: Int) -> Int {
+    x := a;
+    y := g;
+    z := 100;
+    return x + y + z;
+}
+
+x := compare(12, 7, 2);
+y := arithmetic(12, 7, 2);
+z := moves(12);
+assert(z == 119);
+
+m := 0 - 4;
+
+procedure signed(n: Int) -> Int {
+    assert(n < 0);
+    assert(n < m + 1);
+    assert(0 > n);
+    assert(m <= n);
+    assert(m < 0);
+    assert(n >= m);
+    assert(1 >= n);
+    return n * 2;
+}
+
+s := signed(0 - 4);
+assert(s < m);
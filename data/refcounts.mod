@@ -0,0 +1,40 @@
+function id(xs: [Int]) -> [Int] {
+    ys := xs;
+    return ys;
+}
+function pass(xs: [Int]) := id(xs);
+a := pass([1, 2, 3]);
+assert(a[2] == 3);
+
+procedure set_first(xs: [Int]) -> [Int] {
+    var ys := xs;
+    ys[0] = 7;
+    return ys;
+}
+b := set_first(a);
+assert(b[0] == 7);
+assert(a[0] == 1);
+
+procedure keep_both(xs: [Int]) -> [Int] {
+    ys := xs;
+    zs := ys ++ xs;
+    return zs;
+}
+c := keep_both(a);
+assert(c[3] == 1);
+assert(a[0] == 1);
+
+procedure second(xs: [Int], n: Int) -> Int {
+    p := {xs, n};
+    q := p;
+    return q.1 + q.0[0];
+}
+assert(second(a, 5) == 6);
+
+procedure inner(xs: [Int]) -> [Int] {
+    p := {xs, 6};
+    q := p;
+    return q.0;
+}
+d := inner(a);
+assert(d[1] == 2);
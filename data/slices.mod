@@ -0,0 +1,52 @@
+xs := [1, 2, 3, 4, 5, 6];
+front := xs[0..3];
+back := xs[3..6];
+assert(front[2] == 3);
+assert(back[0] == 4);
+
+n := 2;
+middle := xs[n..n + 2];
+assert(middle[0] == 3);
+assert(middle[1] == 4);
+
+empty := xs[2..2];
+whole := xs[0..6];
+assert(whole[5] == 6);
+
+inner := middle[1..2];
+assert(inner[0] == 4);
+
+var window := xs[1..4];
+window[0] = 20;
+assert(window[0] == 20);
+assert(xs[1] == 2);
+assert(front[1] == 2);
+
+joined := back ++ front;
+assert(joined[3] == 1);
+assert(joined[5] == 3);
+
+var grow := xs[4..6];
+grow = grow ++ [7];
+assert(grow[2] == 7);
+assert(xs[5] == 6);
+
+small := [9];
+assert(small[0..1][0] == 9);
+pair := [1, 2][1..2];
+assert(pair[0] == 2);
+
+rs := [{1, [10]}, {2, [20]}, {3, [30]}];
+tail := rs[1..3];
+assert(tail[1].1[0] == 30);
+
+function second_half(ys: [Int]) := ys[3..6];
+half := second_half(xs);
+assert(half[2] == 6);
+
+computed := xs[n - 1..n + 2];
+assert(computed[0] == 2);
+assert(computed[2] == 4);
+spliced := (xs ++ [7])[5 - n..7 - n];
+assert(spliced[0] == 4);
+assert(spliced[1] == 5);
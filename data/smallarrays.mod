@@ -0,0 +1,36 @@
+var a := [1];
+b := a;
+a[0] = 2;
+assert(a[0] == 2);
+assert(b[0] == 1);
+
+c := a ++ b;
+assert(c[0] == 2);
+assert(c[1] == 1);
+
+e := a ++ [3] ++ b;
+assert(e[1] == 3);
+assert(e[2] == 1);
+
+var s := {1, [4]};
+t := s;
+s.1[0] = 5;
+assert(s.1[0] == 5);
+assert(t.1[0] == 4);
+
+var nested := [[6], [7, 8]];
+inner := nested[0];
+nested[0][0] = 9;
+assert(nested[0][0] == 9);
+assert(inner[0] == 6);
+
+function first(xs: [Int]) := xs[0];
+assert(first([10]) == 10);
+assert(first(a) == 2);
+
+var h := [17];
+h[0] = 1;
+g := [h];
+h[0] = 2;
+assert(h[0] == 2);
+assert(g[0][0] == 1);
@@ -0,0 +1,62 @@
+function scratch(x: Int) -> Int {
+    xs := [x, x + 1, x + 2, x + 3, x + 4];
+    xs[1] = 7;
+    return xs[4] + xs[1] + xs[0];
+}
+assert(scratch(1) == 13);
+
+function mixed(x: Int) -> Int {
+    p := {x, x};
+    rs := [{x, 1}, {x, 2}, {x, 3}];
+    q := {1, 2};
+    ys := [x, x, x] ++ [4, 5];
+    zs := rs ++ [{9, 9}];
+    return rs[2].1 + p.1 + q.0 + ys[4] + zs[3].0;
+}
+assert(mixed(2) == 20);
+
+function rebind(x: Int) -> Int {
+    xs := [x, x, x];
+    xs = xs ++ [x + 1];
+    return xs[3] + xs[0];
+}
+assert(rebind(3) == 7);
+
+function twice(x: Int) -> Int {
+    a := [x, 2, 3];
+    b := [x, 5, 6];
+    return a[0] + b[2];
+}
+function tail(x: Int) -> Int {
+    a := [x, 2, 3];
+    return twice(a[1]);
+}
+assert(tail(1) == 8);
+
+procedure copied(x: Int) -> Int {
+    xs := [x, x, x];
+    var ys := xs;
+    ys[0] = 9;
+    return xs[0] + ys[0];
+}
+assert(copied(1) == 10);
+
+function escapes(x: Int) -> [Int] {
+    xs := [x, x, x];
+    return xs;
+}
+e := escapes(4);
+assert(e[2] == 4);
+
+function nested(x: Int) -> Int {
+    rs := [[x, x, x], [x]];
+    return rs[0][2] + rs[1][0];
+}
+assert(nested(5) == 10);
+
+function sum3(xs: [Int]) := xs[0] + xs[1] + xs[2];
+function passed(x: Int) -> Int {
+    xs := [x, x, x];
+    return sum3(xs) + xs[1];
+}
+assert(passed(2) == 8);
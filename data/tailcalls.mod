@@ -0,0 +1,25 @@
+function add(x: Int, y: Int) := x + y;
+
+function add_one(x: Int) := add(x, 1);
+
+procedure add_two(x: Int) -> Int {
+    y := x + 1;
+    return add_one(y);
+}
+
+assert(add_two(5) == 7);
+
+function sum(xs: [Int]) := xs[0] + xs[1] + xs[2];
+
+procedure sum_twice(xs: [Int]) -> Int {
+    ys := xs ++ [0];
+    return sum(ys ++ xs);
+}
+
+assert(sum_twice([1, 2, 3]) == 6);
+
+fs := [add_one, add_two];
+
+function apply(i: Int, x: Int) := fs[i](x);
+
+assert(apply(1, 2) == 4);
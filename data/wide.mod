@@ -0,0 +1,37 @@
+big := 5000000000;
+max := 9223372036854775807;
+edge := 2147483648;
+below := 2147483647;
+assert(big - 5000000000 == 0);
+assert(max - 9223372036854775806 == 1);
+assert(edge - below == 1);
+assert(edge == 1 << 31);
+assert(4294967296 == 1 << 32);
+assert(max > big);
+assert(max == (1 << 62) - 1 + (1 << 62));
+
+negative := 0 - 5000000000;
+assert(negative < 0);
+assert(negative + big == 0);
+assert(negative + 10000000000 == big);
+
+procedure scale(x: Int) -> Int {
+    y := x * 3000000000 + 7000000000;
+    return y % 1000000007;
+}
+
+assert(scale(2) == (6000000000 + 7000000000) % 1000000007);
+assert(scale(3) == 16000000000 % 1000000007);
+
+procedure pick(i: Int) -> Int {
+    values := [3000000000, 4000000000, 5000000000, 6000000000];
+    return values[i] / 1000000000;
+}
+
+assert(pick(0) + pick(3) == 9);
+
+limits := {low: 2147483648, high: 9223372036854775807};
+assert(limits.high / limits.low == 4294967295);
+totals := [big, max - big, edge * 4];
+assert(totals[0] + totals[1] == max);
+assert(totals[2] == 8589934592);
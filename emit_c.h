@@ -0,0 +1,797 @@
+#ifndef MODLANG_EMIT_C_H
+#define MODLANG_EMIT_C_H
+
+#include "types.h"
+#include "bytecode.h"
+#include "interpreter.h"
+
+/* Ahead of time compilation. Rather than running a program, this writes it
+   out as a C translation unit, that includes interpreter.h for the runtime,
+   and can then be built by any C compiler, with the modlang sources on the
+   include path. Each procedure becomes a C function, with each of its
+   variables in a C local of its own, so that the C compiler can keep them in
+   registers, and each top level statement becomes a block in main. */
+
+/* Everything the program does at the top level, in order. */
+struct c_statement {
+    struct bytecode code;
+    struct bytecode deinitialize_code;
+    /* The globals that this statement introduces, which get printed once it
+       has run, just like in the interpreter. */
+    size_t globals_start;
+    size_t globals_end;
+};
+
+struct c_statement_buffer {
+    struct c_statement *data;
+    size_t count;
+    size_t capacity;
+};
+
+struct type_pointer_buffer {
+    struct type **data;
+    size_t count;
+    size_t capacity;
+};
+
+struct c_emitter {
+    FILE *out;
+    struct procedure_buffer *procedures;
+    struct record_table *bindings;
+    struct variable_stack *vars;
+    struct c_statement_buffer *statements;
+
+    /* Every struct type that the program needs at run time, either because
+       the bytecode points at it, or to print a global. */
+    struct type_pointer_buffer types;
+
+    /* How many variables each procedure copies in from its caller, see
+       emit_c_input_count, and the most that any of them does. Calls pass
+       their arguments in an array with room for at least this many, so that
+       calls through procedure values and tail calls don't need to know their
+       callee. */
+    int64 *input_counts;
+    int64 max_input_count;
+
+    /* How many variables the code being written has. */
+    int64 frame_size;
+};
+
+/*********/
+/* Types */
+/*********/
+
+int emit_c_type_index(struct c_emitter *em, struct type *type) {
+    for (int i = 0; i < em->types.count; i++) {
+        if (em->types.data[i] == type) return i;
+    }
+    buffer_push(em->types, type);
+    return em->types.count - 1;
+}
+
+void emit_c_type_initializer(FILE *out, struct type *type);
+
+void emit_c_type_array(FILE *out, struct type_buffer *types) {
+    if (types->count == 0) {
+        fprintf(out, "{NULL, 0, 0}");
+        return;
+    }
+    fprintf(out, "{(struct type[]){");
+    for (int i = 0; i < types->count; i++) {
+        if (i > 0) fprintf(out, ", ");
+        emit_c_type_initializer(out, &types->data[i]);
+    }
+    fprintf(out, "}, %zu, %zu}", types->count, types->count);
+}
+
+/* Types are written out as nested initializers, using compound literals for
+   anything that the type points to. */
+void emit_c_type_initializer(FILE *out, struct type *type) {
+    fprintf(out, "{.connective = %d, ", type->connective);
+    switch (type->connective) {
+    case TYPE_TUPLE:
+        fprintf(out, ".elements = ");
+        emit_c_type_array(out, &type->elements);
+        break;
+    case TYPE_RECORD:
+        fprintf(out, ".fields = ");
+        if (type->fields.count == 0) {
+            fprintf(out, "{NULL, 0, 0}");
+            break;
+        }
+        fprintf(out, "{(struct field[]){");
+        for (int i = 0; i < type->fields.count; i++) {
+            struct field *field = &type->fields.data[i];
+            if (i > 0) fprintf(out, ", ");
+            fprintf(out, "{{\"%.*s\", %zu}, ", (int)field->name.length,
+                field->name.data, field->name.length);
+            emit_c_type_initializer(out, &field->type);
+            fprintf(out, "}");
+        }
+        fprintf(out, "}, %zu, %zu}", type->fields.count, type->fields.count);
+        break;
+    case TYPE_ARRAY:
+        fprintf(out, ".inner = (struct type[]){");
+        emit_c_type_initializer(out, type->inner);
+        fprintf(out, "}");
+        break;
+    case TYPE_PROCEDURE:
+        fprintf(out, ".proc = {");
+        emit_c_type_array(out, &type->proc.inputs);
+        fprintf(out, ", ");
+        emit_c_type_array(out, &type->proc.outputs);
+        fprintf(out, "}");
+        break;
+    default:
+        fprintf(out, ".word_size = %d", type->word_size);
+        break;
+    }
+    fprintf(out, ", .total_size = %d}", type->total_size);
+}
+
+/*************/
+/* Operands */
+/*************/
+
+/* Enough for the longest operand that emit_c_operand writes. */
+#define C_OPERAND_SIZE 96
+
+/* Operands are written straight into the expressions that use them, rather
+   than being copied, so that arrays are indexed where they live. */
+void emit_c_operand(struct c_emitter *em, struct ref ref, char *text) {
+    switch (ref.type) {
+    case REF_NULL:
+        snprintf(text, C_OPERAND_SIZE, "((union variable_contents){0})");
+        break;
+    case REF_CONSTANT:
+        snprintf(text, C_OPERAND_SIZE,
+            "((union variable_contents){.val64 = %lldLL})", (long long)ref.x);
+        break;
+    case REF_STATIC_POINTER:
+        snprintf(text, C_OPERAND_SIZE, "((union variable_contents){.pointer = "
+            "(uint8*)&type_%d})", emit_c_type_index(em, (struct type*)ref.x));
+        break;
+    case REF_GLOBAL:
+        snprintf(text, C_OPERAND_SIZE, "g[%lld]", (long long)ref.x);
+        break;
+    case REF_LOCAL:
+    case REF_TEMPORARY:
+        snprintf(text, C_OPERAND_SIZE, "v%lld", (long long)ref.x);
+        break;
+    default:
+        fprintf(errout, "Error: Tried to emit unexpected ref.type value "
+            "%d?\n", ref.type);
+        error_exit();
+    }
+}
+
+void emit_c_write(struct c_emitter *em, struct ref ref, char *value) {
+    if (ref.type != REF_GLOBAL && ref.type != REF_LOCAL
+        && ref.type != REF_TEMPORARY)
+    {
+        fprintf(errout, "Error: Tried to emit a write to a ref of type "
+            "%d?\n", ref.type);
+        error_exit();
+    }
+    char lvalue[C_OPERAND_SIZE];
+    emit_c_operand(em, ref, lvalue);
+    fprintf(em->out, "        %s = %s;\n", lvalue, value);
+}
+
+/* How many variables a procedure reads before it writes them, counting from
+   its first argument, which is how many its caller has to hand over. There
+   are no jumps in bytecode, so this is just the first mention of each. */
+int64 emit_c_input_count(struct bytecode *code) {
+    bool *written = calloc(code->frame_size + 1, sizeof(bool));
+    int64 count = 0;
+    for (int i = 0; i < code->instructions.count; i++) {
+        struct instruction instr = unpack_instruction(code, i);
+        struct operation_rule *rule = &operation_rules[instr.op];
+        struct ref refs[3] = {instr.output, instr.arg1, instr.arg2};
+        enum operand_use uses[3] = {rule->output, rule->arg1, rule->arg2};
+
+        int64 start = 0, length = 0;
+        if (instr.op == OP_CALL || instr.op == OP_TAIL_CALL) {
+            start = instr.arg2.x;
+            length = instr.output.x;
+        } else if (instr.op == OP_RET) {
+            start = instr.arg1.x;
+            length = instr.arg2.x;
+        }
+        for (int64 x = start; x < start + length; x++) {
+            if (!written[x] && x + 1 > count) count = x + 1;
+        }
+        for (int j = 0; j < 3; j++) {
+            if (refs[j].type != REF_LOCAL && refs[j].type != REF_TEMPORARY) {
+                continue;
+            }
+            bool reads = uses[j] == OPERAND_READ
+                || uses[j] == OPERAND_READ_WRITE;
+            if (reads && !written[refs[j].x] && refs[j].x + 1 > count) {
+                count = refs[j].x + 1;
+            }
+        }
+
+        for (int j = 0; j < 3; j++) {
+            if (refs[j].type != REF_LOCAL && refs[j].type != REF_TEMPORARY) {
+                continue;
+            }
+            if (uses[j] == OPERAND_WRITE || uses[j] == OPERAND_READ_WRITE) {
+                written[refs[j].x] = true;
+            }
+        }
+        if (instr.op == OP_CALL) {
+            int64 results_index = instr.arg2.x;
+            if (instr.arg1.type == REF_TEMPORARY) results_index -= 1;
+            written[results_index] = true;
+        }
+    }
+    free(written);
+    return count;
+}
+
+/****************/
+/* Instructions */
+/****************/
+
+struct c_binary_op {
+    enum operation op;
+    char *expression;
+};
+
+/* The same expressions as the interpreter's binary handlers. */
+struct c_binary_op c_binary_ops[] = {
+    {OP_LOR, "x1 || x2"},
+    {OP_LAND, "x1 && x2"},
+    {OP_EQ, "x1 == x2"},
+    {OP_NEQ, "x1 != x2"},
+    {OP_LEQ, "x1 <= x2"},
+    {OP_GEQ, "x1 >= x2"},
+    {OP_LESS, "x1 < x2"},
+    {OP_GREATER, "x1 > x2"},
+    {OP_BOR, "x1 | x2"},
+    {OP_BAND, "x1 & x2"},
+    {OP_BXOR, "x1 ^ x2"},
+    {OP_PLUS, "x1 + x2"},
+    {OP_MINUS, "x1 - x2"},
+    {OP_LSHIFT, "x1 << x2"},
+    {OP_RSHIFT, "x1 >> x2"},
+    {OP_MUL, "x1 * x2"},
+    {OP_DIV, "x1 / x2"},
+    {OP_MOD, "x1 % x2"},
+    {OP_EDIV, "x1 >= 0 ? x1 / x2 : (x1 - x2 + 1) / x2"},
+    {OP_EMOD, "x1 >= 0 ? x1 % x2 : x2 - 1 - (-x1 - 1) % x2"},
+};
+
+/* Whether a global is bound to a procedure before the program runs, rather
+   than being computed by a statement, in which case vars holds its value. */
+bool emit_c_is_bound_procedure(struct c_emitter *em, int64 global) {
+    if (global >= em->vars->count) return false;
+
+    struct record_entry *binding = &em->bindings->data[global];
+    if (binding->is_var) return false;
+    if (binding->type.connective != TYPE_PROCEDURE) return false;
+
+    for (int i = 0; i < em->statements->count; i++) {
+        struct c_statement *it = &em->statements->data[i];
+        if (global >= it->globals_start && global < it->globals_end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Most calls go through a procedure that was bound by name, so they can be
+   resolved to a direct call to the right C function, which the C compiler
+   can then inline. Returns -1 if the procedure isn't known until run
+   time. */
+int64 emit_c_static_callee(struct c_emitter *em, struct ref ref) {
+    if (ref.type == REF_CONSTANT) return ref.x;
+    if (ref.type != REF_GLOBAL) return -1;
+    if (!emit_c_is_bound_procedure(em, ref.x)) return -1;
+    return em->vars->data[ref.x].value.val64;
+}
+
+/* How many variables a call hands over, from arg2 onwards. Struct results
+   come back through pointers that are set up after the arguments, and that
+   the callee reads as inputs too. */
+int64 emit_c_call_input_count(struct c_emitter *em, struct instruction *instr) {
+    int64 callee = emit_c_static_callee(em, instr->arg1);
+    int64 count = callee >= 0 ? em->input_counts[callee] : em->max_input_count;
+    if (count < instr->output.x) count = instr->output.x;
+    return count;
+}
+
+void emit_c_instruction(
+    struct c_emitter *em,
+    struct instruction *instr,
+    bool top_level
+) {
+    FILE *out = em->out;
+    bool temp1 = instr->arg1.type == REF_TEMPORARY;
+    bool temp2 = instr->arg2.type == REF_TEMPORARY;
+
+    if (instr->op == OP_NULL) return;
+
+    char o[C_OPERAND_SIZE], a1[C_OPERAND_SIZE], a2[C_OPERAND_SIZE];
+    emit_c_operand(em, instr->output, o);
+    emit_c_operand(em, instr->arg1, a1);
+    emit_c_operand(em, instr->arg2, a2);
+
+    fprintf(out, "    {\n");
+
+    for (int i = 0; i < ARRAY_LENGTH(c_binary_ops); i++) {
+        if (c_binary_ops[i].op != instr->op) continue;
+
+        fprintf(out, "        int64 x1 = %s.val64;\n", a1);
+        fprintf(out, "        int64 x2 = %s.val64;\n", a2);
+        fprintf(out, "        union variable_contents r = {.val64 = %s};\n",
+            c_binary_ops[i].expression);
+        emit_c_write(em, instr->output, "r");
+        fprintf(out, "    }\n");
+        return;
+    }
+
+    switch (instr->op) {
+    case OP_MOV:
+        fprintf(out, "        union variable_contents r = {0};\n");
+        fprintf(out, "        copy_scalar(r.bytes, %s.bytes, %d, %d);\n", a1,
+            instr->flags, temp1);
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_CALL:
+      {
+        /* The arguments go in an array, along with the callee if it's a
+           temporary, since that's where the result comes back. It has room
+           for any procedure's inputs, in case the callee makes a tail
+           call. */
+        int64 results_index = temp1 ? instr->arg2.x - 1 : instr->arg2.x;
+        int64 args_offset = instr->arg2.x - results_index;
+        int64 input_count = emit_c_call_input_count(em, instr);
+        int64 room = input_count;
+        if (em->max_input_count > room) room = em->max_input_count;
+        if (args_offset + room == 0) room = 1;
+        int64 end = instr->arg2.x + input_count;
+        if (end == results_index) end += 1;
+        if (end > em->frame_size) end = em->frame_size;
+        fprintf(out, "        union variable_contents c[%lld]%s;\n",
+            (long long)(args_offset + room),
+            instr->arg2.x + room > end ? " = {0}" : "");
+        for (int64 x = results_index; x < end; x++) {
+            fprintf(out, "        c[%lld] = v%lld;\n",
+                (long long)(x - results_index), (long long)x);
+        }
+
+        int64 callee = emit_c_static_callee(em, instr->arg1);
+        if (callee >= 0) {
+            fprintf(out, "        proc_%lld(stack, ", (long long)callee);
+        } else {
+            fprintf(out, "        procedure_table[%s.val64](stack, ", a1);
+        }
+        fprintf(out, "c + %lld, c);\n", (long long)args_offset);
+        /* Left as it was if the callee doesn't return anything. */
+        if (results_index < em->frame_size) {
+            fprintf(out, "        v%lld = c[0];\n", (long long)results_index);
+        }
+        break;
+      }
+    case OP_TAIL_CALL:
+      {
+        /* Hand the arguments over in the array that ours came in, which has
+           room for any procedure's, see max_input_count. */
+        for (int64 i = 0; i < instr->output.x; i++) {
+            fprintf(out, "        args[%lld] = v%lld;\n", (long long)i,
+                (long long)(instr->arg2.x + i));
+        }
+        int64 callee = emit_c_static_callee(em, instr->arg1);
+        if (callee >= 0) {
+            fprintf(out, "        proc_%lld(stack, ", (long long)callee);
+        } else {
+            fprintf(out, "        procedure_table[%s.val64](stack, ", a1);
+        }
+        fprintf(out, "args, results);\n");
+        fprintf(out, "        return;\n");
+        break;
+      }
+    case OP_RET:
+        if (top_level) {
+            if (instr->arg2.x != 0) {
+                fprintf(errout, "Error: Tried to emit a top level return "
+                    "with results?\n");
+                error_exit();
+            }
+            break;
+        }
+        for (int64 i = 0; i < instr->arg2.x; i++) {
+            fprintf(out, "        results[%lld] = v%lld;\n", (long long)i,
+                (long long)(instr->arg1.x + i));
+        }
+        fprintf(out, "        return;\n");
+        break;
+    case OP_ARRAY_ALLOC:
+        fprintf(out, "        union variable_contents r;\n");
+        if (instr->flags & OP_STACK_ARRAY) {
+            fprintf(out, "        r.shared_buff = shared_buff_alloc_stack("
+                "&stack->data, type_glue_of((struct type *)%s.pointer), "
+                "%s.val64);\n", a1, a2);
+        } else {
+            fprintf(out, "        r.shared_buff = shared_buff_alloc("
+                "type_glue_of((struct type *)%s.pointer), %s.val64);\n",
+                a1, a2);
+        }
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_ARRAY_OFFSET:
+    case OP_ARRAY_OFFSET_MAKE_UNIQUE:
+        fprintf(out, "        union variable_contents r;\n");
+        fprintf(out, "        r.pointer = shared_buff_get_index%s("
+            "&%s.shared_buff, %s.val64);\n",
+            instr->op == OP_ARRAY_OFFSET ? "" : "_unique", a1, a2);
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_ARRAY_STORE:
+        /* Inline arrays keep their elements in the variable itself, which
+           this writes straight into. */
+        fprintf(out, "        uint8 *data = shared_buff_get_index("
+            "&%s.shared_buff, %s.val64);\n", o, a1);
+        fprintf(out, "        copy_scalar(data, %s.bytes, %d, %d);\n", a2,
+            instr->flags, temp2);
+        break;
+    case OP_ARRAY_INDEX:
+        fprintf(out, "        uint8 *data = shared_buff_get_index("
+            "&%s.shared_buff, %s.val64);\n", a1, a2);
+        fprintf(out, "        union variable_contents r = {0};\n");
+        fprintf(out, "        copy_scalar(r.bytes, data, %d, false);\n",
+            instr->flags);
+        if (instr->output.type == instr->arg1.type
+            && instr->output.x == instr->arg1.x)
+        {
+            fprintf(out, "        shared_buff_decrement(%s.shared_buff);\n",
+                a1);
+        }
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_ARRAY_CONCAT:
+        fprintf(out, "        union variable_contents r;\n");
+        fprintf(out, "        r.shared_buff = shared_buff_concat("
+            "&%s.shared_buff, &%s.shared_buff, %s);\n", a1, a2,
+            temp1 || (instr->flags & OP_MOVE_ARG1) ? "true" : "false");
+        if (temp2) {
+            fprintf(out, "        shared_buff_decrement(%s.shared_buff);\n",
+                a2);
+        }
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_ARRAY_SLICE_END:
+    case OP_ARRAY_SLICE_START:
+        fprintf(out, "        union variable_contents r = %s;\n", a1);
+        fprintf(out, "        shared_buff_slice_%s(&r.shared_buff, "
+            "%s.val64);\n", instr->op == OP_ARRAY_SLICE_END ? "end" : "start",
+            a2);
+        if (!temp1) {
+            fprintf(out, "        shared_buff_increment(&r.shared_buff);\n");
+        }
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_DECREMENT_REFCOUNT:
+        fprintf(out, "        shared_buff_decrement(%s.shared_buff);\n", a1);
+        break;
+    case OP_STACK_ALLOC:
+        fprintf(out, "        union variable_contents r;\n");
+        fprintf(out, "        r.pointer = stack_alloc(&stack->data, "
+            "%s.val64);\n", a1);
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_STACK_FREE:
+        fprintf(out, "        stack_free(&stack->data, %s.pointer);\n", a1);
+        break;
+    case OP_POINTER_OFFSET:
+        fprintf(out, "        union variable_contents r;\n");
+        fprintf(out, "        r.pointer = %s.pointer + %s.val64;\n", a1, a2);
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_POINTER_STORE:
+        fprintf(out, "        copy_scalar(%s.pointer + %s.val64, %s.bytes, "
+            "%d, %d);\n", o, a1, a2, instr->flags, temp2);
+        break;
+    case OP_POINTER_COPY:
+        fprintf(out, "        memcpy(%s.pointer, %s.pointer, %s.val64);\n",
+            o, a1, a2);
+        break;
+    case OP_POINTER_DUP:
+        fprintf(out, "        union variable_contents r;\n");
+        fprintf(out, "        r.pointer = stack_alloc(&stack->data, "
+            "%s.val64);\n", a2);
+        fprintf(out, "        memcpy(r.pointer, %s.pointer, %s.val64);\n",
+            a1, a2);
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_POINTER_COPY_OVERLAPPING:
+        fprintf(out, "        memmove(%s.pointer, %s.pointer, %s.val64);\n",
+            o, a1, a2);
+        break;
+    case OP_POINTER_LOAD:
+        fprintf(out, "        union variable_contents r = {0};\n");
+        fprintf(out, "        copy_scalar(r.bytes, %s.pointer + %s.val64, "
+            "%d, false);\n", a1, a2, instr->flags);
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_POINTER_LOAD_MAKE_UNIQUE:
+        fprintf(out, "        struct shared_buff *data = "
+            "(struct shared_buff*)(%s.pointer + %s.val64);\n", a1, a2);
+        fprintf(out, "        shared_buff_make_unique(data);\n");
+        fprintf(out, "        union variable_contents r;\n");
+        fprintf(out, "        r.shared_buff = *data;\n");
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_POINTER_INCREMENT_REFCOUNT:
+        fprintf(out, "        struct shared_buff *buff = "
+            "(struct shared_buff*)(%s.pointer + %s.val64);\n", a1, a2);
+        fprintf(out, "        shared_buff_increment(buff);\n");
+        break;
+    case OP_POINTER_DECREMENT_REFCOUNT:
+        fprintf(out, "        struct shared_buff *buff = "
+            "(struct shared_buff*)(%s.pointer + %s.val64);\n", a1, a2);
+        fprintf(out, "        shared_buff_decrement(*buff);\n");
+        break;
+    case OP_ASSERT:
+        fprintf(out, "        if (%s.val64 == 0) {\n", a1);
+        fprintf(out, "            fprintf(stderr, "
+            "\"Error: Assertion failed.\\n\");\n");
+        fprintf(out, "            exit(EXIT_FAILURE);\n");
+        fprintf(out, "        }\n");
+        break;
+    case OP_MEMORY_STATS:
+        fprintf(out, "        memory_stats_snapshot("
+            "(struct memory_stats_record *)%s.pointer, &stack->data);\n", a1);
+        break;
+    case OP_PAR_MAP:
+        fprintf(out, "        union variable_contents r = {0};\n");
+        fprintf(out, "        r.shared_buff = par_map(stack, "
+            "par_call_procedure, NULL, %s.val64, &%s.shared_buff);\n", a2, a1);
+        emit_c_write(em, instr->output, "r");
+        break;
+    case OP_PAR_REDUCE:
+        fprintf(out, "        union variable_contents r = {0};\n");
+        fprintf(out, "        r.val64 = par_reduce(stack, par_call_procedure, "
+            "NULL, %s.val64, &%s.shared_buff, %s.val64);\n", a2, a1, o);
+        emit_c_write(em, instr->output, "r");
+        break;
+    default:
+        fprintf(errout, "Error: Tried to emit unknown opcode %d.\n",
+            instr->op);
+        error_exit();
+    }
+    fprintf(out, "    }\n");
+}
+
+void emit_c_code(struct c_emitter *em, struct bytecode *code, bool top_level) {
+    for (int i = 0; i < code->instructions.count; i++) {
+        struct instruction instr = unpack_instruction(code, i);
+        emit_c_instruction(em, &instr, top_level);
+    }
+}
+
+/* Which of the frame_size variables some instruction in code mentions, so
+   that only those get declared. */
+void emit_c_mark_variables(
+    struct c_emitter *em,
+    struct bytecode *code,
+    bool *mentioned,
+    int64 frame_size
+) {
+    for (int i = 0; i < code->instructions.count; i++) {
+        struct instruction instr = unpack_instruction(code, i);
+        struct ref refs[3] = {instr.output, instr.arg1, instr.arg2};
+        for (int j = 0; j < 3; j++) {
+            if (refs[j].type == REF_LOCAL || refs[j].type == REF_TEMPORARY) {
+                mentioned[refs[j].x] = true;
+            }
+        }
+        int64 start = 0, end = 0;
+        if (instr.op == OP_CALL) {
+            /* Including where the result comes back. */
+            start = instr.arg2.x;
+            end = start + emit_c_call_input_count(em, &instr);
+            if (instr.arg1.type == REF_TEMPORARY) start -= 1;
+            if (end == start) end += 1;
+        } else if (instr.op == OP_TAIL_CALL) {
+            start = instr.arg2.x;
+            end = start + instr.output.x;
+        } else if (instr.op == OP_RET) {
+            start = instr.arg1.x;
+            end = start + instr.arg2.x;
+        }
+        if (end > frame_size) end = frame_size;
+        for (int64 x = start; x < end; x++) mentioned[x] = true;
+    }
+}
+
+/* Declare the variables of a frame as C locals, taking the first
+   input_count of them from args. */
+void emit_c_variables(
+    struct c_emitter *em,
+    bool *mentioned,
+    int64 frame_size,
+    int64 input_count,
+    char *indent
+) {
+    for (int64 x = 0; x < frame_size; x++) {
+        if (!mentioned[x]) continue;
+        if (x < input_count) {
+            fprintf(em->out, "%sunion variable_contents v%lld = args[%lld];\n",
+                indent, (long long)x, (long long)x);
+        } else {
+            fprintf(em->out, "%sunion variable_contents v%lld = {0};\n",
+                indent, (long long)x);
+        }
+    }
+}
+
+/* Make sure every static pointer has a type to point at, before any code
+   is written. */
+void emit_c_collect_types(struct c_emitter *em, struct bytecode *code) {
+    for (int i = 0; i < code->instructions.count; i++) {
+        struct instruction instr = unpack_instruction(code, i);
+        struct ref refs[3] = {instr.output, instr.arg1, instr.arg2};
+        for (int j = 0; j < 3; j++) {
+            if (refs[j].type == REF_STATIC_POINTER) {
+                emit_c_type_index(em, (struct type*)refs[j].x);
+            }
+        }
+    }
+}
+
+/***********/
+/* Program */
+/***********/
+
+void emit_c_program(
+    FILE *out,
+    struct procedure_buffer *procedures,
+    struct record_table *bindings,
+    struct variable_stack *vars,
+    struct c_statement_buffer *statements
+) {
+    struct c_emitter em = {0};
+    em.out = out;
+    em.procedures = procedures;
+    em.bindings = bindings;
+    em.vars = vars;
+    em.statements = statements;
+
+    em.input_counts = malloc((procedures->count + 1) * sizeof(int64));
+    for (int i = 0; i < procedures->count; i++) {
+        struct bytecode *code = &procedures->data[i].code;
+        emit_c_collect_types(&em, code);
+        em.input_counts[i] = emit_c_input_count(code);
+        if (em.input_counts[i] > em.max_input_count) {
+            em.max_input_count = em.input_counts[i];
+        }
+    }
+    for (int i = 0; i < statements->count; i++) {
+        struct c_statement *it = &statements->data[i];
+        emit_c_collect_types(&em, &it->code);
+        emit_c_collect_types(&em, &it->deinitialize_code);
+        for (size_t j = it->globals_start; j < it->globals_end; j++) {
+            emit_c_type_index(&em, &bindings->data[j].type);
+        }
+    }
+
+    fprintf(out, "/* Generated by modlang -emit-c. Build with the modlang "
+        "sources on the include\n   path. */\n\n");
+    /* The generated code never goes through the interpreter's calls. */
+    fprintf(out, "#define MODLANG_NO_JIT\n\n");
+    fprintf(out, "#include <stdio.h>\n");
+    fprintf(out, "#include <stdlib.h>\n");
+    fprintf(out, "#include <stdbool.h>\n");
+    fprintf(out, "#include <stdint.h>\n");
+    fprintf(out, "#include <string.h>\n\n");
+    /* Just the runtime, none of the compiler. */
+    fprintf(out, "#include \"buffer.h\"\n");
+    fprintf(out, "#include \"types.h\"\n");
+    fprintf(out, "#include \"bytecode.h\"\n");
+    fprintf(out, "#include \"interpreter.h\"\n\n");
+
+    for (int i = 0; i < em.types.count; i++) {
+        fprintf(out, "struct type type_%d = ", i);
+        emit_c_type_initializer(out, em.types.data[i]);
+        fprintf(out, ";\n");
+    }
+    fprintf(out, "\nunion variable_contents g[%zu];\n\n",
+        bindings->global_count > 0 ? bindings->global_count : 1);
+
+    /* Callees take their inputs from args, and move their results out to
+       results. */
+    for (int i = 0; i < procedures->count; i++) {
+        fprintf(out, "void proc_%d(struct call_stack *stack, "
+            "union variable_contents *args, "
+            "union variable_contents *results);\n", i);
+    }
+    fprintf(out, "\nvoid (*procedure_table[])(struct call_stack *, "
+        "union variable_contents *, union variable_contents *) = {\n");
+    for (int i = 0; i < procedures->count; i++) {
+        fprintf(out, "    proc_%d,\n", i);
+    }
+    fprintf(out, "};\n");
+
+    /* How par_map and par_reduce call procedures, see par_call_function. */
+    fprintf(out, "\nvoid par_call_procedure(struct call_stack *stack, "
+        "void *context, int64 proc_index,\n"
+        "        union variable_contents *args, int arg_count, "
+        "union variable_contents *result) {\n");
+    /* They pass at most two arguments, and get one result back. */
+    int64 par_room = em.max_input_count > 2 ? em.max_input_count : 2;
+    fprintf(out, "    union variable_contents v[%lld] = {0};\n",
+        (long long)par_room);
+    fprintf(out, "    memcpy(v, args, arg_count * "
+        "sizeof(union variable_contents));\n");
+    fprintf(out, "    procedure_table[proc_index](stack, v, v);\n");
+    fprintf(out, "    *result = v[0];\n");
+    fprintf(out, "}\n");
+
+    for (int i = 0; i < procedures->count; i++) {
+        struct bytecode *code = &procedures->data[i].code;
+        fprintf(out, "\nvoid proc_%d(struct call_stack *stack, "
+            "union variable_contents *args, "
+            "union variable_contents *results) {\n", i);
+        bool *mentioned = calloc(code->frame_size + 1, sizeof(bool));
+        emit_c_mark_variables(&em, code, mentioned, code->frame_size);
+        em.frame_size = code->frame_size;
+        emit_c_variables(&em, mentioned, code->frame_size,
+            em.input_counts[i], "    ");
+        free(mentioned);
+        emit_c_code(&em, code, false);
+        fprintf(out, "}\n");
+    }
+
+    fprintf(out, "\nint main(void) {\n");
+    fprintf(out, "    struct call_stack call_stack = {0};\n");
+    fprintf(out, "    call_stack.data = stack_create(DATA_STACK_DEFAULT_SIZE);\n");
+    fprintf(out, "    struct call_stack *stack = &call_stack;\n\n");
+
+    /* Procedures and builtins are bound before anything runs. */
+    for (int i = 0; i < bindings->global_count; i++) {
+        struct record_entry *binding = &bindings->data[i];
+        if (!emit_c_is_bound_procedure(&em, i)) continue;
+        fprintf(out, "    g[%d].val64 = %lld; /* %.*s */\n", i,
+            (long long)vars->data[i].value.val64,
+            (int)binding->name.length, binding->name.data);
+    }
+
+    for (int i = 0; i < statements->count; i++) {
+        struct c_statement *it = &statements->data[i];
+        int64 frame_size = it->code.frame_size;
+        int64 deinitialize_size = it->deinitialize_code.frame_size;
+        if (deinitialize_size > frame_size) frame_size = deinitialize_size;
+
+        fprintf(out, "\n  {\n");
+        bool *mentioned = calloc(frame_size + 1, sizeof(bool));
+        emit_c_mark_variables(&em, &it->code, mentioned, frame_size);
+        emit_c_mark_variables(&em, &it->deinitialize_code, mentioned,
+            frame_size);
+        em.frame_size = frame_size;
+        emit_c_variables(&em, mentioned, frame_size, 0, "    ");
+        free(mentioned);
+        emit_c_code(&em, &it->code, true);
+        emit_c_code(&em, &it->deinitialize_code, true);
+        fprintf(out, "  }\n");
+
+        for (size_t j = it->globals_start; j < it->globals_end; j++) {
+            struct record_entry *binding = &bindings->data[j];
+            fprintf(out, "    printf(\"%.*s = \");\n",
+                (int)binding->name.length, binding->name.data);
+            fprintf(out, "    print_call_stack_value(g[%zu], &type_%d);\n", j,
+                emit_c_type_index(&em, &binding->type));
+            fprintf(out, "    printf(\"\\n\");\n");
+        }
+    }
+
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+
+    buffer_free(em.types);
+    free(em.input_counts);
+}
+
+#endif
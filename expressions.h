@@ -22,6 +22,7 @@ enum pattern_command_type {
     PATTERN_UNARY,
     PATTERN_BINARY,
     PATTERN_MEMBER,
+    PATTERN_SLICE,
 
     PATTERN_PROCEDURE_CALL,
     PATTERN_ARRAY,
@@ -123,6 +124,8 @@ struct partial_operation {
     size_t open_command_index;
 
     size_t has_child_struct;
+
+    bool is_slice; /* An index that got a '..' token. */
 };
 
 struct partial_operation_buffer {
@@ -180,11 +183,11 @@ void read_next_ref(
     if (tk.id == TOKEN_VAR) {
         tk = get_token(tokenizer);
         if (tk.id != TOKEN_ALPHANUM) {
-            fprintf(stderr, "Error on line %d, %d: Got unexpected "
+            fprintf(errout, "Error on line %d, %d: Got unexpected "
                     "token \"", tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\" while parsing var declaration.\n");
-            exit(EXIT_FAILURE);
+            fputstr(tk.it, errout);
+            fprintf(errout, "\" while parsing var declaration.\n");
+            error_exit();
         }
 
         struct pattern_command val = {PATTERN_VALUE};
@@ -202,17 +205,17 @@ void read_next_ref(
             struct partial_operation *top = buffer_top(stack->lhs);
             if (top && top->type == PARTIAL_TUPLE) {
                 if (top->arg_count != 0) {
-                    fprintf(stderr, "Error at line %d, %d: Got ':' token inside a "
+                    fprintf(errout, "Error at line %d, %d: Got ':' token inside a "
                         "tuple expression.\n", next_tk.row, next_tk.column);
-                    exit(EXIT_FAILURE);
+                    error_exit();
                 }
                 top->type = PARTIAL_RECORD;
             }
             if (!top || top->type != PARTIAL_RECORD) {
-                fprintf(stderr, "Error at line %d, %d: Got ':' token that wasn't "
+                fprintf(errout, "Error at line %d, %d: Got ':' token that wasn't "
                     "in a record literal or wasn't in the correct location.\n",
                     next_tk.row, next_tk.column);
-                exit(EXIT_FAILURE);
+                error_exit();
             }
             struct partial_operation new = {PARTIAL_FIELD, PRECEDENCE_GROUPING};
             new.op = tk; /* TODO: Are there situations where I want to store
@@ -263,14 +266,23 @@ void read_next_ref(
            straight away, so that the compiler can make an instruction to
            allocate memory up front. */
         buffer_push(*out, command);
+    } else if (tk.id == ')' && stack->lhs.count > 0
+        && buffer_top(stack->lhs)->type == PARTIAL_PROCEDURE_CALL
+        && buffer_top(stack->lhs)->open_command_index == out->count - 1
+    ) {
+        /* A call with no arguments, e.g. `f()`, closes straight away. The
+           open command already has an arg_count of zero. */
+        stack->lhs.count -= 1;
+        stack->grouping_count -= 1;
+        stack->have_next_ref = true;
     } else {
         /* We MUST get a ref if we are at the start of an expression, or if we
            just got an infix operator. Anything else is therefore an error. */
-        fprintf(stderr, "Error on line %d, %d: Got unexpected "
+        fprintf(errout, "Error on line %d, %d: Got unexpected "
                 "token \"", tk.row, tk.column);
-        fputstr(tk.it, stderr);
-        fprintf(stderr, "\" while parsing expression.\n");
-        exit(EXIT_FAILURE);
+        fputstr(tk.it, errout);
+        fprintf(errout, "\" while parsing expression.\n");
+        error_exit();
     }
 }
 
@@ -286,11 +298,11 @@ void read_next_op(
     if (tk.id == '.') {
         tk = get_token(tokenizer);
         if (tk.id != TOKEN_ALPHANUM && tk.id != TOKEN_NUMERIC) {
-            fprintf(stderr, "Error at line %d, %d: After a dot operator we "
+            fprintf(errout, "Error at line %d, %d: After a dot operator we "
                 "expect an identifier or an integer, but instead we got \"",
                 tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\".\n");
+            fputstr(tk.it, errout);
+            fprintf(errout, "\".\n");
         }
 
         struct pattern_command command = {PATTERN_MEMBER};
@@ -366,26 +378,26 @@ void op_stack_resolve_arg(
             buffer_pop(stack->lhs);
             top = buffer_top(stack->lhs);
             if (!top) {
-                fprintf(stderr, "Error: Got record partial command that "
+                fprintf(errout, "Error: Got record partial command that "
                     "wasn't attached to a struct partial command?\n");
-                exit(EXIT_FAILURE);
+                error_exit();
             }
 
             top->arg_count += 1;
         } else {
             if (top->precedence != PRECEDENCE_GROUPING) {
                 /* Should be impossible, but check anyway. */
-                fprintf(stderr, "Error: Hit a comma, and tried to "
+                fprintf(errout, "Error: Hit a comma, and tried to "
                         "push a value into a non-grouping token?\n");
-                exit(EXIT_FAILURE);
+                error_exit();
             }
             top->arg_count += 1;
 
             if (top->type == PARTIAL_PAREN) {
-                fprintf(stderr, "Error at line %d, %d: There was a "
+                fprintf(errout, "Error at line %d, %d: There was a "
                         "comma inside grouping parentheses.\n",
                         top->op.row, top->op.column);
-                exit(EXIT_FAILURE);
+                error_exit();
             }
 
             /* Take the result that was just calculated, and write it
@@ -415,40 +427,52 @@ bool resolve_closing_token(
     if (stack->closing_token.id == ',') {
         op_stack_resolve_arg(stack, out);
 
+        stack->have_next_ref = false;
+        stack->have_closing_token = false;
+    } else if (stack->closing_token.id == TOKEN_RANGE) {
+        /* The start of a slice just waits on the stack for its end. */
+        if (!top || top->type != PARTIAL_INDEX || top->is_slice) {
+            fprintf(errout, "Error at line %d, %d: Got \"..\" outside of an "
+                "array index, or more than once in the same index.\n",
+                stack->closing_token.row, stack->closing_token.column);
+            error_exit();
+        }
+        top->is_slice = true;
+
         stack->have_next_ref = false;
         stack->have_closing_token = false;
     } else if (stack->opening_id == TOKEN_NULL) {
         if (top) {
-            fprintf(stderr, "Error on line %d, %d: Got unexpected "
+            fprintf(errout, "Error on line %d, %d: Got unexpected "
                     "token \"", stack->closing_token.row,
                     stack->closing_token.column);
-            fputstr(stack->closing_token.it, stderr);
-            fprintf(stderr, "\" while parsing expression.\n");
-            exit(EXIT_FAILURE);
+            fputstr(stack->closing_token.it, errout);
+            fprintf(errout, "\" while parsing expression.\n");
+            error_exit();
         }
 
         out->multi_value_count += 1;
 
         return true;
     } else if (!top) {
-        fprintf(stderr, "Error on line %d, %d: Got unmatched "
+        fprintf(errout, "Error on line %d, %d: Got unmatched "
                 "bracket \"", stack->closing_token.row, stack->closing_token.column);
-        fputstr(stack->closing_token.it, stderr);
-        fprintf(stderr, "\" while parsing expression.\n");
-        exit(EXIT_FAILURE);
+        fputstr(stack->closing_token.it, errout);
+        fprintf(errout, "\" while parsing expression.\n");
+        error_exit();
     } else if (top->type == PARTIAL_FIELD && stack->opening_id != '{') {
-        fprintf(stderr, "Error on line %d, %d: Got incorrectly "
+        fprintf(errout, "Error on line %d, %d: Got incorrectly "
                 "matched brackets \"{\" and \"%c\" while parsing "
                 "expression.", stack->closing_token.row,
                 stack->closing_token.column, stack->closing_token.id);
-        exit(EXIT_FAILURE);
+        error_exit();
     } else if (top->type != PARTIAL_FIELD && stack->opening_id != top->op.id) {
-        fprintf(stderr, "Error on line %d, %d: Got incorrectly "
+        fprintf(errout, "Error on line %d, %d: Got incorrectly "
                 "matched brackets \"%c\" and \"%c\" while parsing "
                 "expression.", stack->closing_token.row,
                 stack->closing_token.column, top->op.id,
                 stack->closing_token.id);
-        exit(EXIT_FAILURE);
+        error_exit();
     } else if (top->type == PARTIAL_PAREN) {
         /* Resolve the brackets. */
         stack->lhs.count -= 1;
@@ -457,16 +481,18 @@ bool resolve_closing_token(
     } else if (top->type == PARTIAL_INDEX) {
         top->arg_count += 1;
         if (top->arg_count > 1) {
-            fprintf(stderr, "Error at line %d, %d: Multidimensional array "
+            fprintf(errout, "Error at line %d, %d: Multidimensional array "
                 "index is not yet supported.\n",
                 stack->closing_token.row, stack->closing_token.column);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
 
         /* '[' is listed as the binary operation for array indexing, even
            though that's not how it is parsed. We can still *pretend* that is
-           how it was parsed, though! */
+           how it was parsed, though! Slices take three values, so they get
+           their own command. */
         struct pattern_command op = {PATTERN_BINARY};
+        if (top->is_slice) op.type = PATTERN_SLICE;
         op.tk = top->op;
         buffer_push(*out, op);
 
@@ -554,7 +580,7 @@ struct pattern parse_expression(
                 /* Pretend there was a semicolon. */
                 stack.have_closing_token = true;
                 stack.closing_token.id = ';';
-                stack.closing_token.it.data = malloc(1);
+                stack.closing_token.it.data = arena_alloc(1);
                 stack.closing_token.it.data[0] = ';';
                 stack.closing_token.it.length = 1;
                 stack.closing_token.row = tokenizer->row;
@@ -637,8 +663,8 @@ void compile_begin_emplace(
     } else if (c->type == PATTERN_PROCEDURE_CALL) {
         struct intermediate *proc_val = buffer_top(*intermediates);
         if (proc_val->type.connective != TYPE_PROCEDURE) {
-            fprintf(stderr, "Error: Procedure call pattern did not have a procedure to apply to?\n");
-            exit(EXIT_FAILURE);
+            fprintf(errout, "Error: Procedure call pattern did not have a procedure to apply to?\n");
+            error_exit();
         }
         struct type_buffer outputs = proc_val->type.proc.outputs;
         size_t output_bytes = 0;
@@ -693,11 +719,11 @@ void compile_begin_emplace(
 
         next_emplace->pointer_intermediate_index = intermediates->count - 1;
     } else {
-        fprintf(stderr, "Error at line %d, %d: Got unknown pattern command %d "
+        fprintf(errout, "Error at line %d, %d: Got unknown pattern command %d "
             "from token \"", c->tk.row, c->tk.column, c->type);
-        fputstr(c->tk.it, stderr);
-        fprintf(stderr, "\".\n");
-        exit(EXIT_FAILURE);
+        fputstr(c->tk.it, errout);
+        fprintf(errout, "\".\n");
+        error_exit();
     }
     next_emplace->args_handled = 0;
     next_emplace->args_total = c->arg_count;
@@ -717,7 +743,7 @@ void compile_end_arg(
             em->size = val.type.total_size;
 
             /* TODO: actually garbage collect this type info?? idk */
-            struct type *ty = malloc(sizeof(struct type));
+            struct type *ty = arena_alloc(sizeof(struct type));
             *ty = val.type;
             em->element_type = ty;
             pointer_val->type.inner = ty;
@@ -725,10 +751,10 @@ void compile_end_arg(
             /* TODO: properly compare types to make sure the elements of
                the array all agree */
             if (em->size != val.type.total_size) {
-                fprintf(stderr, "Error at line %d, %d: Array elements had "
+                fprintf(errout, "Error at line %d, %d: Array elements had "
                     "different sizes.\n", c->tk.row,
                     c->tk.column);
-                exit(EXIT_FAILURE);
+                error_exit();
             }
         }
         if (val.type.connective == TYPE_INT || val.type.connective == TYPE_PROCEDURE) {
@@ -782,15 +808,15 @@ void compile_end_arg(
                        nothing has been pushed to it yet. */
                     pointer_val->type = type_empty_record;
                 } else {
-                    fprintf(stderr, "Error: Got record element in a tuple "
+                    fprintf(errout, "Error: Got record element in a tuple "
                         "type.\n");
-                    exit(EXIT_FAILURE);
+                    error_exit();
                 }
             }
             if (pointer_val->type.connective != TYPE_RECORD) {
-                fprintf(stderr, "Error: Tried compiling record emplace "
+                fprintf(errout, "Error: Tried compiling record emplace "
                     "command to an output that wasn't a record?\n");
-                exit(EXIT_FAILURE);
+                error_exit();
             }
 
             size_t offset = pointer_val->type.total_size;
@@ -804,13 +830,13 @@ void compile_end_arg(
         } else {
             /* No identifier attached to the arg, build a tuple literal. */
             if (pointer_val->type.connective == TYPE_RECORD) {
-                fprintf(stderr, "Error: Got bare tuple element in a record type.\n");
-                exit(EXIT_FAILURE);
+                fprintf(errout, "Error: Got bare tuple element in a record type.\n");
+                error_exit();
             }
             if (pointer_val->type.connective != TYPE_TUPLE) {
-                fprintf(stderr, "Error: Tried compiling tuple emplace command to "
+                fprintf(errout, "Error: Tried compiling tuple emplace command to "
                     "an output that wasn't a tuple?\n");
-                exit(EXIT_FAILURE);
+                error_exit();
             }
 
             size_t offset = pointer_val->type.total_size;
@@ -820,11 +846,11 @@ void compile_end_arg(
             buffer_push(pointer_val->type.elements, val_type);
         }
     } else {
-        fprintf(stderr, "Error at line %d, %d: Multi-value "
+        fprintf(errout, "Error at line %d, %d: Multi-value "
             "encountered with unknown emplace type %d.\n",
             c->tk.row, c->tk.column,
             em->type);
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 }
 
@@ -869,11 +895,11 @@ void compile_end_emplace(
         alloc_instr->arg2.type = REF_NULL;
         alloc_instr->arg2.x = 0;
     } else {
-        fprintf(stderr, "Error at line %d, %d: Multi-value "
+        fprintf(errout, "Error at line %d, %d: Multi-value "
             "encountered with unknown emplace type %d.\n",
             c->tk.row, c->tk.column,
             em->type);
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 }
 
@@ -891,9 +917,9 @@ void compile_expression_inner(
         if (c->type == PATTERN_VALUE) {
             compile_value_token(bindings, intermediates, &c->tk);
         } else if (c->type == PATTERN_UNARY) {
-            fprintf(stderr, "Error: Unary operators are not yet "
+            fprintf(errout, "Error: Unary operators are not yet "
                 "implemented.\n");
-            exit(EXIT_FAILURE);
+            error_exit();
         } else if (c->type == PATTERN_BINARY) {
             /* TODO: detect if this is about to be assigned to a variable, and
                use that as the output if so. */
@@ -904,6 +930,13 @@ void compile_expression_inner(
                 c->tk,
                 is_assignment_lhs
             );
+        } else if (c->type == PATTERN_SLICE) {
+            compile_array_slice(
+                out,
+                intermediates,
+                c->tk,
+                is_assignment_lhs
+            );
         } else if (c->type == PATTERN_MEMBER) {
             compile_struct_member(
                 out,
@@ -914,10 +947,10 @@ void compile_expression_inner(
             );
         } else if (c->type == PATTERN_END_TERM) {
             if (emplace_stack.count != 0) {
-                fprintf(stderr, "Error: Got multivalue command in the middle "
+                fprintf(errout, "Error: Got multivalue command in the middle "
                     "of a function argument list, or struct/array "
                     "literal...?\n");
-                exit(EXIT_FAILURE);
+                error_exit();
             }
             if (!is_assignment_lhs) {
                 /* We are either assigning or returning this multi-value, push it
@@ -927,10 +960,10 @@ void compile_expression_inner(
         } else if (c->type == PATTERN_END_ARG) {
             struct emplace_info *em = buffer_top(emplace_stack);
             if (!em) {
-                fprintf(stderr, "Error at line %d, %d: Got an END_ARG command "
+                fprintf(errout, "Error at line %d, %d: Got an END_ARG command "
                     "outside of a function/array/struct expression?\n",
                     c->tk.row, c->tk.column);
-                exit(EXIT_FAILURE);
+                error_exit();
             }
             compile_end_arg(out, intermediates, em, c);
             em->args_handled += 1;
@@ -941,13 +974,20 @@ void compile_expression_inner(
             }
         } else {
             if (is_assignment_lhs) {
-                fprintf(stderr, "Error at line %d, %d: Got literal \"", c->tk.row, c->tk.column);
-                fputstr(c->tk.it, stderr);
-                fprintf(stderr, "\" on left hand side of an assignment.\n");
-                exit(EXIT_FAILURE);
+                fprintf(errout, "Error at line %d, %d: Got literal \"", c->tk.row, c->tk.column);
+                fputstr(c->tk.it, errout);
+                fprintf(errout, "\" on left hand side of an assignment.\n");
+                error_exit();
             }
             /* Some kind of opening operation, push it to the emplace stack. */
             compile_begin_emplace(out, intermediates, &emplace_stack, c);
+            struct emplace_info *em = buffer_top(emplace_stack);
+            if (em->type == PATTERN_PROCEDURE_CALL && em->args_total == 0) {
+                /* No END_ARG commands will come, finish the call now. */
+                int local_count = bindings->count - bindings->global_count;
+                compile_end_emplace(out, local_count, intermediates, em, c);
+                emplace_stack.count -= 1;
+            }
         }
     }
 
@@ -976,30 +1016,30 @@ void assert_match_pattern(
     while (pattern->count > 0) {
         if (values->count == 0) {
             struct token *tk = &pattern->data[0].tk;
-            fprintf(stderr, "Error at line %d, %d: There are more values on "
+            fprintf(errout, "Error at line %d, %d: There are more values on "
                 "the left hand side of the assignment than on the right hand "
                 "side.\n", tk->row, tk->column);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
 
         struct pattern_command *c = buffer_top(*pattern);
         if (c->type != PATTERN_VALUE) {
-            fprintf(stderr, "Error at line %d, %d: The operator \"",
+            fprintf(errout, "Error at line %d, %d: The operator \"",
                 c->tk.row, c->tk.column);
-            fputstr(c->tk.it, stderr);
-            fprintf(stderr, "\" appeared on the left hand side of an "
+            fputstr(c->tk.it, errout);
+            fprintf(errout, "\" appeared on the left hand side of an "
                 "assignment statement. Pattern matching is not "
                 "implemented.\n");
-            exit(EXIT_FAILURE);
+            error_exit();
         }
         if (c->tk.id != TOKEN_ALPHANUM) {
-            fprintf(stderr, "Error at line %d, %d: The literal \"",
+            fprintf(errout, "Error at line %d, %d: The literal \"",
                 c->tk.row, c->tk.column);
-            fputstr(c->tk.it, stderr);
-            fprintf(stderr, "\" appeared on the left hand side of an "
+            fputstr(c->tk.it, errout);
+            fprintf(errout, "\" appeared on the left hand side of an "
                 "assignment statement. Pattern matching is not "
                 "implemented.\n");
-            exit(EXIT_FAILURE);
+            error_exit();
         }
 
         size_t global_index = bindings->count;
@@ -1044,10 +1084,10 @@ void assert_match_pattern(
 
         if (pattern->count == 1 && values->count > 0) {
             struct token *tk = &pattern->data[0].tk;
-            fprintf(stderr, "Error at line %d, %d: There are more values on "
+            fprintf(errout, "Error at line %d, %d: There are more values on "
                 "the right hand side of the assignment than on the left hand "
                 "side.\n", tk->row, tk->column);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
 
         pattern->count -= 1;
@@ -1092,10 +1132,10 @@ void compile_assignment(
 
     if (lhs_count != rhs_count) {
         struct token *tk = &lhs->data[0].tk;
-        fprintf(stderr, "Error at line %d, %d: There are %d values on the "
+        fprintf(errout, "Error at line %d, %d: There are %d values on the "
             "left hand side of assignment, but %d on the right hand side.\n",
             tk->row, tk->column, lhs_count, rhs_count);
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 
     for (int i = rhs_count - 1; i >= 0; i--) {
@@ -1108,21 +1148,21 @@ void compile_assignment(
         int err_row = err_tk->row;
         int err_col = err_tk->column;
         if (!type_eq(&l.type, &r.type)) {
-            fprintf(stderr, "Error at line %d, %d: ", err_row, err_col);
+            fprintf(errout, "Error at line %d, %d: ", err_row, err_col);
             if (rhs_count == 1) {
-                fprintf(stderr, "Assignment had the wrong type.\n");
+                fprintf(errout, "Assignment had the wrong type.\n");
             } else {
-                fprintf(stderr, "Assignment to term %d had the wrong type.\n", i);
+                fprintf(errout, "Assignment to term %d had the wrong type.\n", i);
             }
-            exit(EXIT_FAILURE);
+            error_exit();
         }
 
         if (l.ref.type == REF_CONSTANT) {
-            fprintf(stderr, "Error at line %d, %d: ", err_row, err_col);
+            fprintf(errout, "Error at line %d, %d: ", err_row, err_col);
             if (rhs_count == 1) {
-                fprintf(stderr, "A literal appeared on the left hand side of an assignment.\n");
+                fprintf(errout, "A literal appeared on the left hand side of an assignment.\n");
             } else {
-                fprintf(stderr, "A literal appeared in term %d on the left hand side of an assignment.\n", i);
+                fprintf(errout, "A literal appeared in term %d on the left hand side of an assignment.\n", i);
             }
         }
 
@@ -1131,10 +1171,13 @@ void compile_assignment(
         /* Only do the assignment if the references are different, to avoid
            pushing reference counts to 0 in confusion. */
         if (!r_is_l) {
-            compile_variable_decrements(out, l.ref, &l.type, 0, true, false);
             if (l.is_pointer) {
+                /* The old value lives behind the pointer, possibly at an
+                   offset, so decrement it in place. */
+                compile_pointer_refcounts(out, l.ref, l.ref_offset, &l.type, true);
                 compile_store(out, l.ref, l.ref_offset, &intermediates, r);
             } else {
+                compile_variable_decrements(out, l.ref, &l.type, 0, true, false);
                 compile_mov(out, l.ref, &r);
             }
         }
@@ -2,17 +2,34 @@
 #define MODLANG_INTERPRETER_H
 
 #include "types.h"
-/* We really just need the items. We could move them to types.h, or items.h? */
-#include "statements.h"
+#include "bytecode.h"
 
-extern bool debug;
 
 /*************************/
 /* Procedure Definitions */
 /*************************/
 
+/* Native code for a procedure, see jit.h. Takes the same frame that OP_CALL
+   would have pushed, and returns once the results have been moved into
+   place. */
+struct procedure_buffer;
+struct call_stack;
+typedef void jit_function(
+    struct call_stack *stack,
+    struct procedure_buffer *procedures,
+    size_t locals_start,
+    size_t results_start
+);
+
 struct procedure {
-    struct instruction_buffer instructions;
+    struct bytecode code;
+
+    /* Only used when the JIT is enabled. */
+    jit_function *jit_code;
+    size_t jit_size;
+    void *jit_snippets;
+    int call_count;
+    bool jit_unsupported;
 };
 
 struct procedure_buffer {
@@ -21,6 +38,26 @@ struct procedure_buffer {
     size_t capacity;
 };
 
+/* The verifier checks calls to constant procedures, but not calls through a
+   variable, since it can't know what the variable will hold. Those get
+   checked as they happen. */
+void check_procedure_index(struct procedure_buffer *procedures, int64 index) {
+    if (index < 0 || (uint64)index >= procedures->count) {
+        fprintf(errout, "Runtime error: Tried to call procedure %lld, but "
+            "there are only %zu.\n", (long long)index, procedures->count);
+        error_exit();
+    }
+}
+
+/* The JIT is only built for x86-64 Linux, and only used if jit_enabled is
+   set, with the -jit option. Define MODLANG_NO_JIT to leave it out. */
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(MODLANG_NO_JIT)
+#define MODLANG_JIT
+#endif
+
+/* Like debug, this belongs to whichever context the thread is running. */
+MODLANG_THREAD_LOCAL bool jit_enabled;
+
 /******************/
 /* Shared Buffers */
 /******************/
@@ -32,174 +69,1438 @@ struct procedure_buffer {
    copying is necessary, including finer granularities where an array of arrays
    is rearranged, but the inner arrays are not modified. */
 
+/* Everything that arrays need to know about their element type at run time,
+   worked out once, so that copying or dropping elements never has to walk the
+   type. Glue is never freed, since arrays can outlive the types that made
+   them. */
+struct type_glue {
+    int32 size;
+    /* Whether elements are plain integers, which can go inline. */
+    bool is_int;
+    /* Where each array sits within an element, in bytes. Elements with no
+       arrays in them have nothing to count. */
+    int32 array_count;
+    int32 *array_offsets;
+
+    /* Types that look the same share one glue, which also keeps telemetry
+       per element type. See type_glue_of and memory_stats. */
+    int32 id;
+    char *name;
+
+    /* The nodes of large arrays are arrays of arrays, with their own glue,
+       see SHARED_BUFF_TRIE_THRESHOLD. For those, height counts the levels of
+       nodes down to the leaves, and leaf is the glue of the elements. Each
+       glue makes the one for the level above it on demand. */
+    int32 trie_height;
+    struct type_glue *trie_leaf;
+    struct type_glue *trie_parent;
+};
+
 struct shared_buff_header {
-    struct type *element_type;
-    int32 references;
+    struct type_glue *glue;
+    int32 references; /* See SHARED_BUFF_THREAD_SHARED. */
     int32 start_offset; /* In bytes. */
     int32 count;
-    int32 buffer_size; /* In bytes; this is not a capacity count. */
+    int32 capacity; /* In elements, so at least count. */
 };
 
+/* References are counted with plain integers while only one thread can see
+   an array, so that programs without threads pay nothing for them. Before an
+   array is handed to another thread, shared_buff_share sets this bit in the
+   count of everything that can be reached from it. The bit never gets
+   cleared, and every thread changes counts that have it atomically. It is
+   tested on the count that was about to be changed anyway. Whichever thread
+   drops the last reference releases the array, into its own pool. */
+#define SHARED_BUFF_THREAD_SHARED ((int32)1 << 30)
+#define SHARED_BUFF_REFERENCE_MASK (SHARED_BUFF_THREAD_SHARED - 1)
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define MODLANG_ATOMIC_LOAD(PTR) (*(long volatile*)(PTR))
+#define MODLANG_ATOMIC_ADD(PTR, N) \
+    (_InterlockedExchangeAdd((long volatile*)(PTR), (N)) + (N))
+#define MODLANG_ATOMIC_OR(PTR, N) _InterlockedOr((long volatile*)(PTR), (N))
+#define MODLANG_ATOMIC_LOAD_POINTER(PTR) \
+    _InterlockedCompareExchangePointer((void *volatile*)(PTR), NULL, NULL)
+#define MODLANG_ATOMIC_STORE_POINTER(PTR, VALUE) \
+    _InterlockedExchangePointer((void *volatile*)(PTR), (VALUE))
+#else
+#define MODLANG_ATOMIC_LOAD(PTR) __atomic_load_n((PTR), __ATOMIC_RELAXED)
+#define MODLANG_ATOMIC_ADD(PTR, N) \
+    __atomic_add_fetch((PTR), (N), __ATOMIC_ACQ_REL)
+#define MODLANG_ATOMIC_OR(PTR, N) \
+    __atomic_fetch_or((PTR), (N), __ATOMIC_RELEASE)
+/* For pointers to things that get filled in once, then shared. */
+#define MODLANG_ATOMIC_LOAD_POINTER(PTR) \
+    __atomic_load_n((PTR), __ATOMIC_ACQUIRE)
+#define MODLANG_ATOMIC_STORE_POINTER(PTR, VALUE) \
+    __atomic_store_n((PTR), (VALUE), __ATOMIC_RELEASE)
+#endif
+
+/* While par_map or par_reduce has other threads running, they can all reach
+   the arrays in the globals, and nothing keeps track of which arrays those
+   are, so every count gets changed atomically until the threads are done.
+   Set on the pool's threads for good, and on the caller while they run. */
+MODLANG_THREAD_LOCAL bool shared_buff_threads_running;
+
+/* Threads, for par_map and par_reduce. Without them, those just run on the
+   calling thread. */
+#if defined(_WIN32)
+#define MODLANG_THREADS
+#include <windows.h>
+typedef SRWLOCK thread_mutex;
+typedef CONDITION_VARIABLE thread_cond;
+#define THREAD_MUTEX_INIT SRWLOCK_INIT
+#define thread_mutex_lock(M) AcquireSRWLockExclusive(M)
+#define thread_mutex_unlock(M) ReleaseSRWLockExclusive(M)
+#define thread_cond_init(C) InitializeConditionVariable(C)
+#define thread_cond_wait(C, M) SleepConditionVariableSRW((C), (M), INFINITE, 0)
+#define thread_cond_broadcast(C) WakeAllConditionVariable(C)
+#elif defined(__unix__) || defined(__APPLE__)
+#define MODLANG_THREADS
+#include <pthread.h>
+typedef pthread_mutex_t thread_mutex;
+typedef pthread_cond_t thread_cond;
+#define THREAD_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define thread_mutex_lock(M) pthread_mutex_lock(M)
+#define thread_mutex_unlock(M) pthread_mutex_unlock(M)
+#define thread_cond_init(C) pthread_cond_init((C), NULL)
+#define thread_cond_wait(C, M) pthread_cond_wait((C), (M))
+#define thread_cond_broadcast(C) pthread_cond_broadcast(C)
+#else
+typedef int thread_mutex;
+#define THREAD_MUTEX_INIT 0
+#define thread_mutex_lock(M) ((void)(M))
+#define thread_mutex_unlock(M) ((void)(M))
+#endif
+
+/* How many references there are to an array, wherever they are. */
+int32 shared_buff_references(struct shared_buff_header *ptr) {
+    return MODLANG_ATOMIC_LOAD(&ptr->references) & SHARED_BUFF_REFERENCE_MASK;
+}
+
+/* Arrays that are small enough, and have nothing in them to count references
+   to, are kept inline, in the space where the header pointer would go. They
+   are marked by a start_offset of SHARED_BUFF_INLINE, and have no header, so
+   copying one is just copying the struct. */
+#define SHARED_BUFF_INLINE (-1)
+#define SHARED_BUFF_INLINE_SIZE sizeof(struct shared_buff_header*)
+
 struct shared_buff {
-    struct shared_buff_header *ptr;
-    int32 start_offset; /* In bytes. */
+    union {
+        struct shared_buff_header *ptr;
+        uint8 inline_data[SHARED_BUFF_INLINE_SIZE];
+    };
+    int32 start_offset; /* In bytes, or SHARED_BUFF_INLINE. */
     int32 count;
 };
 
-void print_ref_count(struct shared_buff_header *header) {
-    if (header) {
-        printf("ref count at %p is now %d\n", header, header->references);
+bool shared_buff_is_inline(struct shared_buff *buff) {
+    return buff->start_offset == SHARED_BUFF_INLINE;
+}
+
+/* Shared buffers come and go constantly, and most of them are small, so
+   small ones are carved out of slabs and recycled through a free list for
+   each size class, rather than going through malloc and free every time.
+   Anything bigger than the largest class goes straight to malloc. The pool
+   belongs to the thread that is running the interpreter, or to the context
+   that it is running, so none of this needs locking. Blocks are only reused,
+   and never given back to malloc until the whole pool is, see pool_release. */
+
+/* Block sizes include the header. Multiples of 16 keep every block as aligned
+   as malloc would have. */
+#define POOL_CLASS_SIZES(X) X(32) X(48) X(64) X(96) X(128) X(192) X(256) X(512)
+#define POOL_CLASS_SIZE_ENTRY(SIZE) SIZE,
+size_t pool_class_sizes[] = {POOL_CLASS_SIZES(POOL_CLASS_SIZE_ENTRY)};
+#undef POOL_CLASS_SIZE_ENTRY
+#define POOL_CLASS_COUNT (sizeof(pool_class_sizes) / sizeof(pool_class_sizes[0]))
+
+/* How much memory to ask malloc for whenever a free list runs dry. */
+#define POOL_SLAB_SIZE (16 * 1024)
+
+struct pool_block {
+    struct pool_block *next;
+};
+
+/* Large blocks are kept on a list, just in front of the memory that gets
+   handed out, which the header keeps as aligned as malloc would have. */
+struct pool_large_block {
+    struct pool_large_block *prev;
+    struct pool_large_block *next;
+};
+
+struct pool_slab_buffer {
+    uint8 **data;
+    size_t count;
+    size_t capacity;
+};
+
+struct pool_class_stats {
+    uint64 allocations;
+    uint64 hits; /* Allocations that the free list could serve directly. */
+    uint64 refills;
+    uint64 live_blocks;
+    uint64 live_requested_bytes; /* What the live blocks were asked for. */
+};
+
+struct shared_buff_pool {
+    struct pool_block *free_lists[POOL_CLASS_COUNT];
+    struct pool_class_stats classes[POOL_CLASS_COUNT];
+    struct pool_slab_buffer slabs;
+    struct pool_large_block *large_blocks;
+    uint64 slab_bytes;
+    uint64 large_allocations;
+    uint64 live_large_bytes;
+};
+
+MODLANG_THREAD_LOCAL struct shared_buff_pool shared_buff_pool;
+
+/* Returns POOL_CLASS_COUNT if the size is too big for any class. */
+int pool_class_of(size_t size) {
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        if (size <= pool_class_sizes[i]) return i;
     }
+    return POOL_CLASS_COUNT;
 }
 
-/* Allocate a shared buffer big enough to hold count elements each of the
-   specified size. */
-struct shared_buff shared_buff_alloc(struct type *elem_type, int count) {
-    int elem_size = elem_type->total_size;
-    struct shared_buff_header *ptr =
-        malloc(sizeof(struct shared_buff_header) + elem_size * count);
-    ptr->element_type = elem_type;
-    ptr->references = 1;
-    ptr->start_offset = 0;
-    ptr->count = count;
-    ptr->buffer_size = elem_size * count;
-    if (debug) {
-        print_ref_count(ptr);
-        printf("count is %d\n", count);
+/* Cut a whole slab up into blocks of one class, and put them all on the free
+   list at once. */
+void pool_refill(struct shared_buff_pool *pool, int class) {
+    size_t block_size = pool_class_sizes[class];
+    uint8 *slab = malloc(POOL_SLAB_SIZE);
+    if (!slab) {
+        fprintf(errout, "Error: Ran out of memory for shared buffers.\n");
+        error_exit();
+    }
+    buffer_push(pool->slabs, slab);
+    pool->slab_bytes += POOL_SLAB_SIZE;
+    pool->classes[class].refills += 1;
+
+    size_t block_count = POOL_SLAB_SIZE / block_size;
+    for (size_t i = block_count; i > 0; i--) {
+        struct pool_block *block = (struct pool_block*)&slab[(i - 1) * block_size];
+        block->next = pool->free_lists[class];
+        pool->free_lists[class] = block;
+    }
+}
+
+void pool_link_large(
+    struct shared_buff_pool *pool,
+    struct pool_large_block *block
+) {
+    block->prev = NULL;
+    block->next = pool->large_blocks;
+    if (block->next) block->next->prev = block;
+    pool->large_blocks = block;
+}
+
+void pool_unlink_large(
+    struct shared_buff_pool *pool,
+    struct pool_large_block *block
+) {
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        pool->large_blocks = block->next;
+    }
+    if (block->next) block->next->prev = block->prev;
+}
+
+void *pool_alloc(size_t size) {
+    struct shared_buff_pool *pool = &shared_buff_pool;
+    int class = pool_class_of(size);
+    if (class == POOL_CLASS_COUNT) {
+        struct pool_large_block *block =
+            malloc(sizeof(struct pool_large_block) + size);
+        if (!block) {
+            fprintf(errout, "Error: Ran out of memory for shared buffers.\n");
+            error_exit();
+        }
+        pool_link_large(pool, block);
+        pool->large_allocations += 1;
+        pool->live_large_bytes += size;
+        return &block[1];
+    }
+
+    struct pool_class_stats *stats = &pool->classes[class];
+    stats->allocations += 1;
+    stats->live_blocks += 1;
+    stats->live_requested_bytes += size;
+    if (pool->free_lists[class]) {
+        stats->hits += 1;
+    } else {
+        pool_refill(pool, class);
+    }
+
+    struct pool_block *block = pool->free_lists[class];
+    pool->free_lists[class] = block->next;
+    return block;
+}
+
+/* The size has to be the same one that the block was allocated with. */
+void pool_free(void *ptr, size_t size);
+
+/* Move a block to a bigger size, keeping the first used bytes. Large blocks
+   can grow where they are. */
+void *pool_realloc(void *ptr, size_t old_size, size_t new_size, size_t used) {
+    struct shared_buff_pool *pool = &shared_buff_pool;
+    if (pool_class_of(old_size) == POOL_CLASS_COUNT
+        && pool_class_of(new_size) == POOL_CLASS_COUNT)
+    {
+        struct pool_large_block *block = (struct pool_large_block*)ptr - 1;
+        pool_unlink_large(pool, block);
+        struct pool_large_block *result =
+            realloc(block, sizeof(struct pool_large_block) + new_size);
+        if (!result) {
+            fprintf(errout, "Error: Ran out of memory for shared buffers.\n");
+            error_exit();
+        }
+        pool_link_large(pool, result);
+        pool->live_large_bytes += new_size - old_size;
+        return &result[1];
     }
 
-    struct shared_buff result = {ptr, 0, count};
+    void *result = pool_alloc(new_size);
+    memcpy(result, ptr, used);
+    pool_free(ptr, old_size);
     return result;
 }
 
-void shared_buff_decrement(struct shared_buff_header *ptr);
+void pool_free(void *ptr, size_t size) {
+    struct shared_buff_pool *pool = &shared_buff_pool;
+    int class = pool_class_of(size);
+    if (class == POOL_CLASS_COUNT) {
+        struct pool_large_block *block = (struct pool_large_block*)ptr - 1;
+        pool_unlink_large(pool, block);
+        pool->live_large_bytes -= size;
+        free(block);
+        return;
+    }
 
-/* Decrements the elements of an array of a known datatype. Passes through the
-   whole array multiple times, once for each offset where an array sits. This
-   performs best for structs with no arrays in them or just one array in them,
-   but probably still does well with two or three arrays. */
-void do_decrements(uint8 *data, struct type *type, int count, size_t stride) {
-    if (type->connective == TYPE_ARRAY) {
-        for (int i = 0; i < count; i++) {
-            struct shared_buff *buff = (struct shared_buff*)data;
-            shared_buff_decrement(buff->ptr);
-            data += stride;
+    struct pool_class_stats *stats = &pool->classes[class];
+    stats->live_blocks -= 1;
+    stats->live_requested_bytes -= size;
+
+    struct pool_block *block = ptr;
+    block->next = pool->free_lists[class];
+    pool->free_lists[class] = block;
+}
+
+/* Blocks that are freed together, chained up by class so that each free
+   list and its stats only get touched once per batch. */
+struct pool_free_batch {
+    struct pool_block *heads[POOL_CLASS_COUNT];
+    struct pool_block *tails[POOL_CLASS_COUNT];
+    uint64 blocks[POOL_CLASS_COUNT];
+    uint64 requested_bytes[POOL_CLASS_COUNT];
+};
+
+void pool_batch_free(struct pool_free_batch *batch, void *ptr, size_t size) {
+    int class = pool_class_of(size);
+    if (class == POOL_CLASS_COUNT) {
+        pool_free(ptr, size);
+        return;
+    }
+
+    struct pool_block *block = ptr;
+    block->next = batch->heads[class];
+    if (!batch->heads[class]) batch->tails[class] = block;
+    batch->heads[class] = block;
+    batch->blocks[class] += 1;
+    batch->requested_bytes[class] += size;
+}
+
+void pool_flush_batch(struct pool_free_batch *batch) {
+    struct shared_buff_pool *pool = &shared_buff_pool;
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        if (!batch->heads[i]) continue;
+        batch->tails[i]->next = pool->free_lists[i];
+        pool->free_lists[i] = batch->heads[i];
+        pool->classes[i].live_blocks -= batch->blocks[i];
+        pool->classes[i].live_requested_bytes -= batch->requested_bytes[i];
+
+        batch->heads[i] = NULL;
+        batch->tails[i] = NULL;
+        batch->blocks[i] = 0;
+        batch->requested_bytes[i] = 0;
+    }
+}
+
+/* Give everything that a pool has back to malloc, whether or not it is still
+   in use, for when nothing that was allocated from it can be reached. */
+void pool_release(struct shared_buff_pool *pool) {
+    for (size_t i = 0; i < pool->slabs.count; i++) free(pool->slabs.data[i]);
+    buffer_free(pool->slabs);
+    while (pool->large_blocks) {
+        struct pool_large_block *block = pool->large_blocks;
+        pool->large_blocks = block->next;
+        free(block);
+    }
+    *pool = (struct shared_buff_pool){0};
+}
+
+/* Report how well the size classes fit the program. Internal waste is the
+   space lost to rounding up to a class, and idle memory is slab space that is
+   sitting on a free list. */
+void print_shared_buff_pool_stats(void) {
+    struct shared_buff_pool *pool = &shared_buff_pool;
+    uint64 allocations = 0, hits = 0, live_bytes = 0, requested_bytes = 0;
+
+    fprintf(stderr, "Shared buffer pool:\n");
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        struct pool_class_stats *stats = &pool->classes[i];
+        if (stats->allocations == 0) continue;
+        fprintf(stderr, "    %4zu bytes: %llu allocations, %.1f%% hits, "
+            "%llu refills, %llu live\n",
+            pool_class_sizes[i],
+            (unsigned long long)stats->allocations,
+            100.0 * stats->hits / stats->allocations,
+            (unsigned long long)stats->refills,
+            (unsigned long long)stats->live_blocks);
+        allocations += stats->allocations;
+        hits += stats->hits;
+        live_bytes += stats->live_blocks * pool_class_sizes[i];
+        requested_bytes += stats->live_requested_bytes;
+    }
+    fprintf(stderr, "    Large: %llu allocations, %llu bytes live\n",
+        (unsigned long long)pool->large_allocations,
+        (unsigned long long)pool->live_large_bytes);
+
+    if (allocations > 0) {
+        fprintf(stderr, "    Hit rate: %.1f%%\n", 100.0 * hits / allocations);
+    }
+    if (live_bytes > 0) {
+        fprintf(stderr, "    Internal waste: %.1f%% of %llu live bytes\n",
+            100.0 * (live_bytes - requested_bytes) / live_bytes,
+            (unsigned long long)live_bytes);
+    }
+    if (pool->slab_bytes > 0) {
+        fprintf(stderr, "    Idle: %.1f%% of %llu slab bytes\n",
+            100.0 * (pool->slab_bytes - live_bytes) / pool->slab_bytes,
+            (unsigned long long)pool->slab_bytes);
+    }
+}
+
+/********************/
+/* Memory Telemetry */
+/********************/
+
+/* Counters for where memory goes, kept all the time, since each one is a
+   single add next to work that costs far more. -stats prints them at exit,
+   and the memory_stats builtin hands them to scripts. Like the pool, they
+   belong to the thread that is running the interpreter, but the threads that
+   help with par_map and par_reduce hand theirs back to that thread once each
+   job is done, see memory_stats_merge. */
+
+/* Shared buffer sizes go in power of two buckets, from 32 bytes up. */
+#define MEMORY_STATS_SIZE_BUCKETS 24
+#define MEMORY_STATS_SMALLEST_BUCKET 5
+
+struct type_memory_stats {
+    uint64 allocations;
+    uint64 live_bytes;
+    uint64 peak_bytes;
+};
+
+struct type_memory_stats_buffer {
+    struct type_memory_stats *data;
+    size_t count;
+    size_t capacity;
+};
+
+struct memory_stats {
+    /* Shared buffers on the heap, by the id of their element glue. */
+    struct type_memory_stats_buffer types;
+    struct type_memory_stats total;
+    uint64 size_buckets[MEMORY_STATS_SIZE_BUCKETS];
+
+    uint64 increments;
+    uint64 decrements;
+    uint64 unique_copies;
+    uint64 unique_copy_bytes;
+
+    /* As of the last time anything was freed from the data stack. */
+    uint64 data_stack_peak;
+};
+
+MODLANG_THREAD_LOCAL struct memory_stats memory_stats;
+
+void type_memory_stats_add(struct type_memory_stats *stats, int64 bytes) {
+    stats->live_bytes += bytes;
+    if (stats->live_bytes > stats->peak_bytes) {
+        stats->peak_bytes = stats->live_bytes;
+    }
+}
+
+/* Count a shared buffer block of this many bytes being handed out. */
+void memory_stats_count_size(size_t bytes) {
+    int bucket = 0;
+    while (bucket < MEMORY_STATS_SIZE_BUCKETS - 1
+        && bytes > (1ull << (bucket + MEMORY_STATS_SMALLEST_BUCKET)))
+    {
+        bucket += 1;
+    }
+    memory_stats.size_buckets[bucket] += 1;
+}
+
+struct type_memory_stats *memory_stats_type(
+    struct memory_stats *stats,
+    int32 id
+) {
+    if (id >= stats->types.count) {
+        size_t old_count = stats->types.count;
+        buffer_setcount(stats->types, id + 1);
+        memset(&stats->types.data[old_count], 0,
+            (stats->types.count - old_count) * sizeof(struct type_memory_stats));
+    }
+    return &stats->types.data[id];
+}
+
+/* Record a change in how many bytes of shared buffers hold elements of this
+   glue, counting an allocation as well if allocated is set. */
+void memory_stats_add(struct type_glue *glue, int64 bytes, bool allocated) {
+    struct memory_stats *stats = &memory_stats;
+    struct type_memory_stats *type = memory_stats_type(stats, glue->id);
+    type_memory_stats_add(type, bytes);
+    type_memory_stats_add(&stats->total, bytes);
+    if (allocated) {
+        type->allocations += 1;
+        stats->total.allocations += 1;
+        memory_stats_count_size(bytes);
+    }
+}
+
+/* Start counting from zero, keeping the room for each type. */
+void memory_stats_clear(struct memory_stats *stats) {
+    struct type_memory_stats_buffer types = stats->types;
+    if (types.count > 0) {
+        memset(types.data, 0, types.count * sizeof(struct type_memory_stats));
+    }
+    *stats = (struct memory_stats){.types = types};
+}
+
+void type_memory_stats_merge(
+    struct type_memory_stats *to,
+    struct type_memory_stats *from
+) {
+    to->allocations += from->allocations;
+    if (from->peak_bytes > to->peak_bytes) to->peak_bytes = from->peak_bytes;
+    /* Live bytes can wrap below zero on a thread that freed more than it
+       made, but they add up right. */
+    type_memory_stats_add(to, from->live_bytes);
+}
+
+/* Add in what another thread counted. Peaks from different threads could
+   have overlapped or not, so the result is just the biggest of them. */
+void memory_stats_merge(struct memory_stats *to, struct memory_stats *from) {
+    for (int32 i = 0; i < from->types.count; i++) {
+        type_memory_stats_merge(memory_stats_type(to, i),
+            &from->types.data[i]);
+    }
+    type_memory_stats_merge(&to->total, &from->total);
+    for (int i = 0; i < MEMORY_STATS_SIZE_BUCKETS; i++) {
+        to->size_buckets[i] += from->size_buckets[i];
+    }
+    to->increments += from->increments;
+    to->decrements += from->decrements;
+    to->unique_copies += from->unique_copies;
+    to->unique_copy_bytes += from->unique_copy_bytes;
+    if (from->data_stack_peak > to->data_stack_peak) {
+        to->data_stack_peak = from->data_stack_peak;
+    }
+}
+
+struct type_glue type_glue_int64;
+
+struct type_glue_buffer {
+    struct type_glue **data;
+    size_t count;
+    size_t capacity;
+};
+
+/* Every glue other than type_glue_int64, in order of id. */
+struct type_glue_buffer type_glues;
+
+struct type_glue *type_glue_with_id(int32 id) {
+    if (id == 0) return &type_glue_int64;
+    return type_glues.data[id - 1];
+}
+
+void print_memory_stats(void) {
+    struct memory_stats *stats = &memory_stats;
+
+    fprintf(stderr, "Memory:\n");
+    fprintf(stderr, "    Shared buffers: %llu allocations, %llu bytes live, "
+        "%llu bytes peak\n",
+        (unsigned long long)stats->total.allocations,
+        (unsigned long long)stats->total.live_bytes,
+        (unsigned long long)stats->total.peak_bytes);
+    for (int i = 0; i < stats->types.count; i++) {
+        struct type_memory_stats *type = &stats->types.data[i];
+        if (type->allocations == 0) continue;
+        fprintf(stderr, "        [%s]: %llu allocations, %llu bytes live, "
+            "%llu bytes peak\n",
+            type_glue_with_id(i)->name,
+            (unsigned long long)type->allocations,
+            (unsigned long long)type->live_bytes,
+            (unsigned long long)type->peak_bytes);
+    }
+    fprintf(stderr, "    Sizes:\n");
+    for (int i = 0; i < MEMORY_STATS_SIZE_BUCKETS; i++) {
+        if (stats->size_buckets[i] == 0) continue;
+        if (i == MEMORY_STATS_SIZE_BUCKETS - 1) {
+            fprintf(stderr, "        more: %llu\n",
+                (unsigned long long)stats->size_buckets[i]);
+        } else {
+            fprintf(stderr, "        <= %llu bytes: %llu\n",
+                1ull << (i + MEMORY_STATS_SMALLEST_BUCKET),
+                (unsigned long long)stats->size_buckets[i]);
         }
-    } else if (type->connective == TYPE_TUPLE) {
+    }
+    fprintf(stderr, "    Refcounts: %llu increments, %llu decrements\n",
+        (unsigned long long)stats->increments,
+        (unsigned long long)stats->decrements);
+    fprintf(stderr, "    Copies to make arrays unique: %llu, %llu bytes\n",
+        (unsigned long long)stats->unique_copies,
+        (unsigned long long)stats->unique_copy_bytes);
+    fprintf(stderr, "    Data stack: %llu bytes peak\n",
+        (unsigned long long)stats->data_stack_peak);
+
+    print_shared_buff_pool_stats();
+}
+
+void print_ref_count(struct shared_buff_header *header) {
+    if (header) {
+        printf("ref count at %p is now %d\n", header,
+            shared_buff_references(header));
+    }
+}
+
+/* Plain integers all share one glue, so that the constant type_int64 never
+   has to be written to. */
+struct type_glue type_glue_int64 = {8, true, 0, NULL, 0, "Int"};
+
+/* Spell a type the way it would be written, to tell glues apart, and to name
+   them in telemetry. */
+void type_name_append(struct char_buffer *out, struct type *type) {
+    char *text = NULL;
+    switch (type->connective) {
+    case TYPE_INT:
+        text = "Int";
+        break;
+    case TYPE_PROCEDURE:
+        text = "Procedure";
+        break;
+    case TYPE_ARRAY:
+        buffer_push(*out, '[');
+        type_name_append(out, type->inner);
+        buffer_push(*out, ']');
+        return;
+    case TYPE_TUPLE:
+        buffer_push(*out, '{');
         for (int i = 0; i < type->elements.count; i++) {
-            struct type *elem_type = &type->elements.data[i];
-            do_decrements(data, elem_type, count, stride);
-            data += elem_type->total_size;
+            if (i > 0) {
+                buffer_push(*out, ',');
+                buffer_push(*out, ' ');
+            }
+            type_name_append(out, &type->elements.data[i]);
         }
-    } else if (type->connective == TYPE_RECORD) {
+        buffer_push(*out, '}');
+        return;
+    case TYPE_RECORD:
+        buffer_push(*out, '{');
         for (int i = 0; i < type->fields.count; i++) {
-            struct type *elem_type = &type->fields.data[i].type;
-            do_decrements(data, elem_type, count, stride);
-            data += elem_type->total_size;
+            struct field *field = &type->fields.data[i];
+            if (i > 0) {
+                buffer_push(*out, ',');
+                buffer_push(*out, ' ');
+            }
+            memcpy(buffer_addn(*out, field->name.length), field->name.data,
+                field->name.length);
+            buffer_push(*out, ':');
+            buffer_push(*out, ' ');
+            type_name_append(out, &field->type);
         }
-    } else if (type->connective != TYPE_INT) {
-        fprintf(stderr, "Warning: Got an unknown type connective, leaking.\n");
+        buffer_push(*out, '}');
+        return;
+    default:
+        text = "?";
+        break;
     }
+    size_t len = strlen(text);
+    memcpy(buffer_addn(*out, len), text, len);
 }
 
-/* Copy of do_decrements that increments instead. I think this will work. */
-void do_increments(uint8 *data, struct type *type, int count, size_t stride) {
+struct int32_buffer {
+    int32 *data;
+    size_t count;
+    size_t capacity;
+};
+
+void type_glue_collect(
+    struct type *type,
+    int32 offset,
+    struct int32_buffer *offsets
+) {
     if (type->connective == TYPE_ARRAY) {
-        struct shared_buff *buffs = (struct shared_buff*)data;
-        for (int i = 0; i < count; i++) {
-            struct shared_buff_header *header = buffs[i].ptr;
-            if (header) header->references += 1;
-            if (debug) {
-                print_ref_count(header);
-                printf("count is %d\n", buffs[i].count);
-            }
-        }
+        buffer_push(*offsets, offset);
     } else if (type->connective == TYPE_TUPLE) {
         for (int i = 0; i < type->elements.count; i++) {
             struct type *elem_type = &type->elements.data[i];
-            do_increments(data, elem_type, count, stride);
-            data += elem_type->total_size;
+            type_glue_collect(elem_type, offset, offsets);
+            offset += elem_type->total_size;
         }
     } else if (type->connective == TYPE_RECORD) {
         for (int i = 0; i < type->fields.count; i++) {
             struct type *elem_type = &type->fields.data[i].type;
-            do_increments(data, elem_type, count, stride);
-            data += elem_type->total_size;
+            type_glue_collect(elem_type, offset, offsets);
+            offset += elem_type->total_size;
         }
-    } else if (type->connective != TYPE_INT) {
-        fprintf(stderr, "Warning: Got an unknown type connective, leaking.\n");
+    } else if (type->connective != TYPE_INT
+        && type->connective != TYPE_PROCEDURE)
+    {
+        fprintf(errout, "Warning: Got an unknown type connective, leaking.\n");
     }
 }
 
-void shared_buff_decrement(struct shared_buff_header *ptr) {
-    if (!ptr) return;
+/* Glues get made while programs run, possibly on several threads at once,
+   see Parallel Evaluation, so making one takes this lock. */
+thread_mutex type_glue_lock = THREAD_MUTEX_INIT;
+
+struct type_glue *type_glue_find_or_make(struct type *type) {
+    struct char_buffer name = {0};
+    type_name_append(&name, type);
+    buffer_push(name, '\0');
+    for (int i = 0; i < type_glues.count; i++) {
+        if (strcmp(type_glues.data[i]->name, name.data) == 0) {
+            buffer_free(name);
+            return type_glues.data[i];
+        }
+    }
 
-    struct type *elem_type = ptr->element_type;
+    struct int32_buffer offsets = {0};
+    type_glue_collect(type, 0, &offsets);
+
+    struct type_glue *glue = malloc(sizeof(struct type_glue));
+    *glue = (struct type_glue){0};
+    glue->size = type->total_size;
+    glue->is_int = type->connective == TYPE_INT;
+    glue->array_count = (int32)offsets.count;
+    glue->array_offsets = offsets.data;
+    glue->id = (int32)type_glues.count + 1;
+    glue->name = name.data;
+    buffer_push(type_glues, glue);
+    return glue;
+}
+
+struct type_glue *type_glue_of(struct type *type) {
+    struct type_glue *glue = MODLANG_ATOMIC_LOAD_POINTER(&type->glue);
+    if (glue) return glue;
+    if (type->connective == TYPE_INT && type->total_size == 8) {
+        return &type_glue_int64;
+    }
+
+    thread_mutex_lock(&type_glue_lock);
+    glue = type->glue;
+    if (!glue) {
+        glue = type_glue_find_or_make(type);
+        MODLANG_ATOMIC_STORE_POINTER(&type->glue, glue);
+    }
+    thread_mutex_unlock(&type_glue_lock);
+    return glue;
+}
+
+/* Every node holds a single array, which is a child node or a leaf. */
+int32 type_glue_trie_offsets[1] = {0};
+
+struct type_glue *type_glue_trie_parent(struct type_glue *glue) {
+    struct type_glue *existing =
+        MODLANG_ATOMIC_LOAD_POINTER(&glue->trie_parent);
+    if (existing) return existing;
+
+    thread_mutex_lock(&type_glue_lock);
+    if (glue->trie_parent) {
+        thread_mutex_unlock(&type_glue_lock);
+        return glue->trie_parent;
+    }
+
+    struct type_glue *parent = malloc(sizeof(struct type_glue));
+    *parent = (struct type_glue){0};
+    parent->size = sizeof(struct shared_buff);
+    parent->array_count = 1;
+    parent->array_offsets = type_glue_trie_offsets;
+    parent->trie_height = glue->trie_height + 1;
+    parent->trie_leaf = glue->trie_height > 0 ? glue->trie_leaf : glue;
+
+    struct char_buffer name = {0};
+    size_t len = strlen(parent->trie_leaf->name);
+    memcpy(buffer_addn(name, len), parent->trie_leaf->name, len);
+    char level[32];
+    len = snprintf(level, sizeof(level), " node %d", parent->trie_height);
+    memcpy(buffer_addn(name, len + 1), level, len + 1);
+    parent->name = name.data;
+
+    parent->id = (int32)type_glues.count + 1;
+    buffer_push(type_glues, parent);
+    MODLANG_ATOMIC_STORE_POINTER(&glue->trie_parent, parent);
+    thread_mutex_unlock(&type_glue_lock);
+    return parent;
+}
+
+/* The glue of the nodes at some height of a trie of leaf elements. */
+struct type_glue *type_glue_trie_level(struct type_glue *leaf, int height) {
+    struct type_glue *glue = leaf;
+    for (int i = 0; i < height; i++) glue = type_glue_trie_parent(glue);
+    return glue;
+}
+
+/* Whether an array can go inline. Empty arrays of anything have nothing to
+   store. Otherwise only plain integers are allowed, so that inline arrays
+   never hold references, and so that int64 is always the right element type
+   when one has to move to the heap. */
+bool shared_buff_fits_inline(struct type_glue *glue, int count) {
+    if (count == 0) return true;
+    return glue->is_int && glue->size * count <= SHARED_BUFF_INLINE_SIZE;
+}
+
+/* Allocate a shared buffer on the heap big enough to hold count elements
+   each of the specified size. */
+struct shared_buff shared_buff_alloc_heap(struct type_glue *glue, int count) {
+    size_t size = sizeof(struct shared_buff_header) + glue->size * count;
+    struct shared_buff_header *ptr = pool_alloc(size);
+    memory_stats_add(glue, size, true);
+    ptr->glue = glue;
+    ptr->references = 1;
+    ptr->start_offset = 0;
+    ptr->count = count;
+    ptr->capacity = count;
+    if (debug) {
+        print_ref_count(ptr);
+        printf("count is %d\n", count);
+    }
+
+    struct shared_buff result = {.ptr = ptr, .count = count};
+    return result;
+}
+
+/* Arrays with more elements than this are kept in a trie rather than one
+   flat buffer, so that writing to one element of a shared array only copies
+   the nodes on the path down to it, rather than every element. Each node is
+   an ordinary array holding up to SHARED_BUFF_TRIE_WIDTH child arrays, and
+   each leaf holds up to that many elements, so counting references to
+   nodes, copying them and releasing them all work like any other array of
+   arrays. Every leaf but the last is full, so an index picks out its path
+   with its own bits. The shared_buff looks the same as a flat one, except
+   that start_offset is in elements instead of bytes. Children are only ever
+   looked at through their headers, so their start_offset and count are left
+   at zero. */
+#ifndef SHARED_BUFF_TRIE_THRESHOLD
+#define SHARED_BUFF_TRIE_THRESHOLD 1024
+#endif
+#define SHARED_BUFF_TRIE_BITS 5
+#define SHARED_BUFF_TRIE_WIDTH (1 << SHARED_BUFF_TRIE_BITS)
+#define SHARED_BUFF_TRIE_MASK (SHARED_BUFF_TRIE_WIDTH - 1)
+
+bool shared_buff_is_trie(struct shared_buff *buff) {
+    if (shared_buff_is_inline(buff) || !buff->ptr) return false;
+    return buff->ptr->glue->trie_height > 0;
+}
+
+/* The glue of the elements themselves, wherever they are kept. Inline arrays
+   don't record it, but anything inline that has elements holds integers. */
+struct type_glue *shared_buff_element_glue(struct shared_buff *buff) {
+    if (shared_buff_is_inline(buff) || !buff->ptr) return &type_glue_int64;
+    struct type_glue *glue = buff->ptr->glue;
+    if (glue->trie_height > 0) return glue->trie_leaf;
+    return glue;
+}
+
+struct shared_buff *trie_children(struct shared_buff_header *node) {
+    return (struct shared_buff*)&node[1];
+}
+
+/* Nodes and leaves always have room for a full set of children or elements,
+   so that appending can fill them in place. */
+struct shared_buff_header *trie_node_alloc(struct type_glue *glue, int count) {
+    struct shared_buff node =
+        shared_buff_alloc_heap(glue, SHARED_BUFF_TRIE_WIDTH);
+    node.ptr->count = count;
+    return node.ptr;
+}
+
+/* Build a trie with room for count elements, none of which are set yet. */
+struct shared_buff shared_buff_alloc_trie(struct type_glue *glue, int count) {
+    int64 level_count =
+        ((int64)count + SHARED_BUFF_TRIE_MASK) >> SHARED_BUFF_TRIE_BITS;
+    struct shared_buff_header **level =
+        malloc(level_count * sizeof(struct shared_buff_header*));
+    for (int64 i = 0; i < level_count; i++) {
+        int64 leaf_count = count - i * SHARED_BUFF_TRIE_WIDTH;
+        if (leaf_count > SHARED_BUFF_TRIE_WIDTH) {
+            leaf_count = SHARED_BUFF_TRIE_WIDTH;
+        }
+        level[i] = trie_node_alloc(glue, (int)leaf_count);
+    }
+
+    /* Then each level of nodes above those, until one holds everything.
+       There is always at least one, even if there is only one leaf. */
+    struct type_glue *node_glue = glue;
+    do {
+        node_glue = type_glue_trie_parent(node_glue);
+        int64 parent_count =
+            (level_count + SHARED_BUFF_TRIE_MASK) >> SHARED_BUFF_TRIE_BITS;
+        for (int64 i = 0; i < parent_count; i++) {
+            int64 child_start = i * SHARED_BUFF_TRIE_WIDTH;
+            int64 child_count = level_count - child_start;
+            if (child_count > SHARED_BUFF_TRIE_WIDTH) {
+                child_count = SHARED_BUFF_TRIE_WIDTH;
+            }
+            struct shared_buff_header *node =
+                trie_node_alloc(node_glue, (int)child_count);
+            struct shared_buff *children = trie_children(node);
+            for (int64 j = 0; j < child_count; j++) {
+                struct shared_buff child = {.ptr = level[child_start + j]};
+                children[j] = child;
+            }
+            level[i] = node;
+        }
+        level_count = parent_count;
+    } while (level_count > 1);
+
+    struct shared_buff result = {.ptr = level[0], .count = count};
+    free(level);
+    return result;
+}
+
+/* Allocate an array of count elements, inline if it fits. */
+struct shared_buff shared_buff_alloc(struct type_glue *glue, int count) {
+    if (shared_buff_fits_inline(glue, count)) {
+        struct shared_buff result = {0};
+        result.start_offset = SHARED_BUFF_INLINE;
+        result.count = count;
+        return result;
+    }
+    if (count > SHARED_BUFF_TRIE_THRESHOLD) {
+        return shared_buff_alloc_trie(glue, count);
+    }
+    return shared_buff_alloc_heap(glue, count);
+}
+
+void shared_buff_decrement(struct shared_buff buff);
+
+/* Drop the arrays held by count elements. */
+void glue_decrements(uint8 *data, struct type_glue *glue, int count) {
+    if (glue->array_count == 0) return;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < glue->array_count; j++) {
+            struct shared_buff *buff =
+                (struct shared_buff*)(data + glue->array_offsets[j]);
+            shared_buff_decrement(*buff);
+        }
+        data += glue->size;
+    }
+}
+
+/* Take another reference to an array. Null and inline arrays have nothing to
+   count. */
+void shared_buff_increment(struct shared_buff *buff) {
+    if (shared_buff_is_inline(buff) || !buff->ptr) return;
+    struct shared_buff_header *ptr = buff->ptr;
+    if (shared_buff_threads_running
+            || MODLANG_ATOMIC_LOAD(&ptr->references) & SHARED_BUFF_THREAD_SHARED) {
+        MODLANG_ATOMIC_ADD(&ptr->references, 1);
+    } else {
+        ptr->references += 1;
+    }
+    memory_stats.increments += 1;
+    if (debug) {
+        print_ref_count(buff->ptr);
+        printf("count is %d\n", buff->count);
+    }
+}
+
+/* Take another reference to the arrays held by count elements. */
+void glue_increments(uint8 *data, struct type_glue *glue, int count) {
+    if (glue->array_count == 0) return;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < glue->array_count; j++) {
+            shared_buff_increment(
+                (struct shared_buff*)(data + glue->array_offsets[j]));
+        }
+        data += glue->size;
+    }
+}
+
+/* Arrays that have run out of references, but still hold references to the
+   arrays inside them. Releasing them off a worklist, instead of recursing
+   through glue_decrements, keeps deep or long chains of arrays off the C
+   stack, and lets all of their blocks go back to the pool in one batch. */
+struct release_queue {
+    struct shared_buff_header **data;
+    size_t count;
+    size_t capacity;
+    bool releasing;
+    /* Leave dead arrays on the queue until release_dead_buffers is called,
+       which main.c does between top level statements. */
+    bool deferred;
+};
+
+MODLANG_THREAD_LOCAL struct release_queue release_queue;
+
+void release_dead_buffers(void) {
+    struct release_queue *queue = &release_queue;
+    /* Arrays that die while this runs get queued, and picked up below. */
+    if (queue->releasing) return;
+    queue->releasing = true;
+
+    struct pool_free_batch batch = {0};
+    while (queue->count > 0) {
+        struct shared_buff_header *ptr = buffer_pop(*queue);
+        struct type_glue *glue = ptr->glue;
 
-    ptr->references -= 1;
-    if (debug) print_ref_count(ptr);
-    if (ptr->references <= 0) {
         uint8 *buff_start = (uint8*)&ptr[1];
         uint8 *data = buff_start + ptr->start_offset;
-        do_decrements(data, elem_type, ptr->count, elem_type->total_size);
+        glue_decrements(data, glue, ptr->count);
+
+        size_t size = sizeof(struct shared_buff_header)
+            + glue->size * ptr->capacity;
+        memory_stats_add(glue, -(int64)size, false);
+        pool_batch_free(&batch, ptr, size);
+    }
+    pool_flush_batch(&batch);
+
+    queue->releasing = false;
+}
+
+/* Give up a reference to an array that is on the heap. */
+void shared_buff_header_decrement(struct shared_buff_header *ptr) {
+    int32 references;
+    if (shared_buff_threads_running
+            || MODLANG_ATOMIC_LOAD(&ptr->references) & SHARED_BUFF_THREAD_SHARED) {
+        references = MODLANG_ATOMIC_ADD(&ptr->references, -1)
+            & SHARED_BUFF_REFERENCE_MASK;
+    } else {
+        ptr->references -= 1;
+        references = ptr->references;
+    }
+    if (debug) print_ref_count(ptr);
+    if (references <= 0) {
+        buffer_push(release_queue, ptr);
+        if (!release_queue.deferred) release_dead_buffers();
+    }
+}
+
+void shared_buff_decrement(struct shared_buff buff) {
+    if (shared_buff_is_inline(&buff)) return;
+    struct shared_buff_header *ptr = buff.ptr;
+    if (!ptr) return;
+
+    memory_stats.decrements += 1;
+    shared_buff_header_decrement(ptr);
+}
+
+struct shared_buff_header_buffer {
+    struct shared_buff_header **data;
+    size_t count;
+    size_t capacity;
+};
+
+/* Let other threads hold an array, by marking it and everything that can be
+   reached from it with SHARED_BUFF_THREAD_SHARED. This has to happen before
+   the array is handed over, and the handover has to publish what was
+   written, the way that starting a thread or a locked queue does. Whatever
+   is marked already has had everything in it marked too, so nothing gets
+   walked twice. Arrays on the data stack can't escape, so never get here. */
+void shared_buff_share(struct shared_buff *buff) {
+    if (shared_buff_is_inline(buff) || !buff->ptr) return;
+
+    struct shared_buff_header_buffer worklist = {0};
+    buffer_push(worklist, buff->ptr);
+    while (worklist.count > 0) {
+        struct shared_buff_header *ptr = buffer_pop(worklist);
+        if (MODLANG_ATOMIC_LOAD(&ptr->references) & SHARED_BUFF_THREAD_SHARED) {
+            continue;
+        }
+        MODLANG_ATOMIC_OR(&ptr->references, SHARED_BUFF_THREAD_SHARED);
+
+        struct type_glue *glue = ptr->glue;
+        uint8 *data = (uint8*)&ptr[1] + ptr->start_offset;
+        for (int i = 0; i < ptr->count; i++) {
+            for (int j = 0; j < glue->array_count; j++) {
+                struct shared_buff *inner =
+                    (struct shared_buff*)(data + glue->array_offsets[j]);
+                if (shared_buff_is_inline(inner) || !inner->ptr) continue;
+                buffer_push(worklist, inner->ptr);
+            }
+            data += glue->size;
+        }
+    }
+    buffer_free(worklist);
+}
+
+/* Find an element of the trie that node is the root of, counting from the
+   start of the trie rather than of any slice of it. */
+uint8 *trie_index(struct shared_buff_header *node, int64 index) {
+    for (int height = node->glue->trie_height; height > 0; height--) {
+        int64 slot = (index >> (SHARED_BUFF_TRIE_BITS * height))
+            & SHARED_BUFF_TRIE_MASK;
+        node = trie_children(node)[slot].ptr;
+    }
+    return (uint8*)&node[1] + node->glue->size * (index & SHARED_BUFF_TRIE_MASK);
+}
+
+/* How many elements there are in the trie that node is the root of. */
+int64 trie_count(struct shared_buff_header *node) {
+    int64 total = 0;
+    for (int height = node->glue->trie_height; height > 0; height--) {
+        total += (int64)(node->count - 1) << (SHARED_BUFF_TRIE_BITS * height);
+        node = trie_children(node)[node->count - 1].ptr;
+    }
+    return total + node->count;
+}
 
-        free(ptr);
+void shared_buff_check_index(struct shared_buff *buff, int index) {
+    if (index < 0 || index >= buff->count) {
+        fprintf(errout, "Runtime error: Tried to access index %lld of an "
+            "array of size %d.\n", (long long)index, buff->count);
+        error_exit();
     }
 }
 
-void *shared_buff_get_index(struct shared_buff buff, int index) {
-    if (index < 0 || index >= buff.count) {
-        fprintf(stderr, "Runtime error: Tried to access index %lld of an "
-            "array of size %d.\n", (long long)index, buff.count);
-        exit(EXIT_FAILURE);
+/* Takes the array by pointer, since an inline array's elements live in the
+   struct itself. */
+void *shared_buff_get_index(struct shared_buff *buff, int index) {
+    shared_buff_check_index(buff, index);
+    if (shared_buff_is_inline(buff)) {
+        return &buff->inline_data[type_int64.total_size * index];
     }
-    struct type *element_type = buff.ptr->element_type;
-    uint8 *data = (uint8*)&buff.ptr[1];
-    data += buff.start_offset;
-    data += element_type->total_size * index;
+    if (buff->ptr->glue->trie_height > 0) {
+        return trie_index(buff->ptr, (int64)buff->start_offset + index);
+    }
+    uint8 *data = (uint8*)&buff->ptr[1];
+    data += buff->start_offset;
+    data += buff->ptr->glue->size * index;
     return data;
 }
 
-void copy_vals(struct type *element_type, void *dest, void *source, int count) {
-    memcpy(dest, source, count * element_type->total_size);
-    do_increments(source, element_type, count, element_type->total_size);
+void copy_vals(struct type_glue *glue, void *dest, void *source, int count) {
+    memcpy(dest, source, count * glue->size);
+    glue_increments(source, glue, count);
+}
+
+/* Find an element, and count how many elements from there on are next to
+   it in memory, which for a trie is the rest of its leaf. */
+void *shared_buff_get_run(struct shared_buff *buff, int index, int *run) {
+    void *result = shared_buff_get_index(buff, index);
+    *run = buff->count - index;
+    if (shared_buff_is_trie(buff)) {
+        int leaf_rest = SHARED_BUFF_TRIE_WIDTH
+            - (int)(((int64)buff->start_offset + index) & SHARED_BUFF_TRIE_MASK);
+        if (*run > leaf_rest) *run = leaf_rest;
+    }
+    return result;
 }
 
+/* Copy count elements between two arrays, either of which might be a trie,
+   taking a reference to each element that is copied. */
+void shared_buff_copy_range(
+    struct type_glue *glue,
+    struct shared_buff *dest,
+    int dest_index,
+    struct shared_buff *source,
+    int source_index,
+    int count
+) {
+    while (count > 0) {
+        int dest_run;
+        int source_run;
+        uint8 *to = shared_buff_get_run(dest, dest_index, &dest_run);
+        uint8 *from = shared_buff_get_run(source, source_index, &source_run);
+        int run = count;
+        if (run > dest_run) run = dest_run;
+        if (run > source_run) run = source_run;
+        copy_vals(glue, to, from, run);
+        dest_index += run;
+        source_index += run;
+        count -= run;
+    }
+}
+
+/* Give the caller its own copy of a trie node or leaf if anything else holds
+   it, taking a reference to whatever the copy holds, and giving up the
+   caller's reference to the original. */
+struct shared_buff_header *trie_node_make_unique(
+    struct shared_buff_header *node
+) {
+    if (shared_buff_references(node) == 1) return node;
+
+    struct type_glue *glue = node->glue;
+    struct shared_buff_header *copy = trie_node_alloc(glue, node->count);
+    copy_vals(glue, &copy[1], &node[1], node->count);
+    memory_stats.unique_copies += 1;
+    memory_stats.unique_copy_bytes += glue->size * node->count;
+
+    /* Another thread might have let go of it since, leaving this the last
+       reference. */
+    shared_buff_header_decrement(node);
+    return copy;
+}
+
+/* Narrow an array down to its first end elements. */
+void shared_buff_slice_end(struct shared_buff *buff, int64 end) {
+    if (end < 0 || end > buff->count) {
+        fprintf(errout, "Runtime error: Tried to end a slice at %lld, in an "
+            "array of size %d.\n", (long long)end, buff->count);
+        error_exit();
+    }
+    buff->count = end;
+}
+
+/* Drop the first start elements of an array. Heap arrays and tries just move
+   their view along, while inline arrays shift what they hold. */
+void shared_buff_slice_start(struct shared_buff *buff, int64 start) {
+    if (start < 0 || start > buff->count) {
+        fprintf(errout, "Runtime error: Tried to start a slice at %lld, when "
+            "it ends at %d.\n", (long long)start, buff->count);
+        error_exit();
+    }
+    if (start == 0) return;
+
+    if (shared_buff_is_inline(buff)) {
+        size_t size = type_int64.total_size;
+        memmove(buff->inline_data, buff->inline_data + size * start,
+            size * (buff->count - start));
+    } else if (shared_buff_is_trie(buff)) {
+        buff->start_offset += start;
+    } else {
+        buff->start_offset += buff->ptr->glue->size * start;
+    }
+    buff->count -= start;
+}
+
+/* Make sure that nothing else can see changes to the array. Shared arrays
+   only copy the range that they view. Inline arrays are already private, but they get moved to the heap anyway, since whoever
+   asked is about to hold on to a pointer into them, or to a copy of the
+   struct that has to share its elements with the original. Tries only copy
+   their root, and leave the rest to shared_buff_get_index_unique. */
 void shared_buff_make_unique(struct shared_buff *buff) {
+    if (shared_buff_is_inline(buff)) {
+        if (buff->count == 0) return;
+        struct shared_buff heap =
+            shared_buff_alloc_heap(&type_glue_int64, buff->count);
+        memcpy(shared_buff_get_index(&heap, 0), buff->inline_data,
+            type_int64.total_size * buff->count);
+        *buff = heap;
+        memory_stats.unique_copies += 1;
+        memory_stats.unique_copy_bytes +=
+            type_int64.total_size * buff->count;
+        return;
+    }
+
     struct shared_buff_header *ptr = buff->ptr;
-    if (ptr->references > 1) {
-        struct shared_buff unique = shared_buff_alloc(ptr->element_type, buff->count);
+    if (ptr->glue->trie_height > 0) {
+        buff->ptr = trie_node_make_unique(ptr);
+        return;
+    }
+    if (shared_buff_references(ptr) > 1) {
+        /* Not shared_buff_alloc, since the caller is about to take a pointer
+           into the copy, which has to be on the heap too. */
+        struct shared_buff unique =
+            shared_buff_alloc_heap(ptr->glue, buff->count);
 
-        uint8 *source = shared_buff_get_index(*buff, 0);
-        uint8 *dest = shared_buff_get_index(unique, 0);
-        copy_vals(ptr->element_type, dest, source, buff->count);
+        shared_buff_copy_range(ptr->glue, &unique, 0, buff, 0, buff->count);
+        memory_stats.unique_copies += 1;
+        memory_stats.unique_copy_bytes += ptr->glue->size * buff->count;
 
         *buff = unique;
-        ptr->references -= 1;
+        shared_buff_header_decrement(ptr);
+    }
+}
+
+/* Find an element that is about to be written to, once nothing else can see
+   the change. Flat arrays get copied whole, if they are shared, but tries
+   only copy the nodes on the way down to the element. */
+void *shared_buff_get_index_unique(struct shared_buff *buff, int index) {
+    if (!shared_buff_is_trie(buff)) {
+        shared_buff_make_unique(buff);
+        return shared_buff_get_index(buff, index);
+    }
+    shared_buff_check_index(buff, index);
+
+    struct shared_buff_header *node = trie_node_make_unique(buff->ptr);
+    buff->ptr = node;
+    int64 trie_index = (int64)buff->start_offset + index;
+    for (int height = node->glue->trie_height; height > 0; height--) {
+        int64 slot = (trie_index >> (SHARED_BUFF_TRIE_BITS * height))
+            & SHARED_BUFF_TRIE_MASK;
+        struct shared_buff *child = &trie_children(node)[slot];
+        child->ptr = trie_node_make_unique(child->ptr);
+        node = child->ptr;
+    }
+    return (uint8*)&node[1]
+        + node->glue->size * (trie_index & SHARED_BUFF_TRIE_MASK);
+}
+
+/* Whether an array can grow in place: it has to be on the heap, nobody else
+   can see it, and it has to reach the end of what its buffer holds. */
+bool shared_buff_can_extend(struct shared_buff *buff) {
+    if (shared_buff_is_inline(buff)) return false;
+    struct shared_buff_header *ptr = buff->ptr;
+    if (!ptr || shared_buff_references(ptr) != 1) return false;
+    if (ptr->glue->trie_height > 0) {
+        return (int64)buff->start_offset + buff->count == trie_count(ptr);
+    }
+    size_t end = buff->start_offset
+        + (size_t)ptr->glue->size * buff->count;
+    return end == ptr->start_offset + (size_t)ptr->glue->size * ptr->count;
+}
+
+/* Make room for at least count elements in total, growing geometrically so
+   that repeated appends copy each element a constant number of times on
+   average. */
+void shared_buff_reserve(struct shared_buff *buff, int64 count) {
+    struct shared_buff_header *ptr = buff->ptr;
+    if (count <= ptr->capacity) return;
+
+    int64 capacity = (int64)ptr->capacity * 2;
+    if (capacity < count) capacity = count;
+    if (capacity < 4) capacity = 4;
+    if (capacity > INT32_MAX) capacity = INT32_MAX;
+    if (count > capacity) {
+        fprintf(errout, "Runtime error: Array of %lld elements is too "
+            "large.\n", (long long)count);
+        error_exit();
+    }
+
+    size_t elem_size = ptr->glue->size;
+    size_t header_size = sizeof(struct shared_buff_header);
+    memory_stats_add(ptr->glue, elem_size * (capacity - ptr->capacity), false);
+    memory_stats_count_size(header_size + elem_size * capacity);
+    ptr = pool_realloc(ptr,
+        header_size + elem_size * ptr->capacity,
+        header_size + elem_size * capacity,
+        header_size + ptr->start_offset + elem_size * ptr->count);
+    ptr->capacity = (int32)capacity;
+    buff->ptr = ptr;
+}
+
+/* Add count elements to the end of a trie that nothing else can see, for the
+   caller to fill in. Only nodes along the right edge are touched, and any of
+   those that are still shared get copied first. */
+void shared_buff_trie_extend(struct shared_buff *buff, int count) {
+    struct type_glue *leaf_glue = buff->ptr->glue->trie_leaf;
+    int64 end = trie_count(buff->ptr);
+    int64 new_end = end + count;
+    while (end < new_end) {
+        struct shared_buff_header *node = buff->ptr;
+        int height = node->glue->trie_height;
+        if (end >> (SHARED_BUFF_TRIE_BITS * (height + 1)) != 0) {
+            /* Full, so grow a new root above it. */
+            struct shared_buff_header *root =
+                trie_node_alloc(type_glue_trie_parent(node->glue), 1);
+            struct shared_buff child = {.ptr = node};
+            trie_children(root)[0] = child;
+            buff->ptr = root;
+            continue;
+        }
+
+        for (; height > 0; height--) {
+            int64 slot = (end >> (SHARED_BUFF_TRIE_BITS * height))
+                & SHARED_BUFF_TRIE_MASK;
+            struct shared_buff *child = &trie_children(node)[slot];
+            if (slot == node->count) {
+                struct shared_buff empty = {
+                    .ptr = trie_node_alloc(
+                        type_glue_trie_level(leaf_glue, height - 1), 0)
+                };
+                *child = empty;
+                node->count += 1;
+            } else {
+                child->ptr = trie_node_make_unique(child->ptr);
+            }
+            node = child->ptr;
+        }
+
+        /* Then take as much of the leaf as is wanted. */
+        int64 room = SHARED_BUFF_TRIE_WIDTH - node->count;
+        if (room > new_end - end) room = new_end - end;
+        node->count += (int32)room;
+        end += room;
     }
 }
 
+/* Build an array out of the elements of two others, taking a reference to
+   each element that is copied. If consume_arg1 is set then arg1's reference
+   is used up, either by extending arg1 in place when nothing else can see
+   it, or by dropping it once its elements are copied. */
+struct shared_buff shared_buff_concat(
+    struct shared_buff *arg1,
+    struct shared_buff *arg2,
+    bool consume_arg1
+) {
+    int arg1_count = arg1->count;
+    int arg2_count = arg2->count;
+    int64 total = (int64)arg1_count + arg2_count;
+    if (total > INT32_MAX) {
+        fprintf(errout, "Runtime error: Array of %lld elements is too "
+            "large.\n", (long long)total);
+        error_exit();
+    }
+
+    /* Flat arrays that would outgrow the threshold get moved into a trie
+       instead. */
+    if (consume_arg1 && shared_buff_can_extend(arg1)
+        && (shared_buff_is_trie(arg1) || total <= SHARED_BUFF_TRIE_THRESHOLD))
+    {
+        struct shared_buff result = *arg1;
+        if (arg2_count > 0) {
+            struct type_glue *glue = shared_buff_element_glue(&result);
+            if (shared_buff_is_trie(&result)) {
+                shared_buff_trie_extend(&result, arg2_count);
+            } else {
+                shared_buff_reserve(&result, (int64)result.ptr->count + arg2_count);
+                result.ptr->count += arg2_count;
+            }
+            result.count += arg2_count;
+            shared_buff_copy_range(glue, &result, arg1_count,
+                arg2, 0, arg2_count);
+        }
+        return result;
+    }
+
+    /* Both arrays have the same type, but inline arrays don't record it. */
+    struct type_glue *glue = shared_buff_element_glue(arg1);
+    if (shared_buff_is_inline(arg1)) glue = shared_buff_element_glue(arg2);
+
+    struct shared_buff result = shared_buff_alloc(glue, (int)total);
+
+    if (arg1_count > 0) {
+        shared_buff_copy_range(glue, &result, 0, arg1, 0, arg1_count);
+    }
+    if (arg2_count > 0) {
+        shared_buff_copy_range(glue, &result, arg1_count,
+            arg2, 0, arg2_count);
+    }
+    if (consume_arg1) shared_buff_decrement(*arg1);
+
+    return result;
+}
+
 void copy_scalar(
     uint8 *dest,
     uint8 *src,
     enum operation_flags flags,
     bool temporary
 ) {
-    if (flags == OP_SHARED_BUFF) {
-        struct shared_buff *src_buff = (struct shared_buff*)src;
-        struct shared_buff *dest_buff = (struct shared_buff*)dest;
-        *dest_buff = *src_buff;
-        if (!temporary && src_buff->ptr != NULL) {
-            src_buff->ptr->references += 1;
-            if (debug) {
-                print_ref_count(src_buff->ptr);
-                printf("count is %d\n", src_buff->count);
-            }
+    /* memcpy rather than a cast, since dest can be the inline elements of
+       an array variable, which C code from emit_c.h reads as a whole. */
+    if (flags & OP_SHARED_BUFF) {
+        memcpy(dest, src, sizeof(struct shared_buff));
+        if (!temporary && !(flags & OP_NO_REFCOUNT)) {
+            shared_buff_increment((struct shared_buff*)src);
         }
     } else {
-        int64 *src64 = (int64*)src;
-        int64 *dest64 = (int64*)dest;
-        *dest64 = *src64;
+        memcpy(dest, src, sizeof(int64));
     }
 }
 
@@ -209,9 +1510,10 @@ void copy_scalar(
 /**********************/
 
 struct execution_frame {
-    struct instruction *start;
+    struct packed_instruction *start;
     size_t count;
     size_t current;
+    int64 *constants;
 
     /* Stack offset where function args/locals start for this frame. */
     size_t locals_start;
@@ -263,43 +1565,370 @@ struct data_stack {
                     buffer macros on it. */
 };
 
+/* Where the OS lets us, the data stack is a reservation of address space
+   rather than an allocation. Pages only get committed once they are touched,
+   so it can be far bigger than anything a program is likely to use, and it is
+   followed by a guard region that is never accessible. Instead of comparing
+   against the size, stack_alloc reads the byte just past each allocation, so
+   running off the end faults on the guard, and the fault handler reports it.
+   An allocation bigger than the guard could step right over it, so those are
+   still checked. Use -data-stack-size to change the size.
+
+   Windows won't commit reserved pages by itself, so there the fault handler
+   does it, a chunk at a time, whenever the stack is touched below its guard.
+   Committing the whole stack up front would charge all of it against the
+   commit limit, for every context and every worker thread. */
+#ifndef DATA_STACK_DEFAULT_SIZE
+#define DATA_STACK_DEFAULT_SIZE ((size_t)256 << 20)
+#endif
+#define DATA_STACK_GUARD_SIZE ((size_t)64 << 10)
+#define DATA_STACK_COMMIT_SIZE ((size_t)1 << 20)
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MODLANG_DATA_STACK_GUARD
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#define MODLANG_DATA_STACK_GUARD
+#include <windows.h>
+#endif
+
+#ifdef MODLANG_DATA_STACK_GUARD
+/* One guard region for each data stack that is alive, in any context or
+   thread. Slots are taken and given back under the lock, but the fault
+   handler reads them without it, so a slot's end is written before its start
+   when it is taken, and start is cleared first when it is given back. */
+#define DATA_STACK_GUARD_MAX 1024
+
+/* The fault handler reads these without the lock, so a slot's start is
+   only set once its end and base are. */
+struct data_stack_guard {
+    uint8 *start;
+    uint8 *end;
+    uint8 *base; /* Where the stack that the guard ends starts. */
+};
+
+struct data_stack_guard data_stack_guards[DATA_STACK_GUARD_MAX];
+int32 data_stack_guard_count; /* Slots that have ever been used. */
+thread_mutex data_stack_guard_lock = THREAD_MUTEX_INIT;
+
+bool data_stack_guard_contains(uint8 *address) {
+    int32 count = MODLANG_ATOMIC_LOAD(&data_stack_guard_count);
+    for (int i = 0; i < count; i++) {
+        struct data_stack_guard *guard = &data_stack_guards[i];
+        uint8 *start = MODLANG_ATOMIC_LOAD_POINTER(&guard->start);
+        if (!start || address < start) continue;
+        if (address < (uint8*)MODLANG_ATOMIC_LOAD_POINTER(&guard->end)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef _WIN32
+/* If address is in a data stack, below its guard, commit the chunk of the
+   stack that it is in, and say so. */
+bool data_stack_commit(uint8 *address) {
+    int32 count = MODLANG_ATOMIC_LOAD(&data_stack_guard_count);
+    for (int i = 0; i < count; i++) {
+        struct data_stack_guard *guard = &data_stack_guards[i];
+        uint8 *start = MODLANG_ATOMIC_LOAD_POINTER(&guard->start);
+        if (!start || address >= start) continue;
+        uint8 *base = MODLANG_ATOMIC_LOAD_POINTER(&guard->base);
+        if (address < base) continue;
+
+        size_t offset = (size_t)(address - base)
+            / DATA_STACK_COMMIT_SIZE * DATA_STACK_COMMIT_SIZE;
+        size_t size = start - (base + offset);
+        if (size > DATA_STACK_COMMIT_SIZE) size = DATA_STACK_COMMIT_SIZE;
+        if (!VirtualAlloc(base + offset, size, MEM_COMMIT, PAGE_READWRITE)) {
+            fputs("Error: Couldn't commit memory for the data stack.\n",
+                stderr);
+            fflush(stderr);
+            ExitProcess(EXIT_FAILURE);
+        }
+        return true;
+    }
+    return false;
+}
+#endif
+
+void data_stack_install_fault_handler(void);
+
+void data_stack_guard_register(uint8 *base, uint8 *start, uint8 *end) {
+    thread_mutex_lock(&data_stack_guard_lock);
+    data_stack_install_fault_handler();
+    for (int i = 0; i < DATA_STACK_GUARD_MAX; i++) {
+        struct data_stack_guard *guard = &data_stack_guards[i];
+        if (guard->start) continue;
+        MODLANG_ATOMIC_STORE_POINTER(&guard->end, end);
+        MODLANG_ATOMIC_STORE_POINTER(&guard->base, base);
+        MODLANG_ATOMIC_STORE_POINTER(&guard->start, start);
+        if (i >= data_stack_guard_count) {
+            MODLANG_ATOMIC_ADD(&data_stack_guard_count,
+                i + 1 - data_stack_guard_count);
+        }
+        break;
+    }
+    /* With no slot left, running off the end just crashes. */
+    thread_mutex_unlock(&data_stack_guard_lock);
+}
+
+void data_stack_guard_unregister(uint8 *start) {
+    thread_mutex_lock(&data_stack_guard_lock);
+    for (int i = 0; i < data_stack_guard_count; i++) {
+        if (data_stack_guards[i].start == start) {
+            MODLANG_ATOMIC_STORE_POINTER(&data_stack_guards[i].start, NULL);
+            break;
+        }
+    }
+    thread_mutex_unlock(&data_stack_guard_lock);
+}
+
+static const char data_stack_overflow_message[] =
+    "Error: Ran out of memory in the data stack.\n";
+
+#ifdef _WIN32
+LONG WINAPI data_stack_fault(EXCEPTION_POINTERS *info) {
+    EXCEPTION_RECORD *record = info->ExceptionRecord;
+    if (record->ExceptionCode == EXCEPTION_ACCESS_VIOLATION
+            && record->NumberParameters >= 2) {
+        uint8 *address = (uint8 *)record->ExceptionInformation[1];
+        if (data_stack_guard_contains(address)) {
+            fputs(data_stack_overflow_message, stderr);
+            fflush(stderr);
+            ExitProcess(EXIT_FAILURE);
+        }
+        if (data_stack_commit(address)) return EXCEPTION_CONTINUE_EXECUTION;
+    }
+
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+#else
+struct sigaction data_stack_previous_action;
+
+void data_stack_fault(int signal_number, siginfo_t *info, void *context) {
+    uint8 *address = info->si_addr;
+    if (data_stack_guard_contains(address)) {
+        /* The fault came from the probe in stack_alloc, not from the middle
+           of anything that a context would have to worry about, so it can
+           report the error like any other, once SIGSEGV is unblocked for
+           the next time. */
+        if (error_channel && error_channel->recover) {
+            sigset_t unblock;
+            sigemptyset(&unblock);
+            sigaddset(&unblock, SIGSEGV);
+            pthread_sigmask(SIG_UNBLOCK, &unblock, NULL);
+            fputs(data_stack_overflow_message, errout);
+            error_exit();
+        }
+
+        /* Only async-signal-safe calls from here. */
+        ssize_t written = write(STDERR_FILENO, data_stack_overflow_message,
+            sizeof(data_stack_overflow_message) - 1);
+        (void)written;
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Not ours. Put back whoever was handling it before, and let the faulting
+       instruction run again. */
+    sigaction(SIGSEGV, &data_stack_previous_action, NULL);
+}
+#endif
+
+void data_stack_install_fault_handler(void) {
+    static bool installed = false;
+    if (installed) return;
+    installed = true;
+
+#ifdef _WIN32
+    AddVectoredExceptionHandler(1, data_stack_fault);
+#else
+    struct sigaction action = {0};
+    action.sa_sigaction = data_stack_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &data_stack_previous_action);
+#endif
+}
+
+size_t data_stack_page_size(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return sysconf(_SC_PAGESIZE);
+#endif
+}
+#endif
+
 struct data_stack stack_create(size_t size) {
     struct data_stack result;
-    result.data = malloc(size);
     result.allocated_count = 0;
     result.size = size;
 
+#ifdef MODLANG_DATA_STACK_GUARD
+    /* One spare byte for the probe after a full-size allocation. */
+    size_t page_size = data_stack_page_size();
+    size_t usable = (size + 1 + page_size - 1) / page_size * page_size;
+    size_t reserved = usable + DATA_STACK_GUARD_SIZE;
+
+#ifdef _WIN32
+    /* The rest gets committed by data_stack_commit, as it is touched. */
+    size_t initial = usable < DATA_STACK_COMMIT_SIZE
+        ? usable : DATA_STACK_COMMIT_SIZE;
+    result.data = VirtualAlloc(NULL, reserved, MEM_RESERVE, PAGE_NOACCESS);
+    if (result.data && !VirtualAlloc(result.data, initial, MEM_COMMIT,
+            PAGE_READWRITE)) {
+        VirtualFree(result.data, 0, MEM_RELEASE);
+        result.data = NULL;
+    }
+#else
+    result.data = mmap(NULL, reserved, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (result.data == MAP_FAILED) {
+        result.data = NULL;
+    } else if (mprotect(result.data, usable, PROT_READ | PROT_WRITE) != 0) {
+        munmap(result.data, reserved);
+        result.data = NULL;
+    }
+#endif
+    if (!result.data) {
+        fprintf(errout, "Error: Couldn't reserve %llu bytes for the data "
+            "stack.\n", (unsigned long long)size);
+        error_exit();
+    }
+
+    /* Whatever the page rounding gave us is ours to use. */
+    result.size = usable - 1;
+    data_stack_guard_register(result.data, result.data + usable,
+        result.data + reserved);
+#else
+    result.data = malloc(size);
+#endif
+
     return result;
 }
 
-uint8 *stack_alloc(struct data_stack *stack, size_t count) {
+/* Give back everything that stack_create reserved. */
+void stack_destroy(struct data_stack *stack) {
+#ifdef MODLANG_DATA_STACK_GUARD
+    size_t page_size = data_stack_page_size();
+    size_t usable = (stack->size + 1 + page_size - 1) / page_size * page_size;
+    data_stack_guard_unregister(stack->data + usable);
+#ifdef _WIN32
+    VirtualFree(stack->data, 0, MEM_RELEASE);
+#else
+    munmap(stack->data, usable + DATA_STACK_GUARD_SIZE);
+#endif
+#else
+    free(stack->data);
+#endif
+    stack->data = NULL;
+}
+
+uint8 *stack_alloc_checked(struct data_stack *stack, size_t count) {
     if (stack->allocated_count + count > stack->size) {
-        fprintf(stderr, "Error: Ran out of memory in the data stack.\n");
-        exit(EXIT_FAILURE);
+        fprintf(errout, "Error: Ran out of memory in the data stack.\n");
+        error_exit();
+    }
+
+    uint8 *result = stack->data + stack->allocated_count;
+    stack->allocated_count += count;
+
+    return result;
+}
+
+uint8 *stack_alloc(struct data_stack *stack, size_t count) {
+#ifdef MODLANG_DATA_STACK_GUARD
+    if (count <= DATA_STACK_GUARD_SIZE) {
+        uint8 *result = stack->data + stack->allocated_count;
+        stack->allocated_count += count;
+        /* Faults on the guard if this went past the end. Otherwise it costs a
+           load from a line we are about to write anyway. */
+        (void)*(volatile uint8 *)(result + count);
+
+        return result;
     }
+#endif
+
+    return stack_alloc_checked(stack, count);
+}
 
-    uint8 *result = stack->data + stack->allocated_count;
-    stack->allocated_count += count;
+/* Arrays that can't escape their procedure live on the data stack, and get
+   freed with OP_STACK_FREE, see place_stack_arrays. They still have a header,
+   so that nothing else has to know where they are, but nothing else ever
+   holds one, so its count stays at one. */
+struct shared_buff shared_buff_alloc_stack(
+    struct data_stack *stack,
+    struct type_glue *glue,
+    int count
+) {
+    struct shared_buff_header *ptr = (struct shared_buff_header *)stack_alloc(
+        stack, sizeof(struct shared_buff_header) + glue->size * count);
+    ptr->glue = glue;
+    ptr->references = 1;
+    ptr->start_offset = 0;
+    ptr->count = count;
+    ptr->capacity = count;
 
+    struct shared_buff result = {.ptr = ptr, .count = count};
     return result;
 }
 
 void stack_free(struct data_stack *stack, uint8 *ptr) {
     if (ptr < stack->data || ptr > stack->data + stack->size) {
-        fprintf(stderr, "Warning: Tried to free memory location %llp from the "
-            "stack, but it wasn't on the stack.\n", (uint64)ptr);
+        fprintf(errout, "Warning: Tried to free memory location %p from the "
+            "stack, but it wasn't on the stack.\n", (void*)ptr);
         return;
     }
 
     if (ptr > stack->data + stack->allocated_count) {
-        fprintf(stderr, "Warning: Tried to free memory location %llp, but it "
-            "was already free.\n", (uint64)ptr);
+        fprintf(errout, "Warning: Tried to free memory location %p, but it "
+            "was already free.\n", (void*)ptr);
         return;
     }
 
+    if (stack->allocated_count > memory_stats.data_stack_peak) {
+        memory_stats.data_stack_peak = stack->allocated_count;
+    }
     stack->allocated_count = ptr - stack->data;
 }
 
+/* The record that the memory_stats builtin returns, one Int each. */
+#define MEMORY_STATS_FIELDS(X) \
+    X(live_bytes) X(peak_bytes) X(allocations) \
+    X(increments) X(decrements) \
+    X(unique_copies) X(unique_copy_bytes) \
+    X(data_stack_peak)
+
+#define MEMORY_STATS_RECORD_FIELD(NAME) int64 NAME;
+struct memory_stats_record {
+    MEMORY_STATS_FIELDS(MEMORY_STATS_RECORD_FIELD)
+};
+#undef MEMORY_STATS_RECORD_FIELD
+
+void memory_stats_snapshot(
+    struct memory_stats_record *out,
+    struct data_stack *stack
+) {
+    struct memory_stats *stats = &memory_stats;
+    out->live_bytes = stats->total.live_bytes;
+    out->peak_bytes = stats->total.peak_bytes;
+    out->allocations = stats->total.allocations;
+    out->increments = stats->increments;
+    out->decrements = stats->decrements;
+    out->unique_copies = stats->unique_copies;
+    out->unique_copy_bytes = stats->unique_copy_bytes;
+    /* Whatever is on the data stack now hasn't been counted yet. */
+    if (stack->allocated_count > stats->data_stack_peak) {
+        stats->data_stack_peak = stack->allocated_count;
+    }
+    out->data_stack_peak = stats->data_stack_peak;
+}
+
 /* Logically this is a single heterogeneous stack, like the call stack of a CPU
    in virtual memory. In practice we split it across three homogeneous buffers,
    because we have to handle the branches and indexing in software, rather than
@@ -310,18 +1939,418 @@ struct call_stack {
     struct data_stack data;
 };
 
+/* Make room for every variable that a frame running this code will touch,
+   so that nothing in the frame has to check for space as it goes, and the
+   variable stack only moves when a frame is entered. */
+void call_stack_reserve_frame(
+    struct call_stack *stack,
+    size_t locals_start,
+    struct bytecode *code
+) {
+    size_t end = locals_start + code->frame_size;
+    if (stack->vars.count < end) buffer_setcount(stack->vars, end);
+}
+
 void call_stack_push_exec_frame(
     struct call_stack *stack,
-    struct instruction_buffer *code
+    struct bytecode *code
 ) {
     struct execution_frame *frame = buffer_addn(stack->exec, 1);
 
-    frame->start = code->data;
-    frame->count = code->count;
+    frame->start = code->instructions.data;
+    frame->count = code->instructions.count;
     frame->current = 0;
+    frame->constants = code->constants.data;
 
     frame->locals_start = stack->vars.global_count;
     frame->results_start = stack->vars.count;
+    call_stack_reserve_frame(stack, frame->locals_start, code);
+}
+
+/***********************/
+/* Parallel Evaluation */
+/***********************/
+
+/* par_map and par_reduce call a procedure on every element of an array. Big
+   arrays get cut into chunks, which are shared out between a pool of
+   threads, each with a call stack of its own, and the calling thread works on
+   them too. Each thread starts on a run of chunks of its own, and once that
+   is used up, takes chunks from the others' runs, so that threads that get
+   slow chunks don't hold everyone else up. */
+
+/* Calls a procedure on the given call stack, with arg_count arguments, and
+   gets its one result. The interpreter and -emit-c programs each have one,
+   with context holding whatever they need to find the procedure. */
+typedef void par_call_function(
+    struct call_stack *stack,
+    void *context,
+    int64 proc_index,
+    union variable_contents *args,
+    int arg_count,
+    union variable_contents *result
+);
+
+/* How many threads to run on, counting the caller, or 0 for one per core.
+   Use -threads to change it. */
+int par_thread_count = 0;
+
+#ifndef PAR_MIN_CHUNK_SIZE
+#define PAR_MIN_CHUNK_SIZE 256
+#endif
+/* Enough chunks that threads that finish early have something to take. */
+#define PAR_CHUNKS_PER_THREAD 8
+
+/* Set on the pool's threads, and on the caller while they run. Any par_map
+   or par_reduce that they get to just runs on that thread, and the JIT
+   leaves procedures alone, see jit_lookup. */
+MODLANG_THREAD_LOCAL bool par_running;
+
+struct par_job {
+    par_call_function *call;
+    void *context;
+    int64 proc_index;
+    struct shared_buff *input;
+    int64 count;
+    int32 chunk_count;
+    /* par_map writes every result straight into output. par_reduce reduces
+       each chunk to one of the partials instead, and output is NULL. */
+    struct shared_buff *output;
+    int64 *partials;
+
+    /* The caller's settings, which the pool's threads take on for the job,
+       and where their errors go. Once any thread fails, the rest stop
+       taking chunks, and the caller fails too once they have all stopped. */
+    bool debug;
+    bool jit_enabled;
+    FILE *errors;
+    int32 failed;
+};
+
+void par_run_chunk(struct par_job *job, struct call_stack *stack, int32 chunk) {
+    int64 start = job->count * chunk / job->chunk_count;
+    int64 end = job->count * (chunk + 1) / job->chunk_count;
+    union variable_contents args[2] = {0};
+    union variable_contents result;
+    int64 accumulator = 0;
+
+    for (int64 i = start; i < end;) {
+        int run;
+        int64 *in = shared_buff_get_run(job->input, (int)i, &run);
+        if (run > end - i) run = (int)(end - i);
+
+        if (job->output) {
+            int out_run;
+            int64 *out = shared_buff_get_run(job->output, (int)i, &out_run);
+            if (run > out_run) run = out_run;
+            for (int j = 0; j < run; j++) {
+                args[0].val64 = in[j];
+                job->call(stack, job->context, job->proc_index, args, 1,
+                    &result);
+                out[j] = result.val64;
+            }
+        } else {
+            for (int j = 0; j < run; j++) {
+                if (i + j == start) {
+                    accumulator = in[j];
+                    continue;
+                }
+                args[0].val64 = accumulator;
+                args[1].val64 = in[j];
+                job->call(stack, job->context, job->proc_index, args, 2,
+                    &result);
+                accumulator = result.val64;
+            }
+        }
+        i += run;
+    }
+
+    if (!job->output) job->partials[chunk] = accumulator;
+}
+
+#ifdef MODLANG_THREADS
+struct par_worker {
+    struct call_stack *stack;
+    /* The run of chunks that this worker starts on. Whichever thread takes
+       one bumps next_chunk with MODLANG_ATOMIC_ADD. */
+    int32 next_chunk;
+    int32 end_chunk;
+    /* What the worker counted during the last job, for the caller to add to
+       its own. */
+    struct memory_stats stats;
+    /* Keep each worker's counter on a cache line of its own. */
+    uint8 padding[64];
+};
+
+/* Only one job runs at a time, since par_running keeps the pool's own
+   threads from starting another, and a context on another thread that wants
+   the pool while it is busy just runs its job itself. */
+struct par_pool {
+    /* Worker 0 is whichever thread called, using its own call stack. */
+    struct par_worker *workers;
+    int worker_count;
+
+    thread_mutex lock;
+    thread_cond start;
+    thread_cond done;
+    int64 generation;
+    int busy; /* How many of the pool's threads are still on this job. */
+    struct par_job *job;
+};
+
+struct par_pool par_pool = {.lock = THREAD_MUTEX_INIT};
+
+int par_thread_total(void) {
+    if (par_thread_count > 0) return par_thread_count;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+#endif
+}
+
+void par_work(struct par_job *job, int worker) {
+    struct par_worker *workers = par_pool.workers;
+    int count = par_pool.worker_count;
+    struct call_stack *stack = workers[worker].stack;
+
+    /* Our own run first, then everyone else's. */
+    for (int i = 0; i < count; i++) {
+        struct par_worker *it = &workers[(worker + i) % count];
+        while (!MODLANG_ATOMIC_LOAD(&job->failed)) {
+            int32 chunk = MODLANG_ATOMIC_ADD(&it->next_chunk, 1) - 1;
+            if (chunk >= it->end_chunk) break;
+            par_run_chunk(job, stack, chunk);
+        }
+    }
+}
+
+/* Runs par_work, catching any error that it hits rather than exiting. */
+void par_work_catching(struct par_job *job, int worker) {
+    struct error_channel *previous_channel = error_channel;
+    bool previous_debug = debug;
+    bool previous_jit_enabled = jit_enabled;
+
+    error_jump_buffer recover;
+    struct error_channel channel = {job->errors, &recover, false};
+    error_channel = &channel;
+    debug = job->debug;
+    jit_enabled = job->jit_enabled;
+
+    if (error_catch(recover)) {
+        MODLANG_ATOMIC_OR(&job->failed, 1);
+    } else {
+        par_work(job, worker);
+    }
+
+    error_channel = previous_channel;
+    debug = previous_debug;
+    jit_enabled = previous_jit_enabled;
+}
+
+#ifdef _WIN32
+DWORD WINAPI par_thread_main(void *arg) {
+#else
+void *par_thread_main(void *arg) {
+#endif
+    int worker = (int)(intptr_t)arg;
+    par_running = true;
+    shared_buff_threads_running = true;
+
+    int64 seen = 0;
+    thread_mutex_lock(&par_pool.lock);
+    while (true) {
+        while (par_pool.generation == seen) {
+            thread_cond_wait(&par_pool.start, &par_pool.lock);
+        }
+        seen = par_pool.generation;
+        struct par_job *job = par_pool.job;
+        thread_mutex_unlock(&par_pool.lock);
+
+        memory_stats_clear(&memory_stats);
+        par_work_catching(job, worker);
+        /* This shares the buffer of types, which stays put until the next
+           job, and the caller is done with it by then. */
+        par_pool.workers[worker].stats = memory_stats;
+
+        thread_mutex_lock(&par_pool.lock);
+        par_pool.busy -= 1;
+        if (par_pool.busy == 0) thread_cond_broadcast(&par_pool.done);
+    }
+    return 0;
+}
+
+/* The pool's threads last as long as the program. Their data stacks are
+   made here, on the calling thread, so that their guard regions are
+   registered before anything can fault on them. */
+void par_pool_start(struct call_stack *caller) {
+    int count = par_thread_total();
+    par_pool.workers = calloc(count, sizeof(struct par_worker));
+    par_pool.worker_count = 1;
+    thread_cond_init(&par_pool.start);
+    thread_cond_init(&par_pool.done);
+
+    for (int i = 1; i < count; i++) {
+        struct call_stack *stack = calloc(1, sizeof(struct call_stack));
+        stack->data = stack_create(caller->data.size);
+        par_pool.workers[i].stack = stack;
+
+        void *arg = (void*)(intptr_t)i;
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, par_thread_main, arg, 0, NULL);
+        if (!thread) break;
+        CloseHandle(thread);
+#else
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, par_thread_main, arg) != 0) break;
+        pthread_detach(thread);
+#endif
+        par_pool.worker_count = i + 1;
+    }
+}
+#endif
+
+/* Decide how to cut up an array, with a single chunk meaning that it all
+   runs on the calling thread. */
+int32 par_chunk_count(int64 count) {
+    if (count == 0) return 0;
+    int64 max_chunks = 1;
+#ifdef MODLANG_THREADS
+    int threads = par_running ? 1 : par_thread_total();
+    if (threads > 1) max_chunks = (int64)threads * PAR_CHUNKS_PER_THREAD;
+#endif
+    int64 chunks = count / PAR_MIN_CHUNK_SIZE;
+    if (chunks > max_chunks) chunks = max_chunks;
+    if (chunks < 1) chunks = 1;
+    return (int32)chunks;
+}
+
+void par_run(struct call_stack *stack, struct par_job *job) {
+#ifdef MODLANG_THREADS
+    bool pool_free = false;
+    if (job->chunk_count > 1) {
+        thread_mutex_lock(&par_pool.lock);
+        pool_free = !par_pool.job;
+        if (pool_free) {
+            if (!par_pool.workers) par_pool_start(stack);
+            par_pool.job = job;
+        }
+        thread_mutex_unlock(&par_pool.lock);
+    }
+
+    if (pool_free) {
+        struct par_worker *workers = par_pool.workers;
+        int count = par_pool.worker_count;
+
+        workers[0].stack = stack;
+        for (int i = 0; i < count; i++) {
+            workers[i].next_chunk = (int32)((int64)job->chunk_count * i / count);
+            workers[i].end_chunk =
+                (int32)((int64)job->chunk_count * (i + 1) / count);
+
+            /* Everyone gets their own copy of the globals, since the calls
+               on this thread can move the caller's. Whatever an earlier job
+               that failed left on their stacks goes. */
+            if (i == 0) continue;
+            struct call_stack *worker_stack = workers[i].stack;
+            worker_stack->exec.count = 0;
+            worker_stack->data.allocated_count = 0;
+            struct variable_stack *vars = &worker_stack->vars;
+            size_t global_count = stack->vars.global_count;
+            buffer_setcount(*vars, global_count);
+            if (global_count > 0) {
+                memcpy(vars->data, stack->vars.data,
+                    global_count * sizeof(struct variable_data));
+            }
+            vars->global_count = global_count;
+        }
+
+        job->debug = debug;
+        job->jit_enabled = jit_enabled;
+        job->errors = errout;
+
+        shared_buff_threads_running = true;
+        par_running = true;
+
+        thread_mutex_lock(&par_pool.lock);
+        par_pool.generation += 1;
+        par_pool.busy = count - 1;
+        thread_cond_broadcast(&par_pool.start);
+        thread_mutex_unlock(&par_pool.lock);
+
+        par_work_catching(job, 0);
+
+        thread_mutex_lock(&par_pool.lock);
+        while (par_pool.busy > 0) {
+            thread_cond_wait(&par_pool.done, &par_pool.lock);
+        }
+        par_pool.job = NULL;
+        thread_mutex_unlock(&par_pool.lock);
+
+        for (int i = 1; i < count; i++) {
+            memory_stats_merge(&memory_stats, &workers[i].stats);
+        }
+
+        par_running = false;
+        shared_buff_threads_running = false;
+        if (job->failed) error_exit();
+        return;
+    }
+#endif
+
+    for (int32 i = 0; i < job->chunk_count; i++) {
+        par_run_chunk(job, stack, i);
+    }
+}
+
+/* A new array, of the results of calling proc_index on each element. */
+struct shared_buff par_map(
+    struct call_stack *stack,
+    par_call_function *call,
+    void *context,
+    int64 proc_index,
+    struct shared_buff *input
+) {
+    struct shared_buff result = shared_buff_alloc(&type_glue_int64,
+        input->count);
+
+    struct par_job job = {call, context, proc_index, input, input->count};
+    job.chunk_count = par_chunk_count(job.count);
+    job.output = &result;
+    par_run(stack, &job);
+
+    return result;
+}
+
+/* Combine the elements with proc_index, starting from initial. Chunks are
+   reduced separately, and then combined in order, so this only means the
+   same thing as a loop would if the procedure is associative. */
+int64 par_reduce(
+    struct call_stack *stack,
+    par_call_function *call,
+    void *context,
+    int64 proc_index,
+    struct shared_buff *input,
+    int64 initial
+) {
+    struct par_job job = {call, context, proc_index, input, input->count};
+    job.chunk_count = par_chunk_count(job.count);
+    job.partials = malloc((job.chunk_count + 1) * sizeof(int64));
+    par_run(stack, &job);
+
+    union variable_contents args[2] = {0};
+    union variable_contents result;
+    args[0].val64 = initial;
+    for (int32 i = 0; i < job.chunk_count; i++) {
+        args[1].val64 = job.partials[i];
+        call(stack, context, proc_index, args, 2, &result);
+        args[0].val64 = result.val64;
+    }
+    free(job.partials);
+
+    return args[0].val64;
 }
 
 /* Try to decode the ref, but only crash if it is corrupted, not if it is
@@ -348,404 +2377,875 @@ union variable_contents read_ref(
         index = locals_start + ref.x;
         break;
     default:
-        fprintf(stderr, "Unexpected ref.type value %d?\n", ref.type);
-        exit(EXIT_FAILURE);
+        fprintf(errout, "Unexpected ref.type value %d?\n", ref.type);
+        error_exit();
     }
 
     return vars->data[index].value;
 }
 
-void write_ref(
-    struct execution_frame *frame,
-    struct variable_stack *vars,
-    struct ref ref,
-    union variable_contents value
+/* Like read_ref, but for packed operands in the hot path of the interpreter,
+   where the base of the variable stack and of the current frame have already
+   been looked up. */
+union variable_contents read_operand(
+    struct variable_data *globals,
+    struct variable_data *locals,
+    int64 *constants,
+    enum ref_type type,
+    int32 x
 ) {
-    size_t index = 0;
-    switch (ref.type) {
-    case REF_NULL:
-        /* Some operations are just used for their side-effects. */
-        return;
+    switch (type) {
     case REF_CONSTANT:
-        fprintf(stderr, "Error: tried to write value to a constant?\n");
-        exit(EXIT_FAILURE);
+        return (union variable_contents){.val64 = x};
+    case REF_WIDE_CONSTANT:
+        return (union variable_contents){.val64 = constants[x]};
+    case REF_STATIC_POINTER:
+        return (union variable_contents){.pointer = (void*)constants[x]};
     case REF_GLOBAL:
-        index = ref.x;
-        break;
+        return globals[x].value;
     case REF_LOCAL:
     case REF_TEMPORARY:
-        index = frame->locals_start + ref.x;
-        break;
+        return locals[x].value;
     default:
-        fprintf(stderr, "Unexpected ref.type value %d?\n", ref.type);
-        exit(EXIT_FAILURE);
+        return (union variable_contents){0};
+    }
+}
+
+/* The other half of read_operand. Code has been through verify_bytecode
+   before it gets here, so the operand is known to be REF_NULL or a
+   variable, and not a constant or something corrupt, and locals are known to
+   be inside the frame that call_stack_reserve_frame made room for. Only new
+   globals can still grow the variable stack. */
+void write_operand(
+    struct variable_stack *vars,
+    size_t locals_start,
+    enum ref_type type,
+    int32 x,
+    union variable_contents value
+) {
+    size_t index;
+    if (type == REF_NULL) {
+        /* Some operations are just used for their side-effects. */
+        return;
+    } else if (type == REF_GLOBAL) {
+        index = x;
+        if (index >= vars->global_count) vars->global_count = index + 1;
+        if (index + 1 > vars->count) buffer_setcount(*vars, index + 1);
+    } else {
+        index = locals_start + x;
     }
-    if (index + 1 > vars->count) buffer_setcount(*vars, index + 1);
     vars->data[index].value = value;
 }
 
+/* Verified code never reaches an opcode that has no handler, so let the
+   compiler drop the check for one. */
+#if defined(__GNUC__) || defined(__clang__)
+#define UNREACHABLE() __builtin_unreachable()
+#elif defined(_MSC_VER)
+#define UNREACHABLE() __assume(0)
+#else
+#define UNREACHABLE() abort()
+#endif
+
+/* Each opcode gets a handler, and each handler ends by jumping straight to
+   the handler of the next instruction. GCC and Clang let us do that jump
+   through a table of label addresses, so that every handler gets its own
+   indirect branch for the branch predictor to learn, and no bounds check.
+   Anything else goes back through the switch statement. Define
+   MODLANG_NO_THREADED_DISPATCH to use the switch even with GCC or Clang. */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MODLANG_NO_THREADED_DISPATCH)
+#define MODLANG_THREADED_DISPATCH
+#endif
+
+/* Define MODLANG_PROFILE_OPCODE_PAIRS to count how often each operation is
+   executed straight after each other operation, which is what decides the
+   pairs that fuse_bytecode looks for. The counts are in terms of generic
+   operations, so they don't depend on what has already been fused. */
+#ifdef MODLANG_PROFILE_OPCODE_PAIRS
+uint64 opcode_pair_counts[OP_COUNT][OP_COUNT];
+enum operation opcode_profile_previous = OP_NULL;
+
+void opcode_profile_record(struct packed_instruction *ip) {
+    enum operation op = generic_operation(ip->op);
+    opcode_pair_counts[opcode_profile_previous][op] += 1;
+    opcode_profile_previous = op;
+
+    /* Fused operations execute the instructions that they replaced. */
+    int fused_count = fused_operation_length(ip->op);
+    for (int i = 1; i < fused_count; i++) {
+        op = generic_operation(ip[i].op);
+        opcode_pair_counts[opcode_profile_previous][op] += 1;
+        opcode_profile_previous = op;
+    }
+}
+
+void print_opcode_pair_profile(void) {
+    fprintf(stderr, "Most frequent operation pairs:\n");
+    /* Pull out the top few by selection, it's only for diagnostics. */
+    bool printed[OP_COUNT][OP_COUNT] = {0};
+    for (int n = 0; n < 20; n++) {
+        int best_first = -1, best_second = -1;
+        uint64 best_count = 0;
+        for (int i = 0; i < OP_COUNT; i++) {
+            for (int j = 0; j < OP_COUNT; j++) {
+                if (printed[i][j]) continue;
+                if (opcode_pair_counts[i][j] > best_count) {
+                    best_first = i;
+                    best_second = j;
+                    best_count = opcode_pair_counts[i][j];
+                }
+            }
+        }
+        if (best_count == 0) break;
+        printed[best_first][best_second] = true;
+        fprintf(stderr, "    Op%d Op%d: %llu\n", best_first, best_second,
+            (unsigned long long)best_count);
+    }
+}
+
+#define PROFILE_DISPATCH() opcode_profile_record(ip)
+#else
+#define PROFILE_DISPATCH()
+#endif
+
+#ifdef MODLANG_JIT
+/* How many calls a procedure gets before it is compiled. */
+#ifndef MODLANG_JIT_CALL_THRESHOLD
+#define MODLANG_JIT_CALL_THRESHOLD 1
+#endif
+
+void jit_compile_procedure(struct procedure *p);
+
+/* Get the native code for a procedure, compiling it first if it has been
+   called enough times, or NULL if it should be interpreted. */
+jit_function *jit_lookup(struct procedure *p) {
+    if (!jit_enabled) return NULL;
+    /* Other threads could be running it, see Parallel Evaluation. */
+    if (par_running) return p->jit_code;
+    if (!p->jit_code && !p->jit_unsupported) {
+        p->call_count += 1;
+        if (p->call_count >= MODLANG_JIT_CALL_THRESHOLD) {
+            jit_compile_procedure(p);
+        }
+    }
+    return p->jit_code;
+}
+#endif
+
+/* Run the top frame of the execution stack until it returns. Anything that
+   it calls gets run too, but frames below it are left alone, so that native
+   code can call back into the interpreter. */
+par_call_function interpreter_par_call;
+
 void continue_execution(
     struct procedure_buffer procedures,
     struct call_stack *stack
 ) {
-    while (stack->exec.count > 0) {
-        struct execution_frame *frame = buffer_top(stack->exec);
-        if (frame->current < 0 || frame->current >= frame->count) {
-            stack->exec.count -= 1;
-            continue;
-        }
-
-        struct instruction *next = &frame->start[frame->current];
+    if (stack->exec.count == 0) return;
+    size_t base_depth = stack->exec.count - 1;
+
+    /* The current frame, kept in locals so that they only get reloaded when
+       we call or return. The frame itself moves whenever the execution stack
+       grows, and the variable stack data moves whenever a write grows the
+       variable stack. */
+    struct execution_frame *frame;
+    struct packed_instruction *ip;
+    int64 *constants;
+    size_t locals_start;
+    struct variable_data *globals;
+    struct variable_data *locals;
+
+#define LOAD_FRAME() do { \
+        frame = buffer_top(stack->exec); \
+        ip = &frame->start[frame->current]; \
+        constants = frame->constants; \
+        locals_start = frame->locals_start; \
+        globals = stack->vars.data; \
+        locals = globals + locals_start; \
+    } while (0)
+
+#define READ(TYPE, X) read_operand(globals, locals, constants, (TYPE), (X))
+#define READ_OUTPUT() READ(OUTPUT_TYPE(ip), ip->output)
+#define READ_ARG1() READ(ARG1_TYPE(ip), ip->arg1)
+#define READ_ARG2() READ(ARG2_TYPE(ip), ip->arg2)
+#define WRITE(TYPE, X, VALUE) do { \
+        write_operand(&stack->vars, locals_start, (TYPE), (X), (VALUE)); \
+        globals = stack->vars.data; \
+        locals = globals + locals_start; \
+    } while (0)
+#define WRITE_OUTPUT(VALUE) WRITE(OUTPUT_TYPE(ip), ip->output, (VALUE))
+#define WRITE_ARG1(VALUE) WRITE(ARG1_TYPE(ip), ip->arg1, (VALUE))
+
+/* Quickened operations know the kinds of their operands already, so they
+   skip read_operand and write_operand, and go straight to the variable stack. */
+#define OPERAND_L(X) ((int64)locals[X].value.val64)
+#define OPERAND_G(X) ((int64)globals[X].value.val64)
+#define OPERAND_C(X) ((int64)(X))
+#define STORE_LOCAL(X, VALUE) \
+    (locals[X].value = (union variable_contents){.val64 = (VALUE)})
+
+#ifdef MODLANG_THREADED_DISPATCH
+    static void *dispatch_table[] = {
+        [OP_NULL] = &&do_OP_NULL,
+        [OP_MOV] = &&do_OP_MOV,
+        [OP_LOR] = &&do_OP_LOR,
+        [OP_LAND] = &&do_OP_LAND,
+        [OP_EQ] = &&do_OP_EQ,
+        [OP_NEQ] = &&do_OP_NEQ,
+        [OP_LEQ] = &&do_OP_LEQ,
+        [OP_GEQ] = &&do_OP_GEQ,
+        [OP_LESS] = &&do_OP_LESS,
+        [OP_GREATER] = &&do_OP_GREATER,
+        [OP_BOR] = &&do_OP_BOR,
+        [OP_BAND] = &&do_OP_BAND,
+        [OP_BXOR] = &&do_OP_BXOR,
+        [OP_PLUS] = &&do_OP_PLUS,
+        [OP_MINUS] = &&do_OP_MINUS,
+        [OP_LSHIFT] = &&do_OP_LSHIFT,
+        [OP_RSHIFT] = &&do_OP_RSHIFT,
+        [OP_MUL] = &&do_OP_MUL,
+        [OP_DIV] = &&do_OP_DIV,
+        [OP_MOD] = &&do_OP_MOD,
+        [OP_EDIV] = &&do_OP_EDIV,
+        [OP_EMOD] = &&do_OP_EMOD,
+        [OP_CALL] = &&do_OP_CALL,
+        [OP_RET] = &&do_OP_RET,
+        [OP_TAIL_CALL] = &&do_OP_TAIL_CALL,
+        [OP_ARRAY_ALLOC] = &&do_OP_ARRAY_ALLOC,
+        [OP_ARRAY_OFFSET] = &&do_OP_ARRAY_OFFSET,
+        [OP_ARRAY_OFFSET_MAKE_UNIQUE] = &&do_OP_ARRAY_OFFSET_MAKE_UNIQUE,
+        [OP_ARRAY_STORE] = &&do_OP_ARRAY_STORE,
+        [OP_ARRAY_INDEX] = &&do_OP_ARRAY_INDEX,
+        [OP_ARRAY_CONCAT] = &&do_OP_ARRAY_CONCAT,
+        [OP_ARRAY_SLICE_END] = &&do_OP_ARRAY_SLICE_END,
+        [OP_ARRAY_SLICE_START] = &&do_OP_ARRAY_SLICE_START,
+        [OP_DECREMENT_REFCOUNT] = &&do_OP_DECREMENT_REFCOUNT,
+        [OP_STACK_ALLOC] = &&do_OP_STACK_ALLOC,
+        [OP_STACK_FREE] = &&do_OP_STACK_FREE,
+        [OP_POINTER_OFFSET] = &&do_OP_POINTER_OFFSET,
+        [OP_POINTER_STORE] = &&do_OP_POINTER_STORE,
+        [OP_POINTER_COPY] = &&do_OP_POINTER_COPY,
+        [OP_POINTER_DUP] = &&do_OP_POINTER_DUP,
+        [OP_POINTER_COPY_OVERLAPPING] = &&do_OP_POINTER_COPY_OVERLAPPING,
+        [OP_POINTER_LOAD] = &&do_OP_POINTER_LOAD,
+        [OP_POINTER_LOAD_MAKE_UNIQUE] = &&do_OP_POINTER_LOAD_MAKE_UNIQUE,
+        [OP_POINTER_INCREMENT_REFCOUNT] = &&do_OP_POINTER_INCREMENT_REFCOUNT,
+        [OP_POINTER_DECREMENT_REFCOUNT] = &&do_OP_POINTER_DECREMENT_REFCOUNT,
+        [OP_ASSERT] = &&do_OP_ASSERT,
+        [OP_MEMORY_STATS] = &&do_OP_MEMORY_STATS,
+        [OP_PAR_MAP] = &&do_OP_PAR_MAP,
+        [OP_PAR_REDUCE] = &&do_OP_PAR_REDUCE,
+#define QUICKENED_DISPATCH_ENTRY(OP, SYMBOL, A, B) \
+        [OP##_##A##B] = &&do_##OP##_##A##B,
+#define QUICKENED_DISPATCH_OP(OP, SYMBOL) \
+        QUICKENED_OPERAND_KINDS(QUICKENED_DISPATCH_ENTRY, OP, SYMBOL)
+#define QUICKENED_MOV_DISPATCH_ENTRY(A) [OP_MOV_##A] = &&do_OP_MOV_##A,
+        QUICKENED_BINARY_OPS(QUICKENED_DISPATCH_OP)
+        QUICKENED_MOVS(QUICKENED_MOV_DISPATCH_ENTRY)
+#undef QUICKENED_DISPATCH_ENTRY
+#undef QUICKENED_DISPATCH_OP
+#undef QUICKENED_MOV_DISPATCH_ENTRY
+#define FUSED_PAIR_DISPATCH_ENTRY(A, B) \
+        [OP_##A##_##B] = &&do_OP_##A##_##B,
+#define FUSED_TRIPLE_DISPATCH_ENTRY(A, B, C) \
+        [OP_##A##_##B##_##C] = &&do_OP_##A##_##B##_##C,
+        FUSED_PAIRS(FUSED_PAIR_DISPATCH_ENTRY)
+        FUSED_TRIPLES(FUSED_TRIPLE_DISPATCH_ENTRY)
+#undef FUSED_PAIR_DISPATCH_ENTRY
+#undef FUSED_TRIPLE_DISPATCH_ENTRY
+    };
+#define HANDLER(OP) case OP: do_##OP
+#define DISPATCH() do { \
+        PROFILE_DISPATCH(); \
+        goto *dispatch_table[ip->op]; \
+    } while (0)
+#else
+#define HANDLER(OP) case OP
+#define DISPATCH() goto dispatch
+#endif
+#define NEXT() do { ip += 1; DISPATCH(); } while (0)
+
+/* Most operations are a pure function of two integers. */
+#define BINARY_HANDLER(OP, EXPR) HANDLER(OP): { \
+        int64 arg1 = READ_ARG1().val64; \
+        int64 arg2 = READ_ARG2().val64; \
+        union variable_contents result = {.val64 = (EXPR)}; \
+        WRITE_OUTPUT(result); \
+        NEXT(); \
+    }
 
-        /* Execute instruction. */
-        union variable_contents arg1_full =
-            read_ref(frame->locals_start, &stack->vars, next->arg1);
-        union variable_contents arg2_full =
-            read_ref(frame->locals_start, &stack->vars, next->arg2);
-        int64 arg1 = arg1_full.val64;
-        int64 arg2 = arg2_full.val64;
+/* The operations that can start or sit in the middle of a fused run have
+   their bodies pulled out, so that fused handlers can run them in sequence,
+   and then jump straight into the handler of the last operation in the run,
+   which is marked with FUSION_TARGET. */
+#define FUSION_TARGET(OP) HANDLER(OP): fused_##OP
+#define STACK_ALLOC_BODY() do { \
+        union variable_contents result; \
+        result.pointer = stack_alloc(&stack->data, READ_ARG1().val64); \
+        WRITE_OUTPUT(result); \
+    } while (0)
+/* Only arrays of structs, or arrays that have just been made unique, get
+   offset into, and neither of those can be inline, so the pointer is into
+   the heap, and outlives arg1. */
+#define ARRAY_OFFSET_BODY() do { \
+        union variable_contents arg1 = READ_ARG1(); \
+        union variable_contents result; \
+        result.pointer = shared_buff_get_index( \
+            &arg1.shared_buff, \
+            READ_ARG2().val64 \
+        ); \
+        WRITE_OUTPUT(result); \
+    } while (0)
+#define POINTER_OFFSET_BODY() do { \
+        union variable_contents result; \
+        result.pointer = READ_ARG1().pointer + READ_ARG2().val64; \
+        WRITE_OUTPUT(result); \
+    } while (0)
+/* TODO: check that the 'output' array is a shared_buff, and that the memory
+   accessed is actually an initialised and aligned part of the buffer. The
+   struct variable itself is left as is. */
+#define POINTER_STORE_BODY() do { \
+        union variable_contents output = READ_OUTPUT(); \
+        union variable_contents arg2 = READ_ARG2(); \
+        void *data = output.pointer + READ_ARG1().val64; \
+        copy_scalar( \
+            data, \
+            arg2.bytes, \
+            ip->flags, \
+            ARG2_TYPE(ip) == REF_TEMPORARY \
+        ); \
+    } while (0)
+#define POINTER_COPY_BODY() do { \
+        union variable_contents output = READ_OUTPUT(); \
+        memcpy(output.pointer, READ_ARG1().pointer, READ_ARG2().val64); \
+    } while (0)
+#define ASSERT_BODY() do { \
+        if (READ_ARG1().val64 == 0) { \
+            fprintf(errout, "Error: Assertion failed.\n"); \
+            error_exit(); \
+        } \
+    } while (0)
+
+#define FUSED_PAIR_HANDLER(A, B) HANDLER(OP_##A##_##B): \
+        A##_BODY(); \
+        ip += 1; \
+        goto fused_OP_##B;
+#define FUSED_TRIPLE_HANDLER(A, B, C) HANDLER(OP_##A##_##B##_##C): \
+        A##_BODY(); \
+        ip += 1; \
+        B##_BODY(); \
+        ip += 1; \
+        goto fused_OP_##C;
+
+#define QUICKENED_HANDLER(OP, SYMBOL, A, B) HANDLER(OP##_##A##B): \
+        STORE_LOCAL(ip->output, OPERAND_##A(ip->arg1) SYMBOL OPERAND_##B(ip->arg2)); \
+        NEXT();
+#define QUICKENED_HANDLER_OP(OP, SYMBOL) \
+        QUICKENED_OPERAND_KINDS(QUICKENED_HANDLER, OP, SYMBOL)
+#define QUICKENED_MOV_HANDLER(A) HANDLER(OP_MOV_##A): \
+        STORE_LOCAL(ip->output, OPERAND_##A(ip->arg1)); \
+        NEXT();
+
+    LOAD_FRAME();
+
+#ifndef MODLANG_THREADED_DISPATCH
+dispatch:
+#endif
+    PROFILE_DISPATCH();
+    switch (ip->op) {
+    HANDLER(OP_NULL):
+        NEXT();
+    HANDLER(OP_MOV):
+      {
+        union variable_contents arg1 = READ_ARG1();
         union variable_contents result = {0};
-        struct ref output_ref = next->output;
-        switch (next->op) {
-        case OP_NULL:
-            break;
-        case OP_MOV:
-            copy_scalar(
-                result.bytes,
-                arg1_full.bytes,
-                next->flags,
-                next->arg1.type == REF_TEMPORARY
-            );
-            break;
-        case OP_LOR:
-            result.val64 = arg1 || arg2;
-            break;
-        case OP_LAND:
-            result.val64 = arg1 && arg2;
-            break;
-        case OP_EQ:
-            result.val64 = arg1 == arg2;
-            break;
-        case OP_NEQ:
-            result.val64 = arg1 != arg2;
-            break;
-        case OP_LEQ:
-            result.val64 = arg1 <= arg2;
-            break;
-        case OP_GEQ:
-            result.val64 = arg1 >= arg2;
-            break;
-        case OP_LESS:
-            result.val64 = arg1 < arg2;
-            break;
-        case OP_GREATER:
-            result.val64 = arg1 > arg2;
-            break;
-        case OP_BOR:
-            result.val64 = arg1 | arg2;
-            break;
-        case OP_BAND:
-            result.val64 = arg1 & arg2;
-            break;
-        case OP_BXOR:
-            result.val64 = arg1 ^ arg2;
-            break;
-        case OP_PLUS:
-            result.val64 = arg1 + arg2;
-            break;
-        case OP_MINUS:
-            result.val64 = arg1 - arg2;
-            break;
-        case OP_LSHIFT:
-            result.val64 = arg1 << arg2;
-            break;
-        case OP_RSHIFT:
-            result.val64 = arg1 >> arg2;
-            break;
-        case OP_MUL:
-            result.val64 = arg1 * arg2;
-            break;
-        case OP_DIV:
-            result.val64 = arg1 / arg2;
-            break;
-        case OP_MOD:
-            result.val64 = arg1 % arg2;
-            break;
-        case OP_EDIV:
-            if (arg1 >= 0) result.val64 = arg1 / arg2;
-            else result.val64 = (arg1 - arg2 + 1) / arg2;
-            break;
-        case OP_EMOD:
-            /* The naive algorithm in the negative case is
-               `arg2 - ((-arg1) % arg2)`; in modular arithmetic this is
-               equivalent to arg1 % arg2, but by making arg1 positive before
-               computing the modulo, we can know that the result will actually
-               be positive at the end. */
-            /* The problem with this, though, is that ((-arg1) % arg2) is in
-               the range [0, arg2 - 1], so arg2 - that is in the range
-               [1, arg2], when we wanted it to stay in the range [0, arg2 - 1].
-               By subtracting 1 we at least get an operation that maps
-               [0, arg2 - 1] to itself, but then we need to correct by
-               computing (-arg1 - 1) % arg2 instead; these two shifts by -1
-               cancel out when one is subtracted from the other.
-                 e.g. arg1=-arg2 would give (-arg1 - 1) % arg2 = arg2 - 1,
-                      then arg2 - 1 - (arg2 - 1) = 0, which is what we want,
-                 and yet arg1=-1 would give (-arg1 - 1) % arg2 = 0,
-                      then arg2 - 1 - 0 = arg2 - 1, which is also correct. */
-            if (arg1 >= 0) result.val64 = arg1 % arg2;
-            else result.val64 = arg2 - 1 - (-arg1 - 1) % arg2;
-            break;
-        case OP_CALL:
-        {
-            struct execution_frame new;
-            new.start = procedures.data[arg1].instructions.data;
-            new.count = procedures.data[arg1].instructions.count;
-            new.current = 0;
-            new.locals_start = frame->locals_start + arg2;
-            if (next->arg1.type == REF_TEMPORARY) {
-                new.results_start = new.locals_start - 1;
-            } else {
-                new.results_start = new.locals_start;
-            }
+        copy_scalar(
+            result.bytes,
+            arg1.bytes,
+            ip->flags,
+            ARG1_TYPE(ip) == REF_TEMPORARY
+        );
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    BINARY_HANDLER(OP_LOR, arg1 || arg2)
+    BINARY_HANDLER(OP_LAND, arg1 && arg2)
+    BINARY_HANDLER(OP_EQ, arg1 == arg2)
+    BINARY_HANDLER(OP_NEQ, arg1 != arg2)
+    BINARY_HANDLER(OP_LEQ, arg1 <= arg2)
+    BINARY_HANDLER(OP_GEQ, arg1 >= arg2)
+    BINARY_HANDLER(OP_LESS, arg1 < arg2)
+    BINARY_HANDLER(OP_GREATER, arg1 > arg2)
+    BINARY_HANDLER(OP_BOR, arg1 | arg2)
+    BINARY_HANDLER(OP_BAND, arg1 & arg2)
+    BINARY_HANDLER(OP_BXOR, arg1 ^ arg2)
+    BINARY_HANDLER(OP_PLUS, arg1 + arg2)
+    BINARY_HANDLER(OP_MINUS, arg1 - arg2)
+    BINARY_HANDLER(OP_LSHIFT, arg1 << arg2)
+    BINARY_HANDLER(OP_RSHIFT, arg1 >> arg2)
+    BINARY_HANDLER(OP_MUL, arg1 * arg2)
+    BINARY_HANDLER(OP_DIV, arg1 / arg2)
+    BINARY_HANDLER(OP_MOD, arg1 % arg2)
+    BINARY_HANDLER(OP_EDIV,
+        arg1 >= 0 ? arg1 / arg2 : (arg1 - arg2 + 1) / arg2)
+    /* The naive algorithm in the negative case is `arg2 - ((-arg1) % arg2)`;
+       in modular arithmetic this is equivalent to arg1 % arg2, but by making
+       arg1 positive before computing the modulo, we can know that the result
+       will actually be positive at the end. */
+    /* The problem with this, though, is that ((-arg1) % arg2) is in the range
+       [0, arg2 - 1], so arg2 - that is in the range [1, arg2], when we wanted
+       it to stay in the range [0, arg2 - 1]. By subtracting 1 we at least get
+       an operation that maps [0, arg2 - 1] to itself, but then we need to
+       correct by computing (-arg1 - 1) % arg2 instead; these two shifts by -1
+       cancel out when one is subtracted from the other.
+         e.g. arg1=-arg2 would give (-arg1 - 1) % arg2 = arg2 - 1,
+              then arg2 - 1 - (arg2 - 1) = 0, which is what we want,
+         and yet arg1=-1 would give (-arg1 - 1) % arg2 = 0,
+              then arg2 - 1 - 0 = arg2 - 1, which is also correct. */
+    BINARY_HANDLER(OP_EMOD,
+        arg1 >= 0 ? arg1 % arg2 : arg2 - 1 - (-arg1 - 1) % arg2)
+    HANDLER(OP_CALL):
+      {
+        int64 proc_index = READ_ARG1().val64;
+        if (ARG1_TYPE(ip) != REF_CONSTANT) {
+            check_procedure_index(&procedures, proc_index);
+        }
+        /* The verifier made sure that this is a constant. */
+        int64 locals_offset = ip->arg2;
+        struct bytecode *code = &procedures.data[proc_index].code;
+
+        struct execution_frame new;
+        new.start = code->instructions.data;
+        new.count = code->instructions.count;
+        new.current = 0;
+        new.constants = code->constants.data;
+        new.locals_start = locals_start + locals_offset;
+        if (ARG1_TYPE(ip) == REF_TEMPORARY) {
+            new.results_start = new.locals_start - 1;
+        } else {
+            new.results_start = new.locals_start;
+        }
 
-            buffer_push(stack->exec, new);
+        /* Return to one past the call site. This has to happen before the
+           push, since the push might move the frame. */
+        frame->current = ip - frame->start + 1;
+
+#ifdef MODLANG_JIT
+        jit_function *native =
+            jit_lookup(&procedures.data[proc_index]);
+        if (native) {
+            native(stack, &procedures, new.locals_start, new.results_start);
+            /* The native code might have called back into the interpreter,
+               and moved either stack. */
+            LOAD_FRAME();
+            DISPATCH();
+        }
+#endif
 
-            break;
+        buffer_push(stack->exec, new);
+        call_stack_reserve_frame(stack, new.locals_start, code);
+
+        LOAD_FRAME();
+        DISPATCH();
+      }
+    FUSION_TARGET(OP_RET):
+      {
+        /* Unbind all variables that aren't being returned. */
+        size_t source_offset = locals_start + ip->arg1;
+        size_t dest_offset = frame->results_start;
+        int64 result_count = ip->arg2;
+        /* Move results up the stack, to where the inputs were. */
+        for (int i = 0; i < result_count; i++) {
+            stack->vars.data[dest_offset + i] =
+                stack->vars.data[source_offset + i];
+        }
+
+        stack->exec.count -= 1;
+        if (stack->exec.count == base_depth) return;
+
+        LOAD_FRAME();
+        DISPATCH();
+      }
+    HANDLER(OP_TAIL_CALL):
+      {
+        int64 proc_index = READ_ARG1().val64;
+        if (ARG1_TYPE(ip) != REF_CONSTANT) {
+            check_procedure_index(&procedures, proc_index);
+        }
+        int64 locals_offset = ip->arg2;
+        int64 arg_count = ip->output;
+        struct bytecode *code = &procedures.data[proc_index].code;
+
+        /* Move the arguments down to where this frame's arguments were. The
+           results still go wherever this frame's results were going. */
+        for (int i = 0; i < arg_count; i++) {
+            locals[i] = locals[locals_offset + i];
         }
-        case OP_RET:
-        {
-            /* Unbind all variables that aren't being returned. */
-            int source_offset = frame->locals_start + arg1;
-            int dest_offset = frame->results_start;
-            /* Move results up the stack, to where the inputs were. */
-            for (int i = 0; i < arg2; i++) {
-                stack->vars.data[dest_offset + i] =
-                    stack->vars.data[source_offset + i];
-            }
 
+#ifdef MODLANG_JIT
+        jit_function *native =
+            jit_lookup(&procedures.data[proc_index]);
+        if (native) {
+            /* Native code can't take over an interpreter frame, so run it,
+               and then return from this frame as if it had returned. */
+            native(stack, &procedures, locals_start, frame->results_start);
             stack->exec.count -= 1;
+            if (stack->exec.count == base_depth) return;
 
-            break;
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_ARRAY_ALLOC:
-            result.shared_buff = shared_buff_alloc((struct type *)arg1_full.pointer, arg2);
-            break;
-        case OP_ARRAY_OFFSET:
-            result.pointer = shared_buff_get_index(arg1_full.shared_buff, arg2);
-            break;
-        case OP_ARRAY_OFFSET_MAKE_UNIQUE:
-          {
-            /* Make the variable on the stack unique. */
-            shared_buff_make_unique(&arg1_full.shared_buff);
-            write_ref(frame, &stack->vars, next->arg1, arg1_full);
-
-            /* Then do the offset operation to the unique version. */
-            result.pointer = shared_buff_get_index(arg1_full.shared_buff, arg2);
-            break;
-          }
-        case OP_ARRAY_STORE:
-          {
-            /* TODO: check that the 'output' array is a shared_buff. */
-            union variable_contents output =
-                read_ref(frame->locals_start, &stack->vars, output_ref);
-            /* TODO: check that the memory accessed is actually an initialised
-               and aligned part of the buffer. */
-            uint8 *data = shared_buff_get_index(output.shared_buff, arg1);
-            struct type *element_type = output.shared_buff.ptr->element_type;
-            copy_scalar(
-                data,
-                arg2_full.bytes,
-                next->flags,
-                next->arg2.type == REF_TEMPORARY
-            );
-            /* Stop the array variable from being overwritten. */
-            output_ref.type = REF_NULL;
-            break;
-          }
-        case OP_ARRAY_INDEX:
-          {
-            /* TODO: check that the memory accessed is actually an initialised
-               and aligned part of the buffer. */
-            uint8 *data = shared_buff_get_index(arg1_full.shared_buff, arg2);
-            struct type *element_type = arg1_full.shared_buff.ptr->element_type;
-            if (element_type->total_size > 16) {
-                fprintf(stderr, "Error: Tried to read a scalar from an array of structs.\n");
-                exit(EXIT_FAILURE);
-            }
-            copy_scalar(result.bytes, data, next->flags, false);
-            if (next->output.type == next->arg1.type && next->output.x == next->arg1.x) {
-                /* If we are overwriting the array, then decrement it first. */
-                shared_buff_decrement(arg1_full.shared_buff.ptr);
-            }
-            break;
-          }
-        case OP_ARRAY_CONCAT:
-          {
-            /* TODO: check that the two arrays have the same type? Is this
-               guaranteed? */
-            struct type *element_type = arg1_full.shared_buff.ptr->element_type;
-
-            int arg1_count = arg1_full.shared_buff.count;
-            int arg2_count = arg2_full.shared_buff.count;
-            int result_count = arg1_count + arg2_count;
-            result.shared_buff = shared_buff_alloc(element_type, result_count);
-
-            /* TODO: do these need to be checked? Or can we get more lean?
-               Inlining may resolve this anyway. */
-            uint8 *source_1 = shared_buff_get_index(arg1_full.shared_buff, 0);
-            uint8 *dest_1 = shared_buff_get_index(result.shared_buff, 0);
-            copy_vals(element_type, dest_1, source_1, arg1_count);
-
-            uint8 *source_2 = shared_buff_get_index(arg2_full.shared_buff, 0);
-            uint8 *dest_2 = shared_buff_get_index(result.shared_buff, arg1_count);
-            copy_vals(element_type, dest_2, source_2, arg2_count);
-
-            if (next->arg1.type == REF_TEMPORARY) {
-                shared_buff_decrement(arg1_full.shared_buff.ptr);
-            }
-            if (next->arg2.type == REF_TEMPORARY) {
-                shared_buff_decrement(arg2_full.shared_buff.ptr);
-            }
+#endif
 
-            break;
-          }
-        case OP_DECREMENT_REFCOUNT:
-            shared_buff_decrement(arg1_full.shared_buff.ptr);
-            break;
-        case OP_STACK_ALLOC:
-            result.pointer = stack_alloc(&stack->data, arg1);
-            break;
-        case OP_STACK_FREE:
-            stack_free(&stack->data, arg1_full.pointer);
-            break;
-        case OP_POINTER_OFFSET:
-            result.pointer = arg1_full.pointer + arg2;
-            break;
-        case OP_POINTER_STORE:
-          {
-            /* TODO: check that the 'output' array is a shared_buff. */
-            union variable_contents output =
-                read_ref(frame->locals_start, &stack->vars, output_ref);
-            /* TODO: check that the memory accessed is actually an initialised
-               and aligned part of the buffer. */
-            void *data = output.pointer + arg1;
-            copy_scalar(
-                data,
-                arg2_full.bytes,
-                next->flags,
-                next->arg2.type == REF_TEMPORARY
-            );
-            /* Stop the struct variable from being overwritten. */
-            output_ref.type = REF_NULL;
-            break;
-          }
-        case OP_POINTER_COPY:
-          {
-            union variable_contents output =
-                read_ref(frame->locals_start, &stack->vars, output_ref);
-            memcpy(output.pointer, arg1_full.pointer, arg2);
-            /* Stop the struct variable from being overwritten. */
-            output_ref.type = REF_NULL;
-            break;
-          }
-        case OP_POINTER_DUP:
-          {
-            result.pointer = stack_alloc(&stack->data, arg2);
-            memcpy(result.pointer, arg1_full.pointer, arg2);
-            break;
-          }
-        case OP_POINTER_COPY_OVERLAPPING:
-          {
-            union variable_contents output =
-                read_ref(frame->locals_start, &stack->vars, output_ref);
-            memmove(output.pointer, arg1_full.pointer, arg2);
-            /* Stop the struct variable from being overwritten. */
-            output_ref.type = REF_NULL;
-            break;
-          }
-        case OP_POINTER_LOAD:
-          {
-            void *data = arg1_full.pointer + arg2;
-            copy_scalar(result.bytes, data, next->flags, false);
-            break;
-          }
-        case OP_POINTER_LOAD_MAKE_UNIQUE:
-          {
-            /* Get the pointer to the array. */
-            void *addr = arg1_full.pointer + arg2;
-            struct shared_buff *data = addr;
-
-            /* Make it unique. */
-            shared_buff_make_unique(data);
-
-            /* Now put it somewhere. */
-            /* We don't increment it, because this opcode is only for
-               temporaries on the LHS. We could introduce a runtime construct,
-               and possibly even a frontend type, representing a mutable array
-               view, but for now we just use an array that secretly hasn't had
-               its refcount increased. */
-            result.shared_buff = *data;
-            break;
-          }
-        case OP_POINTER_INCREMENT_REFCOUNT:
-          {
-              void *data = arg1_full.pointer + arg2;
-              struct shared_buff *buff = (struct shared_buff*)data;
-              if (buff->ptr) {
-                  buff->ptr->references += 1;
-              }
-              if (debug) {
-                  print_ref_count(buff->ptr);
-                  printf("count is %d\n", buff->count);
-              }
-              break;
-          }
-        case OP_POINTER_DECREMENT_REFCOUNT:
-          {
-              void *data = arg1_full.pointer + arg2;
-              struct shared_buff *buff = (struct shared_buff*)data;
-              shared_buff_decrement(buff->ptr);
-              break;
-          }
-        case OP_ASSERT:
-          {
-              if (arg1 == 0) {
-                  fprintf(stderr, "Error: Assertion failed.\n");
-                  exit(EXIT_FAILURE);
-              }
-              break;
-          }
-        default:
-            fprintf(stderr, "Error: Tried to execute unknown opcode %d.\n",
-                next->op);
-            exit(EXIT_FAILURE);
-        }
-
-        write_ref(frame, &stack->vars, output_ref, result);
-
-        if (next->output.type == REF_GLOBAL
-            && next->output.x >= stack->vars.global_count)
-        {
-            stack->vars.global_count = next->output.x + 1;
-        }
-
-        /* We may have just returned, in which case this change is allowed, but
-           discarded. We also may have just called into something, in which
-           case this change is allowed, and necessary, in order to return to
-           one past the call site. */
-        frame->current += 1;
+        frame->start = code->instructions.data;
+        frame->count = code->instructions.count;
+        frame->current = 0;
+        frame->constants = code->constants.data;
+        /* The callee might need a bigger frame than the caller did. */
+        call_stack_reserve_frame(stack, locals_start, code);
+
+        LOAD_FRAME();
+        DISPATCH();
+      }
+    HANDLER(OP_ARRAY_ALLOC):
+      {
+        union variable_contents result;
+        struct type_glue *glue =
+            type_glue_of((struct type *)READ_ARG1().pointer);
+        if (ip->flags & OP_STACK_ARRAY) {
+            result.shared_buff = shared_buff_alloc_stack(
+                &stack->data, glue, READ_ARG2().val64);
+        } else {
+            result.shared_buff = shared_buff_alloc(glue, READ_ARG2().val64);
+        }
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_ARRAY_OFFSET):
+        ARRAY_OFFSET_BODY();
+        NEXT();
+    HANDLER(OP_ARRAY_OFFSET_MAKE_UNIQUE):
+      {
+        /* Make the variable on the stack unique, at least as far as the
+           element goes, and then offset into the unique version. */
+        union variable_contents arg1 = READ_ARG1();
+        union variable_contents result;
+        result.pointer = shared_buff_get_index_unique(
+            &arg1.shared_buff,
+            READ_ARG2().val64
+        );
+        WRITE_ARG1(arg1);
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_ARRAY_STORE):
+      {
+        /* TODO: check that the 'output' array is a shared_buff. */
+        union variable_contents output = READ_OUTPUT();
+        union variable_contents arg2 = READ_ARG2();
+        /* TODO: check that the memory accessed is actually an initialised
+           and aligned part of the buffer. */
+        uint8 *data = shared_buff_get_index(
+            &output.shared_buff,
+            READ_ARG1().val64
+        );
+        copy_scalar(
+            data,
+            arg2.bytes,
+            ip->flags,
+            ARG2_TYPE(ip) == REF_TEMPORARY
+        );
+        /* The array variable itself is left as is, unless the elements are
+           stored in it. */
+        if (shared_buff_is_inline(&output.shared_buff)) WRITE_OUTPUT(output);
+        NEXT();
+      }
+    HANDLER(OP_ARRAY_INDEX):
+      {
+        union variable_contents arg1 = READ_ARG1();
+        /* TODO: check that the memory accessed is actually an initialised
+           and aligned part of the buffer. */
+        uint8 *data = shared_buff_get_index(
+            &arg1.shared_buff,
+            READ_ARG2().val64
+        );
+        if (shared_buff_element_glue(&arg1.shared_buff)->size > 16) {
+            fprintf(errout, "Error: Tried to read a scalar from an array of structs.\n");
+            error_exit();
+        }
+        union variable_contents result = {0};
+        copy_scalar(result.bytes, data, ip->flags, false);
+        if (OUTPUT_TYPE(ip) == ARG1_TYPE(ip) && ip->output == ip->arg1) {
+            /* If we are overwriting the array, then decrement it first. */
+            shared_buff_decrement(arg1.shared_buff);
+        }
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_ARRAY_CONCAT):
+      {
+        union variable_contents arg1 = READ_ARG1();
+        union variable_contents arg2 = READ_ARG2();
+        /* TODO: check that the two arrays have the same type? Is this
+           guaranteed? */
+        bool consume_arg1 =
+            ARG1_TYPE(ip) == REF_TEMPORARY || (ip->flags & OP_MOVE_ARG1);
+        union variable_contents result;
+        result.shared_buff = shared_buff_concat(
+            &arg1.shared_buff, &arg2.shared_buff, consume_arg1);
+
+        if (ARG2_TYPE(ip) == REF_TEMPORARY) {
+            shared_buff_decrement(arg2.shared_buff);
+        }
+
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_ARRAY_SLICE_END):
+      {
+        union variable_contents result = READ_ARG1();
+        shared_buff_slice_end(&result.shared_buff, READ_ARG2().val64);
+        if (ARG1_TYPE(ip) != REF_TEMPORARY) {
+            shared_buff_increment(&result.shared_buff);
+        }
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_ARRAY_SLICE_START):
+      {
+        union variable_contents result = READ_ARG1();
+        shared_buff_slice_start(&result.shared_buff, READ_ARG2().val64);
+        if (ARG1_TYPE(ip) != REF_TEMPORARY) {
+            shared_buff_increment(&result.shared_buff);
+        }
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_DECREMENT_REFCOUNT):
+        shared_buff_decrement(READ_ARG1().shared_buff);
+        NEXT();
+    HANDLER(OP_STACK_ALLOC):
+        STACK_ALLOC_BODY();
+        NEXT();
+    FUSION_TARGET(OP_STACK_FREE):
+        stack_free(&stack->data, READ_ARG1().pointer);
+        NEXT();
+    HANDLER(OP_POINTER_OFFSET):
+        POINTER_OFFSET_BODY();
+        NEXT();
+    FUSION_TARGET(OP_POINTER_STORE):
+        POINTER_STORE_BODY();
+        NEXT();
+    FUSION_TARGET(OP_POINTER_COPY):
+        POINTER_COPY_BODY();
+        NEXT();
+    HANDLER(OP_POINTER_DUP):
+      {
+        int64 size = READ_ARG2().val64;
+        union variable_contents result;
+        result.pointer = stack_alloc(&stack->data, size);
+        memcpy(result.pointer, READ_ARG1().pointer, size);
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_POINTER_COPY_OVERLAPPING):
+      {
+        union variable_contents output = READ_OUTPUT();
+        memmove(output.pointer, READ_ARG1().pointer, READ_ARG2().val64);
+        /* The struct variable itself is left as is. */
+        NEXT();
+      }
+    FUSION_TARGET(OP_POINTER_LOAD):
+      {
+        void *data = READ_ARG1().pointer + READ_ARG2().val64;
+        union variable_contents result = {0};
+        copy_scalar(result.bytes, data, ip->flags, false);
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_POINTER_LOAD_MAKE_UNIQUE):
+      {
+        /* Get the pointer to the array. */
+        void *addr = READ_ARG1().pointer + READ_ARG2().val64;
+        struct shared_buff *data = addr;
+
+        /* Make it unique. */
+        shared_buff_make_unique(data);
+
+        /* Now put it somewhere. */
+        /* We don't increment it, because this opcode is only for
+           temporaries on the LHS. We could introduce a runtime construct,
+           and possibly even a frontend type, representing a mutable array
+           view, but for now we just use an array that secretly hasn't had
+           its refcount increased. */
+        union variable_contents result;
+        result.shared_buff = *data;
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_POINTER_INCREMENT_REFCOUNT):
+      {
+        void *data = READ_ARG1().pointer + READ_ARG2().val64;
+        shared_buff_increment((struct shared_buff*)data);
+        NEXT();
+      }
+    HANDLER(OP_POINTER_DECREMENT_REFCOUNT):
+      {
+        void *data = READ_ARG1().pointer + READ_ARG2().val64;
+        struct shared_buff *buff = (struct shared_buff*)data;
+        shared_buff_decrement(*buff);
+        NEXT();
+      }
+    HANDLER(OP_ASSERT):
+        ASSERT_BODY();
+        NEXT();
+    HANDLER(OP_MEMORY_STATS):
+        memory_stats_snapshot(
+            (struct memory_stats_record *)READ_ARG1().pointer,
+            &stack->data
+        );
+        NEXT();
+    HANDLER(OP_PAR_MAP):
+      {
+        struct shared_buff input = READ_ARG1().shared_buff;
+        int64 proc_index = READ_ARG2().val64;
+        if (ARG2_TYPE(ip) != REF_CONSTANT) {
+            check_procedure_index(&procedures, proc_index);
+        }
+#ifdef MODLANG_JIT
+        /* The other threads can only use native code that already exists. */
+        jit_lookup(&procedures.data[proc_index]);
+#endif
+        /* The calls run on top of this frame, and can move both stacks. */
+        frame->current = ip - frame->start;
+        union variable_contents result = {0};
+        result.shared_buff = par_map(stack, interpreter_par_call,
+            &procedures, proc_index, &input);
+        LOAD_FRAME();
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    HANDLER(OP_PAR_REDUCE):
+      {
+        int64 initial = READ_OUTPUT().val64;
+        struct shared_buff input = READ_ARG1().shared_buff;
+        int64 proc_index = READ_ARG2().val64;
+        if (ARG2_TYPE(ip) != REF_CONSTANT) {
+            check_procedure_index(&procedures, proc_index);
+        }
+#ifdef MODLANG_JIT
+        jit_lookup(&procedures.data[proc_index]);
+#endif
+        frame->current = ip - frame->start;
+        union variable_contents result = {0};
+        result.val64 = par_reduce(stack, interpreter_par_call,
+            &procedures, proc_index, &input, initial);
+        LOAD_FRAME();
+        WRITE_OUTPUT(result);
+        NEXT();
+      }
+    QUICKENED_BINARY_OPS(QUICKENED_HANDLER_OP)
+    QUICKENED_MOVS(QUICKENED_MOV_HANDLER)
+    FUSED_PAIRS(FUSED_PAIR_HANDLER)
+    FUSED_TRIPLES(FUSED_TRIPLE_HANDLER)
+    default:
+        UNREACHABLE();
+    }
+
+#undef FUSED_TRIPLE_HANDLER
+#undef FUSED_PAIR_HANDLER
+#undef ASSERT_BODY
+#undef POINTER_COPY_BODY
+#undef POINTER_STORE_BODY
+#undef POINTER_OFFSET_BODY
+#undef ARRAY_OFFSET_BODY
+#undef STACK_ALLOC_BODY
+#undef FUSION_TARGET
+#undef QUICKENED_MOV_HANDLER
+#undef QUICKENED_HANDLER_OP
+#undef QUICKENED_HANDLER
+#undef BINARY_HANDLER
+#undef NEXT
+#undef PROFILE_DISPATCH
+#undef DISPATCH
+#undef HANDLER
+#undef STORE_LOCAL
+#undef OPERAND_C
+#undef OPERAND_G
+#undef OPERAND_L
+#undef WRITE
+#undef WRITE_ARG1
+#undef WRITE_OUTPUT
+#undef READ_ARG2
+#undef READ_ARG1
+#undef READ_OUTPUT
+#undef READ
+#undef LOAD_FRAME
+}
+
+/* Run a procedure on top of whatever is on the stack already, with its
+   arguments and results in the variables above. */
+void interpreter_call(
+    struct call_stack *stack,
+    struct procedure_buffer *procedures,
+    int64 proc_index,
+    union variable_contents *args,
+    int arg_count,
+    union variable_contents *results,
+    int result_count
+) {
+    struct procedure *p = &procedures->data[proc_index];
+    size_t locals_start = stack->vars.count;
+    int slot_count = arg_count + 1;
+    if (slot_count < result_count) slot_count = result_count;
+    buffer_setcount(stack->vars, locals_start + slot_count);
+    call_stack_reserve_frame(stack, locals_start, &p->code);
+    for (int i = 0; i < arg_count; i++) {
+        stack->vars.data[locals_start + i].value = args[i];
+    }
+
+#ifdef MODLANG_JIT
+    jit_function *native = jit_lookup(p);
+    if (native) {
+        native(stack, procedures, locals_start, locals_start);
+    } else
+#endif
+    {
+        call_stack_push_exec_frame(stack, &p->code);
+        struct execution_frame *frame = buffer_top(stack->exec);
+        frame->locals_start = locals_start;
+        frame->results_start = locals_start;
+        continue_execution(*procedures, stack);
     }
+
+    for (int i = 0; i < result_count; i++) {
+        results[i] = stack->vars.data[locals_start + i].value;
+    }
+    buffer_setcount(stack->vars, locals_start);
+}
+
+/* Run a procedure for par_map or par_reduce, which is on top of nothing on
+   the pool's threads. */
+void interpreter_par_call(
+    struct call_stack *stack,
+    void *context,
+    int64 proc_index,
+    union variable_contents *args,
+    int arg_count,
+    union variable_contents *result
+) {
+    interpreter_call(stack, context, proc_index, args, arg_count, result, 1);
 }
 
 void execute_top_level_code(
     struct procedure_buffer procedures,
     struct call_stack *stack,
-    struct instruction_buffer *statement_code
+    struct bytecode *statement_code
 ) {
     if (stack->exec.count != 0) {
-        fprintf(stderr, "Error: Tried to execute top-level-code while another "
+        fprintf(errout, "Error: Tried to execute top-level-code while another "
             "function call was already in process?\n");
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 
     call_stack_push_exec_frame(stack, statement_code);
@@ -753,4 +3253,55 @@ void execute_top_level_code(
     continue_execution(procedures, stack);
 }
 
+/************/
+/* Printing */
+/************/
+
+void print_data(uint8 *it, struct type *type) {
+    if (type->connective == TYPE_ARRAY) {
+        struct shared_buff *buff = (struct shared_buff*)it;
+        struct type *element_type = type->inner;
+        printf("[");
+        for (int i = 0; i < buff->count; i++) {
+            if (i > 0) printf(", ");
+
+            print_data(shared_buff_get_index(buff, i), element_type);
+        }
+        printf("]");
+    } else if (type->connective == TYPE_INT) {
+        int64 *as_int = (int64*)it;
+        printf("%lld", (long long)*as_int);
+    } else if (type->connective == TYPE_TUPLE) {
+        printf("{");
+        for (int i = 0; i < type->elements.count; i++) {
+            if (i > 0) printf(", ");
+            struct type *elem_ty = &type->elements.data[i];
+            print_data(it, elem_ty);
+            it += elem_ty->total_size;
+        }
+        printf("}");
+    } else if (type->connective == TYPE_RECORD) {
+        printf("{");
+        for (int i = 0; i < type->fields.count; i++) {
+            if (i > 0) printf(", ");
+            struct field *field = &type->fields.data[i];
+            fputstr(field->name, stdout);
+            printf(": ");
+            print_data(it, &field->type);
+            it += field->type.total_size;
+        }
+        printf("}");
+    } else {
+        printf("?");
+    }
+}
+
+void print_call_stack_value(union variable_contents it, struct type *type) {
+    if (type->connective == TYPE_TUPLE || type->connective == TYPE_RECORD) {
+        print_data(it.pointer, type);
+    } else {
+        print_data(it.bytes, type);
+    }
+}
+
 #endif
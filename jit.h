@@ -0,0 +1,733 @@
+#ifndef MODLANG_JIT_H
+#define MODLANG_JIT_H
+
+#include "types.h"
+#include "bytecode.h"
+#include "interpreter.h"
+
+#ifdef MODLANG_JIT
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+/* A baseline compiler from packed bytecode to x86-64 machine code. Each
+   instruction is translated on its own, with no register allocation; locals
+   stay in the variable stack, and are loaded and stored around every
+   operation. 64 bit integer operations, moves, calls, tail calls, returns and
+   assertions are emitted inline. Anything else is handed back to the
+   interpreter, one instruction at a time, so that every procedure can be
+   compiled without duplicating the more complicated handlers here. */
+
+/* While native code runs, these registers are reserved. They are all callee
+   saved, so they survive calls out to helpers. The results_start of the
+   frame is kept at [rsp]. */
+enum jit_register {
+    JIT_RAX,
+    JIT_RCX,
+    JIT_RDX,
+    JIT_RBX,
+    JIT_RSP,
+    JIT_RBP,
+    JIT_RSI,
+    JIT_RDI,
+    JIT_R8,
+    JIT_R9,
+    JIT_R10,
+    JIT_R11,
+    JIT_R12,
+    JIT_R13,
+    JIT_R14,
+    JIT_R15,
+};
+
+#define JIT_LOCALS JIT_RBX
+#define JIT_GLOBALS JIT_R12
+#define JIT_STACK JIT_R13
+#define JIT_PROCEDURES JIT_R14
+#define JIT_LOCALS_START JIT_R15
+
+/* Condition codes for setcc. */
+enum jit_condition {
+    JIT_CC_E = 0x4,
+    JIT_CC_NE = 0x5,
+    JIT_CC_L = 0xC,
+    JIT_CC_GE = 0xD,
+    JIT_CC_LE = 0xE,
+    JIT_CC_G = 0xF,
+};
+
+struct jit_buffer {
+    uint8 *data;
+    size_t count;
+    size_t capacity;
+};
+
+/***********/
+/* Helpers */
+/***********/
+
+/* These get called from native code. */
+
+struct variable_data *jit_helper_reserve(
+    struct call_stack *stack,
+    size_t count
+) {
+    if (stack->vars.count < count) buffer_setcount(stack->vars, count);
+    return stack->vars.data;
+}
+
+void jit_helper_call(
+    struct call_stack *stack,
+    struct procedure_buffer *procedures,
+    int64 proc_index,
+    size_t locals_start,
+    size_t results_start
+) {
+    /* Native code doesn't know whether the target was a constant. */
+    check_procedure_index(procedures, proc_index);
+    struct procedure *p = &procedures->data[proc_index];
+    jit_function *native = jit_lookup(p);
+    if (native) {
+        native(stack, procedures, locals_start, results_start);
+        return;
+    }
+
+    call_stack_push_exec_frame(stack, &p->code);
+    struct execution_frame *frame = buffer_top(stack->exec);
+    frame->locals_start = locals_start;
+    frame->results_start = results_start;
+    call_stack_reserve_frame(stack, locals_start, &p->code);
+    continue_execution(*procedures, stack);
+}
+
+/* Run a single instruction in the interpreter. The instruction is followed by
+   an OP_RET, see jit_compile_procedure. */
+void jit_helper_interpret(
+    struct call_stack *stack,
+    struct procedure_buffer *procedures,
+    size_t locals_start,
+    struct packed_instruction *snippet,
+    int64 *constants
+) {
+    struct execution_frame *frame = buffer_addn(stack->exec, 1);
+    frame->start = snippet;
+    frame->count = 2;
+    frame->current = 0;
+    frame->constants = constants;
+    frame->locals_start = locals_start;
+    frame->results_start = locals_start;
+    continue_execution(*procedures, stack);
+}
+
+void jit_helper_assert_failed(void) {
+    fprintf(errout, "Error: Assertion failed.\n");
+    error_exit();
+}
+
+/************/
+/* Encoding */
+/************/
+
+void jit_emit_byte(struct jit_buffer *out, uint8 byte) {
+    buffer_push(*out, byte);
+}
+
+void jit_emit_int32(struct jit_buffer *out, int32 x) {
+    uint8 *bytes = buffer_addn(*out, 4);
+    memcpy(bytes, &x, 4);
+}
+
+void jit_emit_int64(struct jit_buffer *out, int64 x) {
+    uint8 *bytes = buffer_addn(*out, 8);
+    memcpy(bytes, &x, 8);
+}
+
+/* REX.W prefix, extending the reg and rm fields of the ModRM byte. */
+void jit_emit_rex(struct jit_buffer *out, int reg, int rm) {
+    jit_emit_byte(out, 0x48 | (reg >= 8) << 2 | (rm >= 8));
+}
+
+void jit_emit_modrm_reg(struct jit_buffer *out, int reg, int rm) {
+    jit_emit_byte(out, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* [base + disp32] */
+void jit_emit_modrm_mem(struct jit_buffer *out, int reg, int base, int32 disp) {
+    jit_emit_byte(out, 0x80 | (reg & 7) << 3 | (base & 7));
+    /* rsp and r12 can only be used as a base through a SIB byte. */
+    if ((base & 7) == JIT_RSP) jit_emit_byte(out, 0x24);
+    jit_emit_int32(out, disp);
+}
+
+/* mov reg, [base + disp] */
+void jit_emit_load(struct jit_buffer *out, int reg, int base, int32 disp) {
+    jit_emit_rex(out, reg, base);
+    jit_emit_byte(out, 0x8B);
+    jit_emit_modrm_mem(out, reg, base, disp);
+}
+
+/* mov [base + disp], reg */
+void jit_emit_store(struct jit_buffer *out, int base, int32 disp, int reg) {
+    jit_emit_rex(out, reg, base);
+    jit_emit_byte(out, 0x89);
+    jit_emit_modrm_mem(out, reg, base, disp);
+}
+
+/* mov qword [base + disp], imm */
+void jit_emit_store_imm(struct jit_buffer *out, int base, int32 disp, int32 imm) {
+    jit_emit_rex(out, 0, base);
+    jit_emit_byte(out, 0xC7);
+    jit_emit_modrm_mem(out, 0, base, disp);
+    jit_emit_int32(out, imm);
+}
+
+/* mov dest, src */
+void jit_emit_mov(struct jit_buffer *out, int dest, int src) {
+    jit_emit_rex(out, src, dest);
+    jit_emit_byte(out, 0x89);
+    jit_emit_modrm_reg(out, src, dest);
+}
+
+/* mov dest, imm */
+void jit_emit_mov_imm(struct jit_buffer *out, int dest, int64 imm) {
+    if (imm >= INT32_MIN && imm <= INT32_MAX) {
+        jit_emit_rex(out, 0, dest);
+        jit_emit_byte(out, 0xC7);
+        jit_emit_modrm_reg(out, 0, dest);
+        jit_emit_int32(out, (int32)imm);
+    } else {
+        jit_emit_rex(out, 0, dest);
+        jit_emit_byte(out, 0xB8 | (dest & 7));
+        jit_emit_int64(out, imm);
+    }
+}
+
+/* add/sub/and/or/xor/cmp/test dest, src, given the opcode of the r/m, reg
+   form. */
+void jit_emit_alu(struct jit_buffer *out, uint8 opcode, int dest, int src) {
+    jit_emit_rex(out, src, dest);
+    jit_emit_byte(out, opcode);
+    jit_emit_modrm_reg(out, src, dest);
+}
+
+#define JIT_ADD 0x01
+#define JIT_OR 0x09
+#define JIT_AND 0x21
+#define JIT_SUB 0x29
+#define JIT_XOR 0x31
+#define JIT_CMP 0x39
+#define JIT_TEST 0x85
+
+/* Group 1 operations with an immediate, e.g. add reg, imm. */
+void jit_emit_alu_imm(struct jit_buffer *out, int ext, int dest, int32 imm) {
+    jit_emit_rex(out, 0, dest);
+    jit_emit_byte(out, 0x81);
+    jit_emit_modrm_reg(out, ext, dest);
+    jit_emit_int32(out, imm);
+}
+
+#define JIT_ADD_IMM 0
+#define JIT_SUB_IMM 5
+
+/* shl reg, imm */
+void jit_emit_shl_imm(struct jit_buffer *out, int reg, uint8 imm) {
+    jit_emit_rex(out, 0, reg);
+    jit_emit_byte(out, 0xC1);
+    jit_emit_modrm_reg(out, 4, reg);
+    jit_emit_byte(out, imm);
+}
+
+/* setcc al, then zero extend into rax. */
+void jit_emit_setcc(struct jit_buffer *out, enum jit_condition cc) {
+    jit_emit_byte(out, 0x0F);
+    jit_emit_byte(out, 0x90 | cc);
+    jit_emit_byte(out, 0xC0);
+    jit_emit_byte(out, 0x0F);
+    jit_emit_byte(out, 0xB6);
+    jit_emit_byte(out, 0xC0);
+}
+
+void jit_emit_push(struct jit_buffer *out, int reg) {
+    if (reg >= 8) jit_emit_byte(out, 0x41);
+    jit_emit_byte(out, 0x50 | (reg & 7));
+}
+
+void jit_emit_pop(struct jit_buffer *out, int reg) {
+    if (reg >= 8) jit_emit_byte(out, 0x41);
+    jit_emit_byte(out, 0x58 | (reg & 7));
+}
+
+/* mov rax, imm64; call rax. Always JIT_CALL_LENGTH bytes, so that it can be
+   jumped over. */
+#define JIT_CALL_LENGTH 12
+void jit_emit_call(struct jit_buffer *out, void *function) {
+    jit_emit_rex(out, 0, JIT_RAX);
+    jit_emit_byte(out, 0xB8);
+    jit_emit_int64(out, (int64)function);
+    jit_emit_byte(out, 0xFF);
+    jit_emit_byte(out, 0xD0);
+}
+
+/* mov rax, imm64; jmp rax */
+void jit_emit_jump(struct jit_buffer *out, void *function) {
+    jit_emit_rex(out, 0, JIT_RAX);
+    jit_emit_byte(out, 0xB8);
+    jit_emit_int64(out, (int64)function);
+    jit_emit_byte(out, 0xFF);
+    jit_emit_byte(out, 0xE0);
+}
+
+/*******************/
+/* Code Generation */
+/*******************/
+
+int32 jit_variable_offset(int32 x) {
+    return x * (int32)sizeof(struct variable_data);
+}
+
+void jit_load_operand(
+    struct jit_buffer *out,
+    int reg,
+    struct bytecode *code,
+    enum ref_type type,
+    int32 x
+) {
+    switch (type) {
+    case REF_LOCAL:
+    case REF_TEMPORARY:
+        jit_emit_load(out, reg, JIT_LOCALS, jit_variable_offset(x));
+        break;
+    case REF_GLOBAL:
+        jit_emit_load(out, reg, JIT_GLOBALS, jit_variable_offset(x));
+        break;
+    case REF_CONSTANT:
+        jit_emit_mov_imm(out, reg, x);
+        break;
+    case REF_WIDE_CONSTANT:
+    case REF_STATIC_POINTER:
+        jit_emit_mov_imm(out, reg, code->constants.data[x]);
+        break;
+    default:
+        jit_emit_mov_imm(out, reg, 0);
+        break;
+    }
+}
+
+/* Store rax into a local, clearing the rest of the variable the way the
+   interpreter does. */
+void jit_store_local(struct jit_buffer *out, int32 x) {
+    int32 offset = jit_variable_offset(x);
+    jit_emit_store(out, JIT_LOCALS, offset, JIT_RAX);
+    jit_emit_store_imm(out, JIT_LOCALS, offset + 8, 0);
+}
+
+/* The reverse of jit_compile_procedure's prologue, leaving rsp pointing at
+   the return address. */
+void jit_emit_epilogue(struct jit_buffer *out) {
+    jit_emit_alu_imm(out, JIT_ADD_IMM, JIT_RSP, 8);
+    jit_emit_pop(out, JIT_R15);
+    jit_emit_pop(out, JIT_R14);
+    jit_emit_pop(out, JIT_R13);
+    jit_emit_pop(out, JIT_R12);
+    jit_emit_pop(out, JIT_RBX);
+    jit_emit_pop(out, JIT_RBP);
+}
+
+/* Move count variables down the frame, from source to dest. */
+void jit_emit_move_variables(
+    struct jit_buffer *out,
+    int base,
+    int32 dest,
+    int32 source,
+    int32 count
+) {
+    for (int32 i = 0; i < count; i++) {
+        int32 from = jit_variable_offset(source + i);
+        int32 to = jit_variable_offset(dest + i);
+        jit_emit_load(out, JIT_RAX, JIT_LOCALS, from);
+        jit_emit_store(out, base, to, JIT_RAX);
+        jit_emit_load(out, JIT_RAX, JIT_LOCALS, from + 8);
+        jit_emit_store(out, base, to + 8, JIT_RAX);
+    }
+}
+
+/* Anything that calls out might grow the variable stack. */
+void jit_reload_bases(struct jit_buffer *out) {
+    jit_emit_load(out, JIT_GLOBALS, JIT_STACK,
+        offsetof(struct call_stack, vars.data));
+    jit_emit_mov(out, JIT_LOCALS, JIT_LOCALS_START);
+    jit_emit_shl_imm(out, JIT_LOCALS, 4);
+    jit_emit_alu(out, JIT_ADD, JIT_LOCALS, JIT_GLOBALS);
+}
+
+bool jit_is_inline_binary_op(enum operation op) {
+    switch (op) {
+    case OP_LOR:
+    case OP_LAND:
+    case OP_EQ:
+    case OP_NEQ:
+    case OP_LEQ:
+    case OP_GEQ:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_BOR:
+    case OP_BAND:
+    case OP_BXOR:
+    case OP_PLUS:
+    case OP_MINUS:
+    case OP_LSHIFT:
+    case OP_RSHIFT:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Whether an instruction gets native code, rather than going back to the
+   interpreter. */
+bool jit_is_inline(enum operation op, struct packed_instruction *instr) {
+    switch (op) {
+    case OP_NULL:
+    case OP_CALL:
+    case OP_RET:
+    case OP_TAIL_CALL:
+    case OP_ASSERT:
+        return true;
+    case OP_MOV:
+        break;
+    default:
+        if (!jit_is_inline_binary_op(op)) return false;
+        break;
+    }
+    if (instr->flags != OP_64BIT) return false;
+    enum ref_type output_type = OUTPUT_TYPE(instr);
+    return output_type == REF_LOCAL || output_type == REF_TEMPORARY;
+}
+
+/* Compute rax = rax op rcx. */
+void jit_emit_binary_op(struct jit_buffer *out, enum operation op) {
+    switch (op) {
+    case OP_LOR:
+        jit_emit_alu(out, JIT_OR, JIT_RAX, JIT_RCX);
+        jit_emit_setcc(out, JIT_CC_NE);
+        break;
+    case OP_LAND:
+        /* test rax, rax; setne dl; movzx edx, dl; then the same for rcx
+           into rax, and combine them. */
+        jit_emit_alu(out, JIT_TEST, JIT_RAX, JIT_RAX);
+        jit_emit_byte(out, 0x0F);
+        jit_emit_byte(out, 0x95);
+        jit_emit_byte(out, 0xC2);
+        jit_emit_byte(out, 0x0F);
+        jit_emit_byte(out, 0xB6);
+        jit_emit_byte(out, 0xD2);
+        jit_emit_alu(out, JIT_TEST, JIT_RCX, JIT_RCX);
+        jit_emit_setcc(out, JIT_CC_NE);
+        jit_emit_alu(out, JIT_AND, JIT_RAX, JIT_RDX);
+        break;
+    case OP_EQ:
+        jit_emit_alu(out, JIT_CMP, JIT_RAX, JIT_RCX);
+        jit_emit_setcc(out, JIT_CC_E);
+        break;
+    case OP_NEQ:
+        jit_emit_alu(out, JIT_CMP, JIT_RAX, JIT_RCX);
+        jit_emit_setcc(out, JIT_CC_NE);
+        break;
+    case OP_LEQ:
+        jit_emit_alu(out, JIT_CMP, JIT_RAX, JIT_RCX);
+        jit_emit_setcc(out, JIT_CC_LE);
+        break;
+    case OP_GEQ:
+        jit_emit_alu(out, JIT_CMP, JIT_RAX, JIT_RCX);
+        jit_emit_setcc(out, JIT_CC_GE);
+        break;
+    case OP_LESS:
+        jit_emit_alu(out, JIT_CMP, JIT_RAX, JIT_RCX);
+        jit_emit_setcc(out, JIT_CC_L);
+        break;
+    case OP_GREATER:
+        jit_emit_alu(out, JIT_CMP, JIT_RAX, JIT_RCX);
+        jit_emit_setcc(out, JIT_CC_G);
+        break;
+    case OP_BOR:
+        jit_emit_alu(out, JIT_OR, JIT_RAX, JIT_RCX);
+        break;
+    case OP_BAND:
+        jit_emit_alu(out, JIT_AND, JIT_RAX, JIT_RCX);
+        break;
+    case OP_BXOR:
+        jit_emit_alu(out, JIT_XOR, JIT_RAX, JIT_RCX);
+        break;
+    case OP_PLUS:
+        jit_emit_alu(out, JIT_ADD, JIT_RAX, JIT_RCX);
+        break;
+    case OP_MINUS:
+        jit_emit_alu(out, JIT_SUB, JIT_RAX, JIT_RCX);
+        break;
+    case OP_LSHIFT:
+        /* shl rax, cl */
+        jit_emit_rex(out, 0, JIT_RAX);
+        jit_emit_byte(out, 0xD3);
+        jit_emit_modrm_reg(out, 4, JIT_RAX);
+        break;
+    case OP_RSHIFT:
+        /* sar rax, cl, since the interpreter shifts signed integers. */
+        jit_emit_rex(out, 0, JIT_RAX);
+        jit_emit_byte(out, 0xD3);
+        jit_emit_modrm_reg(out, 7, JIT_RAX);
+        break;
+    case OP_MUL:
+        /* imul rax, rcx */
+        jit_emit_rex(out, JIT_RAX, JIT_RCX);
+        jit_emit_byte(out, 0x0F);
+        jit_emit_byte(out, 0xAF);
+        jit_emit_modrm_reg(out, JIT_RAX, JIT_RCX);
+        break;
+    case OP_DIV:
+    case OP_MOD:
+        /* cqo; idiv rcx */
+        jit_emit_byte(out, 0x48);
+        jit_emit_byte(out, 0x99);
+        jit_emit_rex(out, 0, JIT_RCX);
+        jit_emit_byte(out, 0xF7);
+        jit_emit_modrm_reg(out, 7, JIT_RCX);
+        if (op == OP_MOD) jit_emit_mov(out, JIT_RAX, JIT_RDX);
+        break;
+    default:
+        fprintf(errout, "Error: Tried to JIT unexpected binary operation "
+            "%d?\n", op);
+        error_exit();
+    }
+}
+
+void jit_emit_instruction(
+    struct jit_buffer *out,
+    struct bytecode *code,
+    enum operation op,
+    struct packed_instruction *instr,
+    struct packed_instruction **next_snippet
+) {
+    if (!jit_is_inline(op, instr)) {
+        /* Copy the instruction, and hand it to the interpreter. */
+        struct packed_instruction *snippet = *next_snippet;
+        *next_snippet += 2;
+        snippet[0] = *instr;
+        snippet[0].op = op;
+        snippet[1] = (struct packed_instruction){0};
+        snippet[1].op = OP_RET;
+        snippet[1].ref_types =
+            PACK_REF_TYPES(REF_NULL, REF_CONSTANT, REF_CONSTANT);
+
+        jit_emit_mov(out, JIT_RDI, JIT_STACK);
+        jit_emit_mov(out, JIT_RSI, JIT_PROCEDURES);
+        jit_emit_mov(out, JIT_RDX, JIT_LOCALS_START);
+        jit_emit_mov_imm(out, JIT_RCX, (int64)snippet);
+        jit_emit_mov_imm(out, JIT_R8, (int64)code->constants.data);
+        jit_emit_call(out, jit_helper_interpret);
+        jit_reload_bases(out);
+        return;
+    }
+
+    switch (op) {
+    case OP_NULL:
+        break;
+    case OP_MOV:
+        jit_load_operand(out, JIT_RAX, code, ARG1_TYPE(instr), instr->arg1);
+        jit_store_local(out, instr->output);
+        break;
+    case OP_CALL:
+        /* rcx = locals_start + arg2, r8 = rcx, or rcx - 1 if the procedure
+           is being moved out of a temporary. */
+        jit_load_operand(out, JIT_RDX, code, ARG1_TYPE(instr), instr->arg1);
+        jit_load_operand(out, JIT_RCX, code, ARG2_TYPE(instr), instr->arg2);
+        jit_emit_alu(out, JIT_ADD, JIT_RCX, JIT_LOCALS_START);
+        jit_emit_mov(out, JIT_R8, JIT_RCX);
+        if (ARG1_TYPE(instr) == REF_TEMPORARY) {
+            jit_emit_alu_imm(out, JIT_SUB_IMM, JIT_R8, 1);
+        }
+        jit_emit_mov(out, JIT_RDI, JIT_STACK);
+        jit_emit_mov(out, JIT_RSI, JIT_PROCEDURES);
+        jit_emit_call(out, jit_helper_call);
+        jit_reload_bases(out);
+        break;
+    case OP_RET:
+      {
+        /* Move the results to rdx = &vars.data[results_start]. */
+        jit_emit_load(out, JIT_RDX, JIT_RSP, 0);
+        jit_emit_shl_imm(out, JIT_RDX, 4);
+        jit_emit_alu(out, JIT_ADD, JIT_RDX, JIT_GLOBALS);
+        jit_emit_move_variables(out, JIT_RDX, 0, instr->arg1, instr->arg2);
+
+        jit_emit_epilogue(out);
+        jit_emit_byte(out, 0xC3);
+        break;
+      }
+    case OP_TAIL_CALL:
+        /* Read the procedure before the arguments are moved over it, then
+           move the arguments to the start of this frame. */
+        jit_load_operand(out, JIT_RDX, code, ARG1_TYPE(instr), instr->arg1);
+        jit_emit_move_variables(out, JIT_LOCALS, 0, instr->arg2,
+            instr->output);
+
+        /* Leave this procedure, and jump to jit_helper_call with the same
+           frame, so that it returns straight to our caller. */
+        jit_emit_mov(out, JIT_RDI, JIT_STACK);
+        jit_emit_mov(out, JIT_RSI, JIT_PROCEDURES);
+        jit_emit_mov(out, JIT_RCX, JIT_LOCALS_START);
+        jit_emit_load(out, JIT_R8, JIT_RSP, 0);
+        jit_emit_epilogue(out);
+        jit_emit_jump(out, jit_helper_call);
+        break;
+    case OP_ASSERT:
+        /* test rax, rax; jnz past the call */
+        jit_load_operand(out, JIT_RAX, code, ARG1_TYPE(instr), instr->arg1);
+        jit_emit_alu(out, JIT_TEST, JIT_RAX, JIT_RAX);
+        jit_emit_byte(out, 0x75);
+        jit_emit_byte(out, JIT_CALL_LENGTH);
+        jit_emit_call(out, jit_helper_assert_failed);
+        break;
+    default:
+        jit_load_operand(out, JIT_RAX, code, ARG1_TYPE(instr), instr->arg1);
+        jit_load_operand(out, JIT_RCX, code, ARG2_TYPE(instr), instr->arg2);
+        jit_emit_binary_op(out, op);
+        jit_store_local(out, instr->output);
+        break;
+    }
+}
+
+/* Variables are addressed with 32 bit displacements, so give up on frames
+   that couldn't be. */
+#define JIT_MAX_VARIABLE (INT32_MAX / (int32)sizeof(struct variable_data) - 1)
+
+bool jit_check_ref(enum ref_type type, int32 x) {
+    switch (type) {
+    case REF_LOCAL:
+    case REF_TEMPORARY:
+    case REF_GLOBAL:
+        return x < JIT_MAX_VARIABLE;
+    default:
+        return true;
+    }
+}
+
+void jit_compile_procedure(struct procedure *p) {
+    struct bytecode *code = &p->code;
+    struct packed_instruction *instrs = code->instructions.data;
+    size_t count = code->instructions.count;
+
+    /* Work out how many instructions have to go back to the interpreter. The
+       whole frame gets reserved on entry, so none of them need to grow the
+       variable stack either. */
+    if (code->frame_size >= JIT_MAX_VARIABLE) {
+        p->jit_unsupported = true;
+        return;
+    }
+    size_t snippet_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct packed_instruction *instr = &instrs[i];
+        enum operation op = generic_operation(instr->op);
+        bool ok = jit_check_ref(OUTPUT_TYPE(instr), instr->output)
+            && jit_check_ref(ARG1_TYPE(instr), instr->arg1)
+            && jit_check_ref(ARG2_TYPE(instr), instr->arg2);
+        if (op == OP_RET) {
+            /* The results are copied inline, so they have to be known. */
+            ok = ok && ARG1_TYPE(instr) == REF_CONSTANT
+                && ARG2_TYPE(instr) == REF_CONSTANT
+                && instr->arg2 >= 0
+                && instr->arg1 >= 0
+                && instr->arg1 < JIT_MAX_VARIABLE - instr->arg2;
+        } else if (op == OP_TAIL_CALL) {
+            /* So are the arguments. */
+            ok = ok && OUTPUT_TYPE(instr) == REF_CONSTANT
+                && ARG2_TYPE(instr) == REF_CONSTANT
+                && instr->output >= 0
+                && instr->arg2 >= 0
+                && instr->arg2 < JIT_MAX_VARIABLE - instr->output;
+        }
+        if (!ok) {
+            p->jit_unsupported = true;
+            return;
+        }
+        if (!jit_is_inline(op, instr)) snippet_count += 1;
+    }
+
+    struct packed_instruction *snippets = NULL;
+    if (snippet_count > 0) {
+        snippets = malloc(2 * snippet_count * sizeof(struct packed_instruction));
+    }
+    struct packed_instruction *next_snippet = snippets;
+
+    struct jit_buffer out = {0};
+
+    /* Prologue. Six pushes and the results_start slot keep rsp 16 byte
+       aligned for calls. */
+    jit_emit_push(&out, JIT_RBP);
+    jit_emit_push(&out, JIT_RBX);
+    jit_emit_push(&out, JIT_R12);
+    jit_emit_push(&out, JIT_R13);
+    jit_emit_push(&out, JIT_R14);
+    jit_emit_push(&out, JIT_R15);
+    jit_emit_alu_imm(&out, JIT_SUB_IMM, JIT_RSP, 8);
+    jit_emit_mov(&out, JIT_STACK, JIT_RDI);
+    jit_emit_mov(&out, JIT_PROCEDURES, JIT_RSI);
+    jit_emit_mov(&out, JIT_LOCALS_START, JIT_RDX);
+    jit_emit_store(&out, JIT_RSP, 0, JIT_RCX);
+
+    /* Reserve the whole frame, then point at it. */
+    jit_emit_mov(&out, JIT_RDI, JIT_STACK);
+    jit_emit_mov(&out, JIT_RSI, JIT_LOCALS_START);
+    jit_emit_alu_imm(&out, JIT_ADD_IMM, JIT_RSI, code->frame_size);
+    jit_emit_call(&out, jit_helper_reserve);
+    jit_reload_bases(&out);
+
+    for (size_t i = 0; i < count; i++) {
+        /* Fused operations are compiled one instruction at a time. */
+        enum operation op = generic_operation(instrs[i].op);
+        jit_emit_instruction(&out, code, op, &instrs[i], &next_snippet);
+    }
+
+    void *memory = mmap(NULL, out.count, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(errout, "Warning: Could not map memory for JIT code.\n");
+        buffer_free(out);
+        free(snippets);
+        p->jit_unsupported = true;
+        return;
+    }
+    memcpy(memory, out.data, out.count);
+    if (mprotect(memory, out.count, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(errout, "Warning: Could not make JIT code executable.\n");
+        munmap(memory, out.count);
+        buffer_free(out);
+        free(snippets);
+        p->jit_unsupported = true;
+        return;
+    }
+
+    if (debug) {
+        printf("JIT compiled %zu instructions into %zu bytes, %zu of them "
+            "interpreted.\n", count, out.count, snippet_count);
+    }
+
+    buffer_free(out);
+    /* The snippets are referenced by the native code, and live as long as
+       it does, which is as long as the procedure. */
+    p->jit_code = (jit_function*)memory;
+    p->jit_size = out.count;
+    p->jit_snippets = snippets;
+}
+
+void jit_free_procedure(struct procedure *p) {
+    if (!p->jit_code) return;
+    munmap((void*)p->jit_code, p->jit_size);
+    free(p->jit_snippets);
+    p->jit_code = NULL;
+}
+
+#endif
+
+#endif
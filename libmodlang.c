@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "types.h"
+
+#include "compiler_primitives.h"
+#include "bytecode.h"
+#include "tokenizer.h"
+#include "expressions.h"
+#include "statements.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "builtins.h"
+#include "context.h"
+
+#include "modlang.h"
+
+/* The library behind modlang.h. A program is a context, and every call
+   enters it, so none of the thread locals that the interpreter uses are
+   left behind on the caller's thread. */
+
+struct modlang_program {
+    struct context *ctx;
+    /* By procedure index, filled in as modlang_lookup finds them, so that
+       calls can be checked without going through the bindings again. */
+    struct modlang_signature *signatures;
+    bool *found;
+};
+
+/* The tokenizer reads from a FILE, so give it one over the source. */
+FILE *modlang_open_source(const char *source, size_t length) {
+#if defined(__unix__) || defined(__APPLE__)
+    if (length > 0) return fmemopen((void*)source, length, "rb");
+#endif
+    FILE *input = tmpfile();
+    if (input && fwrite(source, 1, length, input) != length) {
+        fclose(input);
+        return NULL;
+    }
+    if (input) rewind(input);
+    return input;
+}
+
+struct modlang_program *modlang_compile(
+    const char *source,
+    size_t length,
+    const struct modlang_options *options
+) {
+    struct modlang_options defaults = {0};
+    if (!options) options = &defaults;
+
+    size_t data_stack_size = options->data_stack_size;
+    if (data_stack_size == 0) data_stack_size = DATA_STACK_DEFAULT_SIZE;
+    struct context *ctx = context_create(data_stack_size);
+    ctx->jit_enabled = options->jit;
+    ctx->errors.output = options->errors;
+
+    FILE *input = modlang_open_source(source, length);
+    if (!input) {
+        fprintf(options->errors ? options->errors : stderr,
+            "Error: Couldn't make a file to compile from.\n");
+        context_free(ctx);
+        return NULL;
+    }
+
+    bool ok = context_run_source(ctx, input);
+    fclose(input);
+    if (!ok) {
+        context_free(ctx);
+        return NULL;
+    }
+
+    struct modlang_program *program = malloc(sizeof(struct modlang_program));
+    program->ctx = ctx;
+    size_t count = ctx->procedures.count;
+    program->signatures = calloc(count, sizeof(struct modlang_signature));
+    program->found = calloc(count, sizeof(bool));
+    return program;
+}
+
+bool modlang_type_of(struct type *type, enum modlang_type *result) {
+    if (type->connective == TYPE_INT && type->total_size == 8) {
+        *result = MODLANG_INT;
+        return true;
+    }
+    if (type->connective == TYPE_ARRAY
+        && type->inner->connective == TYPE_INT
+        && type->inner->total_size == 8)
+    {
+        *result = MODLANG_INT_ARRAY;
+        return true;
+    }
+    return false;
+}
+
+bool modlang_types_of(
+    struct type_buffer *types,
+    enum modlang_type *result,
+    int *count
+) {
+    if (types->count > MODLANG_MAX_VALUES) return false;
+    for (size_t i = 0; i < types->count; i++) {
+        if (!modlang_type_of(&types->data[i], &result[i])) return false;
+    }
+    *count = (int)types->count;
+    return true;
+}
+
+int64_t modlang_lookup(
+    struct modlang_program *program,
+    const char *name,
+    struct modlang_signature *signature
+) {
+    struct context *ctx = program->ctx;
+    int index = lookup_name(&ctx->bindings, from_cstr((char*)name));
+    if (index < 0 || index >= ctx->call_stack.vars.global_count) return -1;
+
+    struct type *type = &ctx->bindings.data[index].type;
+    if (type->connective != TYPE_PROCEDURE) return -1;
+    struct modlang_signature result = {0};
+    if (!modlang_types_of(&type->proc.inputs, result.args, &result.arg_count)
+        || !modlang_types_of(&type->proc.outputs, result.results,
+            &result.result_count))
+    {
+        return -1;
+    }
+
+    int64 procedure = ctx->call_stack.vars.data[index].value.val64;
+    program->signatures[procedure] = result;
+    program->found[procedure] = true;
+    if (signature) *signature = result;
+    return procedure;
+}
+
+struct shared_buff modlang_array_in(struct modlang_array array) {
+    if (array.count < 0 || array.count > INT32_MAX) {
+        fprintf(errout, "Error: Can't pass an array of %lld elements.\n",
+            (long long)array.count);
+        error_exit();
+    }
+
+    struct shared_buff result =
+        shared_buff_alloc(&type_glue_int64, (int)array.count);
+    for (int i = 0; i < array.count;) {
+        int run;
+        int64 *to = shared_buff_get_run(&result, i, &run);
+        memcpy(to, array.data + i, run * sizeof(int64));
+        i += run;
+    }
+    return result;
+}
+
+/* Copy an array out of the program's memory, and drop the reference that
+   the call gave us. */
+struct modlang_array modlang_array_out(struct shared_buff buff) {
+    struct modlang_array result;
+    result.count = buff.count;
+    result.data = malloc((buff.count > 0 ? buff.count : 1) * sizeof(int64));
+    for (int i = 0; i < buff.count;) {
+        int run;
+        int64 *from = shared_buff_get_run(&buff, i, &run);
+        memcpy(result.data + i, from, run * sizeof(int64));
+        i += run;
+    }
+    shared_buff_decrement(buff);
+    return result;
+}
+
+bool modlang_call(
+    struct modlang_program *program,
+    int64_t procedure,
+    const union modlang_value *args,
+    union modlang_value *results
+) {
+    struct context *ctx = program->ctx;
+    struct call_stack *stack = &ctx->call_stack;
+    size_t vars_count = stack->vars.count;
+    size_t data_count = stack->data.allocated_count;
+
+    struct context_thread_state saved;
+    error_jump_buffer recover;
+    context_enter(ctx, &saved, &recover);
+    if (error_catch(recover)) {
+        /* Procedures can't assign globals, so putting the stacks back how
+           they were is enough to make the program usable again. */
+        stack->exec.count = 0;
+        buffer_setcount(stack->vars, vars_count);
+        stack->data.allocated_count = data_count;
+        release_queue.releasing = false;
+        ctx->errors.failed = false;
+        context_leave(ctx, &saved);
+        return false;
+    }
+
+    if (procedure < 0 || procedure >= ctx->procedures.count
+        || !program->found[procedure])
+    {
+        fprintf(errout, "Error: %lld isn't a procedure that modlang_lookup "
+            "found.\n", (long long)procedure);
+        error_exit();
+    }
+    struct modlang_signature *signature = &program->signatures[procedure];
+
+    union variable_contents call_args[MODLANG_MAX_VALUES];
+    union variable_contents call_results[MODLANG_MAX_VALUES];
+    for (int i = 0; i < signature->arg_count; i++) {
+        if (signature->args[i] == MODLANG_INT_ARRAY) {
+            call_args[i].shared_buff = modlang_array_in(args[i].array);
+        } else {
+            call_args[i].val64 = (uint64)args[i].integer;
+        }
+    }
+
+    interpreter_call(stack, &ctx->procedures, procedure,
+        call_args, signature->arg_count,
+        call_results, signature->result_count);
+
+    for (int i = 0; i < signature->result_count; i++) {
+        if (signature->results[i] == MODLANG_INT_ARRAY) {
+            results[i].array = modlang_array_out(call_results[i].shared_buff);
+        } else {
+            results[i].integer = (int64_t)call_results[i].val64;
+        }
+    }
+    release_dead_buffers();
+
+    context_leave(ctx, &saved);
+    return true;
+}
+
+void modlang_free(struct modlang_program *program) {
+    context_free(program->ctx);
+    free(program->signatures);
+    free(program->found);
+    free(program);
+}
@@ -0,0 +1,102 @@
+/* Tests for the library interface in modlang.h, which tests.sh runs after the
+   scripts in data/. The library is built in, rather than linked, so that this
+   runs with tcc -run like everything else. */
+
+#include "libmodlang.c"
+
+const char *test_source =
+    "base := 10;\n"
+    "procedure score(x: Int, y: Int) -> Int {\n"
+    "    return x * y + base;\n"
+    "}\n"
+    "procedure twice(xs: [Int]) -> [Int] {\n"
+    "    return xs ++ xs;\n"
+    "}\n";
+
+/* Cycles of compiling and freeing, and how much the process can grow over
+   them once it has warmed up. Anything the context leaves behind adds up
+   well past this. */
+#define TEST_CYCLES 2000
+#define TEST_WARMUP_CYCLES 200
+#define TEST_MAX_GROWTH ((long)2 << 20)
+
+int test_failures = 0;
+
+void test_check(bool ok, char *message) {
+    if (!ok) {
+        fprintf(stderr, "Library test failed: %s\n", message);
+        test_failures += 1;
+    }
+}
+
+/* Resident bytes, or -1 where there's no cheap way to tell. AddressSanitizer
+   holds on to freed memory, and finds leaks itself. */
+long test_resident_size(void) {
+#if defined(__linux__) && !defined(__SANITIZE_ADDRESS__)
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) return -1;
+    long pages, resident;
+    int count = fscanf(statm, "%ld %ld", &pages, &resident);
+    fclose(statm);
+    if (count != 2) return -1;
+    return resident * sysconf(_SC_PAGESIZE);
+#else
+    return -1;
+#endif
+}
+
+void test_calls(struct modlang_program *program) {
+    struct modlang_signature signature;
+    int64_t score = modlang_lookup(program, "score", &signature);
+    test_check(score >= 0 && signature.arg_count == 2
+        && signature.result_count == 1, "lookup score");
+    test_check(modlang_lookup(program, "base", NULL) == -1, "lookup base");
+
+    union modlang_value args[2] = {{.integer = 6}, {.integer = 7}};
+    union modlang_value results[1];
+    test_check(modlang_call(program, score, args, results)
+        && results[0].integer == 52, "call score");
+
+    int64_t twice = modlang_lookup(program, "twice", NULL);
+    int64_t data[3] = {1, 2, 3};
+    args[0].array = (struct modlang_array){data, 3};
+    test_check(modlang_call(program, twice, args, results)
+        && results[0].array.count == 6 && results[0].array.data[5] == 3,
+        "call twice");
+    if (results[0].array.count == 6) free(results[0].array.data);
+}
+
+int main(void) {
+    struct modlang_options options = {0};
+    options.data_stack_size = 64 << 10;
+    FILE *errors = tmpfile();
+    options.errors = errors;
+
+    long warm_size = -1;
+    for (int i = 0; i < TEST_CYCLES; i++) {
+        if (i == TEST_WARMUP_CYCLES) warm_size = test_resident_size();
+
+        struct modlang_program *program =
+            modlang_compile(test_source, strlen(test_source), &options);
+        test_check(program != NULL, "compile");
+        if (!program) break;
+        test_calls(program);
+        modlang_free(program);
+
+        /* Failing part way through has to clean up just as well. */
+        const char *bad_source = "x := 1;\ny := x +;\n";
+        test_check(!modlang_compile(bad_source, strlen(bad_source), &options),
+            "compile bad source");
+    }
+
+    long size = test_resident_size();
+    if (warm_size >= 0 && size >= 0) {
+        test_check(size - warm_size < TEST_MAX_GROWTH,
+            "compiling and freeing programs leaks memory");
+    }
+
+    if (errors) fclose(errors);
+    if (test_failures > 0) return EXIT_FAILURE;
+    printf("Library tests passed.\n");
+    return 0;
+}
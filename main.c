@@ -14,11 +14,16 @@
 #include "types.h"
 
 #include "compiler_primitives.h"
+#include "bytecode.h"
 #include "tokenizer.h"
 #include "expressions.h"
 #include "statements.h"
 #include "interpreter.h"
+#include "jit.h"
 #include "builtins.h"
+#include "context.h"
+#include "emit_c.h"
+#include "modc.h"
 
 void print_ref(struct ref ref) {
     switch (ref.type) {
@@ -42,17 +47,23 @@ void print_ref(struct ref ref) {
     }
 }
 
-void disassemble_instructions(struct instruction_buffer instructions) {
-    for (int i = 0; i < instructions.count; i++) {
-        struct instruction *instr = &instructions.data[i];
+void disassemble_instructions(struct bytecode *code) {
+    for (int i = 0; i < code->instructions.count; i++) {
+        struct instruction unpacked = unpack_instruction(code, i);
+        struct instruction *instr = &unpacked;
         if (instr->op == OP_MOV) {
             print_ref(instr->output);
             printf(" = ");
             print_ref(instr->arg1);
+            if (instr->flags & OP_NO_REFCOUNT) printf(" (no refcount)");
             printf("\n");
         } else if (instr->op == OP_ARRAY_ALLOC) {
             print_ref(instr->output);
-            printf(" = alloc_array(");
+            if (instr->flags & OP_STACK_ARRAY) {
+                printf(" = alloc_stack_array(");
+            } else {
+                printf(" = alloc_array(");
+            }
             print_ref(instr->arg1);
             printf(", ");
             print_ref(instr->arg2);
@@ -80,6 +91,13 @@ void disassemble_instructions(struct instruction_buffer instructions) {
             printf("  // size = ");
             print_ref(instr->arg2);
             printf("\n");
+        } else if (instr->op == OP_CALL || instr->op == OP_TAIL_CALL) {
+            if (instr->op == OP_TAIL_CALL) printf("tail ");
+            printf("call ");
+            print_ref(instr->arg1);
+            printf("(%lld args from", (long long)instr->output.x);
+            print_ref(instr->arg2);
+            printf(")\n");
         } else {
             if (instr->output.type != REF_NULL) {
                 print_ref(instr->output);
@@ -94,58 +112,6 @@ void disassemble_instructions(struct instruction_buffer instructions) {
     }
 }
 
-void print_data(uint8 *it, struct type *type) {
-    if (type->connective == TYPE_ARRAY) {
-        struct shared_buff *buff = (struct shared_buff*)it;
-        struct type *element_type = type->inner;
-        printf("[");
-        if (buff->count > 0) {
-            uint8 *data = shared_buff_get_index(*buff, 0);
-            for (int i = 0; i < buff->count; i++) {
-                if (i > 0) printf(", ");
-
-                print_data(data, element_type);
-
-                data += element_type->total_size;
-            }
-        }
-        printf("]");
-    } else if (type->connective == TYPE_INT) {
-        int64 *as_int = (int64*)it;
-        printf("%lld", *as_int);
-    } else if (type->connective == TYPE_TUPLE) {
-        printf("{");
-        for (int i = 0; i < type->elements.count; i++) {
-            if (i > 0) printf(", ");
-            struct type *elem_ty = &type->elements.data[i];
-            print_data(it, elem_ty);
-            it += elem_ty->total_size;
-        }
-        printf("}");
-    } else if (type->connective == TYPE_RECORD) {
-        printf("{");
-        for (int i = 0; i < type->fields.count; i++) {
-            if (i > 0) printf(", ");
-            struct field *field = &type->fields.data[i];
-            fputstr(field->name, stdout);
-            printf(": ");
-            print_data(it, &field->type);
-            it += field->type.total_size;
-        }
-        printf("}");
-    } else {
-        printf("?");
-    }
-}
-
-void print_call_stack_value(union variable_contents it, struct type *type) {
-    if (type->connective == TYPE_TUPLE || type->connective == TYPE_RECORD) {
-        print_data(it.pointer, type);
-    } else {
-        print_data(it.bytes, type);
-    }
-}
-
 void print_multi_expression(
     struct variable_stack *vars,
     struct intermediate_buffer *intermediates
@@ -161,7 +127,7 @@ void print_multi_expression(
 }
 
 struct statement {
-    struct instruction_buffer instructions;
+    struct bytecode code;
     struct intermediate_buffer intermediates;
 };
 
@@ -171,10 +137,31 @@ struct statement_buffer {
     size_t capacity;
 };
 
-bool debug = false;
+/* Parses a byte count, with an optional K, M or G suffix. */
+size_t parse_size_option(char *option, char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': size <<= 10; end++; break;
+    case 'm': case 'M': size <<= 20; end++; break;
+    case 'g': case 'G': size <<= 30; end++; break;
+    }
+    if (end == text || *end != '\0' || size == 0) {
+        fprintf(stderr, "Error: Expected a size like 64M after %s, got "
+            "\"%s\".\n", option, text);
+        exit(EXIT_FAILURE);
+    }
+
+    return size;
+}
 
 int main(int argc, char **argv) {
     char *input_path = NULL;
+    char *emit_c_path = NULL;
+    bool compile_only = false;
+    char *output_path = NULL;
+    size_t data_stack_size = DATA_STACK_DEFAULT_SIZE;
+    bool print_stats = false;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-debug") == 0) {
@@ -183,6 +170,56 @@ int main(int argc, char **argv) {
                     "Ignoring.\n");
             }
             debug = true;
+        } else if (strcmp(argv[i], "-jit") == 0) {
+#ifdef MODLANG_JIT
+            jit_enabled = true;
+#else
+            fprintf(stderr, "Warning: The JIT is not available on this "
+                "platform. Ignoring -jit.\n");
+#endif
+        } else if (strcmp(argv[i], "-defer-release") == 0) {
+            release_queue.deferred = true;
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            print_stats = true;
+        } else if (strcmp(argv[i], "-emit-c") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "Error: Expected an output path after "
+                    "-emit-c.\n");
+                exit(EXIT_FAILURE);
+            }
+            i += 1;
+            emit_c_path = argv[i];
+        } else if (strcmp(argv[i], "-compile-only") == 0) {
+            compile_only = true;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "Error: Expected an output path after -o.\n");
+                exit(EXIT_FAILURE);
+            }
+            i += 1;
+            output_path = argv[i];
+        } else if (strcmp(argv[i], "-threads") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "Error: Expected a thread count after "
+                    "-threads.\n");
+                exit(EXIT_FAILURE);
+            }
+            i += 1;
+            char *end;
+            par_thread_count = strtol(argv[i], &end, 10);
+            if (end == argv[i] || *end != '\0' || par_thread_count <= 0) {
+                fprintf(stderr, "Error: Expected a thread count like 4 after "
+                    "-threads, got \"%s\".\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "-data-stack-size") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "Error: Expected a size after "
+                    "-data-stack-size.\n");
+                exit(EXIT_FAILURE);
+            }
+            i += 1;
+            data_stack_size = parse_size_option("-data-stack-size", argv[i]);
         } else {
             if (input_path) {
                 fprintf(stderr, "Error: Got too many command line "
@@ -193,8 +230,18 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (compile_only != (output_path != NULL)) {
+        fprintf(stderr, "Error: -compile-only and -o go together.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (compile_only && emit_c_path) {
+        fprintf(stderr, "Error: Can't use -compile-only with -emit-c.\n");
+        exit(EXIT_FAILURE);
+    }
+
     FILE *input;
     bool repl;
+    bool compiled = false;
     if (input_path) {
         input = fopen(input_path, "rb");
         if (!input) {
@@ -202,6 +249,16 @@ int main(int argc, char **argv) {
             exit(EXIT_FAILURE);
         }
         repl = false;
+        compiled = modc_is_compiled(input);
+        if (compiled && (emit_c_path || compile_only)) {
+            fprintf(stderr, "Error: \"%s\" is already compiled.\n",
+                input_path);
+            exit(EXIT_FAILURE);
+        }
+    } else if (emit_c_path || compile_only) {
+        fprintf(stderr, "Error: %s needs an input file.\n",
+            emit_c_path ? "-emit-c" : "-compile-only");
+        exit(EXIT_FAILURE);
     } else {
         input = stdin;
         repl = true;
@@ -212,14 +269,37 @@ int main(int argc, char **argv) {
         printf("Unmatched Perspicacity Prompt\n");
         printf("> ");
     }
-    struct procedure_buffer procedures = {0};
-    struct record_table bindings = {0};
-    struct call_stack call_stack = {0};
-    call_stack.data = stack_create(1 << 20); /* A megabyte of memory, why not? */
+    struct context *ctx = context_create(data_stack_size);
+    ctx->debug = debug;
+    ctx->jit_enabled = jit_enabled;
+    ctx->release_queue.deferred = release_queue.deferred;
+
+    /* With no recover point, errors still exit. The context is never left,
+       so that the stats printed at exit are its own. */
+    struct context_thread_state saved;
+    context_enter(ctx, &saved, NULL);
+    struct procedure_buffer *procedures = &ctx->procedures;
+    struct record_table *bindings = &ctx->bindings;
+    struct call_stack *call_stack = &ctx->call_stack;
+
+#ifdef MODLANG_PROFILE_OPCODE_PAIRS
+    /* Scripts can end by failing an assertion, so dump at exit. */
+    atexit(print_opcode_pair_profile);
+#endif
+#ifdef MODLANG_POOL_STATS
+    atexit(print_shared_buff_pool_stats);
+#endif
+    /* Like the opcode profile, this has to survive failed assertions. */
+    if (print_stats) atexit(print_memory_stats);
 
-    add_builtins(&bindings, &procedures, &call_stack);
+    if (compiled) {
+        fclose(input);
+        modc_run(ctx, input_path);
+        return 0;
+    }
 
     struct statement_buffer statements = {0};
+    struct c_statement_buffer c_statements = {0};
 
     while (true) {
         if (repl) {
@@ -230,20 +310,71 @@ int main(int argc, char **argv) {
             }
         }
 
-        struct item item = parse_item(&tokenizer, &bindings, repl);
+        size_t globals_start = bindings->global_count;
+        struct item item = parse_item(&tokenizer, bindings, repl);
+
+        if ((emit_c_path || compile_only) && item.type == ITEM_STATEMENT) {
+            /* Keep the statement for emit_c_program or modc_write, instead
+               of running it. */
+            struct c_statement *statement = buffer_addn(c_statements, 1);
+            statement->code = prepare_bytecode(&item.instructions);
+            struct bytecode_limits limits =
+                {procedures->count, bindings->global_count};
+            check_bytecode(&statement->code, limits);
 
-        if (item.type == ITEM_STATEMENT) {
+            struct instruction_buffer deinitialize_instructions = {0};
+            compile_multivalue_decrements(
+                &deinitialize_instructions,
+                &item.intermediates
+            );
+            statement->deinitialize_code =
+                prepare_bytecode(&deinitialize_instructions);
+            check_bytecode(&statement->deinitialize_code, limits);
+
+            statement->globals_start = globals_start;
+            statement->globals_end = bindings->global_count;
+
+            /* Nothing runs, so leave space for the statement's globals, to
+               keep later procedure bindings at the right index. */
+            buffer_setcount(call_stack->vars, bindings->global_count);
+            call_stack->vars.global_count = bindings->global_count;
+
+            buffer_free(deinitialize_instructions);
+            buffer_free(item.instructions);
+            buffer_free(item.intermediates);
+            continue;
+        } else if (item.type == ITEM_STATEMENT) {
             struct statement statement;
-            statement.instructions = item.instructions;
+            statement.code = prepare_bytecode(&item.instructions);
+            struct bytecode_limits limits =
+                {procedures->count, bindings->global_count};
+            check_bytecode(&statement.code, limits);
             statement.intermediates = item.intermediates;
             buffer_push(statements, statement);
+            buffer_free(item.instructions);
 
             if (debug) {
                 printf("\nStatement parsed. Output:\n");
-                disassemble_instructions(item.instructions);
+                disassemble_instructions(&statement.code);
+                if (statement.code.elided_refcounts > 0) {
+                    printf("Elided %d refcount operations.\n",
+                        statement.code.elided_refcounts);
+                }
             }
         } else if (item.type == ITEM_PROCEDURE) {
-            bind_procedure(&bindings, &procedures, &call_stack, item.proc_binding, item.instructions);
+            bind_procedure(bindings, procedures, call_stack, item.proc_binding, item.instructions);
+            if (debug) {
+                struct procedure *p = &procedures->data[procedures->count - 1];
+                printf("\nProcedure ");
+                fputstr(item.proc_binding.name, stdout);
+                printf(" parsed. Elided %d refcount operations.\n",
+                    p->code.elided_refcounts);
+                if (p->code.stack_arrays > 0) {
+                    printf("Placed %d arrays on the data stack.\n",
+                        p->code.stack_arrays);
+                }
+            }
+            if (emit_c_path || compile_only) continue;
         } else if (item.type == ITEM_NULL) {
             break;
         } else {
@@ -257,16 +388,16 @@ int main(int argc, char **argv) {
 
         /* Finished parsing something. Time to execute it. */
         /* Store global count to track how many are new. */
-        int prev_global_count = call_stack.vars.global_count;
+        int prev_global_count = call_stack->vars.global_count;
 
         if (debug) printf("\nExecuting.\n");
         for (int i = 0; i < statements.count; i++) {
             struct statement *it = &statements.data[i];
-            execute_top_level_code(procedures, &call_stack, &it->instructions);
+            context_execute(ctx, &it->code);
             /* TODO: Check vars.global_count after each statement? */
 
             /* Top level statements are fired once and then forgotten. */
-            buffer_free(it->instructions);
+            bytecode_free(&it->code);
 
             if (repl && it->intermediates.count > 0) {
                 /* If the last statement in this line was a bare expression,
@@ -275,48 +406,70 @@ int main(int argc, char **argv) {
                    of the variable stack, but they'll still be written there,
                    so it's okay. */
                 printf("result = ");
-                print_multi_expression(&call_stack.vars, &it->intermediates);
+                print_multi_expression(&call_stack->vars, &it->intermediates);
                 printf("\n");
             }
 
-            struct instruction_buffer deinitialize_instructions = {0};
-            compile_multivalue_decrements(
-                &deinitialize_instructions,
-                &it->intermediates
-            );
-
-            execute_top_level_code(procedures, &call_stack, &deinitialize_instructions);
-            buffer_free(deinitialize_instructions);
+            context_finish_statement(ctx, &it->intermediates);
             buffer_free(it->intermediates);
-
-            /* Discard any locals or temporaries. */
-            buffer_setcount(call_stack.vars, call_stack.vars.global_count);
         }
         /* Empty the statement buffer, and reuse it next loop. */
         statements.count = 0;
 
-        if (call_stack.vars.global_count != bindings.global_count) {
+        if (call_stack->vars.global_count != bindings->global_count) {
             fprintf(stderr, "Warning: Executing statements resulted in "
                     "%llu global variables being initialized, when %llu "
                     "global variables are in scope.\n",
-                    (long long)call_stack.vars.global_count,
-                    (long long)bindings.global_count);
-            call_stack.vars.global_count = bindings.global_count;
+                    (long long)call_stack->vars.global_count,
+                    (long long)bindings->global_count);
+            call_stack->vars.global_count = bindings->global_count;
         }
 
-        if (debug && prev_global_count < call_stack.vars.global_count) {
+        if (debug && prev_global_count < call_stack->vars.global_count) {
             printf("\nState:\n");
         }
-        for (int i = prev_global_count; i < call_stack.vars.global_count; i++) {
-            fputstr(bindings.data[i].name, stdout);
+        for (int i = prev_global_count; i < call_stack->vars.global_count; i++) {
+            fputstr(bindings->data[i].name, stdout);
             printf(" = ");
-            print_call_stack_value(call_stack.vars.data[i].value, &bindings.data[i].type);
+            print_call_stack_value(call_stack->vars.data[i].value, &bindings->data[i].type);
             printf("\n");
         }
 
         if (repl) printf("> ");
     }
 
+    if (emit_c_path) {
+        FILE *out = fopen(emit_c_path, "w");
+        if (!out) {
+            fprintf(stderr, "Error: couldn't open file \"%s\"\n", emit_c_path);
+            exit(EXIT_FAILURE);
+        }
+        emit_c_program(
+            out,
+            procedures,
+            bindings,
+            &call_stack->vars,
+            &c_statements
+        );
+        fclose(out);
+    }
+    if (compile_only) {
+        FILE *out = fopen(output_path, "wb");
+        if (!out) {
+            fprintf(stderr, "Error: couldn't open file \"%s\"\n", output_path);
+            exit(EXIT_FAILURE);
+        }
+        modc_write(out, ctx, &c_statements);
+        fclose(out);
+    }
+    if (emit_c_path || compile_only) {
+        for (int i = 0; i < c_statements.count; i++) {
+            bytecode_free(&c_statements.data[i].code);
+            bytecode_free(&c_statements.data[i].deinitialize_code);
+        }
+        buffer_free(c_statements);
+    }
+
 #ifdef _DEBUG
 #ifdef _WIN32
     bool found_leak = _CrtDumpMemoryLeaks();
@@ -0,0 +1,914 @@
+#ifndef MODLANG_MODC_H
+#define MODLANG_MODC_H
+
+#include "types.h"
+#include "bytecode.h"
+#include "interpreter.h"
+#include "builtins.h"
+#include "context.h"
+#include "emit_c.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+/* Compiled programs. -compile-only writes out everything that parsing a
+   script produces, which is its procedures, its globals, and the code for
+   each of its top level statements, so that it can be run again without the
+   tokenizer or the compiler. A compiled program is mapped straight into
+   memory, and its bytecode is run from the mapping, so loading one costs
+   little more than verifying it.
+
+   The builtins aren't written out, since context_create makes them anyway,
+   but the file says how many there were, so that indices still line up.
+   Instructions are written as they are in memory, so a compiled program is
+   only good for builds that agree on the opcodes, and on the byte order.
+   The static pointers in the constant pool are the only thing that can't be
+   written as is, so those are written as indices into the types section,
+   and turned back into pointers to freshly built types when they load.
+
+   Everything after the header is checksummed, so a file that was truncated
+   or damaged on the way is turned away before any of it is used. Loading
+   also checks that everything in the file is in range, and verifies all of
+   its bytecode, and calls through variables check their targets as they run.
+   What none of that can tell is whether the types still agree with the code
+   that uses them, so a file that was edited on purpose, and checksummed
+   again, has to be trusted as much as its source would be. */
+
+#define MODC_MAGIC "MODC"
+#define MODC_VERSION 3
+
+/* Everything in the file is found through one of these. Offsets are from
+   the start of the file, and are all 8 byte aligned. */
+struct modc_section {
+    uint64 offset;
+    uint64 count;
+};
+
+struct modc_header {
+    char magic[4];
+    uint32 version;
+    uint32 operation_count;
+    uint32 instruction_size;
+    uint64 builtin_procedure_count;
+    uint64 builtin_global_count;
+    uint64 checksum; /* modc_checksum of everything after the header */
+
+    struct modc_section strings;    /* chars, for names */
+    struct modc_section types;      /* struct modc_type */
+    struct modc_section type_refs;  /* int32 indices into types */
+    struct modc_section fields;     /* struct modc_field */
+    struct modc_section procedures; /* struct modc_code */
+    struct modc_section globals;    /* struct modc_global */
+    struct modc_section statements; /* struct modc_statement */
+    struct modc_section code;       /* bytes, that modc_code points into */
+};
+
+/* Types are flattened so that everything a type refers to comes before it,
+   which also means that they can't form cycles. Tuples and procedure inputs
+   use first and count to pick out type_refs, records use them to pick out
+   fields, and arrays give the inner type as first. */
+struct modc_type {
+    int32 connective;
+    int32 word_size;
+    int32 total_size;
+    int32 first;
+    int32 count;
+    int32 output_first;
+    int32 output_count;
+    int32 padding;
+};
+
+struct modc_field {
+    uint32 name;
+    uint32 name_length;
+    int32 type;
+};
+
+/* The offsets of code are from the start of the code section. */
+struct modc_code {
+    uint64 instructions;
+    uint64 constants;
+    uint32 instruction_count;
+    uint32 constant_count;
+    int32 frame_size;
+    int32 elided_refcounts;
+    int32 stack_arrays;
+    int32 padding;
+};
+
+/* Each global after the builtins. Globals that no statement introduces are
+   procedures, and value says which. */
+struct modc_global {
+    uint32 name;
+    uint32 name_length;
+    int32 type;
+    int32 is_var;
+    int64 value;
+};
+
+struct modc_statement {
+    struct modc_code code;
+    struct modc_code deinitialize_code;
+    uint64 globals_start;
+    uint64 globals_end;
+};
+
+struct modc_type_buffer {
+    struct modc_type *data;
+    size_t count;
+    size_t capacity;
+};
+
+struct modc_field_buffer {
+    struct modc_field *data;
+    size_t count;
+    size_t capacity;
+};
+
+struct modc_code_buffer {
+    struct modc_code *data;
+    size_t count;
+    size_t capacity;
+};
+
+struct modc_global_buffer {
+    struct modc_global *data;
+    size_t count;
+    size_t capacity;
+};
+
+struct modc_statement_buffer {
+    struct modc_statement *data;
+    size_t count;
+    size_t capacity;
+};
+
+/* 64 bit FNV-1a. This is there to catch accidents, not forgeries. */
+uint64 modc_checksum(uint8 *data, size_t size) {
+    uint64 hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+/* The operand of instr that is a static pointer, if there is one at that
+   position, 0 to 2. */
+int32 *modc_static_pointer(struct packed_instruction *instr, int position) {
+    enum ref_type types[3] =
+        {OUTPUT_TYPE(instr), ARG1_TYPE(instr), ARG2_TYPE(instr)};
+    int32 *operands[3] = {&instr->output, &instr->arg1, &instr->arg2};
+    return types[position] == REF_STATIC_POINTER ? operands[position] : NULL;
+}
+
+/***********/
+/* Writing */
+/***********/
+
+struct modc_writer {
+    struct char_buffer strings;
+    struct modc_type_buffer types;
+    struct int32_buffer type_refs;
+    struct modc_field_buffer fields;
+    struct modc_code_buffer procedures;
+    struct modc_global_buffer globals;
+    struct modc_statement_buffer statements;
+    struct char_buffer code;
+
+    /* The types that static pointers point at, each written once, and the
+       index it was written at. */
+    struct type_pointer_buffer pointers;
+    struct int32_buffer pointer_indices;
+};
+
+uint32 modc_write_string(struct modc_writer *w, str string) {
+    uint32 offset = w->strings.count;
+    char *to = buffer_addn(w->strings, string.length);
+    memcpy(to, string.data, string.length);
+    return offset;
+}
+
+int32 modc_write_type(struct modc_writer *w, struct type *type);
+
+/* Returns where the indices of types start in type_refs. */
+int32 modc_write_type_refs(struct modc_writer *w, struct type_buffer *types) {
+    struct int32_buffer indices = {0};
+    for (size_t i = 0; i < types->count; i++) {
+        buffer_push(indices, modc_write_type(w, &types->data[i]));
+    }
+
+    int32 first = w->type_refs.count;
+    int32 *to = buffer_addn(w->type_refs, indices.count);
+    if (indices.count > 0) memcpy(to, indices.data, indices.count * 4);
+    buffer_free(indices);
+    return first;
+}
+
+int32 modc_write_type(struct modc_writer *w, struct type *type) {
+    struct modc_type result = {0};
+    result.connective = type->connective;
+    result.total_size = type->total_size;
+
+    switch (type->connective) {
+    case TYPE_TUPLE:
+        result.first = modc_write_type_refs(w, &type->elements);
+        result.count = type->elements.count;
+        break;
+    case TYPE_RECORD: {
+        struct modc_field_buffer fields = {0};
+        for (size_t i = 0; i < type->fields.count; i++) {
+            struct field *field = &type->fields.data[i];
+            struct modc_field *it = buffer_addn(fields, 1);
+            it->name = modc_write_string(w, field->name);
+            it->name_length = field->name.length;
+            it->type = modc_write_type(w, &field->type);
+        }
+        result.first = w->fields.count;
+        result.count = fields.count;
+        struct modc_field *to = buffer_addn(w->fields, fields.count);
+        if (fields.count > 0) {
+            memcpy(to, fields.data, fields.count * sizeof(struct modc_field));
+        }
+        buffer_free(fields);
+        break;
+    }
+    case TYPE_ARRAY:
+        result.first = modc_write_type(w, type->inner);
+        break;
+    case TYPE_PROCEDURE:
+        result.first = modc_write_type_refs(w, &type->proc.inputs);
+        result.count = type->proc.inputs.count;
+        result.output_first = modc_write_type_refs(w, &type->proc.outputs);
+        result.output_count = type->proc.outputs.count;
+        break;
+    default:
+        result.word_size = type->word_size;
+        break;
+    }
+
+    buffer_push(w->types, result);
+    return w->types.count - 1;
+}
+
+int32 modc_write_pointer_type(struct modc_writer *w, struct type *type) {
+    for (size_t i = 0; i < w->pointers.count; i++) {
+        if (w->pointers.data[i] == type) return w->pointer_indices.data[i];
+    }
+    int32 index = modc_write_type(w, type);
+    buffer_push(w->pointers, type);
+    buffer_push(w->pointer_indices, index);
+    return index;
+}
+
+void modc_align_code(struct modc_writer *w) {
+    while (w->code.count % 8 != 0) buffer_push(w->code, 0);
+}
+
+struct modc_code modc_write_code(struct modc_writer *w, struct bytecode *code) {
+    struct modc_code result = {0};
+    size_t instructions_size =
+        code->instructions.count * sizeof(struct packed_instruction);
+    size_t constants_size = code->constants.count * sizeof(int64);
+
+    modc_align_code(w);
+    result.instructions = w->code.count;
+    result.instruction_count = code->instructions.count;
+    char *to = buffer_addn(w->code, instructions_size);
+    if (instructions_size > 0) {
+        memcpy(to, code->instructions.data, instructions_size);
+    }
+
+    modc_align_code(w);
+    result.constants = w->code.count;
+    result.constant_count = code->constants.count;
+    to = buffer_addn(w->code, constants_size);
+    if (constants_size > 0) memcpy(to, code->constants.data, constants_size);
+
+    int64 *constants = (int64*)to;
+    for (size_t i = 0; i < code->instructions.count; i++) {
+        for (int k = 0; k < 3; k++) {
+            int32 *x = modc_static_pointer(&code->instructions.data[i], k);
+            if (!x) continue;
+            struct type *type = (struct type*)code->constants.data[*x];
+            constants[*x] = modc_write_pointer_type(w, type);
+        }
+    }
+
+    result.frame_size = code->frame_size;
+    result.elided_refcounts = code->elided_refcounts;
+    result.stack_arrays = code->stack_arrays;
+    return result;
+}
+
+/* Appends count items of the given size, and says where they went. */
+struct modc_section modc_write_section(
+    struct char_buffer *file,
+    void *data,
+    size_t count,
+    size_t size
+) {
+    while (file->count % 8 != 0) buffer_push(*file, 0);
+    struct modc_section result = {file->count, count};
+    char *to = buffer_addn(*file, count * size);
+    if (count > 0) memcpy(to, data, count * size);
+    return result;
+}
+
+/* Write out the program that was parsed into ctx, with the top level
+   statements that main kept instead of running. */
+void modc_write(
+    FILE *out,
+    struct context *ctx,
+    struct c_statement_buffer *statements
+) {
+    struct modc_writer w = {0};
+    struct modc_header header = {0};
+    memcpy(header.magic, MODC_MAGIC, 4);
+    header.version = MODC_VERSION;
+    header.operation_count = OP_COUNT;
+    header.instruction_size = sizeof(struct packed_instruction);
+    header.builtin_procedure_count = ctx->builtin_procedure_count;
+    header.builtin_global_count = ctx->builtin_global_count;
+
+    for (size_t i = ctx->builtin_procedure_count;
+        i < ctx->procedures.count; i++)
+    {
+        struct modc_code code =
+            modc_write_code(&w, &ctx->procedures.data[i].code);
+        buffer_push(w.procedures, code);
+    }
+
+    for (size_t i = 0; i < statements->count; i++) {
+        struct c_statement *it = &statements->data[i];
+        struct modc_statement *statement = buffer_addn(w.statements, 1);
+        statement->code = modc_write_code(&w, &it->code);
+        statement->deinitialize_code =
+            modc_write_code(&w, &it->deinitialize_code);
+        statement->globals_start = it->globals_start;
+        statement->globals_end = it->globals_end;
+    }
+
+    size_t statement_index = 0;
+    for (size_t i = ctx->builtin_global_count;
+        i < ctx->bindings.global_count; i++)
+    {
+        while (statement_index < statements->count
+            && statements->data[statement_index].globals_end <= i)
+        {
+            statement_index += 1;
+        }
+        bool bound = statement_index == statements->count
+            || i < statements->data[statement_index].globals_start;
+
+        struct record_entry *binding = &ctx->bindings.data[i];
+        struct modc_global *global = buffer_addn(w.globals, 1);
+        global->name = modc_write_string(&w, binding->name);
+        global->name_length = binding->name.length;
+        global->type = modc_write_type(&w, &binding->type);
+        global->is_var = binding->is_var;
+        global->value = bound ? ctx->call_stack.vars.data[i].value.val64 : 0;
+    }
+
+    struct char_buffer file = {0};
+    buffer_setcount(file, sizeof(struct modc_header));
+    header.strings = modc_write_section(&file,
+        w.strings.data, w.strings.count, 1);
+    header.types = modc_write_section(&file,
+        w.types.data, w.types.count, sizeof(struct modc_type));
+    header.type_refs = modc_write_section(&file,
+        w.type_refs.data, w.type_refs.count, sizeof(int32));
+    header.fields = modc_write_section(&file,
+        w.fields.data, w.fields.count, sizeof(struct modc_field));
+    header.procedures = modc_write_section(&file,
+        w.procedures.data, w.procedures.count, sizeof(struct modc_code));
+    header.globals = modc_write_section(&file,
+        w.globals.data, w.globals.count, sizeof(struct modc_global));
+    header.statements = modc_write_section(&file,
+        w.statements.data, w.statements.count, sizeof(struct modc_statement));
+    header.code = modc_write_section(&file,
+        w.code.data, w.code.count, 1);
+    header.checksum = modc_checksum((uint8*)file.data + sizeof(header),
+        file.count - sizeof(header));
+    memcpy(file.data, &header, sizeof(struct modc_header));
+
+    if (fwrite(file.data, 1, file.count, out) != file.count) {
+        fprintf(errout, "Error: Couldn't write the compiled program.\n");
+        error_exit();
+    }
+
+    buffer_free(file);
+    buffer_free(w.strings);
+    buffer_free(w.types);
+    buffer_free(w.type_refs);
+    buffer_free(w.fields);
+    buffer_free(w.procedures);
+    buffer_free(w.globals);
+    buffer_free(w.statements);
+    buffer_free(w.code);
+    buffer_free(w.pointers);
+    buffer_free(w.pointer_indices);
+}
+
+/***********/
+/* Loading */
+/***********/
+
+/* Types nest deeper than this only in files that were made to blow the C
+   stack. */
+#define MODC_MAX_TYPE_DEPTH 1024
+
+struct modc_loader {
+    struct context *ctx;
+    uint8 *file;
+    size_t size;
+    struct modc_header *header;
+
+    char *strings;
+    struct modc_type *types;
+    int32 *type_refs;
+    struct modc_field *fields;
+    struct modc_code *procedures;
+    struct modc_global *globals;
+    struct modc_statement *statements;
+    uint8 *code;
+
+    /* Code is loaded in the order it was written, and can't overlap, so
+       that no static pointer gets relocated twice. */
+    uint64 code_read;
+    /* What static pointers point at, by type index, built on first use. */
+    struct type **pointer_types;
+    /* Each statement's code, then its deinitialize code. */
+    struct bytecode *statement_code;
+    /* Which procedures some global binds. */
+    bool *bound;
+};
+
+/* The mapping belongs to the context, and everything else was allocated in
+   its arena. */
+void modc_loader_free(struct modc_loader *l) {
+    free(l->pointer_types);
+    free(l->statement_code);
+    free(l->bound);
+    *l = (struct modc_loader){l->ctx};
+}
+
+bool modc_is_compiled(FILE *input) {
+    char magic[4];
+    size_t count = fread(magic, 1, 4, input);
+    rewind(input);
+    return count == 4 && memcmp(magic, MODC_MAGIC, 4) == 0;
+}
+
+void modc_corrupt(char *message) {
+    fprintf(errout, "Error: Compiled program is corrupt: %s\n", message);
+    error_exit();
+}
+
+/* Maps the whole file, copy on write, since static pointers are patched in
+   place. */
+void *modc_map(char *path, size_t *size) {
+    void *result = NULL;
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+        *size = info.st_size;
+        result = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (result == MAP_FAILED) result = NULL;
+    }
+    if (fd >= 0) close(fd);
+#elif defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER file_size;
+    if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &file_size)
+        && file_size.QuadPart > 0)
+    {
+        HANDLE mapping =
+            CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping) {
+            *size = file_size.QuadPart;
+            result = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    FILE *file = fopen(path, "rb");
+    if (file && fseek(file, 0, SEEK_END) == 0) {
+        long file_size = ftell(file);
+        rewind(file);
+        if (file_size > 0) {
+            *size = file_size;
+            result = malloc(*size);
+            if (fread(result, 1, *size, file) != *size) {
+                free(result);
+                result = NULL;
+            }
+        }
+    }
+    if (file) fclose(file);
+#endif
+    if (!result) {
+        fprintf(errout, "Error: couldn't map file \"%s\"\n", path);
+        error_exit();
+    }
+    return result;
+}
+
+void *modc_section(
+    struct modc_loader *l,
+    struct modc_section section,
+    size_t size
+) {
+    if (section.offset % 8 != 0 || section.offset > l->size
+        || section.count > (l->size - section.offset) / size)
+    {
+        modc_corrupt("A section is out of range.");
+    }
+    return l->file + section.offset;
+}
+
+str modc_string(struct modc_loader *l, uint32 offset, uint32 length) {
+    if (offset > l->header->strings.count
+        || length > l->header->strings.count - offset)
+    {
+        modc_corrupt("A name is out of range.");
+    }
+    return (str){l->strings + offset, length};
+}
+
+void modc_load_type(
+    struct modc_loader *l,
+    int32 index,
+    int32 limit,
+    int depth,
+    struct type *out
+);
+
+void modc_load_type_refs(
+    struct modc_loader *l,
+    int32 parent,
+    int32 first,
+    int32 count,
+    int depth,
+    struct type_buffer *out
+) {
+    if (first < 0 || count < 0
+        || (uint64)first + count > l->header->type_refs.count)
+    {
+        modc_corrupt("A type's elements are out of range.");
+    }
+    *out = (struct type_buffer){0};
+    buffer_setcount(*out, count);
+    for (int32 i = 0; i < count; i++) {
+        modc_load_type(l, l->type_refs[first + i], parent, depth + 1,
+            &out->data[i]);
+    }
+}
+
+/* Types can only refer to types that came before them, so index has to be
+   below limit. */
+void modc_load_type(
+    struct modc_loader *l,
+    int32 index,
+    int32 limit,
+    int depth,
+    struct type *out
+) {
+    if (index < 0 || index >= limit) modc_corrupt("Bad type index.");
+    if (depth > MODC_MAX_TYPE_DEPTH) modc_corrupt("Types nest too deeply.");
+    struct modc_type *it = &l->types[index];
+
+    *out = (struct type){0};
+    out->connective = it->connective;
+    out->total_size = it->total_size;
+    switch (it->connective) {
+    case TYPE_INT:
+    case TYPE_UINT:
+    case TYPE_WORD:
+    case TYPE_FLOAT:
+        if (it->word_size < 0 || it->word_size > 3) {
+            modc_corrupt("Bad word size.");
+        }
+        out->word_size = it->word_size;
+        break;
+    case TYPE_TUPLE:
+        modc_load_type_refs(l, index, it->first, it->count, depth,
+            &out->elements);
+        break;
+    case TYPE_RECORD:
+        if (it->first < 0 || it->count < 0
+            || (uint64)it->first + it->count > l->header->fields.count)
+        {
+            modc_corrupt("A record's fields are out of range.");
+        }
+        buffer_setcount(out->fields, it->count);
+        for (int32 i = 0; i < it->count; i++) {
+            struct modc_field *field = &l->fields[it->first + i];
+            out->fields.data[i].name =
+                modc_string(l, field->name, field->name_length);
+            modc_load_type(l, field->type, index, depth + 1,
+                &out->fields.data[i].type);
+        }
+        break;
+    case TYPE_ARRAY:
+        out->inner = arena_alloc(sizeof(struct type));
+        modc_load_type(l, it->first, index, depth + 1, out->inner);
+        break;
+    case TYPE_PROCEDURE:
+        modc_load_type_refs(l, index, it->first, it->count, depth,
+            &out->proc.inputs);
+        modc_load_type_refs(l, index, it->output_first, it->output_count,
+            depth, &out->proc.outputs);
+        break;
+    default:
+        modc_corrupt("Unknown type connective.");
+    }
+}
+
+struct type *modc_pointer_type(struct modc_loader *l, int64 index) {
+    if (index < 0 || index >= l->header->types.count) {
+        modc_corrupt("Static pointer to a type that doesn't exist.");
+    }
+    if (!l->pointer_types[index]) {
+        struct type *type = arena_alloc(sizeof(struct type));
+        modc_load_type(l, index, index + 1, 0, type);
+        l->pointer_types[index] = type;
+    }
+    return l->pointer_types[index];
+}
+
+/* Returns where count items of the given size start in the code section,
+   after the code that was already loaded. */
+void *modc_code_range(
+    struct modc_loader *l,
+    uint64 offset,
+    uint64 count,
+    size_t size
+) {
+    uint64 code_size = l->header->code.count;
+    if (offset % 8 != 0 || offset < l->code_read || offset > code_size
+        || count > (code_size - offset) / size)
+    {
+        modc_corrupt("Code is out of range.");
+    }
+    l->code_read = offset + count * size;
+    return l->code + offset;
+}
+
+/* The result points into the mapping, with a capacity of 0, so that
+   bytecode_free leaves it alone. */
+struct bytecode modc_load_code(struct modc_loader *l, struct modc_code *code) {
+    struct bytecode result = {0};
+    result.instructions.data = modc_code_range(l, code->instructions,
+        code->instruction_count, sizeof(struct packed_instruction));
+    result.instructions.count = code->instruction_count;
+    result.constants.data = modc_code_range(l, code->constants,
+        code->constant_count, sizeof(int64));
+    result.constants.count = code->constant_count;
+    result.frame_size = code->frame_size;
+    result.elided_refcounts = code->elided_refcounts;
+    result.stack_arrays = code->stack_arrays;
+
+    bool *relocated = calloc(code->constant_count + 1, sizeof(bool));
+    for (size_t i = 0; i < result.instructions.count; i++) {
+        for (int k = 0; k < 3; k++) {
+            int32 *x = modc_static_pointer(&result.instructions.data[i], k);
+            if (!x) continue;
+            if (*x < 0 || *x >= result.constants.count) {
+                modc_corrupt("Constant pool index out of range.");
+            }
+            if (relocated[*x]) continue;
+            int64 *constant = &result.constants.data[*x];
+            *constant = (int64)modc_pointer_type(l, *constant);
+            relocated[*x] = true;
+        }
+    }
+    free(relocated);
+    return result;
+}
+
+struct record_entry modc_load_global(struct modc_loader *l, size_t index) {
+    struct modc_global *global = &l->globals[index];
+    struct record_entry result;
+    result.name = modc_string(l, global->name, global->name_length);
+    modc_load_type(l, global->type, l->header->types.count, 0, &result.type);
+    result.is_var = global->is_var != 0;
+    return result;
+}
+
+/* Where the globals of each statement start, or where the globals end after
+   the last one. */
+size_t modc_statement_globals_start(struct modc_loader *l, size_t statement) {
+    if (statement == l->header->statements.count) {
+        return l->header->builtin_global_count + l->header->globals.count;
+    }
+    return l->statements[statement].globals_start;
+}
+
+/* Run the compiled program at path in the context of l, which the calling
+   thread has entered, printing each global as it is made, like main does for
+   source. What l allocates is left for modc_loader_free, so that it can be
+   freed after an error too. */
+void modc_load_and_run(struct modc_loader *l, char *path) {
+    struct context *ctx = l->ctx;
+    allocation_arena = &ctx->arena;
+    l->file = modc_map(path, &l->size);
+    ctx->mapping = l->file;
+    ctx->mapping_size = l->size;
+
+    if (l->size < sizeof(struct modc_header)
+        || memcmp(l->file, MODC_MAGIC, 4) != 0)
+    {
+        fprintf(errout, "Error: \"%s\" isn't a compiled program.\n", path);
+        error_exit();
+    }
+    l->header = (struct modc_header*)l->file;
+    struct modc_header *header = l->header;
+    if (header->version != MODC_VERSION
+        || header->operation_count != OP_COUNT
+        || header->instruction_size != sizeof(struct packed_instruction))
+    {
+        fprintf(errout, "Error: \"%s\" was compiled by a different version "
+            "of modlang.\n", path);
+        error_exit();
+    }
+    if (header->builtin_procedure_count != ctx->builtin_procedure_count
+        || header->builtin_global_count != ctx->builtin_global_count)
+    {
+        fprintf(errout, "Error: \"%s\" was compiled with different "
+            "builtins.\n", path);
+        error_exit();
+    }
+    if (modc_checksum(l->file + sizeof(struct modc_header),
+        l->size - sizeof(struct modc_header)) != header->checksum)
+    {
+        modc_corrupt("The checksum doesn't match.");
+    }
+
+    l->strings = modc_section(l, header->strings, 1);
+    l->types = modc_section(l, header->types, sizeof(struct modc_type));
+    l->type_refs = modc_section(l, header->type_refs, sizeof(int32));
+    l->fields = modc_section(l, header->fields, sizeof(struct modc_field));
+    l->procedures =
+        modc_section(l, header->procedures, sizeof(struct modc_code));
+    l->globals = modc_section(l, header->globals, sizeof(struct modc_global));
+    l->statements =
+        modc_section(l, header->statements, sizeof(struct modc_statement));
+    l->code = modc_section(l, header->code, 1);
+    if (header->types.count > INT32_MAX) modc_corrupt("Too many types.");
+    l->pointer_types = calloc(header->types.count + 1, sizeof(struct type*));
+
+    for (size_t i = 0; i < header->procedures.count; i++) {
+        struct procedure *p = buffer_addn(ctx->procedures, 1);
+        *p = (struct procedure){0};
+        p->code = modc_load_code(l, &l->procedures[i]);
+    }
+    l->statement_code =
+        malloc((header->statements.count * 2 + 1) * sizeof(struct bytecode));
+    for (size_t i = 0; i < header->statements.count; i++) {
+        struct modc_statement *it = &l->statements[i];
+        l->statement_code[2 * i] = modc_load_code(l, &it->code);
+        l->statement_code[2 * i + 1] =
+            modc_load_code(l, &it->deinitialize_code);
+    }
+
+    /* Statements take their globals in order, and every other global binds a
+       procedure, each exactly once. All of those procedures are checked up
+       front, since any statement might call any of them. */
+    size_t global_end = modc_statement_globals_start(l,
+        header->statements.count);
+    l->bound = calloc(ctx->procedures.count, sizeof(bool));
+    size_t global = header->builtin_global_count;
+    for (size_t i = 0; i <= header->statements.count; i++) {
+        size_t start = modc_statement_globals_start(l, i);
+        if (start < global || start > global_end) {
+            modc_corrupt("A statement's globals are out of range.");
+        }
+        for (; global < start; global++) {
+            struct modc_global *it =
+                &l->globals[global - header->builtin_global_count];
+            if (it->value < (int64)ctx->builtin_procedure_count
+                || it->value >= (int64)ctx->procedures.count
+                || l->bound[it->value])
+            {
+                modc_corrupt("A global is bound to a bad procedure.");
+            }
+            l->bound[it->value] = true;
+            /* The procedure can only see the globals bound before it. */
+            struct bytecode_limits limits = {ctx->procedures.count, global};
+            check_bytecode(&ctx->procedures.data[it->value].code, limits);
+        }
+        if (i == header->statements.count) break;
+
+        struct modc_statement *it = &l->statements[i];
+        if (it->globals_end < it->globals_start
+            || it->globals_end > global_end)
+        {
+            modc_corrupt("A statement's globals are out of range.");
+        }
+        global = it->globals_end;
+    }
+    for (size_t i = ctx->builtin_procedure_count;
+        i < ctx->procedures.count; i++)
+    {
+        if (!l->bound[i]) {
+            modc_corrupt("A procedure isn't bound to any global.");
+        }
+    }
+
+    struct call_stack *call_stack = &ctx->call_stack;
+    struct record_table *bindings = &ctx->bindings;
+    global = header->builtin_global_count;
+    for (size_t i = 0; i <= header->statements.count; i++) {
+        size_t start = modc_statement_globals_start(l, i);
+        for (; global < start; global++) {
+            struct modc_global *it =
+                &l->globals[global - header->builtin_global_count];
+            union variable_contents value = {.val64 = it->value};
+            bind_global(bindings, call_stack,
+                modc_load_global(l, global - header->builtin_global_count),
+                value);
+        }
+        if (i == header->statements.count) break;
+
+        struct modc_statement *it = &l->statements[i];
+        for (; global < it->globals_end; global++) {
+            buffer_push(*bindings,
+                modc_load_global(l, global - header->builtin_global_count));
+            bindings->global_count = bindings->count;
+        }
+
+        struct bytecode *code = &l->statement_code[2 * i];
+        struct bytecode *deinitialize_code = &l->statement_code[2 * i + 1];
+        struct bytecode_limits limits =
+            {ctx->procedures.count, bindings->global_count};
+        check_bytecode(code, limits);
+        check_bytecode(deinitialize_code, limits);
+
+        int prev_global_count = call_stack->vars.global_count;
+        allocation_arena = NULL;
+        context_execute(ctx, code);
+        context_execute(ctx, deinitialize_code);
+        context_end_statement(ctx);
+        allocation_arena = &ctx->arena;
+
+        if (call_stack->vars.global_count != bindings->global_count) {
+            fprintf(errout, "Warning: Executing statements resulted in "
+                    "%llu global variables being initialized, when %llu "
+                    "global variables are in scope.\n",
+                    (long long)call_stack->vars.global_count,
+                    (long long)bindings->global_count);
+            call_stack->vars.global_count = bindings->global_count;
+        }
+
+        for (int k = prev_global_count; k < call_stack->vars.global_count;
+            k++)
+        {
+            fputstr(bindings->data[k].name, stdout);
+            printf(" = ");
+            print_call_stack_value(call_stack->vars.data[k].value,
+                &bindings->data[k].type);
+            printf("\n");
+        }
+    }
+
+    allocation_arena = NULL;
+}
+
+/* Main runs compiled programs with no recover point, so errors just exit. */
+void modc_run(struct context *ctx, char *path) {
+    struct modc_loader l = {ctx};
+    modc_load_and_run(&l, path);
+    modc_loader_free(&l);
+}
+
+/* Like context_run_source, for a compiled program, which has to be the only
+   one that ctx runs. A file that turns out to be corrupt is an error like any
+   other, so this returns false for it. */
+bool context_run_compiled(struct context *ctx, char *path) {
+    if (ctx->errors.failed) return false;
+
+    struct context_thread_state saved;
+    error_jump_buffer recover;
+    struct modc_loader l = {ctx};
+
+    context_enter(ctx, &saved, &recover);
+    if (error_catch(recover)) {
+        modc_loader_free(&l);
+        context_leave(ctx, &saved);
+        return false;
+    }
+
+    modc_load_and_run(&l, path);
+    modc_loader_free(&l);
+    context_leave(ctx, &saved);
+    return true;
+}
+
+
+#endif
@@ -0,0 +1,172 @@
+/* Tests for loading compiled programs, which tests.sh runs on a program it
+   compiled from data/calltargets.mod. Each damaged copy of it has to be
+   turned away with an error, rather than crashing or running anyway. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "types.h"
+
+#include "compiler_primitives.h"
+#include "bytecode.h"
+#include "tokenizer.h"
+#include "expressions.h"
+#include "statements.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "builtins.h"
+#include "context.h"
+#include "emit_c.h"
+#include "modc.h"
+
+int test_failures = 0;
+
+void test_check(bool ok, char *message) {
+    if (!ok) {
+        fprintf(stderr, "Loader test failed: %s\n", message);
+        test_failures += 1;
+    }
+}
+
+struct char_buffer test_read_file(char *path) {
+    struct char_buffer result = {0};
+    FILE *file = fopen(path, "rb");
+    if (!file) return result;
+    char chunk[4096];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        char *to = buffer_addn(result, count);
+        memcpy(to, chunk, count);
+    }
+    fclose(file);
+    return result;
+}
+
+/* Runs size bytes of data as a compiled program, and says whether it ran.
+   If it didn't, the error has to mention expected. */
+bool test_run(char *scratch, char *data, size_t size, char *expected) {
+    FILE *file = fopen(scratch, "wb");
+    if (!file || fwrite(data, 1, size, file) != size) {
+        fprintf(stderr, "Loader test couldn't write \"%s\".\n", scratch);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    struct context *ctx = context_create(DATA_STACK_DEFAULT_SIZE);
+    FILE *errors = tmpfile();
+    ctx->errors.output = errors;
+    bool ok = context_run_compiled(ctx, scratch);
+    context_free(ctx);
+
+    char message[256] = {0};
+    rewind(errors);
+    size_t count = fread(message, 1, sizeof(message) - 1, errors);
+    message[count] = 0;
+    fclose(errors);
+    if (!ok && expected && !strstr(message, expected)) {
+        fprintf(stderr, "Loader test expected \"%s\", got: %s", expected,
+            message);
+        test_failures += 1;
+    }
+    return ok;
+}
+
+/* Sets the checksum back to what it should be, as if the file was edited on
+   purpose. */
+void test_rechecksum(char *data, size_t size) {
+    struct modc_header *header = (struct modc_header*)data;
+    header->checksum = modc_checksum((uint8*)data + sizeof(*header),
+        size - sizeof(*header));
+}
+
+/* Finds the first statement that copies one global into another, like
+   f := add_one, and makes it copy a constant that isn't a procedure instead.
+   That still verifies, so only the call through f can tell. */
+bool test_break_call_target(char *data) {
+    struct modc_header *header = (struct modc_header*)data;
+    struct modc_statement *statements =
+        (struct modc_statement*)(data + header->statements.offset);
+    char *code = data + header->code.offset;
+    for (size_t i = 0; i < header->statements.count; i++) {
+        struct packed_instruction *instructions = (struct packed_instruction*)
+            (code + statements[i].code.instructions);
+        for (uint32 k = 0; k < statements[i].code.instruction_count; k++) {
+            struct packed_instruction *it = &instructions[k];
+            if (generic_operation(it->op) != OP_MOV
+                || OUTPUT_TYPE(it) != REF_GLOBAL || ARG1_TYPE(it) != REF_GLOBAL)
+            {
+                continue;
+            }
+            it->ref_types =
+                PACK_REF_TYPES(REF_GLOBAL, REF_CONSTANT, ARG2_TYPE(it));
+            it->arg1 = 1000000;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: modc_test <compiled program>\n");
+        return EXIT_FAILURE;
+    }
+    struct char_buffer file = test_read_file(argv[1]);
+    test_check(file.count > sizeof(struct modc_header), "read the program");
+    if (test_failures > 0) return EXIT_FAILURE;
+
+    size_t path_length = strlen(argv[1]);
+    char *scratch = malloc(path_length + 9);
+    memcpy(scratch, argv[1], path_length);
+    memcpy(scratch + path_length, ".corrupt", 9);
+    char *copy = malloc(file.count);
+
+    test_check(test_run(scratch, file.data, file.count, NULL), "intact");
+
+    size_t cuts[] = {4, sizeof(struct modc_header) - 1,
+        sizeof(struct modc_header), file.count / 2, file.count - 1};
+    for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+        test_check(!test_run(scratch, file.data, cuts[i], "Error"),
+            "truncated");
+    }
+
+    /* Any byte after the header, which is what the checksum covers. */
+    size_t step = file.count / 61 + 1;
+    for (size_t i = sizeof(struct modc_header); i < file.count; i += step) {
+        memcpy(copy, file.data, file.count);
+        copy[i] ^= 0x5a;
+        test_check(!test_run(scratch, copy, file.count, "checksum"),
+            "flipped byte");
+    }
+
+    memcpy(copy, file.data, file.count);
+    ((struct modc_header*)copy)->version += 1;
+    test_check(!test_run(scratch, copy, file.count, "different version"),
+        "wrong version");
+
+    /* Past the checksum, a section that runs off the end. */
+    memcpy(copy, file.data, file.count);
+    ((struct modc_header*)copy)->code.count += 8;
+    test_check(!test_run(scratch, copy, file.count, "out of range"),
+        "section out of range");
+
+    memcpy(copy, file.data, file.count);
+    test_check(test_break_call_target(copy), "find a copied procedure");
+    test_rechecksum(copy, file.count);
+    test_check(!test_run(scratch, copy, file.count, "Tried to call procedure"),
+        "call through a broken variable");
+
+    remove(scratch);
+    free(scratch);
+    free(copy);
+    buffer_free(file);
+    if (test_failures > 0) {
+        fprintf(stderr, "%d loader tests failed.\n", test_failures);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef MODLANG_H
+#define MODLANG_H
+
+/* The library interface. libmodlang.c compiles everything else into one
+   library, see build.bat, and programs that embed it only include this.
+
+   A program is compiled once, which runs its top level statements, and then
+   its procedures can be called as many times as needed. Each program has its
+   own memory, so different threads can use different programs at the same
+   time, but only one thread can use a given program at a time. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct modlang_program;
+
+/* The arguments and results that can be passed to and from procedures. */
+enum modlang_type {
+    MODLANG_INT,
+    MODLANG_INT_ARRAY,
+};
+
+struct modlang_array {
+    int64_t *data;
+    int64_t count;
+};
+
+/* Which member is used comes from the procedure's signature. Arrays passed
+   in are copied, and are still the caller's. Arrays that come back are
+   copied into memory from malloc, which the caller frees. */
+union modlang_value {
+    int64_t integer;
+    struct modlang_array array;
+};
+
+#define MODLANG_MAX_VALUES 16
+
+struct modlang_signature {
+    int arg_count;
+    enum modlang_type args[MODLANG_MAX_VALUES];
+    int result_count;
+    enum modlang_type results[MODLANG_MAX_VALUES];
+};
+
+struct modlang_options {
+    /* 0 for the default. */
+    size_t data_stack_size;
+    bool jit;
+    /* Where errors get written, or NULL for stderr. */
+    FILE *errors;
+};
+
+/* Compile and run source, with NULL options for the defaults. Returns NULL
+   if anything went wrong, once the error has been written. */
+struct modlang_program *modlang_compile(
+    const char *source,
+    size_t length,
+    const struct modlang_options *options
+);
+
+/* Find a procedure by name, or -1 if there isn't one that takes and returns
+   only what modlang_value can hold. */
+int64_t modlang_lookup(
+    struct modlang_program *program,
+    const char *name,
+    struct modlang_signature *signature
+);
+
+/* Call a procedure found by modlang_lookup, with as many args and results as
+   its signature has. Returns false if the call failed, once the error has
+   been written. The program can still be used, but whatever the failed call
+   had allocated is only freed with the program. */
+bool modlang_call(
+    struct modlang_program *program,
+    int64_t procedure,
+    const union modlang_value *args,
+    union modlang_value *results
+);
+
+void modlang_free(struct modlang_program *program);
+
+#endif
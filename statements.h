@@ -21,20 +21,20 @@ struct intermediate_buffer parse_statement(
     struct token tk = get_token(tokenizer);
     if (tk.id == TOKEN_RETURN) {
         if (!return_signature) {
-            fprintf(stderr, "Error at line %d, %d: Tried to return from the "
+            fprintf(errout, "Error at line %d, %d: Tried to return from the "
                 "top level of a file.\n", tk.row, tk.column);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
 
         struct pattern lhs = parse_expression(tokenizer, end_on_eol);
 
         tk = get_token(tokenizer);
         if (tk.id != ';') {
-            fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+            fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                     tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\" after expression.\n");
-            exit(EXIT_FAILURE);
+            fputstr(tk.it, errout);
+            fprintf(errout, "\" after expression.\n");
+            error_exit();
         }
 
         struct intermediate_buffer intermediates = compile_expression(
@@ -74,11 +74,11 @@ struct intermediate_buffer parse_statement(
             tk = get_token(tokenizer);
             if (tk.id != ';') {
                 /* TODO: Make a token assert proc? */
-                fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+                fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                     tk.row, tk.column);
-                fputstr(tk.it, stderr);
-                fprintf(stderr, "\"\n");
-                exit(EXIT_FAILURE);
+                fputstr(tk.it, errout);
+                fprintf(errout, "\"\n");
+                error_exit();
             }
 
             /* TODO: reuse intermediates buffer. */
@@ -99,11 +99,11 @@ struct intermediate_buffer parse_statement(
             tk = get_token(tokenizer);
             if (tk.id != ';') {
                 /* TODO: Make a token assert proc? */
-                fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+                fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                     tk.row, tk.column);
-                fputstr(tk.it, stderr);
-                fprintf(stderr, "\"\n");
-                exit(EXIT_FAILURE);
+                fputstr(tk.it, errout);
+                fprintf(errout, "\"\n");
+                error_exit();
             }
 
             compile_assignment(out, bindings, &lhs, &rhs);
@@ -111,11 +111,11 @@ struct intermediate_buffer parse_statement(
             buffer_free(lhs);
             buffer_free(rhs);
         } else {
-            fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+            fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                     tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\" after expression.\n");
-            exit(EXIT_FAILURE);
+            fputstr(tk.it, errout);
+            fprintf(errout, "\" after expression.\n");
+            error_exit();
         }
     }
 
@@ -129,9 +129,9 @@ struct intermediate_buffer parse_statement(
 
 struct type parse_type_name(struct token tk) {
     if (!str_eq(tk.it, from_cstr("Int"))) {
-        fprintf(stderr, "Error at line %d, %d: Currently only Int, array, "
+        fprintf(errout, "Error at line %d, %d: Currently only Int, array, "
             "tuple, and record parameters are supported.\n", tk.row, tk.column);
-        exit(EXIT_FAILURE);
+        error_exit();
     }
 
     return type_int64;
@@ -146,11 +146,11 @@ struct type parse_type(struct tokenizer *tokenizer) {
         tk = get_token(tokenizer);
 
         if (tk.id != ']') {
-            fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+            fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                 tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\" in parameter/output type.\n");
-            exit(EXIT_FAILURE);
+            fputstr(tk.it, errout);
+            fprintf(errout, "\" in parameter/output type.\n");
+            error_exit();
         }
 
         return result;
@@ -169,8 +169,8 @@ struct type parse_type(struct tokenizer *tokenizer) {
                 tk = get_token(tokenizer);
                 if (tk.id == ':') {
                     if (got_element && result.connective != TYPE_RECORD) {
-                        fprintf(stderr, "Error at line %d, %d: Cannot mix anonymous elements with named fields in a single tuple/record type.", tk.row, tk.column);
-                        exit(EXIT_FAILURE);
+                        fprintf(errout, "Error at line %d, %d: Cannot mix anonymous elements with named fields in a single tuple/record type.", tk.row, tk.column);
+                        error_exit();
                     }
                     struct type ty = parse_type(tokenizer);
 
@@ -184,8 +184,8 @@ struct type parse_type(struct tokenizer *tokenizer) {
                     result.total_size += ty.total_size;
                 } else {
                     if (got_element && result.connective != TYPE_TUPLE) {
-                        fprintf(stderr, "Error at line %d, %d: Cannot mix anonymous elements with named fields in a single tuple/record type.", tk.row, tk.column);
-                        exit(EXIT_FAILURE);
+                        fprintf(errout, "Error at line %d, %d: Cannot mix anonymous elements with named fields in a single tuple/record type.", tk.row, tk.column);
+                        error_exit();
                     }
                     struct type ty = parse_type_name(name_tk);
 
@@ -200,8 +200,8 @@ struct type parse_type(struct tokenizer *tokenizer) {
                 }
             } else {
                 if (got_element && result.connective != TYPE_TUPLE) {
-                    fprintf(stderr, "Error at line %d, %d: Cannot mix anonymous elements with named fields in a single tuple/record type.", tk.row, tk.column);
-                    exit(EXIT_FAILURE);
+                    fprintf(errout, "Error at line %d, %d: Cannot mix anonymous elements with named fields in a single tuple/record type.", tk.row, tk.column);
+                    error_exit();
                 }
 
                 put_token_back(tokenizer, tk);
@@ -218,17 +218,17 @@ struct type parse_type(struct tokenizer *tokenizer) {
 
             if (tk.id != ',') {
                 if (got_element && result.connective == TYPE_RECORD) {
-                    fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+                    fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                         tk.row, tk.column);
-                    fputstr(tk.it, stderr);
-                    fprintf(stderr, "\" in record type.\n");
-                    exit(EXIT_FAILURE);
+                    fputstr(tk.it, errout);
+                    fprintf(errout, "\" in record type.\n");
+                    error_exit();
                 } else {
-                    fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+                    fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                         tk.row, tk.column);
-                    fputstr(tk.it, stderr);
-                    fprintf(stderr, "\" in record type.\n");
-                    exit(EXIT_FAILURE);
+                    fputstr(tk.it, errout);
+                    fprintf(errout, "\" in record type.\n");
+                    error_exit();
                 }
             }
         }
@@ -237,11 +237,11 @@ struct type parse_type(struct tokenizer *tokenizer) {
     }
 
     if (tk.id != TOKEN_ALPHANUM) {
-        fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+        fprintf(errout, "Error at line %d, %d: Unexpected token \"",
             tk.row, tk.column);
-        fputstr(tk.it, stderr);
-        fprintf(stderr, "\" in parameter/output type.\n");
-        exit(EXIT_FAILURE);
+        fputstr(tk.it, errout);
+        fprintf(errout, "\" in parameter/output type.\n");
+        error_exit();
     }
 
     return parse_type_name(tk);
@@ -254,11 +254,11 @@ struct record_entry parse_procedure(
 ) {
     struct token tk = get_token(tokenizer);
     if (tk.id != TOKEN_ALPHANUM) {
-        fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+        fprintf(errout, "Error at line %d, %d: Unexpected token \"",
             tk.row, tk.column);
-        fputstr(tk.it, stderr);
-        fprintf(stderr, "\" after function/procedure keyword.\n");
-        exit(EXIT_FAILURE);
+        fputstr(tk.it, errout);
+        fprintf(errout, "\" after function/procedure keyword.\n");
+        error_exit();
     }
 
     str proc_name = tk.it;
@@ -267,11 +267,11 @@ struct record_entry parse_procedure(
 
     tk = get_token(tokenizer);
     if (tk.id != '(') {
-        fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+        fprintf(errout, "Error at line %d, %d: Unexpected token \"",
             tk.row, tk.column);
-        fputstr(tk.it, stderr);
-        fprintf(stderr, "\" after function/procedure keyword.\n");
-        exit(EXIT_FAILURE);
+        fputstr(tk.it, errout);
+        fprintf(errout, "\" after function/procedure keyword.\n");
+        error_exit();
     }
 
     struct type_buffer input_types = {0};
@@ -290,20 +290,20 @@ struct record_entry parse_procedure(
         }
 
         if (tk.id != TOKEN_ALPHANUM) {
-            fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+            fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                 tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\" in parameter list.\n");
+            fputstr(tk.it, errout);
+            fprintf(errout, "\" in parameter list.\n");
         }
         str name = tk.it;
 
         tk = get_token(tokenizer);
         if (tk.id != ':') {
-            fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+            fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                 tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\" in parameter list.\n");
-            exit(EXIT_FAILURE);
+            fputstr(tk.it, errout);
+            fprintf(errout, "\" in parameter list.\n");
+            error_exit();
         }
 
         struct type ty = parse_type(tokenizer);
@@ -321,11 +321,11 @@ struct record_entry parse_procedure(
         }
         /* else */
         if (tk.id != ',') {
-            fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+            fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                 tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\" in parameter list.\n");
-            exit(EXIT_FAILURE);
+            fputstr(tk.it, errout);
+            fprintf(errout, "\" in parameter list.\n");
+            error_exit();
         }
     }
     bindings->arg_count = bindings->count - bindings->global_count;
@@ -352,11 +352,11 @@ struct record_entry parse_procedure(
 
         struct token tk = get_token(tokenizer);
         if (tk.id != ';') {
-            fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+            fprintf(errout, "Error at line %d, %d: Unexpected token \"",
                 tk.row, tk.column);
-            fputstr(tk.it, stderr);
-            fprintf(stderr, "\" in procedure/function body.\n");
-            exit(EXIT_FAILURE);
+            fputstr(tk.it, errout);
+            fprintf(errout, "\" in procedure/function body.\n");
+            error_exit();
         }
 
         struct intermediate_buffer intermediates = compile_expression(
@@ -372,10 +372,10 @@ struct record_entry parse_procedure(
             for (int i = 0; i < intermediates.count; i++) {
                 struct type *it = &intermediates.data[i].type;
                 if (it->connective == TYPE_TUPLE || it->connective == TYPE_RECORD) {
-                    fprintf(stderr, "Error on line %d: Currently one-line "
+                    fprintf(errout, "Error on line %d: Currently one-line "
                         "functions/procedures require signatures if their "
                         "output/s include a tuple or record type.", tk.row);
-                    exit(EXIT_FAILURE);
+                    error_exit();
                 }
                 buffer_push(output_types, *it);
             }
@@ -398,7 +398,7 @@ struct record_entry parse_procedure(
             if (have_returned && !have_warned) {
                 /* Got a statement after we already returned, print a
                    warning. */
-                fprintf(stderr, "Warning at line %d, %d: Statement cannot be "
+                fprintf(errout, "Warning at line %d, %d: Statement cannot be "
                     "reached.\n", tk.row, tk.column);
                 have_warned = true;
             }
@@ -425,18 +425,18 @@ struct record_entry parse_procedure(
                 struct intermediate_buffer intermediates = intermediates_start(bindings);
                 compile_return(out, bindings, &intermediates);
             } else {
-                fprintf(stderr, "Error at line %d, %d: The function \"",
+                fprintf(errout, "Error at line %d, %d: The function \"",
                     tk.row, tk.column);
-                fputstr(proc_name, stderr);
-                fprintf(stderr, "\" might not return a value.\n");
+                fputstr(proc_name, errout);
+                fprintf(errout, "\" might not return a value.\n");
             }
         }
     } else {
-        fprintf(stderr, "Error at line %d, %d: Unexpected token \"",
+        fprintf(errout, "Error at line %d, %d: Unexpected token \"",
             tk.row, tk.column);
-        fputstr(tk.it, stderr);
-        fprintf(stderr, "\" in parameter list.\n");
-        exit(EXIT_FAILURE);
+        fputstr(tk.it, errout);
+        fprintf(errout, "\" in parameter list.\n");
+        error_exit();
     }
 
     bindings->count = prev_binding_count;
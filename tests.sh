@@ -2,6 +2,7 @@
 
 succeeded=0
 failed=0
+scratch=$(mktemp -d)
 for F in data/*; do
     if tcc -run main.c "$F" > /dev/null
     then
@@ -12,9 +13,82 @@ for F in data/*; do
     fi
 done
 
+# A compiled program has to print just what its source does.
+for F in data/*; do
+    if tcc -run main.c -compile-only -o "$scratch/program.modc" "$F" \
+        && tcc -run main.c "$F" > "$scratch/source.txt" \
+        && tcc -run main.c "$scratch/program.modc" > "$scratch/compiled.txt" \
+        && cmp -s "$scratch/source.txt" "$scratch/compiled.txt"
+    then
+        succeeded=$((succeeded + 1))
+    else
+        echo "File $F gave different results once compiled!"
+        failed=$((failed + 1))
+    fi
+done
+
+if tcc -run main.c -compile-only -o "$scratch/calltargets.modc" \
+        data/calltargets.mod \
+    && tcc -run modc_test.c "$scratch/calltargets.modc" > /dev/null
+then
+    succeeded=$((succeeded + 1))
+else
+    echo "The loader tests gave an error!"
+    failed=$((failed + 1))
+fi
+
+# The JIT is only built by gcc, and the C that -emit-c writes needs a
+# compiler too, so these passes only run where gcc is around. Each one has to
+# print just what the interpreter does.
+check_same() {
+    if "$@" > "$scratch/actual.txt" \
+        && cmp -s "$scratch/expected.txt" "$scratch/actual.txt"
+    then
+        succeeded=$((succeeded + 1))
+    else
+        echo "File $F gave different results with $*!"
+        failed=$((failed + 1))
+    fi
+}
+
+run_emitted() {
+    "$scratch/modlang" -emit-c "$scratch/program.c" "$1" > /dev/null \
+        && gcc -I. -o "$scratch/program" "$scratch/program.c" -lm -lpthread \
+        && "$scratch/program"
+}
+
+if command -v gcc > /dev/null
+then
+    gcc -o "$scratch/modlang" main.c -lm -lpthread
+    # Procedures that run in the interpreter for a few calls first, then
+    # switch to native code.
+    gcc -DMODLANG_JIT_CALL_THRESHOLD=3 -o "$scratch/modlang_warm" main.c \
+        -lm -lpthread
+
+    for F in data/*; do
+        "$scratch/modlang" "$F" > "$scratch/expected.txt" 2> /dev/null
+        check_same "$scratch/modlang" -jit "$F"
+        check_same "$scratch/modlang_warm" -jit "$F"
+        check_same "$scratch/modlang" -defer-release "$F"
+        check_same "$scratch/modlang" -threads 4 "$F"
+        check_same run_emitted "$F"
+    done
+fi
+
+if tcc -run libmodlang_test.c > /dev/null
+then
+    succeeded=$((succeeded + 1))
+else
+    echo "The library tests gave an error!"
+    failed=$((failed + 1))
+fi
+
+rm -rf "$scratch"
+
 if [[ "$failed" = 0 ]]
 then
-    echo "All $succeeded files in data/ ran successfully!"
+    echo "All $succeeded runs of the files in data/, and the library and loader"
+    echo "tests, ran successfully!"
 else
     echo
     echo "$failed failed, $succeeded succeeded."
@@ -3,12 +3,6 @@
 
 #include "types.h"
 
-struct char_buffer {
-    char *data;
-    size_t count;
-    size_t capacity;
-};
-
 struct tokenizer {
     FILE *input;
 
@@ -90,6 +84,7 @@ struct token_definition compound_operators[] = {
     {"<<", TOKEN_LSHIFT},
     {">>", TOKEN_RSHIFT},
     {"++", TOKEN_CONCAT},
+    {"..", TOKEN_RANGE},
 };
 
 bool tokenizer_peek_eol(struct tokenizer *tk) {
@@ -181,13 +176,13 @@ struct token get_token(struct tokenizer *tk) {
     tk->blob_chars_read += 1;
 
     if (c < 32) {
-        fprintf(stderr, "Error at line %d, %d: Non-printable character "
+        fprintf(errout, "Error at line %d, %d: Non-printable character "
             "encountered. (Code: %d)\n", tk->row, tk->column, c);
-        exit(EXIT_FAILURE);
+        error_exit();
     } else if (!IS_PRINTABLE(c)) {
-        fprintf(stderr, "Error at line %d, %d: Non-ASCII character "
+        fprintf(errout, "Error at line %d, %d: Non-ASCII character "
             "encountered.\n", tk->row, tk->column);
-        exit(EXIT_FAILURE);
+        error_exit();
     } else if (IS_ALPHA(c)) {
         while (true) {
             c = tokenizer_peek_char(tk);
@@ -259,8 +254,8 @@ struct token get_token(struct tokenizer *tk) {
 
 void put_token_back(struct tokenizer *tokenizer, struct token tk) {
     if (tokenizer->has_peek_token) {
-        fprintf(stderr, "Error: Tried to put back multiple tokens?\n");
-        exit(EXIT_FAILURE);
+        fprintf(errout, "Error: Tried to put back multiple tokens?\n");
+        error_exit();
     }
 
     tokenizer->peek_token = tk;
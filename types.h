@@ -28,6 +28,52 @@ typedef uint8_t byte;
 
 #define ARRAY_LENGTH(X) (sizeof(X) / sizeof((X)[0]))
 
+/**********/
+/* Errors */
+/**********/
+
+/* Anything that goes wrong, from the tokenizer to the interpreter, gets
+   written to errout, and then calls error_exit. That exits, unless the
+   thread is running a context, see context.h, in which case it jumps back to
+   wherever the context was entered, and the context reports the failure. */
+
+#include <setjmp.h>
+#if defined(__unix__) || defined(__APPLE__)
+/* The signal mask is left alone, so that catching an error costs no system
+   calls. */
+typedef sigjmp_buf error_jump_buffer;
+#define error_catch(BUFFER) sigsetjmp((BUFFER), 0)
+#define error_throw(BUFFER) siglongjmp((BUFFER), 1)
+#else
+typedef jmp_buf error_jump_buffer;
+#define error_catch(BUFFER) setjmp(BUFFER)
+#define error_throw(BUFFER) longjmp((BUFFER), 1)
+#endif
+
+struct error_channel {
+    FILE *output; /* NULL for stderr. */
+    error_jump_buffer *recover; /* NULL to exit. */
+    bool failed;
+};
+
+MODLANG_THREAD_LOCAL struct error_channel *error_channel;
+
+#define errout \
+    (error_channel && error_channel->output ? error_channel->output : stderr)
+
+void error_exit(void) {
+    struct error_channel *channel = error_channel;
+    if (channel && channel->recover) {
+        channel->failed = true;
+        fflush(errout);
+        error_throw(*channel->recover);
+    }
+    exit(EXIT_FAILURE);
+}
+
+/* Print the disassembly and reference counts of everything that runs. */
+MODLANG_THREAD_LOCAL bool debug;
+
 /***********/
 /* Strings */
 /***********/
@@ -37,6 +83,12 @@ typedef struct str {
     size_t length;
 } str;
 
+struct char_buffer {
+    char *data;
+    size_t count;
+    size_t capacity;
+};
+
 bool str_eq(str a, str b) {
     if (a.length != b.length) return false;
     return strncmp(a.data, b.data, a.length) == 0;
@@ -60,9 +112,9 @@ int64 integer_from_string(str it) {
             result *= 10;
             result += c - '0';
         } else {
-            fprintf(stderr, "Error: Got integer literal with unsupported "
+            fprintf(errout, "Error: Got integer literal with unsupported "
                 "character '%c' in it.\n", c);
-            exit(EXIT_FAILURE);
+            error_exit();
         }
     }
 
@@ -99,6 +151,7 @@ enum token_id {
     TOKEN_LSHIFT,
     TOKEN_RSHIFT,
     TOKEN_CONCAT,
+    TOKEN_RANGE,
 
     TOKEN_FUNC,
     TOKEN_PROC,
@@ -166,6 +219,8 @@ struct proc_signature {
     struct type_buffer outputs;
 };
 
+struct type_glue;
+
 struct type {
     enum type_connective connective;
     union {
@@ -176,6 +231,9 @@ struct type {
         struct proc_signature proc;
     };
     int32 total_size;
+    /* Built the first time an array of this type is allocated, see
+       type_glue_of. */
+    struct type_glue *glue;
 };
 
 struct record_entry {
@@ -210,9 +268,9 @@ const struct type type_empty_record = {
 /* TODO: work out a memory arena or reference counting or something to make
    these types safe to copy. */
 struct type type_array_of(struct type entry_type) {
-    struct type result;
+    struct type result = {0};
     result.connective = TYPE_ARRAY;
-    result.inner = malloc(sizeof (struct type));
+    result.inner = arena_alloc(sizeof (struct type));
     *result.inner = entry_type;
     /* TODO: reorganise shared_buffer to be in a place that lets us sizeof it
        from here. */
@@ -222,7 +280,7 @@ struct type type_array_of(struct type entry_type) {
 }
 
 struct type type_proc(struct type_buffer inputs, struct type_buffer outputs) {
-    struct type result;
+    struct type result = {0};
     result.connective = TYPE_PROCEDURE;
     result.proc.inputs = inputs;
     result.proc.outputs = outputs;
@@ -240,7 +298,7 @@ void destroy_type(struct type *it) {
         buffer_free(it->fields);
     } else if (it->connective == TYPE_ARRAY) {
         destroy_type(it->inner);
-        free(it->inner);
+        free_dbg(it->inner);
     }
 };
 
@@ -314,7 +372,7 @@ bool type_eq(struct type *a, struct type *b) {
         }
         return true;
     default:
-        fprintf(stderr, "Warning: Cannot type check unknown type connective "
+        fprintf(errout, "Warning: Cannot type check unknown type connective "
             "%d.\n", a->connective);
         return true;
     }
@@ -324,6 +382,51 @@ bool type_eq(struct type *a, struct type *b) {
 /* Instructions */
 /****************/
 
+/* The compiler only ever emits generic operations, which work out what their
+   operands are at run time. Once code has been lowered, the common 64 bit
+   operations get rewritten into variants that are specialized on the kind of
+   each operand, so the interpreter can index the variable stack directly. The
+   suffix gives the kinds of arg1 and arg2: L for a local or temporary, G for a
+   global, and C for a 32 bit constant. The output of a quickened operation is
+   always a local or temporary. */
+#define QUICKENED_BINARY_OPS(X) \
+    X(OP_EQ, ==) X(OP_NEQ, !=) X(OP_LEQ, <=) X(OP_GEQ, >=) \
+    X(OP_LESS, <) X(OP_GREATER, >) \
+    X(OP_BOR, |) X(OP_BAND, &) X(OP_BXOR, ^) \
+    X(OP_PLUS, +) X(OP_MINUS, -) X(OP_MUL, *)
+/* Constant/constant pairs are left out, since there is no point in them. */
+#define QUICKENED_OPERAND_KINDS(X, OP, SYMBOL) \
+    X(OP, SYMBOL, L, L) X(OP, SYMBOL, L, G) X(OP, SYMBOL, L, C) \
+    X(OP, SYMBOL, G, L) X(OP, SYMBOL, G, G) X(OP, SYMBOL, G, C) \
+    X(OP, SYMBOL, C, L) X(OP, SYMBOL, C, G)
+#define QUICKENED_MOVS(X) X(L) X(G) X(C)
+
+#define QUICKENED_ENUM_ENTRY(OP, SYMBOL, A, B) OP##_##A##B,
+#define QUICKENED_ENUM_OP(OP, SYMBOL) \
+    QUICKENED_OPERAND_KINDS(QUICKENED_ENUM_ENTRY, OP, SYMBOL)
+#define QUICKENED_MOV_ENUM_ENTRY(A) OP_MOV_##A,
+
+/* Fused operations replace the first of a run of instructions that the
+   compiler tends to emit together, and execute the whole run with a single
+   dispatch. The instructions after the first stay where they are, and the
+   fused operation reads its operands from them. These were picked by running
+   the scripts in data/ with MODLANG_PROFILE_OPCODE_PAIRS defined. */
+#define FUSED_PAIRS(X) \
+    X(STACK_ALLOC, POINTER_STORE) \
+    X(POINTER_STORE, POINTER_STORE) \
+    X(ARRAY_OFFSET, POINTER_LOAD) \
+    X(ARRAY_OFFSET, POINTER_COPY) \
+    X(POINTER_OFFSET, POINTER_COPY) \
+    X(POINTER_COPY, STACK_FREE) \
+    X(ASSERT, RET)
+#define FUSED_TRIPLES(X) \
+    X(STACK_ALLOC, POINTER_STORE, POINTER_STORE) \
+    X(ARRAY_OFFSET, POINTER_COPY, STACK_FREE) \
+    X(POINTER_OFFSET, POINTER_COPY, STACK_FREE)
+
+#define FUSED_PAIR_ENUM_ENTRY(A, B) OP_##A##_##B,
+#define FUSED_TRIPLE_ENUM_ENTRY(A, B, C) OP_##A##_##B##_##C,
+
 enum operation {
     OP_NULL,
     OP_MOV,
@@ -350,6 +453,7 @@ enum operation {
 
     OP_CALL,
     OP_RET,
+    OP_TAIL_CALL, /* Call that reuses the current frame, see compile_return. */
 
     OP_ARRAY_ALLOC,
     OP_ARRAY_OFFSET,
@@ -357,6 +461,9 @@ enum operation {
     OP_ARRAY_STORE,
     OP_ARRAY_INDEX,
     OP_ARRAY_CONCAT,
+    /* Views that share their array's buffer, see compile_array_slice. */
+    OP_ARRAY_SLICE_END,
+    OP_ARRAY_SLICE_START,
     OP_DECREMENT_REFCOUNT, /* May be redundant with OP_MOV to REF_NULL */
 
     /* Stack operations, for allocating/freeing tuples and records. */
@@ -374,6 +481,21 @@ enum operation {
     OP_POINTER_DECREMENT_REFCOUNT,
 
     OP_ASSERT,
+    OP_MEMORY_STATS, /* Fills in the record that arg1 points to. */
+    /* Call the procedure in arg2 on every element of the array in arg1,
+       across threads, see Parallel Evaluation in interpreter.h. */
+    OP_PAR_MAP,
+    OP_PAR_REDUCE, /* The output holds the initial value, then the result. */
+
+    /* Quickened operations, see quicken_bytecode. */
+    QUICKENED_BINARY_OPS(QUICKENED_ENUM_OP)
+    QUICKENED_MOVS(QUICKENED_MOV_ENUM_ENTRY)
+
+    /* Fused operations, see fuse_bytecode. */
+    FUSED_PAIRS(FUSED_PAIR_ENUM_ENTRY)
+    FUSED_TRIPLES(FUSED_TRIPLE_ENUM_ENTRY)
+
+    OP_COUNT
 };
 
 enum operation_flags {
@@ -386,7 +508,16 @@ enum operation_flags {
     OP_FLOAT32 = 0x6,
     OP_FLOAT64 = 0x7,
 
-    OP_SHARED_BUFF = 0x8, /* TODO: masks for lifted storage of small arrays? */
+    OP_SHARED_BUFF = 0x8, /* Small arrays may be inline, see shared_buff. */
+    /* With OP_SHARED_BUFF, copy without taking a reference, because the
+       reference is being moved or borrowed. See elide_refcounts. */
+    OP_NO_REFCOUNT = 0x10,
+    /* Take over the reference that arg1 holds, as if it were a temporary.
+       Only OP_ARRAY_CONCAT uses this. See elide_refcounts. */
+    OP_MOVE_ARG1 = 0x20,
+    /* Put the array on the data stack, to be freed with OP_STACK_FREE. Only
+       OP_ARRAY_ALLOC uses this. See place_stack_arrays. */
+    OP_STACK_ARRAY = 0x40,
 };
 
 enum ref_type {
@@ -399,6 +530,9 @@ enum ref_type {
        differently when given REF_TEMPORARY refs. A better name might be
        REF_MOVE or something. */
     REF_TEMPORARY,
+    /* Only appears in packed instructions, as an index into the constant pool,
+       for REF_CONSTANT values that don't fit in 32 bits. */
+    REF_WIDE_CONSTANT,
 };
 
 struct ref {
@@ -420,4 +554,49 @@ struct instruction_buffer {
     size_t capacity;
 };
 
+/* The compiler builds struct instructions, but before anything is executed it
+   gets lowered into this packed form, which is a quarter of the size. Each
+   operand is a 32 bit index or immediate, and its ref_type is packed into
+   three bits of ref_types. Static pointers, and constants that don't fit in 32
+   bits, are stored in the constant pool of the bytecode, and the operand is an
+   index into that pool. */
+struct packed_instruction {
+    uint8 op;
+    uint8 flags;
+    uint16 ref_types;
+    int32 output;
+    int32 arg1;
+    int32 arg2;
+};
+
+#define PACK_REF_TYPES(OUTPUT, ARG1, ARG2) \
+    ((uint16)((OUTPUT) | (ARG1) << 3 | (ARG2) << 6))
+#define OUTPUT_TYPE(INSTR) ((enum ref_type)((INSTR)->ref_types & 0x7))
+#define ARG1_TYPE(INSTR) ((enum ref_type)((INSTR)->ref_types >> 3 & 0x7))
+#define ARG2_TYPE(INSTR) ((enum ref_type)((INSTR)->ref_types >> 6 & 0x7))
+
+struct packed_instruction_buffer {
+    struct packed_instruction *data;
+    size_t count;
+    size_t capacity;
+};
+
+struct constant_pool {
+    int64 *data;
+    size_t count;
+    size_t capacity;
+};
+
+struct bytecode {
+    struct packed_instruction_buffer instructions;
+    struct constant_pool constants;
+    /* How many variables a frame running this code needs, counting from its
+       first argument. See lower_instructions. */
+    int32 frame_size;
+    /* Reference count operations that elide_refcounts removed, for -debug. */
+    int32 elided_refcounts;
+    /* Arrays that place_stack_arrays put on the data stack, for -debug. */
+    int32 stack_arrays;
+};
+
 #endif